@@ -42,6 +42,8 @@
 #include "cache.h"
 #include "http.h"
 #include "transcode.h"
+#include "player.h"
+#include "worker.h"
 
 #include "artwork.h"
 
@@ -73,6 +75,19 @@
 #define ONLINE_SEARCH_COOLDOWN_TIME 3600
 #define ONLINE_SEARCH_FAILURES_MAX 3
 
+// See dir_image_resolve() and album_memo_get(). When the memo has this many
+// entries it is cleared.
+#define MEMO_BUCKETS 1024
+#define MEMO_MAX 20000
+#define MEMO_UNKNOWN -2
+
+// See artwork_pyramid_schedule(). Delays are in seconds, the job waits longer
+// between albums while the player is playing. There is always a delay, since
+// the job shares the single worker thread with e.g. the input's prebuffering.
+#define PYRAMID_START_DELAY 10
+#define PYRAMID_DELAY 1
+#define PYRAMID_DELAY_PLAYING 5
+
 enum artwork_cache
 {
   NEVER = 0,       // No caching of any results
@@ -106,6 +121,10 @@ struct artwork_ctx {
   // Input data to handler, did user configure to look for individual artwork
   int individual;
 
+  // Input data to cache handlers, don't look in the cache (set when building
+  // the thumbnail pyramid)
+  bool skip_cache;
+
   // Input data for item handlers
   struct db_media_file_info *dbmfi;
   int id;
@@ -137,6 +156,10 @@ struct artwork_source {
 
   // When should results from the source be cached?
   enum artwork_cache cache;
+
+  // Online sources are never skipped because of the album memo, since they may
+  // have come up empty for reasons that pass, see online_source_is_failing()
+  bool online;
 };
 
 /* Since online sources of artwork have similar characteristics there generic
@@ -184,6 +207,88 @@ struct online_source {
   enum parse_result (*response_jparse)(char **artwork_url, json_object *response, int max_w, int max_h);
 };
 
+/* Sizes (max width and height) of the thumbnail pyramid, largest first. Each
+ * level is made by scaling down the one before it.
+ */
+static const int pyramid_levels[] = { 1200, 600, 300, 150, 64 };
+
+struct pyramid_job
+{
+  // The job stops if a newer job has been scheduled
+  unsigned int generation;
+  // Albums to go through, read once when the job starts. The job is copied
+  // by worker_execute(), but the list is only freed when the job ends.
+  int64_t *persistentids;
+  int count;
+  // Index of the next album in the list
+  int next;
+  // Number of albums that got new thumbnails
+  int built;
+};
+
+static unsigned int pyramid_generation;
+
+/* Result of looking for an image file in a directory, see dir_image_resolve()
+ */
+struct dir_memo
+{
+  char *dir;
+  // Modification time of the directory when it was searched, with nanoseconds
+  // so that a change in the same second as the search is noticed
+  struct timespec mtime;
+  // Path of the image that was found, NULL if none
+  char *image;
+
+  struct dir_memo *next;
+};
+
+/* Item source that had the artwork for an album, see album_memo_get()
+ */
+struct album_memo
+{
+  int64_t persistentid;
+  // DB_ADMIN_DB_UPDATE when the memo was made
+  int64_t db_update;
+  uint32_t db_update_serial;
+  // Index in artwork_item_source, -1 if no source had artwork
+  int source;
+
+  struct album_memo *next;
+};
+
+static struct dir_memo *dir_memos[MEMO_BUCKETS];
+static struct album_memo *album_memos[MEMO_BUCKETS];
+static int memo_count;
+static pthread_mutex_t memo_lck = PTHREAD_MUTEX_INITIALIZER;
+
+/* A request that is being processed. Identical requests from other threads
+ * wait for it to complete and get a copy of its result instead of running the
+ * sources again, e.g. when a client asks for the same album art several times.
+ */
+struct artwork_flight
+{
+  // Key
+  int type;
+  int id;
+  int max_w;
+  int max_h;
+  int format;
+
+  // Number of threads waiting for the result
+  int waiters;
+  bool done;
+
+  // Result: ART_FMT_* or -1, and a copy of the image if there are waiters
+  int ret;
+  struct evbuffer *evbuf;
+
+  struct artwork_flight *next;
+};
+
+static struct artwork_flight *artwork_flights;
+static pthread_mutex_t artwork_flights_lck = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t artwork_flights_cond = PTHREAD_COND_INITIALIZER;
+
 /* File extensions that we look for or accept
  */
 static const char *cover_extension[] =
@@ -279,6 +384,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_SPOTIFY),
       .media_kinds = MEDIA_KIND_ALL,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .online = true,
     },
     {
       // Note that even though caching is set for this handler, it will in most
@@ -297,6 +403,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .online = true,
     },
     {
       .name = "Spotify search web api (streams)",
@@ -304,6 +411,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = NEVER,
+      .online = true,
     },
     {
       .name = "Discogs (files)",
@@ -311,6 +419,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .online = true,
     },
     {
       .name = "Discogs (streams)",
@@ -318,6 +427,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = NEVER,
+      .online = true,
     },
     {
       // The Cover Art Archive seems rather slow, so low priority
@@ -326,6 +436,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_FILE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = ON_SUCCESS | ON_FAILURE,
+      .online = true,
     },
     {
       // The Cover Art Archive seems rather slow, so low priority
@@ -334,6 +445,7 @@ static struct artwork_source artwork_item_source[] =
       .data_kinds = (1 << DATA_KIND_HTTP) | (1 << DATA_KIND_PIPE),
       .media_kinds = MEDIA_KIND_MUSIC,
       .cache = NEVER,
+      .online = true,
     },
     {
       .name = NULL,
@@ -884,6 +996,181 @@ parent_dir_image_find(char *out_path, size_t len, const char *dir)
   return -1;
 }
 
+/* ----------------------------- RESULT MEMO ------------------------------- */
+
+static void
+memo_clear(void)
+{
+  struct dir_memo *dm;
+  struct album_memo *am;
+  int i;
+
+  for (i = 0; i < MEMO_BUCKETS; i++)
+    {
+      while ((dm = dir_memos[i]))
+	{
+	  dir_memos[i] = dm->next;
+	  free(dm->dir);
+	  free(dm->image);
+	  free(dm);
+	}
+
+      while ((am = album_memos[i]))
+	{
+	  album_memos[i] = am->next;
+	  free(am);
+	}
+    }
+
+  memo_count = 0;
+}
+
+/* Like dir_image_find() followed by parent_dir_image_find(), but remembers the
+ * result for each directory. Adding, removing or renaming a file changes the
+ * modification time of the directory, so as long as that is the same, one
+ * stat() replaces probing for every candidate file name.
+ *
+ * @return 0 if image exists, -1 otherwise
+ */
+static int
+dir_image_resolve(char *out_path, size_t len, const char *dir)
+{
+  struct dir_memo *dm;
+  struct stat sb;
+  unsigned int bucket;
+  int ret;
+
+  if (stat(dir, &sb) < 0)
+    {
+      ret = dir_image_find(out_path, len, dir);
+      if (ret < 0)
+	ret = parent_dir_image_find(out_path, len, dir);
+
+      return ret;
+    }
+
+  bucket = djb_hash(dir, strlen(dir)) % MEMO_BUCKETS;
+
+  pthread_mutex_lock(&memo_lck);
+  for (dm = dir_memos[bucket]; dm; dm = dm->next)
+    {
+      if (strcmp(dm->dir, dir) == 0)
+	break;
+    }
+
+  if (dm && dm->mtime.tv_sec == sb.st_mtim.tv_sec && dm->mtime.tv_nsec == sb.st_mtim.tv_nsec)
+    {
+      if (dm->image)
+	snprintf(out_path, len, "%s", dm->image);
+      ret = dm->image ? 0 : -1;
+      pthread_mutex_unlock(&memo_lck);
+
+      DPRINTF(E_SPAM, L_ART, "Directory artwork for '%s' from memo: %s\n", dir, (ret == 0) ? out_path : "none");
+      return ret;
+    }
+  pthread_mutex_unlock(&memo_lck);
+
+  ret = dir_image_find(out_path, len, dir);
+  if (ret < 0)
+    ret = parent_dir_image_find(out_path, len, dir);
+
+  pthread_mutex_lock(&memo_lck);
+  for (dm = dir_memos[bucket]; dm; dm = dm->next)
+    {
+      if (strcmp(dm->dir, dir) == 0)
+	break;
+    }
+
+  if (!dm)
+    {
+      if (memo_count >= MEMO_MAX)
+	memo_clear();
+
+      CHECK_NULL(L_ART, dm = calloc(1, sizeof(struct dir_memo)));
+      dm->dir = safe_strdup(dir);
+      dm->next = dir_memos[bucket];
+      dir_memos[bucket] = dm;
+      memo_count++;
+    }
+
+  free(dm->image);
+  dm->image = (ret == 0) ? safe_strdup(out_path) : NULL;
+  dm->mtime = sb.st_mtim;
+  pthread_mutex_unlock(&memo_lck);
+
+  return ret;
+}
+
+/* Returns the index of the item source that had the artwork for the album the
+ * last time, -1 if none had, or MEMO_UNKNOWN. The memo is discarded when the
+ * library has been updated, since files may have been added or retagged.
+ */
+static int
+album_memo_get(int64_t persistentid)
+{
+  struct album_memo *am;
+  int64_t db_update;
+  uint32_t serial;
+  int source;
+
+  if (db_admin_getversion(&db_update, &serial, DB_ADMIN_DB_UPDATE) < 0)
+    return MEMO_UNKNOWN;
+
+  source = MEMO_UNKNOWN;
+
+  pthread_mutex_lock(&memo_lck);
+  for (am = album_memos[(uint64_t)persistentid % MEMO_BUCKETS]; am; am = am->next)
+    {
+      if (am->persistentid == persistentid)
+	{
+	  if (am->db_update == db_update && am->db_update_serial == serial)
+	    source = am->source;
+	  break;
+	}
+    }
+  pthread_mutex_unlock(&memo_lck);
+
+  return source;
+}
+
+static void
+album_memo_set(int64_t persistentid, int source)
+{
+  struct album_memo *am;
+  unsigned int bucket;
+  int64_t db_update;
+  uint32_t serial;
+
+  if (db_admin_getversion(&db_update, &serial, DB_ADMIN_DB_UPDATE) < 0)
+    return;
+
+  bucket = (uint64_t)persistentid % MEMO_BUCKETS;
+
+  pthread_mutex_lock(&memo_lck);
+  for (am = album_memos[bucket]; am; am = am->next)
+    {
+      if (am->persistentid == persistentid)
+	break;
+    }
+
+  if (!am)
+    {
+      if (memo_count >= MEMO_MAX)
+	memo_clear();
+
+      CHECK_NULL(L_ART, am = calloc(1, sizeof(struct album_memo)));
+      am->persistentid = persistentid;
+      am->next = album_memos[bucket];
+      album_memos[bucket] = am;
+      memo_count++;
+    }
+
+  am->db_update = db_update;
+  am->db_update_serial = serial;
+  am->source = source;
+  pthread_mutex_unlock(&memo_lck);
+}
+
 /* Looks for an artwork file in a directory. Will rescale if needed.
  *
  * @out evbuf     Image data
@@ -898,13 +1185,7 @@ artwork_get_bydir(struct evbuffer *evbuf, char *out_path, size_t len, char *dir,
 {
   int ret;
 
-  ret = dir_image_find(out_path, len, dir);
-  if (ret >= 0)
-    {
-      return artwork_get(evbuf, out_path, NULL, false, DATA_KIND_FILE, req_params);
-    }
-
-  ret = parent_dir_image_find(out_path, len, dir);
+  ret = dir_image_resolve(out_path, len, dir);
   if (ret >= 0)
     {
       return artwork_get(evbuf, out_path, NULL, false, DATA_KIND_FILE, req_params);
@@ -1337,26 +1618,86 @@ online_source_is_enabled(struct online_source *src)
 
 /* ---------------------- SOURCE HANDLER IMPLEMENTATION -------------------- */
 
-/* Looks in the cache for group artwork
+/* Returns the smallest level of the thumbnail pyramid that the requested size
+ * can be made from, or 0 if there is none
  */
 static int
-source_group_cache_get(struct artwork_ctx *ctx)
+pyramid_level_find(int max_w, int max_h)
 {
+  int level;
+  int i;
+
+  if (max_w <= 0 || max_h <= 0)
+    return 0;
+
+  level = 0;
+  for (i = 0; i < ARRAY_SIZE(pyramid_levels); i++)
+    {
+      if (pyramid_levels[i] < max_w || pyramid_levels[i] < max_h)
+	break;
+
+      level = pyramid_levels[i];
+    }
+
+  return level;
+}
+
+/* Looks in the cache for artwork of the requested size. If there is none, the
+ * artwork is made from the nearest larger level of the thumbnail pyramid, which
+ * is much cheaper than scaling down the source image.
+ */
+static int
+cache_get(struct artwork_ctx *ctx, int type, int64_t persistentid)
+{
+  struct evbuffer *level_buf;
+  int level;
   int format;
   int cached;
   int ret;
 
-  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
+  if (ctx->skip_cache)
+    return ART_E_NONE;
+
+  ret = cache_artwork_get(type, persistentid, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
   if (ret < 0)
     return ART_E_ERROR;
 
-  if (!cached)
+  if (cached)
+    return format ? format : ART_E_ABORT;
+
+  level = pyramid_level_find(ctx->req_params.max_w, ctx->req_params.max_h);
+  if (level == 0 || (level == ctx->req_params.max_w && level == ctx->req_params.max_h))
     return ART_E_NONE;
 
+  CHECK_NULL(L_ART, level_buf = evbuffer_new());
+
+  ret = cache_artwork_get(type, persistentid, level, level, &cached, &format, level_buf);
+  if (ret < 0 || !cached)
+    {
+      evbuffer_free(level_buf);
+      return (ret < 0) ? ART_E_ERROR : ART_E_NONE;
+    }
+
   if (!format)
-    return ART_E_ABORT;
+    {
+      evbuffer_free(level_buf);
+      return ART_E_ABORT;
+    }
 
-  return format;
+  DPRINTF(E_SPAM, L_ART, "Making artwork (max_w=%d, max_h=%d) from cached %dx%d thumbnail\n", ctx->req_params.max_w, ctx->req_params.max_h, level, level);
+
+  ret = artwork_get(ctx->evbuf, NULL, level_buf, false, DATA_KIND_FILE, ctx->req_params);
+  evbuffer_free(level_buf);
+
+  return (ret > 0) ? ret : ART_E_NONE;
+}
+
+/* Looks in the cache for group artwork
+ */
+static int
+source_group_cache_get(struct artwork_ctx *ctx)
+{
+  return cache_get(ctx, CACHE_ARTWORK_GROUP, ctx->persistentid);
 }
 
 /* Looks for cover files in a directory, so if dir is /foo/bar and the user has
@@ -1414,24 +1755,10 @@ source_group_dir_get(struct artwork_ctx *ctx)
 static int
 source_item_cache_get(struct artwork_ctx *ctx)
 {
-  int format;
-  int cached;
-  int ret;
-
   if (!ctx->individual)
     return ART_E_NONE;
 
-  ret = cache_artwork_get(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
-  if (ret < 0)
-    return ART_E_ERROR;
-
-  if (!cached)
-    return ART_E_NONE;
-
-  if (!format)
-    return ART_E_ABORT;
-
-  return format;
+  return cache_get(ctx, CACHE_ARTWORK_INDIVIDUAL, ctx->id);
 }
 
 /* Get an embedded artwork file from a media file. Will rescale if needed.
@@ -1761,9 +2088,16 @@ static int
 process_items(struct artwork_ctx *ctx, int item_mode)
 {
   struct db_media_file_info dbmfi;
+  bool had_error;
+  int memo;
   int i;
   int ret;
 
+  // When looking for album artwork, skip straight to the source that had it the
+  // last time (the cache is always checked)
+  memo = (!item_mode && ctx->persistentid) ? album_memo_get(ctx->persistentid) : MEMO_UNKNOWN;
+  had_error = false;
+
   ret = db_query_start(&ctx->qp);
   if (ret < 0)
     {
@@ -1793,6 +2127,9 @@ process_items(struct artwork_ctx *ctx, int item_mode)
 
       for (i = 0; artwork_item_source[i].handler; i++)
 	{
+	  if (memo != MEMO_UNKNOWN && i != memo && artwork_item_source[i].handler != source_item_cache_get && !artwork_item_source[i].online)
+	    continue;
+
 	  if ((artwork_item_source[i].data_kinds & (1 << ctx->data_kind)) == 0)
 	    continue;
 
@@ -1814,6 +2151,10 @@ process_items(struct artwork_ctx *ctx, int item_mode)
 	      DPRINTF(E_DBG, L_ART, "Artwork for '%s' found in source '%s'\n", dbmfi.title, artwork_item_source[i].name);
 	      ctx->cache = artwork_item_source[i].cache;
 	      db_query_end(&ctx->qp);
+
+	      if (!item_mode && artwork_item_source[i].handler != source_item_cache_get)
+		album_memo_set(ctx->persistentid, i);
+
 	      return ret;
 	    }
 	  else if (ret == ART_E_ABORT)
@@ -1826,6 +2167,7 @@ process_items(struct artwork_ctx *ctx, int item_mode)
 	    {
 	      DPRINTF(E_LOG, L_ART, "Source '%s' returned an error for '%s'\n", artwork_item_source[i].name, dbmfi.title);
 	      ctx->cache = NEVER;
+	      had_error = true;
 	    }
 	}
     }
@@ -1834,8 +2176,17 @@ process_items(struct artwork_ctx *ctx, int item_mode)
     {
       DPRINTF(E_LOG, L_ART, "Error fetching results\n");
       ctx->cache = NEVER;
+      had_error = true;
     }
 
+  // Remember that the album has no artwork, but if the source that had it
+  // before doesn't anymore, the next lookup tries all of them again. A "none"
+  // memo only skips the local sources, the online ones are always asked.
+  if (!item_mode && !had_error && memo == MEMO_UNKNOWN)
+    album_memo_set(ctx->persistentid, -1);
+  else if (!item_mode && memo >= 0)
+    album_memo_set(ctx->persistentid, MEMO_UNKNOWN);
+
  no_artwork:
   db_query_end(&ctx->qp);
 
@@ -1906,10 +2257,292 @@ process_group(struct artwork_ctx *ctx)
 }
 
 
+/* --------------------------- THUMBNAIL PYRAMID --------------------------- */
+/*                              Thread: worker                               */
+
+/* Caches the album artwork in each of the pyramid sizes. The source image is
+ * only decoded once, for the largest level, the others are scaled down from the
+ * level before. Returns 1 if thumbnails were added, 0 if the album already had
+ * them or has no artwork, -1 on error.
+ */
+static int
+pyramid_build(int64_t persistentid)
+{
+  struct artwork_ctx ctx;
+  struct artwork_req_params req_params = { 0 };
+  struct evbuffer *evbuf;
+  struct evbuffer *level_buf;
+  int smallest;
+  int format;
+  int cached;
+  int ret;
+  int i;
+
+  CHECK_NULL(L_ART, evbuf = evbuffer_new());
+
+  // Smallest level is made last, so if it is cached the album is done
+  smallest = pyramid_levels[ARRAY_SIZE(pyramid_levels) - 1];
+  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, persistentid, smallest, smallest, &cached, &format, evbuf);
+  if (ret < 0 || cached)
+    {
+      evbuffer_free(evbuf);
+      return (ret < 0) ? -1 : 0;
+    }
+
+  memset(&ctx, 0, sizeof(struct artwork_ctx));
+
+  ctx.qp.type = Q_GROUP_ITEMS;
+  ctx.qp.persistentid = persistentid;
+  ctx.persistentid = persistentid;
+  ctx.evbuf = evbuf;
+  ctx.req_params.max_w = pyramid_levels[0];
+  ctx.req_params.max_h = pyramid_levels[0];
+  ctx.cache = ON_FAILURE;
+  ctx.individual = cfg_getbool(cfg_getsec(cfg, "library"), "artwork_individual");
+  ctx.skip_cache = true;
+
+  format = process_group(&ctx);
+  if (format <= 0)
+    {
+      if (ctx.cache & ON_FAILURE)
+	{
+	  for (i = 0; i < ARRAY_SIZE(pyramid_levels); i++)
+	    cache_artwork_add(CACHE_ARTWORK_GROUP, persistentid, pyramid_levels[i], pyramid_levels[i], 0, "", evbuf);
+	}
+
+      evbuffer_free(evbuf);
+      return 0;
+    }
+
+  if (!(ctx.cache & ON_SUCCESS))
+    {
+      evbuffer_free(evbuf);
+      return 0;
+    }
+
+  for (i = 0; i < ARRAY_SIZE(pyramid_levels); i++)
+    {
+      if (i > 0)
+	{
+	  CHECK_NULL(L_ART, level_buf = evbuffer_new());
+
+	  req_params.max_w = pyramid_levels[i];
+	  req_params.max_h = pyramid_levels[i];
+	  format = artwork_get(level_buf, NULL, evbuf, false, DATA_KIND_FILE, req_params);
+
+	  evbuffer_free(evbuf);
+	  evbuf = level_buf;
+
+	  if (format <= 0)
+	    {
+	      DPRINTF(E_LOG, L_ART, "Could not make %dx%d thumbnail for album %" PRIi64 "\n", pyramid_levels[i], pyramid_levels[i], persistentid);
+	      evbuffer_free(evbuf);
+	      return -1;
+	    }
+	}
+
+      cache_artwork_add(CACHE_ARTWORK_GROUP, persistentid, pyramid_levels[i], pyramid_levels[i], format, ctx.path, evbuf);
+    }
+
+  evbuffer_free(evbuf);
+  return 1;
+}
+
+// Reads the persistentid of every album with local files, so the job doesn't
+// have to run the album query for each step
+static int
+pyramid_albums_load(struct pyramid_job *job)
+{
+  struct query_params qp;
+  struct db_group_info dbgri;
+  int64_t persistentid;
+  char filter[32];
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+
+  qp.type = Q_GROUP_ALBUMS;
+  qp.sort = S_NONE;
+  qp.idx_type = I_NONE;
+  qp.filter = filter;
+  snprintf(filter, sizeof(filter), "f.data_kind = %d", DATA_KIND_FILE);
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not start query for thumbnail pyramid\n");
+      db_query_end(&qp);
+      return -1;
+    }
+
+  while ((ret = db_query_fetch_group(&dbgri, &qp)) == 0)
+    {
+      if (safe_atoi64(dbgri.persistentid, &persistentid) < 0)
+	continue;
+
+      if (job->count % 256 == 0)
+	CHECK_NULL(L_ART, job->persistentids = realloc(job->persistentids, (job->count + 256) * sizeof(int64_t)));
+
+      job->persistentids[job->count] = persistentid;
+      job->count++;
+    }
+
+  db_query_end(&qp);
+
+  return 0;
+}
+
+static void
+pyramid_job_cb(void *arg)
+{
+  struct pyramid_job *job = arg;
+  struct player_status status;
+  int ret;
+
+  if (job->generation != __atomic_load_n(&pyramid_generation, __ATOMIC_ACQUIRE))
+    {
+      DPRINTF(E_DBG, L_ART, "Thumbnail pyramid job superseded by a newer one\n");
+      free(job->persistentids);
+      return;
+    }
+
+  if (!job->persistentids && pyramid_albums_load(job) < 0)
+    return;
+
+  if (job->next >= job->count)
+    {
+      DPRINTF(E_LOG, L_ART, "Thumbnail pyramid completed, added thumbnails for %d albums\n", job->built);
+      free(job->persistentids);
+      return;
+    }
+
+  if (pyramid_build(job->persistentids[job->next]) > 0)
+    job->built++;
+
+  job->next++;
+
+  // Don't compete with playback for the CPU and the disk
+  ret = player_get_status(&status);
+  if (ret == 0 && status.status == PLAY_PLAYING)
+    worker_execute(pyramid_job_cb, job, sizeof(struct pyramid_job), PYRAMID_DELAY_PLAYING);
+  else
+    worker_execute(pyramid_job_cb, job, sizeof(struct pyramid_job), PYRAMID_DELAY);
+}
+
+
+/* --------------------------- REQUEST COALESCING -------------------------- */
+
+static void
+flight_free(struct artwork_flight *flight)
+{
+  if (flight->evbuf)
+    evbuffer_free(flight->evbuf);
+
+  free(flight);
+}
+
+/* Looks for an identical request in progress. If there is one, waits for it to
+ * complete and adds its result to evbuf. Otherwise registers the request, and
+ * the caller must process it and then call flight_land().
+ *
+ * @out flight  Set if the caller must process the request, otherwise NULL
+ * @return      Result of the identical request, if flight is NULL
+ */
+static int
+flight_join(struct artwork_flight **flight, struct evbuffer *evbuf, int type, int id, int max_w, int max_h, int format)
+{
+  struct artwork_flight *f;
+  int ret;
+
+  pthread_mutex_lock(&artwork_flights_lck);
+
+  for (f = artwork_flights; f; f = f->next)
+    {
+      if (f->type == type && f->id == id && f->max_w == max_w && f->max_h == max_h && f->format == format)
+	break;
+    }
+
+  if (!f)
+    {
+      CHECK_NULL(L_ART, f = calloc(1, sizeof(struct artwork_flight)));
+      f->type = type;
+      f->id = id;
+      f->max_w = max_w;
+      f->max_h = max_h;
+      f->format = format;
+      f->next = artwork_flights;
+      artwork_flights = f;
+
+      pthread_mutex_unlock(&artwork_flights_lck);
+
+      *flight = f;
+      return 0;
+    }
+
+  DPRINTF(E_DBG, L_ART, "Waiting for identical artwork request in progress (id=%d, max_w=%d, max_h=%d)\n", id, max_w, max_h);
+
+  f->waiters++;
+  while (!f->done)
+    pthread_cond_wait(&artwork_flights_cond, &artwork_flights_lck);
+  f->waiters--;
+
+  ret = f->ret;
+  if (ret > 0 && f->evbuf)
+    evbuffer_add(evbuf, evbuffer_pullup(f->evbuf, -1), evbuffer_get_length(f->evbuf));
+
+  if (f->waiters == 0)
+    flight_free(f);
+
+  pthread_mutex_unlock(&artwork_flights_lck);
+
+  *flight = NULL;
+  return ret;
+}
+
+/* Completes a request registered with flight_join() and hands the result to
+ * any waiting threads. The image is the data in evbuf after offset.
+ */
+static void
+flight_land(struct artwork_flight *flight, int ret, struct evbuffer *evbuf, size_t offset)
+{
+  struct artwork_flight *f;
+  struct artwork_flight *prev;
+
+  pthread_mutex_lock(&artwork_flights_lck);
+
+  for (f = artwork_flights, prev = NULL; f && f != flight; prev = f, f = f->next)
+    ;
+
+  if (prev)
+    prev->next = flight->next;
+  else if (f)
+    artwork_flights = flight->next;
+
+  flight->ret = ret;
+  flight->done = true;
+
+  if (flight->waiters == 0)
+    {
+      flight_free(flight);
+      pthread_mutex_unlock(&artwork_flights_lck);
+      return;
+    }
+
+  if (ret > 0)
+    {
+      CHECK_NULL(L_ART, flight->evbuf = evbuffer_new());
+      evbuffer_add(flight->evbuf, evbuffer_pullup(evbuf, -1) + offset, evbuffer_get_length(evbuf) - offset);
+    }
+
+  pthread_cond_broadcast(&artwork_flights_cond);
+  pthread_mutex_unlock(&artwork_flights_lck);
+}
+
+
 /* ------------------------------ ARTWORK API ------------------------------ */
 
-int
-artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+static int
+item_get(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
 {
   struct artwork_ctx ctx;
   char filter[32];
@@ -1969,8 +2602,8 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   return -1;
 }
 
-int
-artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+static int
+group_get(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
 {
   struct artwork_ctx ctx;
   int ret;
@@ -2013,6 +2646,59 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
   return -1;
 }
 
+void
+artwork_pyramid_schedule(void)
+{
+  struct pyramid_job job = { 0 };
+
+  if (!cfg_getbool(cfg_getsec(cfg, "library"), "artwork_pyramid"))
+    return;
+
+  job.generation = __atomic_add_fetch(&pyramid_generation, 1, __ATOMIC_ACQ_REL);
+
+  DPRINTF(E_INFO, L_ART, "Scheduling thumbnail pyramid job\n");
+
+  worker_execute(pyramid_job_cb, &job, sizeof(struct pyramid_job), PYRAMID_START_DELAY);
+}
+
+int
+artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+{
+  struct artwork_flight *flight;
+  size_t offset;
+  int ret;
+
+  ret = flight_join(&flight, evbuf, CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, format);
+  if (!flight)
+    return ret;
+
+  offset = evbuffer_get_length(evbuf);
+  ret = item_get(evbuf, id, max_w, max_h, format);
+
+  flight_land(flight, ret, evbuf, offset);
+
+  return ret;
+}
+
+int
+artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+{
+  struct artwork_flight *flight;
+  size_t offset;
+  int ret;
+
+  ret = flight_join(&flight, evbuf, CACHE_ARTWORK_GROUP, id, max_w, max_h, format);
+  if (!flight)
+    return ret;
+
+  offset = evbuffer_get_length(evbuf);
+  ret = group_get(evbuf, id, max_w, max_h, format);
+
+  flight_land(flight, ret, evbuf, offset);
+
+  return ret;
+}
+
 /* Checks if the file is an artwork file */
 bool
 artwork_file_is_artwork(const char *filename)
@@ -38,6 +38,15 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
 int
 artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format);
 
+/*
+ * Schedules a background job on the worker thread that caches the artwork of
+ * all albums in a fixed set of sizes, so that requests can be served by scaling
+ * down a thumbnail instead of the source image. Does nothing unless enabled
+ * with library.artwork_pyramid. A job that is already running is stopped.
+ */
+void
+artwork_pyramid_schedule(void);
+
 /*
  * Checks if the file is an artwork file (based on user config)
  *
@@ -56,6 +56,7 @@ struct cache_arg
 
   const char *path;  // artwork path
   char *pathcopy;  // copy of artwork path (for async operations)
+  char *newpathcopy; // copy of new artwork path (for async rename)
   int type;    // individual or group artwork
   int64_t persistentid;
   int max_w;
@@ -962,6 +963,48 @@ cache_artwork_ping_impl(void *arg, int *retval)
 #undef Q_TMPL_DEL
 }
 
+/*
+ * Moves all cache entries for the given path to a new path, e.g. because the
+ * media file was moved or renamed.
+ *
+ * @param cmdarg->pathcopy the current full path to the artwork file
+ * @param cmdarg->newpathcopy the new full path to the artwork file
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_rename_impl(void *arg, int *retval)
+{
+#define Q_TMPL "UPDATE artwork SET filepath = '%q', db_timestamp = %" PRIi64 " WHERE filepath = '%q';"
+
+  struct cache_arg *cmdarg;
+  char *query;
+  char *errmsg;
+  int ret;
+
+  cmdarg = arg;
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->newpathcopy, (int64_t)time(NULL), cmdarg->pathcopy);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  free(cmdarg->pathcopy);
+  free(cmdarg->newpathcopy);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+
+#undef Q_TMPL
+}
+
 /*
  * Removes all cache entries for the given path
  *
@@ -1420,6 +1463,34 @@ cache_artwork_ping(const char *path, time_t mtime, int del)
   commands_exec_async(cmdbase, cache_artwork_ping_impl, cmdarg);
 }
 
+/*
+ * Moves all cache entries for the given path to a new path, so that cached
+ * artwork survives moving or renaming the media file
+ *
+ * @param path the current full path to the artwork file
+ * @param newpath the new full path to the artwork file
+ */
+void
+cache_artwork_rename(const char *path, const char *newpath)
+{
+  struct cache_arg *cmdarg;
+
+  if (!g_initialized)
+    return;
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->pathcopy = strdup(path);
+  cmdarg->newpathcopy = strdup(newpath);
+
+  commands_exec_async(cmdbase, cache_artwork_rename_impl, cmdarg);
+}
+
 /*
  * Removes all cache entries for the given path
  *
@@ -30,6 +30,9 @@ cache_daap_threshold(void);
 void
 cache_artwork_ping(const char *path, time_t mtime, int del);
 
+void
+cache_artwork_rename(const char *path, const char *newpath);
+
 int
 cache_artwork_delete_by_path(const char *path);
 
@@ -57,6 +57,12 @@ static cfg_opt_t sec_general[] =
     CFG_STR("bind_address", NULL, CFGF_NONE),
     CFG_STR("cache_path", STATEDIR "/cache/" PACKAGE "/cache.db", CFGF_NONE),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("httpd_workers", 4, CFGF_NONE),
+    CFG_INT("gzip_level", -1, CFGF_NONE),
+    CFG_INT("httpd_max_connections", 0, CFGF_NONE),
+    CFG_INT("httpd_timeout", 0, CFGF_NONE),
+    CFG_INT("httpd_max_headers_size", 0, CFGF_NONE),
+    CFG_INT("httpd_max_body_size", 0, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_false, CFGF_NONE),
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     CFG_BOOL("high_resolution_clock", cfg_false, CFGF_NONE),
@@ -102,6 +108,7 @@ static cfg_opt_t sec_library[] =
     CFG_STR("name_unknown_composer", "Unknown composer", CFGF_NONE),
     CFG_STR_LIST("artwork_basenames", "{artwork,cover,Folder}", CFGF_NONE),
     CFG_BOOL("artwork_individual", cfg_false, CFGF_NONE),
+    CFG_BOOL("artwork_pyramid", cfg_false, CFGF_NONE),
     CFG_STR_LIST("artwork_online_sources", NULL, CFGF_NONE),
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf,.metadata}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
@@ -111,6 +118,12 @@ static cfg_opt_t sec_library[] =
     CFG_BOOL("itunes_smartpl", cfg_false, CFGF_NONE),
     CFG_STR_LIST("no_decode", NULL, CFGF_NONE),
     CFG_STR_LIST("force_decode", NULL, CFGF_NONE),
+    CFG_INT("decode_buffer_size_file", 0, CFGF_NONE),
+    CFG_INT("decode_readahead_file", 0, CFGF_NONE),
+    CFG_INT("decode_buffer_size_spotify", 4096, CFGF_NONE),
+    CFG_INT("transcode_cache_size", 67108864, CFGF_NONE),
+    CFG_INT("prebuffer_next_seconds", 3, CFGF_NONE),
+    CFG_INT("prebuffer_lead_seconds", 10, CFGF_NONE),
     CFG_BOOL("pipe_autostart", cfg_true, CFGF_NONE),
     CFG_INT("pipe_sample_rate", 44100, CFGF_NONE),
     CFG_INT("pipe_bits_per_sample", 16, CFGF_NONE),
@@ -226,6 +239,7 @@ static cfg_opt_t sec_mpd[] =
   {
     CFG_INT("port", 6600, CFGF_NONE),
     CFG_INT("http_port", 0, CFGF_NONE),
+    CFG_INT("idle_min_interval", 0, CFGF_NONE),
     CFG_BOOL("clear_queue_on_stop_disable", cfg_false, CFGF_NODEFAULT | CFGF_DEPRECATED),
     CFG_BOOL("allow_modifying_stored_playlists", cfg_false, CFGF_NODEFAULT | CFGF_DEPRECATED),
     CFG_STR("default_playlist_directory", NULL, CFGF_NODEFAULT | CFGF_DEPRECATED),
@@ -54,9 +54,6 @@
 #include "rng.h"
 
 
-// Inotify cookies are uint32_t
-#define INOTIFY_FAKE_COOKIE ((int64_t)1 << 32)
-
 // Flags that the field will not be bound to prepared statements, which is relevant if the field has no
 // matching column, or if the the column value is set automatically by the db, e.g. by a trigger
 #define DB_FLAG_NO_BIND  (1 << 0)
@@ -115,11 +112,19 @@ struct db_statements
 
   sqlite3_stmt *playlists_insert;
   sqlite3_stmt *playlists_update;
+  sqlite3_stmt *playlistitems_insert;
 
   sqlite3_stmt *queue_items_insert;
   sqlite3_stmt *queue_items_update;
 };
 
+struct db_admin_mirror {
+  const char *key;
+  int64_t value;
+  uint32_t serial;
+  bool is_valid;
+};
+
 struct col_type_map {
   char *name;
   ssize_t offset;
@@ -230,6 +235,7 @@ static const struct col_type_map mfi_cols_map[] =
     { "channels",           mfi_offsetof(channels),           DB_TYPE_INT },
     { "usermark",           mfi_offsetof(usermark),           DB_TYPE_INT },
     { "scan_kind",          mfi_offsetof(scan_kind),          DB_TYPE_INT },
+    { "content_hash",       mfi_offsetof(content_hash),       DB_TYPE_INT64 },
   };
 
 /* This list must be kept in sync with
@@ -371,6 +377,7 @@ static const ssize_t dbmfi_cols_map[] =
     dbmfi_offsetof(channels),
     dbmfi_offsetof(usermark),
     dbmfi_offsetof(scan_kind),
+    dbmfi_offsetof(content_hash),
   };
 
 /* This list must be kept in sync with
@@ -655,6 +662,25 @@ static bool db_rating_updates;
 static __thread sqlite3 *hdl;
 static __thread struct db_statements db_statements;
 
+// Version-type admin keys that clients poll, kept in memory so checking them
+// doesn't require a query. Protected by db_admin_mirror_lck.
+static struct db_admin_mirror db_admin_mirror[] =
+  {
+    { DB_ADMIN_DB_UPDATE },
+    { DB_ADMIN_DB_MODIFIED },
+    { DB_ADMIN_QUEUE_VERSION },
+  };
+static pthread_mutex_t db_admin_mirror_lck = PTHREAD_MUTEX_INITIALIZER;
+// Mirrored keys written in the current transaction of this thread
+static __thread uint32_t db_admin_mirror_pending;
+
+// Queue batch of this thread, see db_queue_batch_begin()
+static __thread struct db_queue_batch {
+  bool active;
+  bool changed;
+  int queue_version;
+} db_queue_batch;
+
 
 /* Forward */
 static enum group_type
@@ -663,6 +689,9 @@ db_group_type_bypersistentid(int64_t persistentid);
 static int
 db_query_run(char *query, int free, short update_events);
 
+static void
+admin_mirror_transaction_done(void);
+
 
 char *
 db_escape_string(const char *str)
@@ -1901,7 +1930,8 @@ db_get_one_int(const char *query)
 void
 db_transaction_begin(void)
 {
-  char *query = "BEGIN TRANSACTION;";
+  // Within a queue batch there is already a transaction, so nest
+  char *query = db_queue_batch.active ? "SAVEPOINT nested;" : "BEGIN TRANSACTION;";
   char *errmsg;
   int ret;
 
@@ -1919,7 +1949,7 @@ db_transaction_begin(void)
 void
 db_transaction_end(void)
 {
-  char *query = "END TRANSACTION;";
+  char *query = db_queue_batch.active ? "RELEASE nested;" : "END TRANSACTION;";
   char *errmsg;
   int ret;
 
@@ -1932,12 +1962,15 @@ db_transaction_end(void)
 
       sqlite3_free(errmsg);
     }
+
+  if (!db_queue_batch.active)
+    admin_mirror_transaction_done();
 }
 
 void
 db_transaction_rollback(void)
 {
-  char *query = "ROLLBACK TRANSACTION;";
+  char *query = db_queue_batch.active ? "ROLLBACK TO nested;" : "ROLLBACK TRANSACTION;";
   char *errmsg;
   int ret;
 
@@ -1950,6 +1983,15 @@ db_transaction_rollback(void)
 
       sqlite3_free(errmsg);
     }
+
+  // Rolling back to a savepoint leaves it open
+  if (db_queue_batch.active)
+    {
+      db_transaction_end();
+      return;
+    }
+
+  admin_mirror_transaction_done();
 }
 
 static void
@@ -3588,6 +3630,52 @@ db_file_update_directoryid(const char *path, int dir_id)
 #undef Q_TMPL
 }
 
+// Relocates a file that was moved/renamed while keeping its id and user data
+// (play count, rating, playlist membership). Returns number of changed rows.
+int
+db_file_path_update_byid(int id, const char *path, const char *fname, const char *virtual_path, int dir_id)
+{
+#define Q_TMPL_PLITEMS "UPDATE playlistitems SET filepath = '%q' WHERE filepath = (SELECT f.path FROM files f WHERE f.id = %d);"
+#define Q_TMPL_QUEUE "UPDATE queue SET path = '%q', virtual_path = '%q', queue_version = %d WHERE file_id = %d;"
+#define Q_TMPL "UPDATE files SET path = '%q', fname = '%q', virtual_path = '%q', directory_id = %d, db_timestamp = %" PRIi64 ", disabled = 0 WHERE id = %d;"
+  char *query;
+  int queue_version;
+  int ret;
+
+  query = sqlite3_mprintf(Q_TMPL_PLITEMS, path, id);
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    return -1;
+
+  // The scanner calls this from within its own transaction, so we can't use
+  // queue_transaction_begin/end(), but the version must still go up so that
+  // clients see the new paths. The LISTENER_QUEUE event is deferred by the
+  // library until the changes are committed.
+  queue_version = 0;
+  db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
+  queue_version++;
+
+  query = sqlite3_mprintf(Q_TMPL_QUEUE, path, virtual_path, queue_version, id);
+  ret = db_query_run(query, 1, LISTENER_QUEUE);
+  if (ret < 0)
+    return -1;
+
+  if (sqlite3_changes(hdl) > 0)
+    {
+      ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
+      if (ret < 0)
+	return -1;
+    }
+
+  query = sqlite3_mprintf(Q_TMPL, path, fname, virtual_path, dir_id, (int64_t)time(NULL), id);
+  ret = db_query_run(query, 1, LISTENER_DATABASE);
+
+  return ((ret < 0) ? -1 : sqlite3_changes(hdl));
+#undef Q_TMPL_PLITEMS
+#undef Q_TMPL_QUEUE
+#undef Q_TMPL
+}
+
 
 /* Playlists */
 int
@@ -3895,6 +3983,33 @@ db_pl_add_item_bypath(int plid, const char *path)
 #undef Q_TMPL
 }
 
+// Adds many items with a reused prepared statement, the caller should wrap
+// this in a transaction. Returns number of items added or -1 on error.
+int
+db_pl_add_items_bypath(int plid, const char **paths, int npaths)
+{
+  int added;
+  int ret;
+  int i;
+
+  for (i = 0, added = 0; i < npaths; i++)
+    {
+      sqlite3_bind_int(db_statements.playlistitems_insert, 1, plid);
+      sqlite3_bind_text(db_statements.playlistitems_insert, 2, paths[i], -1, SQLITE_STATIC);
+
+      ret = db_statement_run(db_statements.playlistitems_insert, 0);
+      if (ret < 0)
+	return -1;
+
+      added += ret;
+    }
+
+  if (added > 0)
+    library_update_trigger(LISTENER_DATABASE);
+
+  return added;
+}
+
 int
 db_pl_add_item_byid(int plid, int fileid)
 {
@@ -4661,15 +4776,90 @@ db_spotify_files_delete(void)
 }
 
 /* Admin */
+static struct db_admin_mirror *
+admin_mirror_find(const char *key)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(db_admin_mirror); i++)
+    {
+      if (strcmp(db_admin_mirror[i].key, key) == 0)
+	return &db_admin_mirror[i];
+    }
+
+  return NULL;
+}
+
+static void
+admin_mirror_invalidate(struct db_admin_mirror *m)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_admin_mirror_lck));
+  m->is_valid = false;
+  m->serial++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_admin_mirror_lck));
+}
+
+// Called after the admin table was written. A value of NULL means the new value
+// is unknown (string write or delete), so the next read goes to the database.
+static void
+admin_mirror_update(const char *key, int64_t *value)
+{
+  struct db_admin_mirror *m;
+
+  m = admin_mirror_find(key);
+  if (!m)
+    return;
+
+  // Inside a transaction the new value isn't visible to other connections yet,
+  // so readers must keep getting the committed value. The key is invalidated
+  // again when the transaction ends.
+  if (hdl && !sqlite3_get_autocommit(hdl))
+    {
+      db_admin_mirror_pending |= (1 << (m - db_admin_mirror));
+      value = NULL;
+    }
+
+  if (!value)
+    {
+      admin_mirror_invalidate(m);
+      return;
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_admin_mirror_lck));
+  m->value = *value;
+  m->is_valid = true;
+  m->serial++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_admin_mirror_lck));
+}
+
+static void
+admin_mirror_transaction_done(void)
+{
+  int i;
+
+  for (i = 0; db_admin_mirror_pending && i < ARRAY_SIZE(db_admin_mirror); i++)
+    {
+      if (db_admin_mirror_pending & (1 << i))
+	admin_mirror_invalidate(&db_admin_mirror[i]);
+    }
+
+  db_admin_mirror_pending = 0;
+}
+
 int
 db_admin_set(const char *key, const char *value)
 {
 #define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%q');"
   char *query;
+  int ret;
 
   query = sqlite3_mprintf(Q_TMPL, key, value);
 
-  return db_query_run(query, 1, 0);
+  ret = db_query_run(query, 1, 0);
+
+  admin_mirror_update(key, NULL);
+
+  return ret;
 #undef Q_TMPL
 }
 
@@ -4678,10 +4868,17 @@ db_admin_setint(const char *key, int value)
 {
 #define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%d');"
   char *query;
+  int64_t value64;
+  int ret;
 
   query = sqlite3_mprintf(Q_TMPL, key, value);
 
-  return db_query_run(query, 1, 0);
+  ret = db_query_run(query, 1, 0);
+
+  value64 = value;
+  admin_mirror_update(key, (ret == 0) ? &value64 : NULL);
+
+  return ret;
 #undef Q_TMPL
 }
 
@@ -4690,10 +4887,15 @@ db_admin_setint64(const char *key, int64_t value)
 {
 #define Q_TMPL "INSERT OR REPLACE INTO admin (key, value) VALUES ('%q', '%" PRIi64 "');"
   char *query;
+  int ret;
 
   query = sqlite3_mprintf(Q_TMPL, key, value);
 
-  return db_query_run(query, 1, 0);
+  ret = db_query_run(query, 1, 0);
+
+  admin_mirror_update(key, (ret == 0) ? &value : NULL);
+
+  return ret;
 #undef Q_TMPL
 }
 
@@ -4764,15 +4966,64 @@ db_admin_getint64(int64_t *int64val, const char *key)
   return admin_get(int64val, key, DB_TYPE_INT64);
 }
 
+int
+db_admin_getversion(int64_t *value, uint32_t *serial, const char *key)
+{
+  struct db_admin_mirror *m;
+  int64_t dbval;
+  uint32_t dbserial;
+  int ret;
+
+  m = admin_mirror_find(key);
+  if (!m)
+    {
+      DPRINTF(E_LOG, L_DB, "Bug! Admin key '%s' is not mirrored, can't get version\n", key);
+      return -1;
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_admin_mirror_lck));
+  *value = m->value;
+  *serial = m->serial;
+  ret = m->is_valid;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_admin_mirror_lck));
+
+  if (ret)
+    return 0;
+
+  // Not loaded yet or invalidated, read from the database. A missing key is
+  // stored as 0. The value is only stored if no write happened in the meantime.
+  dbval = 0;
+  admin_get(&dbval, key, DB_TYPE_INT64);
+
+  dbserial = *serial;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_admin_mirror_lck));
+  if (m->serial == dbserial)
+    {
+      m->value = dbval;
+      m->is_valid = true;
+    }
+  *value = dbval;
+  *serial = m->serial;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_admin_mirror_lck));
+
+  return 0;
+}
+
 int
 db_admin_delete(const char *key)
 {
 #define Q_TMPL "DELETE FROM admin WHERE key='%q';"
   char *query;
+  int ret;
 
   query = sqlite3_mprintf(Q_TMPL, key);
 
-  return db_query_run(query, 1, 0);
+  ret = db_query_run(query, 1, 0);
+
+  admin_mirror_update(key, NULL);
+
+  return ret;
 #undef Q_TMPL
 }
 
@@ -4864,6 +5115,11 @@ queue_transaction_begin()
 
   db_transaction_begin();
 
+  // In a batch the version is only written when the batch ends, but every
+  // change still gets its own version, since some of the queries depend on it
+  if (db_queue_batch.active)
+    return ++db_queue_batch.queue_version;
+
   db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
   queue_version++;
 
@@ -4888,6 +5144,13 @@ queue_transaction_end(int retval, int queue_version)
   if (retval < 0)
     goto error;
 
+  if (db_queue_batch.active)
+    {
+      db_queue_batch.changed = true;
+      db_transaction_end();
+      return;
+    }
+
   ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, queue_version);
   if (ret < 0)
     goto error;
@@ -4900,6 +5163,56 @@ queue_transaction_end(int retval, int queue_version)
   db_transaction_rollback();
 }
 
+/*
+ * Starts a batch of queue changes. Until db_queue_batch_end() is called, all
+ * queue changes made by this thread are part of a single transaction, and the
+ * queue version is only written, and LISTENER_QUEUE only notified, once at the
+ * end. The caller must not wait for other threads that might write to the
+ * database while the batch is active, since they will be blocked.
+ */
+void
+db_queue_batch_begin(void)
+{
+  if (db_queue_batch.active)
+    return;
+
+  db_transaction_begin();
+
+  db_queue_batch.queue_version = 0;
+  db_admin_getint(&db_queue_batch.queue_version, DB_ADMIN_QUEUE_VERSION);
+  db_queue_batch.changed = false;
+  db_queue_batch.active = true;
+}
+
+void
+db_queue_batch_end(void)
+{
+  bool changed;
+  int ret;
+
+  if (!db_queue_batch.active)
+    return;
+
+  db_queue_batch.active = false;
+  changed = db_queue_batch.changed;
+
+  if (changed)
+    {
+      ret = db_admin_setint(DB_ADMIN_QUEUE_VERSION, db_queue_batch.queue_version);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Could not write queue version of batch, rolling back\n");
+	  db_transaction_rollback();
+	  return;
+	}
+    }
+
+  db_transaction_end();
+
+  if (changed)
+    listener_notify(LISTENER_QUEUE);
+}
+
 static int
 queue_reshuffle(uint32_t item_id, int queue_version);
 
@@ -7122,6 +7435,23 @@ db_statements_prepare_ping(const char *table)
   return stmt;
 }
 
+static sqlite3_stmt *
+db_statements_prepare_plitem_insert(void)
+{
+  const char *query = "INSERT INTO playlistitems (playlistid, filepath) VALUES (?, ?);";
+  sqlite3_stmt *stmt;
+  int ret;
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+      return NULL;
+    }
+
+  return stmt;
+}
+
 static int
 db_statements_prepare(void)
 {
@@ -7131,12 +7461,13 @@ db_statements_prepare(void)
 
   db_statements.playlists_insert = db_statements_prepare_insert(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
   db_statements.playlists_update = db_statements_prepare_update(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
+  db_statements.playlistitems_insert = db_statements_prepare_plitem_insert();
 
   db_statements.queue_items_insert = db_statements_prepare_insert(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
   db_statements.queue_items_update = db_statements_prepare_update(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
 
   if ( !db_statements.files_insert || !db_statements.files_update || !db_statements.files_ping
-       || !db_statements.playlists_insert || !db_statements.playlists_update
+       || !db_statements.playlists_insert || !db_statements.playlists_update || !db_statements.playlistitems_insert
        || !db_statements.queue_items_insert || !db_statements.queue_items_update
      )
     return -1;
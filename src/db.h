@@ -76,6 +76,9 @@ enum query_type {
 /* Max value for media_file_info->rating (valid range is from 0 to 100) */
 #define DB_FILES_RATING_MAX 100
 
+// Inotify cookies are uint32_t
+#define INOTIFY_FAKE_COOKIE ((int64_t)1 << 32)
+
 /* Magic id for media_file_info objects that are not stored in the files database table */
 #define DB_MEDIA_FILE_NON_PERSISTENT_ID 9999999
 
@@ -248,6 +251,7 @@ struct media_file_info {
   char *composer_sort;
 
   uint32_t scan_kind; /* Identifies the library_source that created/updates this item */
+  int64_t content_hash; /* Hash of size and head/tail of file content, used to detect moved files */
 };
 
 #define mfi_offsetof(field) offsetof(struct media_file_info, field)
@@ -422,6 +426,7 @@ struct db_media_file_info {
   char *channels;
   char *usermark;
   char *scan_kind;
+  char *content_hash;
 };
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
@@ -734,6 +739,9 @@ db_file_enable_bycookie(uint32_t cookie, const char *path, const char *filename)
 int
 db_file_update_directoryid(const char *path, int dir_id);
 
+int
+db_file_path_update_byid(int id, const char *path, const char *fname, const char *virtual_path, int dir_id);
+
 int
 db_filecount_get(struct filecount_info *fci, struct query_params *qp);
 
@@ -774,6 +782,9 @@ db_pl_update(struct playlist_info *pli);
 int
 db_pl_add_item_bypath(int plid, const char *path);
 
+int
+db_pl_add_items_bypath(int plid, const char **paths, int npaths);
+
 int
 db_pl_add_item_byid(int plid, int fileid);
 
@@ -873,6 +884,21 @@ db_admin_getint(int *intval, const char *key);
 int
 db_admin_getint64(int64_t *int64val, const char *key);
 
+/*
+ * Gets the value of one of the version-type admin keys (DB_ADMIN_DB_UPDATE,
+ * DB_ADMIN_DB_MODIFIED, DB_ADMIN_QUEUE_VERSION) from memory, only querying the
+ * database if the value isn't known yet. serial is incremented with every
+ * write of the key in this process, so two writes within the same second give
+ * different serials even if the timestamp value is the same.
+ *
+ * @out value  Value of the key, 0 if not set
+ * @out serial Write counter of the key
+ * @param key  Admin key
+ * @return     0 on success, -1 on failure
+ */
+int
+db_admin_getversion(int64_t *value, uint32_t *serial, const char *key);
+
 int
 db_admin_delete(const char *key);
 
@@ -974,6 +1000,12 @@ db_queue_inc_version(void);
 int
 db_queue_get_count(uint32_t *nitems);
 
+void
+db_queue_batch_begin(void);
+
+void
+db_queue_batch_end(void);
+
 int
 db_queue_get_pos(uint32_t item_id, char shuffle);
 
@@ -98,7 +98,8 @@
   "   composer_sort      VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   channels           INTEGER DEFAULT 0,"		\
   "   usermark           INTEGER DEFAULT 0,"		\
-  "   scan_kind          INTEGER DEFAULT 0"		\
+  "   scan_kind          INTEGER DEFAULT 0,"		\
+  "   content_hash       INTEGER DEFAULT 0"		\
   ");"
 
 #define T_PL					\
@@ -297,6 +298,9 @@ static const struct db_init_query db_init_table_queries[] =
 #define I_RESCAN				\
   "CREATE INDEX IF NOT EXISTS idx_rescan ON files(path, db_timestamp);"
 
+#define I_IDENTITY				\
+  "CREATE INDEX IF NOT EXISTS idx_identity ON files(file_size, content_hash);"
+
 #define I_FNAME					\
   "CREATE INDEX IF NOT EXISTS idx_fname ON files(disabled, fname COLLATE NOCASE);"
 
@@ -379,6 +383,7 @@ static const struct db_init_query db_init_table_queries[] =
 static const struct db_init_query db_init_index_queries[] =
   {
     { I_RESCAN,    "create rescan index" },
+    { I_IDENTITY,  "create identity index" },
     { I_FNAME,     "create filename index" },
     { I_SONGARTISTID, "create songartistid index" },
     { I_SONGALBUMID, "create songalbumid index" },
@@ -1227,6 +1227,19 @@ static const struct db_upgrade_query db_upgrade_v2200_queries[] =
     { U_v2200_SCVER_MINOR,    "set schema_version_minor to 00" },
   };
 
+#define U_v2201_ALTER_FILES_ADD_CONTENT_HASH \
+  "ALTER TABLE files ADD COLUMN content_hash INTEGER DEFAULT 0;"
+
+#define U_v2201_SCVER_MINOR                    \
+  "UPDATE admin SET value = '01' WHERE key = 'schema_version_minor';"
+
+static const struct db_upgrade_query db_upgrade_v2201_queries[] =
+  {
+    { U_v2201_ALTER_FILES_ADD_CONTENT_HASH, "alter table files add column content_hash" },
+
+    { U_v2201_SCVER_MINOR,    "set schema_version_minor to 01" },
+  };
+
 /* -------------------------- Main upgrade handler -------------------------- */
 
 int
@@ -1437,6 +1450,13 @@ db_upgrade(sqlite3 *hdl, int db_ver)
       if (ret < 0)
 	return -1;
 
+      /* FALLTHROUGH */
+
+    case 2200:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2201_queries, ARRAY_SIZE(db_upgrade_v2201_queries));
+      if (ret < 0)
+	return -1;
+
 
       /* Last case statement is the only one that ends with a break statement! */
       break;
@@ -20,6 +20,8 @@
 # include <config.h>
 #endif
 
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -385,56 +387,214 @@ dmap_send_error(struct evhttp_request *req, const char *container, const char *e
 }
 
 
-int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+/* An encoding plan is made from the requested meta tags once per request, so
+ * the lookups and special cases of the meta tags are dealt with up front. The
+ * items are encoded into a flat scratch buffer and added to the song list
+ * with a single evbuffer_add().
+ */
+
+enum dmap_wav_override
 {
-  const struct dmap_field_map *dfm;
+  DMAP_WAV_NONE,
+  DMAP_WAV_TYPE,
+  DMAP_WAV_BITRATE,
+  DMAP_WAV_DESCRIPTION,
+};
+
+struct dmap_encode_step {
   const struct dmap_field *df;
-  char **strval;
-  char *ptr;
-  int32_t val;
-  int want_mikd;
-  int want_asdk;
-  int want_ased;
+  ssize_t offset;
+  enum dmap_wav_override wav;
+};
+
+struct dmap_encode_plan {
+  struct dmap_encode_step *steps;
+  int nsteps;
+
+  bool want_mikd;
+  bool want_asdk;
+  bool want_ased;
+  bool sort_tags;
+
+  // Scratch buffer, the first DMAP_PLAN_HEADROOM bytes are kept free for the
+  // mlit container header and the mikd/asdk tags that go in front of the item
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+};
+
+#define DMAP_PLAN_HEADROOM (8 + 9 + 9)
+
+static void
+plan_reserve(struct dmap_encode_plan *plan, size_t len)
+{
+  size_t size;
+
+  if (plan->len + len <= plan->size)
+    return;
+
+  size = plan->size;
+  while (size < plan->len + len)
+    size *= 2;
+
+  CHECK_NULL(L_DMAP, plan->buf = realloc(plan->buf, size));
+  plan->size = size;
+}
+
+static inline void
+plan_put_uint32(uint8_t *p, uint32_t val)
+{
+  p[0] = (val >> 24) & 0xff;
+  p[1] = (val >> 16) & 0xff;
+  p[2] = (val >> 8) & 0xff;
+  p[3] = val & 0xff;
+}
+
+static void
+plan_add_data(struct dmap_encode_plan *plan, const char *tag, const void *data, uint32_t len)
+{
+  uint8_t *p;
+
+  plan_reserve(plan, 8 + len);
+
+  p = plan->buf + plan->len;
+  memcpy(p, tag, 4);
+  plan_put_uint32(p + 4, len);
+  if (len > 0)
+    memcpy(p + 8, data, len);
+
+  plan->len += 8 + len;
+}
+
+// Adds the size lowest bytes of val in network byte order
+static void
+plan_add_number(struct dmap_encode_plan *plan, const char *tag, uint64_t val, int size)
+{
+  uint8_t buf[8];
   int i;
-  int ret;
 
-  want_mikd = 0;
-  want_asdk = 0;
-  want_ased = 0;
+  for (i = size - 1; i >= 0; i--)
+    {
+      buf[i] = val & 0xff;
+      val >>= 8;
+    }
+
+  plan_add_data(plan, tag, buf, size);
+}
 
-  i = -1;
-  while (1)
+// Same as dmap_add_field(), but encodes to the scratch buffer of the plan
+static void
+plan_add_field(struct dmap_encode_plan *plan, const struct dmap_field *df, char *strval, int32_t intval)
+{
+  uint32_t u32;
+  int32_t i32;
+  uint64_t u64;
+  int64_t i64;
+
+  switch (df->type)
     {
-      i++;
+      case DMAP_TYPE_UBYTE:
+      case DMAP_TYPE_USHORT:
+      case DMAP_TYPE_UINT:
+      case DMAP_TYPE_DATE:
+	if (!strval)
+	  u32 = intval;
+	else if (safe_atou32(strval, &u32) < 0)
+	  u32 = 0;
+
+	if (u32)
+	  plan_add_number(plan, df->tag, u32, (df->type == DMAP_TYPE_UBYTE) ? 1 : (df->type == DMAP_TYPE_USHORT) ? 2 : 4);
+	break;
+
+      case DMAP_TYPE_BYTE:
+      case DMAP_TYPE_SHORT:
+      case DMAP_TYPE_INT:
+	if (!strval)
+	  i32 = intval;
+	else if (safe_atoi32(strval, &i32) < 0)
+	  i32 = 0;
+
+	if (i32)
+	  plan_add_number(plan, df->tag, i32, (df->type == DMAP_TYPE_BYTE) ? 1 : (df->type == DMAP_TYPE_SHORT) ? 2 : 4);
+	break;
+
+      case DMAP_TYPE_ULONG:
+	if (!strval)
+	  u64 = intval;
+	else if (safe_atou64(strval, &u64) < 0)
+	  u64 = 0;
+
+	if (u64)
+	  plan_add_number(plan, df->tag, u64, 8);
+	break;
+
+      case DMAP_TYPE_LONG:
+	if (!strval)
+	  i64 = intval;
+	else if (safe_atoi64(strval, &i64) < 0)
+	  i64 = 0;
+
+	if (i64)
+	  plan_add_number(plan, df->tag, i64, 8);
+	break;
+
+      case DMAP_TYPE_STRING:
+	if (strval)
+	  plan_add_data(plan, df->tag, strval, strlen(strval));
+	break;
+
+      // Filtered out when making the plan
+      case DMAP_TYPE_VERSION:
+      case DMAP_TYPE_LIST:
+	break;
+    }
+}
+
+static void
+plan_add_string(struct dmap_encode_plan *plan, const char *tag, const char *str)
+{
+  plan_add_data(plan, tag, str, str ? strlen(str) : 0);
+}
+
+struct dmap_encode_plan *
+dmap_encode_plan_new(const struct dmap_field **meta, int nmeta, int sort_tags)
+{
+  struct dmap_encode_plan *plan;
+  struct dmap_encode_step *step;
+  const struct dmap_field_map *dfm;
+  const struct dmap_field *df;
+  int nfields;
+  int i;
+
+  nfields = (nmeta > 0) ? nmeta : (sizeof(dmap_fields) / sizeof(dmap_fields[0]));
+
+  CHECK_NULL(L_DMAP, plan = calloc(1, sizeof(struct dmap_encode_plan)));
+  CHECK_NULL(L_DMAP, plan->steps = calloc(nfields, sizeof(struct dmap_encode_step)));
+
+  plan->size = 512;
+  CHECK_NULL(L_DMAP, plan->buf = malloc(plan->size));
+
+  plan->sort_tags = sort_tags;
 
+  for (i = 0; i < nfields; i++)
+    {
       /* Specific meta tags requested (or default list) */
       if (nmeta > 0)
 	{
-	  if (i == nmeta)
-	    break;
-
 	  df = meta[i];
-	  if (df->dfm)
-	    dfm = df->dfm;
-	  else
+	  if (!df || !df->dfm)
 	    break;
 	}
       /* No specific meta tags requested, send out everything */
       else
-	{
-	  /* End of list */
-	  if (i == (sizeof(dmap_fields) / sizeof(dmap_fields[0])))
-	    break;
+	df = &dmap_fields[i];
 
-	  df = &dmap_fields[i];
-	  dfm = dmap_fields[i].dfm;
-	}
+      dfm = df->dfm;
 
       /* Extradata not in media_file_info but flag for reply */
       if (dfm == &dfm_dmap_ased)
 	{
-	  want_ased = 1;
+	  plan->want_ased = true;
 	  continue;
 	}
 
@@ -445,28 +605,93 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
       /* Will be prepended to the list */
       if (dfm == &dfm_dmap_mikd)
 	{
-	  /* item kind */
-	  want_mikd = 1;
+	  plan->want_mikd = true;
 	  continue;
 	}
       else if (dfm == &dfm_dmap_asdk)
 	{
-	  /* data kind */
-	  want_asdk = 1;
+	  plan->want_asdk = true;
 	  continue;
 	}
 
-      DPRINTF(E_SPAM, L_DAAP, "Investigating %s\n", df->desc);
+      if (df->type == DMAP_TYPE_VERSION || df->type == DMAP_TYPE_LIST)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Unsupported DMAP type %d for DMAP field %s\n", df->type, df->desc);
+	  continue;
+	}
 
-      strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
+      step = &plan->steps[plan->nsteps];
+      step->df = df;
+      step->offset = dfm->mfi_offset;
+
+      switch (dfm->mfi_offset)
+	{
+	  case dbmfi_offsetof(type):
+	    step->wav = DMAP_WAV_TYPE;
+	    break;
+	  case dbmfi_offsetof(bitrate):
+	    step->wav = DMAP_WAV_BITRATE;
+	    break;
+	  case dbmfi_offsetof(description):
+	    step->wav = DMAP_WAV_DESCRIPTION;
+	    break;
+	  default:
+	    step->wav = DMAP_WAV_NONE;
+	}
+
+      plan->nsteps++;
+    }
+
+  return plan;
+}
+
+void
+dmap_encode_plan_free(struct dmap_encode_plan *plan)
+{
+  if (!plan)
+    return;
+
+  free(plan->steps);
+  free(plan->buf);
+  free(plan);
+}
+
+int
+dmap_encode_file_metadata(struct evbuffer *songlist, struct dmap_encode_plan *plan, struct db_media_file_info *dbmfi, int force_wav)
+{
+  struct dmap_encode_step *step;
+  const struct dmap_field *df;
+  uint8_t *p;
+  char **strval;
+  char *ptr;
+  size_t start;
+  size_t len;
+  int32_t val;
+  int i;
+  int ret;
+
+  plan->len = DMAP_PLAN_HEADROOM;
+
+  for (i = 0; i < plan->nsteps; i++)
+    {
+      step = &plan->steps[i];
+      df = step->df;
+
+      strval = (char **) ((char *)dbmfi + step->offset);
 
       if (!(*strval) || (**strval == '\0'))
 	continue;
 
       /* Here's one exception ... codectype (ascd) is actually an integer */
-      if (dfm == &dfm_dmap_ascd)
+      if (df->dfm == &dfm_dmap_ascd)
 	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
+	  plan_reserve(plan, 12);
+	  p = plan->buf + plan->len;
+	  memcpy(p, df->tag, 4);
+	  plan_put_uint32(p + 4, 4);
+	  memset(p + 8, 0, 4);
+	  memcpy(p + 8, *strval, strnlen(*strval, 4));
+	  plan->len += 12;
 	  continue;
 	}
 
@@ -474,14 +699,14 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
       if (force_wav)
 	{
-	  switch (dfm->mfi_offset)
+	  switch (step->wav)
 	    {
-	      case dbmfi_offsetof(type):
+	      case DMAP_WAV_TYPE:
 		ptr = "wav";
 		strval = &ptr;
 		break;
 
-	      case dbmfi_offsetof(bitrate):
+	      case DMAP_WAV_BITRATE:
 		val = 0;
 		ret = safe_atoi32(dbmfi->samplerate, &val);
 		if ((ret < 0) || (val == 0))
@@ -493,65 +718,75 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 		strval = &ptr;
 		break;
 
-	      case dbmfi_offsetof(description):
+	      case DMAP_WAV_DESCRIPTION:
 		ptr = "wav audio file";
 		strval = &ptr;
 		break;
 
-	      default:
+	      case DMAP_WAV_NONE:
 		break;
 	    }
 	}
 
-      dmap_add_field(song, df, *strval, val);
+      plan_add_field(plan, df, *strval, val);
 
       DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
     }
 
   /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
-  if (want_ased)
+  if (plan->want_ased)
     {
-      dmap_add_short(song, "ased", 1);
-      dmap_add_short(song, "asac", 1);
+      plan_add_number(plan, "ased", 1, 2);
+      plan_add_number(plan, "asac", 1, 2);
     }
 
-  if (sort_tags)
+  if (plan->sort_tags)
     {
-      dmap_add_string(song, "assn", dbmfi->title_sort);
-      dmap_add_string(song, "assa", dbmfi->artist_sort);
-      dmap_add_string(song, "assu", dbmfi->album_sort);
-      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+      plan_add_string(plan, "assn", dbmfi->title_sort);
+      plan_add_string(plan, "assa", dbmfi->artist_sort);
+      plan_add_string(plan, "assu", dbmfi->album_sort);
+      plan_add_string(plan, "assl", dbmfi->album_artist_sort);
 
       if (dbmfi->composer_sort)
-	dmap_add_string(song, "assc", dbmfi->composer_sort);
+	plan_add_string(plan, "assc", dbmfi->composer_sort);
     }
 
-  val = 0;
-  if (want_mikd)
-    val += 9;
-  if (want_asdk)
-    val += 9;
-
-  dmap_add_container(songlist, "mlit", evbuffer_get_length(song) + val);
+  /* Prepend mlit, mikd & asdk in the headroom, working backwards */
+  start = DMAP_PLAN_HEADROOM;
+  if (plan->want_asdk)
+    {
+      ret = safe_atoi32(dbmfi->data_kind, &val);
+      if (ret < 0)
+	val = 0;
 
-  /* Prepend mikd & asdk if needed */
-  if (want_mikd)
+      start -= 9;
+      p = plan->buf + start;
+      memcpy(p, "asdk", 4);
+      plan_put_uint32(p + 4, 1);
+      p[8] = val;
+    }
+  if (plan->want_mikd)
     {
       /* dmap.itemkind must come first */
       ret = safe_atoi32(dbmfi->item_kind, &val);
       if (ret < 0)
 	val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
-    }
-  if (want_asdk)
-    {
-      ret = safe_atoi32(dbmfi->data_kind, &val);
-      if (ret < 0)
-	val = 0;
-      dmap_add_char(songlist, "asdk", val);
+
+      start -= 9;
+      p = plan->buf + start;
+      memcpy(p, "mikd", 4);
+      plan_put_uint32(p + 4, 1);
+      p[8] = val;
     }
 
-  ret = evbuffer_add_buffer(songlist, song);
+  len = plan->len - start;
+
+  start -= 8;
+  p = plan->buf + start;
+  memcpy(p, "mlit", 4);
+  plan_put_uint32(p + 4, len);
+
+  ret = evbuffer_add(songlist, plan->buf + start, len + 8);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Could not add song to song list\n");
@@ -82,8 +82,20 @@ void
 dmap_send_error(struct evhttp_request *req, const char *container, const char *errmsg);
 
 
+/*
+ * Song list items are encoded according to a plan, made from the requested
+ * meta tags once per request. If nmeta is 0 all fields will be encoded.
+ */
+struct dmap_encode_plan;
+
+struct dmap_encode_plan *
+dmap_encode_plan_new(const struct dmap_field **meta, int nmeta, int sort_tags);
+
+void
+dmap_encode_plan_free(struct dmap_encode_plan *plan);
+
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
+dmap_encode_file_metadata(struct evbuffer *songlist, struct dmap_encode_plan *plan, struct db_media_file_info *dbmfi, int force_wav);
 
 int
 dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item);
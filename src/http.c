@@ -84,6 +84,45 @@ curl_headers_save(struct keyval *kv, CURL *curl)
     }
 }
 
+// Saves the validators that the caller can use for a conditional request (the
+// Content-Type is saved after the request by curl_headers_save)
+static size_t
+curl_header_cb(char *ptr, size_t size, size_t nitems, void *userdata)
+{
+  struct http_client_ctx *ctx = userdata;
+  size_t realsize = size * nitems;
+  const char *names[] = { "ETag", "Last-Modified" };
+  char *value;
+  size_t len;
+  int i;
+
+  // Headers from a redirect response must not be mixed with the final ones
+  if (realsize > 5 && strncmp(ptr, "HTTP/", 5) == 0)
+    {
+      for (i = 0; i < ARRAY_SIZE(names); i++)
+	keyval_remove(ctx->input_headers, names[i]);
+      return realsize;
+    }
+
+  for (i = 0; i < ARRAY_SIZE(names); i++)
+    {
+      len = strlen(names[i]);
+      if (realsize <= len + 1 || strncasecmp(ptr, names[i], len) != 0 || ptr[len] != ':')
+	continue;
+
+      value = strndup(ptr + len + 1, realsize - len - 1);
+      if (!value)
+	break;
+
+      keyval_remove(ctx->input_headers, names[i]);
+      keyval_add(ctx->input_headers, names[i], trim(value));
+      free(value);
+      break;
+    }
+
+  return realsize;
+}
+
 static size_t
 curl_request_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
@@ -107,32 +146,14 @@ curl_request_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
   return realsize;
 }
 
-int
-http_client_request(struct http_client_ctx *ctx, struct http_client_session *session)
+static struct curl_slist *
+curl_request_setup(CURL *curl, struct http_client_ctx *ctx)
 {
-  CURL *curl;
-  CURLcode res;
   struct curl_slist *headers;
   struct onekeyval *okv;
   const char *user_agent;
   long verifypeer;
   char header[1024];
-  long response_code;
-
-  if (session)
-    {
-      curl = session->curl;
-      curl_easy_reset(curl);
-    }
-  else
-    {
-      curl = curl_easy_init();
-    }
-  if (!curl)
-    {
-      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl handle\n");
-      return -1;
-    }
 
   user_agent = cfg_getstr(cfg_getsec(cfg, "general"), "user_agent");
   curl_easy_setopt(curl, CURLOPT_USERAGENT, user_agent);
@@ -162,10 +183,53 @@ http_client_request(struct http_client_ctx *ctx, struct http_client_session *ses
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_request_cb);
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, ctx);
 
+  if (ctx->input_headers)
+    {
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_cb);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, ctx);
+    }
+
   // Artwork and playlist requests might require redirects
   curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
   curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5);
 
+  return headers;
+}
+
+static void
+curl_request_finish(CURL *curl, struct http_client_ctx *ctx)
+{
+  long response_code;
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+  ctx->response_code = (int) response_code;
+  curl_headers_save(ctx->input_headers, curl);
+}
+
+int
+http_client_request(struct http_client_ctx *ctx, struct http_client_session *session)
+{
+  CURL *curl;
+  CURLcode res;
+  struct curl_slist *headers;
+
+  if (session)
+    {
+      curl = session->curl;
+      curl_easy_reset(curl);
+    }
+  else
+    {
+      curl = curl_easy_init();
+    }
+  if (!curl)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl handle\n");
+      return -1;
+    }
+
+  headers = curl_request_setup(curl, ctx);
+
   /* Make request */
   DPRINTF(E_INFO, L_HTTP, "Making request for %s\n", ctx->url);
 
@@ -181,9 +245,7 @@ http_client_request(struct http_client_ctx *ctx, struct http_client_session *ses
       return -1;
     }
 
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-  ctx->response_code = (int) response_code;
-  curl_headers_save(ctx->input_headers, curl);
+  curl_request_finish(curl, ctx);
 
   curl_slist_free_all(headers);
   if (!session)
@@ -194,6 +256,129 @@ http_client_request(struct http_client_ctx *ctx, struct http_client_session *ses
   return 0;
 }
 
+struct curl_multi_item
+{
+  CURL *curl;
+  struct curl_slist *headers;
+  struct http_client_ctx *ctx;
+};
+
+static int
+curl_multi_item_add(CURLM *multi, struct curl_multi_item *item, struct http_client_ctx *ctx)
+{
+  item->ctx = ctx;
+  item->curl = curl_easy_init();
+  if (!item->curl)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl handle\n");
+      ctx->ret = -1;
+      return -1;
+    }
+
+  item->headers = curl_request_setup(item->curl, ctx);
+  curl_easy_setopt(item->curl, CURLOPT_PRIVATE, item);
+
+  DPRINTF(E_INFO, L_HTTP, "Making request for %s\n", ctx->url);
+
+  curl_multi_add_handle(multi, item->curl);
+  return 0;
+}
+
+static void
+curl_multi_item_done(CURLM *multi, struct curl_multi_item *item, CURLcode res)
+{
+  if (res != CURLE_OK)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Request to %s failed: %s\n", item->ctx->url, curl_easy_strerror(res));
+      item->ctx->ret = -1;
+    }
+  else
+    {
+      curl_request_finish(item->curl, item->ctx);
+      item->ctx->ret = 0;
+    }
+
+  curl_multi_remove_handle(multi, item->curl);
+  curl_easy_cleanup(item->curl);
+  curl_slist_free_all(item->headers);
+  item->curl = NULL;
+  item->headers = NULL;
+}
+
+int
+http_client_request_multi(struct http_client_ctx **ctxs, int nctxs, int max_parallel)
+{
+  CURLM *multi;
+  CURLMsg *msg;
+  struct curl_multi_item *items;
+  struct curl_multi_item *item;
+  int next;
+  int active;
+  int running;
+  int queued;
+  int ret;
+
+  if (nctxs <= 0)
+    return 0;
+
+  multi = curl_multi_init();
+  if (!multi)
+    {
+      DPRINTF(E_LOG, L_HTTP, "Error: Could not get curl multi handle\n");
+      return -1;
+    }
+
+  CHECK_NULL(L_HTTP, items = calloc(nctxs, sizeof(struct curl_multi_item)));
+
+  if (max_parallel <= 0)
+    max_parallel = 1;
+
+  // The connection cache is shared by the handles in the multi handle, so
+  // connections to the same host are kept alive and reused between requests
+  curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)max_parallel);
+#ifdef CURLPIPE_MULTIPLEX
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+  for (next = 0, active = 0; next < nctxs && active < max_parallel; next++)
+    {
+      ret = curl_multi_item_add(multi, &items[next], ctxs[next]);
+      if (ret == 0)
+	active++;
+    }
+
+  while (active > 0)
+    {
+      curl_multi_perform(multi, &running);
+
+      while ((msg = curl_multi_info_read(multi, &queued)))
+	{
+	  if (msg->msg != CURLMSG_DONE)
+	    continue;
+
+	  curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&item);
+	  curl_multi_item_done(multi, item, msg->data.result);
+	  active--;
+
+	  // Refill
+	  for (; next < nctxs && active < max_parallel; next++)
+	    {
+	      ret = curl_multi_item_add(multi, &items[next], ctxs[next]);
+	      if (ret == 0)
+		active++;
+	    }
+	}
+
+      if (active > 0)
+	curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+
+  curl_multi_cleanup(multi);
+  free(items);
+
+  return 0;
+}
+
 char *
 http_form_urlencode(struct keyval *kv)
 {
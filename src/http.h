@@ -38,8 +38,12 @@ struct http_client_ctx
   /* HTTP Response code */
   int response_code;
 
-  /* Private */
+  /* Result of the request when made with http_client_request_multi(), 0 if
+   * successful, -1 if an error occurred
+   */
   int ret;
+
+  /* Private */
   void *evbase;
 };
 
@@ -76,6 +80,23 @@ http_client_session_deinit(struct http_client_session *session);
 int
 http_client_request(struct http_client_ctx *ctx, struct http_client_session *session);
 
+/* Makes a number of http(s) requests concurrently, at most max_parallel at a
+ * time. Connections are kept alive and reused for requests to the same host.
+ * The function blocks until all requests have completed, the result of each
+ * request is in ctx->ret and ctx->response_code.
+ *
+ * If input_headers is set, ETag and Last-Modified from the response are saved
+ * in it, so that the caller can make a conditional request next time. This is
+ * also the case for http_client_request().
+ *
+ * @param ctxs Array of HTTP request params
+ * @param nctxs Number of requests in ctxs
+ * @param max_parallel Max number of requests in progress at the same time
+ * @return 0 if the requests were made, -1 if an error occurred
+ */
+int
+http_client_request_multi(struct http_client_ctx **ctxs, int nctxs, int max_parallel);
+
 
 /* Converts the keyval dictionary to a application/x-www-form-urlencoded string.
  * The values will be uri_encoded. Example output: "key1=foo%20bar&key2=123".
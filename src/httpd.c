@@ -53,6 +53,7 @@
 #include "conffile.h"
 #include "misc.h"
 #include "worker.h"
+#include "commands.h"
 #include "httpd.h"
 #include "httpd_rsp.h"
 #include "httpd_daap.h"
@@ -71,6 +72,13 @@
 
 
 #define STREAM_CHUNK_SIZE (64 * 1024)
+#define GZIP_CHUNK_SIZE (16 * 1024)
+// Web root files up to this size are kept in memory, along with a gzipped copy
+#define HTDOCS_CACHE_FILE_MAX (4 * 1024 * 1024)
+#define HTDOCS_CACHE_MAX      (32 * 1024 * 1024)
+// Transcoded streams that haven't been read for this long are dropped from the
+// cache, see transcode_cache_size for its size
+#define XCODE_CACHE_IDLE_SECS  300
 #define ERR_PAGE "<html>\n<head>\n" \
   "<title>%d %s</title>\n" \
   "</head>\n<body>\n" \
@@ -94,6 +102,9 @@ struct stream_ctx {
   struct event *ev;
   int id;
   int fd;
+#ifndef HAVE_LIBEVENT2_OLD
+  struct evbuffer_file_segment *seg;
+#endif
   off_t size;
   off_t stream_size;
   off_t offset;
@@ -101,6 +112,104 @@ struct stream_ctx {
   off_t end_offset;
   int marked;
   struct transcode_ctx *xcode;
+  struct xcode_cache_entry *xc;
+};
+
+/*
+ * Output of a transcoding that is shared by all requests for the same file.
+ * The first request to need data beyond len runs the transcoder, and the data
+ * is kept so the other requests can read it from memory. Only used by the
+ * httpd thread.
+ */
+struct xcode_cache_entry {
+  int id;
+  uint32_t time_modified;
+
+  // NULL when the transcoding is complete or has failed
+  struct transcode_ctx *xcode;
+  struct evbuffer *pending;
+  bool complete;
+  bool failed;
+
+  uint8_t *data;
+  size_t len;
+  size_t alloc;
+  off_t est_size;
+
+  int refcount;
+  time_t last_used;
+
+  struct xcode_cache_entry *next;
+};
+
+struct httpd_reply_stream {
+  struct evhttp_request *req;
+  // Only set if the reply is gzipped
+  struct evbuffer *gzbuf;
+  z_stream strm;
+};
+
+// A client connection, see conn_register()
+struct httpd_conn {
+  struct evhttp_connection *evcon;
+
+  // Close callback of the handler, see httpd_connection_set_closecb()
+  void (*closecb)(struct evhttp_connection *, void *);
+  void *closecb_arg;
+
+  struct httpd_conn *next;
+};
+
+struct httpd_request_timing {
+  struct httpd_conn *conn;
+  enum httpd_route_class route;
+  struct timespec start;
+
+  struct httpd_request_timing *next;
+};
+
+struct httpd_worker {
+  pthread_t tid;
+  struct event_base *evbase;
+  struct commands_base *cmdbase;
+};
+
+/*
+ * A request handed to a worker thread by httpd_request_dispatch(). The reply
+ * the handler produces is held here until the httpd thread sends it.
+ */
+struct httpd_job {
+  struct evhttp_request *req;
+  struct httpd_request *hreq;
+  void (*cb)(struct httpd_request *hreq);
+
+  // Own copies, since the caller's are freed when dispatch returns
+  struct httpd_uri_parsed *uri_parsed;
+  char *peer_address;
+
+  bool replied;
+  bool is_error;
+  int code;
+  char *reason;
+  struct evbuffer *reply;
+};
+
+/*
+ * A web root file held in memory. Replies reference the data instead of
+ * copying it, so the entry is refcounted and freed when the last reply using
+ * it has been sent. Only used by the httpd thread.
+ */
+struct htdocs_file {
+  char *path;
+  time_t mtime;
+  off_t size;
+  int refcount;
+
+  uint8_t *data;
+  uint8_t *gzdata;
+  size_t gzlen;
+
+  struct htdocs_file *next;
 };
 
 static const struct content_type_map ext2ctype[] =
@@ -133,6 +242,32 @@ static pthread_t tid_httpd;
 
 static const char *allow_origin;
 static int httpd_port;
+static int gzip_level;
+
+// Worker threads for handlers that may block, e.g. on the database
+static struct httpd_worker *httpd_workers;
+static int httpd_workers_num;
+static int httpd_workers_next;
+static bool httpd_workers_stopped;
+static struct commands_base *httpd_cmdbase;
+static __thread struct httpd_job *httpd_job_current;
+
+static struct htdocs_file *htdocs_cache;
+static size_t htdocs_cache_size;
+
+// Transcoded streams are kept in memory, so that clients that open the same
+// stream several times (or make range requests) don't each need a transcoder
+static struct xcode_cache_entry *xcode_cache;
+static size_t xcode_cache_size;
+static size_t xcode_cache_max;
+static size_t xcode_cache_entry_max;
+static struct event *xcode_cache_ev;
+
+static struct httpd_conn *httpd_conns;
+static struct httpd_request_timing *httpd_inflight;
+static int httpd_max_connections;
+static struct httpd_stats httpd_stats;
+static pthread_mutex_t httpd_stats_lck = PTHREAD_MUTEX_INITIALIZER;
 
 #ifdef HAVE_LIBEVENT2_OLD
 struct stream_ctx *g_st;
@@ -141,6 +276,18 @@ struct stream_ctx *g_st;
 
 /* -------------------------------- HELPERS --------------------------------- */
 
+static bool
+request_accepts_gzip(struct evhttp_request *req)
+{
+  struct evkeyvalq *input_headers;
+  const char *param;
+
+  input_headers = evhttp_request_get_input_headers(req);
+  param = evhttp_find_header(input_headers, "Accept-Encoding");
+
+  return (param && (strstr(param, "gzip") || strstr(param, "*")));
+}
+
 static int
 path_is_legal(const char *path)
 {
@@ -340,6 +487,47 @@ httpd_request_not_modified_since(struct evhttp_request *req, time_t mtime)
   return false;
 }
 
+/*
+ * Checks the validators of a request against the given ETag and timestamp
+ *
+ * As required by RFC 7232, "If-Modified-Since" is only evaluated if the request
+ * has no "If-None-Match" header. If the resource is modified, the "Cache-Control",
+ * "ETag" and "Last-Modified" headers are added to the response header.
+ *
+ * @param req The request with request and response headers
+ * @param etag The valid ETag for the requested resource
+ * @param mtime The last modified timestamp for the requested resource
+ * @return True if the client's cached copy is still valid, otherwise false
+ */
+bool
+httpd_request_not_modified(struct evhttp_request *req, const char *etag, time_t mtime)
+{
+  struct evkeyvalq *input_headers;
+  struct evkeyvalq *output_headers;
+  char last_modified[1000];
+  const char *none_match;
+  const char *modified_since;
+  struct tm timebuf;
+
+  input_headers = evhttp_request_get_input_headers(req);
+  none_match = evhttp_find_header(input_headers, "If-None-Match");
+  modified_since = evhttp_find_header(input_headers, "If-Modified-Since");
+
+  strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S %Z", gmtime_r(&mtime, &timebuf));
+
+  if (none_match && (strcasecmp(etag, none_match) == 0))
+    return true;
+  if (!none_match && modified_since && (strcasecmp(last_modified, modified_since) == 0))
+    return true;
+
+  output_headers = evhttp_request_get_output_headers(req);
+  evhttp_add_header(output_headers, "Cache-Control", "private,no-cache,max-age=0");
+  evhttp_add_header(output_headers, "ETag", etag);
+  evhttp_add_header(output_headers, "Last-Modified", last_modified);
+
+  return false;
+}
+
 void
 httpd_response_not_cachable(struct evhttp_request *req)
 {
@@ -356,6 +544,157 @@ httpd_response_not_cachable(struct evhttp_request *req)
   evhttp_add_header(output_headers, "Cache-Control", "no-store");
 }
 
+/* ---------------------------- WEB ROOT CACHE ------------------------------ */
+
+static struct evbuffer *
+gzip_deflate(struct evbuffer *in, int level);
+
+static void
+htdocs_file_unref(struct htdocs_file *file)
+{
+  file->refcount--;
+  if (file->refcount > 0)
+    return;
+
+  free(file->path);
+  free(file->data);
+  free(file->gzdata);
+  free(file);
+}
+
+// Called by libevent when a reply referencing the file data has been sent
+static void
+htdocs_file_ref_cleanup(const void *data, size_t datalen, void *extra)
+{
+  htdocs_file_unref(extra);
+}
+
+static void
+htdocs_cache_remove(struct htdocs_file *file)
+{
+  struct htdocs_file *f;
+
+  if (htdocs_cache == file)
+    htdocs_cache = file->next;
+  else
+    {
+      for (f = htdocs_cache; f && (f->next != file); f = f->next)
+	; /* EMPTY */
+
+      if (f)
+	f->next = file->next;
+    }
+
+  htdocs_cache_size -= file->size + file->gzlen;
+
+  htdocs_file_unref(file);
+}
+
+static void
+htdocs_cache_purge(void)
+{
+  while (htdocs_cache)
+    htdocs_cache_remove(htdocs_cache);
+}
+
+static struct htdocs_file *
+htdocs_file_load(const char *path, struct stat *sb)
+{
+  struct htdocs_file *file;
+  struct evbuffer *evbuf;
+  struct evbuffer *gzbuf;
+  size_t pos;
+  ssize_t ret;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  CHECK_NULL(L_HTTPD, file = calloc(1, sizeof(struct htdocs_file)));
+  CHECK_NULL(L_HTTPD, file->data = malloc(sb->st_size));
+
+  for (pos = 0; pos < sb->st_size; pos += ret)
+    {
+      ret = read(fd, file->data + pos, sb->st_size - pos);
+      if (ret <= 0)
+	break;
+    }
+
+  close(fd);
+
+  if (pos != sb->st_size)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not read '%s' into cache\n", path);
+
+      free(file->data);
+      free(file);
+      return NULL;
+    }
+
+  file->path = strdup(path);
+  file->mtime = sb->st_mtime;
+  file->size = sb->st_size;
+  file->refcount = 1;
+
+  // Compress once here instead of on every request. Not worth keeping if it
+  // doesn't shrink much, e.g. for images.
+  CHECK_NULL(L_HTTPD, evbuf = evbuffer_new());
+  evbuffer_add_reference(evbuf, file->data, file->size, NULL, NULL);
+
+  // Only done once per file, so we can afford the best compression
+  gzbuf = gzip_deflate(evbuf, Z_BEST_COMPRESSION);
+  if (gzbuf && (evbuffer_get_length(gzbuf) < (file->size * 9) / 10))
+    {
+      file->gzlen = evbuffer_get_length(gzbuf);
+      CHECK_NULL(L_HTTPD, file->gzdata = malloc(file->gzlen));
+      evbuffer_remove(gzbuf, file->gzdata, file->gzlen);
+    }
+
+  if (gzbuf)
+    evbuffer_free(gzbuf);
+  evbuffer_free(evbuf);
+
+  DPRINTF(E_DBG, L_HTTPD, "Cached web root file '%s' (%zu bytes, gzipped %zu)\n", path, (size_t)file->size, file->gzlen);
+
+  return file;
+}
+
+/*
+ * Returns the cached version of the file at path, loading it if it isn't
+ * cached or has changed. Returns NULL if the file shouldn't be cached.
+ */
+static struct htdocs_file *
+htdocs_cache_get(const char *path, struct stat *sb)
+{
+  struct htdocs_file *file;
+
+  for (file = htdocs_cache; file; file = file->next)
+    {
+      if (strcmp(file->path, path) != 0)
+	continue;
+
+      if (file->mtime == sb->st_mtime && file->size == sb->st_size)
+	return file;
+
+      htdocs_cache_remove(file);
+      break;
+    }
+
+  if (sb->st_size == 0 || sb->st_size > HTDOCS_CACHE_FILE_MAX || htdocs_cache_size + sb->st_size > HTDOCS_CACHE_MAX)
+    return NULL;
+
+  file = htdocs_file_load(path, sb);
+  if (!file)
+    return NULL;
+
+  file->next = htdocs_cache;
+  htdocs_cache = file;
+  htdocs_cache_size += file->size + file->gzlen;
+
+  return file;
+}
+
 static void
 serve_file(struct evhttp_request *req, const char *uri)
 {
@@ -365,11 +704,16 @@ serve_file(struct evhttp_request *req, const char *uri)
   char *ctype;
   struct evbuffer *evbuf;
   struct evkeyvalq *output_headers;
+  struct htdocs_file *file;
+  struct evbuffer_file_segment *seg;
   struct stat sb;
+  char etag[64];
+  uint8_t *data;
+  size_t len;
   int fd;
   int i;
-  uint8_t buf[4096];
   bool slashed;
+  bool gzipped;
   int ret;
 
   /* Check authentication */
@@ -453,7 +797,20 @@ serve_file(struct evhttp_request *req, const char *uri)
       return;
     }
 
-  if (httpd_request_not_modified_since(req, sb.st_mtime))
+  output_headers = evhttp_request_get_output_headers(req);
+
+  file = htdocs_cache_get(deref, &sb);
+  gzipped = (file && file->gzdata && request_accepts_gzip(req));
+
+  // The representation depends on Accept-Encoding if we have a gzipped copy
+  if (file && file->gzdata)
+    evhttp_add_header(output_headers, "Vary", "Accept-Encoding");
+
+  // ETag changes when the file is replaced, so clients can revalidate cheaply.
+  // It must be different for the gzipped and the identity representation.
+  snprintf(etag, sizeof(etag), "\"%" PRIx64 "-%" PRIx64 "%s\"", (uint64_t)sb.st_mtime, (uint64_t)sb.st_size, gzipped ? "-gz" : "");
+
+  if (httpd_request_not_modified(req, etag, sb.st_mtime))
     {
       httpd_send_reply(req, HTTP_NOTMODIFIED, NULL, NULL, HTTPD_SEND_NO_GZIP);
       return;
@@ -468,32 +825,6 @@ serve_file(struct evhttp_request *req, const char *uri)
       return;
     }
 
-  fd = open(deref, O_RDONLY);
-  if (fd < 0)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", deref, strerror(errno));
-
-      httpd_send_error(req, HTTP_NOTFOUND, "Not Found");
-      evbuffer_free(evbuf);
-      return;
-    }
-
-  ret = evbuffer_expand(evbuf, sb.st_size);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Out of memory for htdocs-file\n");
-      goto out_fail;
-    }
-
-  while ((ret = read(fd, buf, sizeof(buf))) > 0)
-    evbuffer_add(evbuf, buf, ret);
-
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Could not read file into evbuffer\n");
-      goto out_fail;
-    }
-
   ctype = "application/octet-stream";
   ext = strrchr(path, '.');
   if (ext)
@@ -508,91 +839,372 @@ serve_file(struct evhttp_request *req, const char *uri)
 	}
     }
 
-  output_headers = evhttp_request_get_output_headers(req);
+  if (file)
+    {
+      if (gzipped)
+	{
+	  evhttp_add_header(output_headers, "Content-Encoding", "gzip");
+	  data = file->gzdata;
+	  len = file->gzlen;
+	}
+      else
+	{
+	  data = file->data;
+	  len = file->size;
+	}
+
+      file->refcount++;
+      evbuffer_add_reference(evbuf, data, len, htdocs_file_ref_cleanup, file);
+    }
+  else if (sb.st_size > 0)
+    {
+      fd = open(deref, O_RDONLY);
+      if (fd < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not open %s: %s\n", deref, strerror(errno));
+
+	  httpd_send_error(req, HTTP_NOTFOUND, "Not Found");
+	  evbuffer_free(evbuf);
+	  return;
+	}
+
+      // Lets libevent sendfile()/mmap() the file. Once the segment exists it
+      // owns fd, and closes it when the last reference is gone. Depending on
+      // where it fails, evbuffer_add_file() may or may not have closed fd, so
+      // we make the segment ourselves to know who should close it.
+      seg = evbuffer_file_segment_new(fd, 0, sb.st_size, EVBUF_FS_CLOSE_ON_FREE);
+      if (!seg)
+	close(fd);
+
+      ret = seg ? evbuffer_add_file_segment(evbuf, seg, 0, sb.st_size) : -1;
+      if (seg)
+	evbuffer_file_segment_free(seg);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not add %s to evbuffer\n", deref);
+
+	  httpd_send_error(req, HTTP_SERVUNAVAIL, "Internal error");
+	  evbuffer_free(evbuf);
+	  return;
+	}
+    }
+
   evhttp_add_header(output_headers, "Content-Type", ctype);
 
   httpd_send_reply(req, HTTP_OK, "OK", evbuf, HTTPD_SEND_NO_GZIP);
 
   evbuffer_free(evbuf);
-  close(fd);
-  return;
-
- out_fail:
-  httpd_send_error(req, HTTP_SERVUNAVAIL, "Internal error");
-  evbuffer_free(evbuf);
-  close(fd);
 }
 
 
-/* ---------------------------- STREAM HANDLING ----------------------------- */
+/* ---------------------------- TRANSCODE CACHE ----------------------------- */
 
 static void
-stream_end(struct stream_ctx *st, int failed)
+xcode_cache_entry_free(struct xcode_cache_entry *xc)
 {
-  struct evhttp_connection *evcon;
-
-  evcon = evhttp_request_get_connection(st->req);
-
-  if (evcon)
-    evhttp_connection_set_closecb(evcon, NULL, NULL);
-
-  if (!failed)
-    evhttp_send_reply_end(st->req);
+  transcode_cleanup(&xc->xcode);
+  if (xc->pending)
+    evbuffer_free(xc->pending);
+  free(xc->data);
+  free(xc);
+}
 
-  evbuffer_free(st->evbuf);
-  event_free(st->ev);
+static void
+xcode_cache_remove(struct xcode_cache_entry *xc)
+{
+  struct xcode_cache_entry *e;
 
-  if (st->xcode)
-    transcode_cleanup(&st->xcode);
+  if (xcode_cache == xc)
+    xcode_cache = xc->next;
   else
     {
-      free(st->buf);
-      close(st->fd);
+      for (e = xcode_cache; e && (e->next != xc); e = e->next)
+	; /* EMPTY */
+
+      if (e)
+	e->next = xc->next;
     }
 
-#ifdef HAVE_LIBEVENT2_OLD
-  if (g_st == st)
-    g_st = NULL;
-#endif
+  xcode_cache_size -= xc->alloc;
 
-  free(st);
+  xcode_cache_entry_free(xc);
 }
 
 static void
-stream_end_register(struct stream_ctx *st)
+xcode_cache_purge(void)
 {
-  if (!st->marked
-      && (st->stream_size > ((st->size * 50) / 100))
-      && (st->offset > ((st->size * 80) / 100)))
-    {
-      st->marked = 1;
-      worker_execute(playcount_inc_cb, &st->id, sizeof(int), 0);
-#ifdef LASTFM
-      worker_execute(scrobble_cb, &st->id, sizeof(int), 1);
-#endif
-    }
+  while (xcode_cache)
+    xcode_cache_remove(xcode_cache);
 }
 
+// Evicts the least recently used entries that no request is reading from
+// until there is room for size more bytes
 static void
-stream_chunk_resched_cb(struct evhttp_connection *evcon, void *arg)
+xcode_cache_evict(size_t size)
 {
-  struct stream_ctx *st;
-  struct timeval tv;
-  int ret;
-
-  st = (struct stream_ctx *)arg;
+  struct xcode_cache_entry *xc;
+  struct xcode_cache_entry *lru;
 
-  evutil_timerclear(&tv);
-  ret = event_add(st->ev, &tv);
-  if (ret < 0)
+  while (xcode_cache_size + size > xcode_cache_max)
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming\n");
+      lru = NULL;
+      for (xc = xcode_cache; xc; xc = xc->next)
+	{
+	  if (xc->refcount == 0 && (!lru || xc->last_used < lru->last_used))
+	    lru = xc;
+	}
 
-      stream_end(st, 0);
+      if (!lru)
+	return;
+
+      DPRINTF(E_DBG, L_HTTPD, "Evicting transcoded file id %d from cache\n", lru->id);
+      xcode_cache_remove(lru);
     }
 }
 
-#ifdef HAVE_LIBEVENT2_OLD
+static void
+xcode_cache_idle_cb(int fd, short what, void *arg)
+{
+  struct xcode_cache_entry *xc;
+  struct xcode_cache_entry *next;
+  struct timeval tv = { XCODE_CACHE_IDLE_SECS, 0 };
+  time_t now;
+
+  now = time(NULL);
+
+  for (xc = xcode_cache; xc; xc = next)
+    {
+      next = xc->next;
+      if (xc->refcount == 0 && (now - xc->last_used >= XCODE_CACHE_IDLE_SECS))
+	xcode_cache_remove(xc);
+    }
+
+  if (xcode_cache)
+    evtimer_add(xcode_cache_ev, &tv);
+}
+
+/*
+ * Returns a cache entry for the file with a reference for the caller, setting
+ * up the transcoder if needed. Returns NULL if the file should be transcoded
+ * without the cache, e.g. because it is too long.
+ */
+static struct xcode_cache_entry *
+xcode_cache_get(struct media_file_info *mfi, struct media_quality *quality)
+{
+  struct xcode_cache_entry *xc;
+  struct timeval tv = { XCODE_CACHE_IDLE_SECS, 0 };
+  off_t est_size;
+
+  for (xc = xcode_cache; xc; xc = xc->next)
+    {
+      if (xc->id == mfi->id)
+	break;
+    }
+
+  if (xc && (xc->failed || xc->time_modified != mfi->time_modified))
+    {
+      if (xc->refcount > 0)
+	return NULL;
+
+      xcode_cache_remove(xc);
+      xc = NULL;
+    }
+
+  if (xc)
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Transcoded file id %d is cached (%zu bytes, complete %d)\n", xc->id, xc->len, xc->complete);
+
+      xc->refcount++;
+      xc->last_used = time(NULL);
+      return xc;
+    }
+
+  if (xcode_cache_max == 0)
+    return NULL;
+
+  est_size = (off_t)mfi->song_length * quality->sample_rate / 1000 * (quality->bits_per_sample / 8) * quality->channels;
+  if (est_size == 0 || est_size > xcode_cache_entry_max)
+    return NULL;
+
+  CHECK_NULL(L_HTTPD, xc = calloc(1, sizeof(struct xcode_cache_entry)));
+  CHECK_NULL(L_HTTPD, xc->pending = evbuffer_new());
+
+  xc->xcode = transcode_setup(XCODE_PCM16_HEADER, quality, mfi->data_kind, mfi->path, mfi->song_length, &xc->est_size);
+  if (!xc->xcode)
+    {
+      xcode_cache_entry_free(xc);
+      return NULL;
+    }
+
+  xc->id = mfi->id;
+  xc->time_modified = mfi->time_modified;
+  xc->refcount = 1;
+  xc->last_used = time(NULL);
+
+  // Reserve for the whole stream up front, so other entries get evicted now
+  // instead of while we are streaming. If the entries in use leave no room,
+  // the request transcodes without the cache.
+  xc->alloc = xc->est_size + STREAM_CHUNK_SIZE;
+  xcode_cache_evict(xc->alloc);
+  if (xcode_cache_size + xc->alloc > xcode_cache_max)
+    {
+      DPRINTF(E_DBG, L_HTTPD, "No room in cache for transcoding file id %d (%zu bytes)\n", mfi->id, xc->alloc);
+      xcode_cache_entry_free(xc);
+      return NULL;
+    }
+
+  CHECK_NULL(L_HTTPD, xc->data = malloc(xc->alloc));
+  xcode_cache_size += xc->alloc;
+
+  xc->next = xcode_cache;
+  xcode_cache = xc;
+
+  if (!evtimer_pending(xcode_cache_ev, NULL))
+    evtimer_add(xcode_cache_ev, &tv);
+
+  return xc;
+}
+
+static void
+xcode_cache_release(struct xcode_cache_entry *xc)
+{
+  xc->refcount--;
+  xc->last_used = time(NULL);
+}
+
+/*
+ * Transcodes the next chunk into the cache. Returns the number of bytes added,
+ * 0 if the transcoding is complete or -1 on error.
+ */
+static int
+xcode_cache_fill(struct xcode_cache_entry *xc)
+{
+  size_t len;
+  size_t alloc;
+  int ret;
+
+  if (xc->complete)
+    return 0;
+  if (!xc->xcode)
+    return -1;
+
+  ret = transcode(xc->pending, NULL, xc->xcode, STREAM_CHUNK_SIZE);
+  if (ret <= 0)
+    {
+      if (ret == 0)
+	xc->complete = true;
+      else
+	xc->failed = true;
+
+      transcode_cleanup(&xc->xcode);
+      return ret;
+    }
+
+  len = evbuffer_get_length(xc->pending);
+  if (xc->len + len > xc->alloc)
+    {
+      // The estimate was too low
+      alloc = MAX(xc->len + len, xc->alloc + xc->alloc / 4);
+      xcode_cache_evict(alloc - xc->alloc);
+      if (alloc > xcode_cache_entry_max || xcode_cache_size + (alloc - xc->alloc) > xcode_cache_max)
+	{
+	  // Stop here, the requests reading from the entry have already been
+	  // given everything up to the estimated size that they were told. The
+	  // entry is replaced when no longer in use.
+	  DPRINTF(E_WARN, L_HTTPD, "Transcoded file id %d exceeds its cache reservation, stopping at %zu bytes\n", xc->id, xc->len);
+	  xc->failed = true;
+	  transcode_cleanup(&xc->xcode);
+	  evbuffer_drain(xc->pending, len);
+	  return -1;
+	}
+
+      CHECK_NULL(L_HTTPD, xc->data = realloc(xc->data, alloc));
+      xcode_cache_size += alloc - xc->alloc;
+      xc->alloc = alloc;
+    }
+
+  evbuffer_remove(xc->pending, xc->data + xc->len, len);
+  xc->len += len;
+
+  return len;
+}
+
+
+/* ---------------------------- STREAM HANDLING ----------------------------- */
+
+static void
+stream_end(struct stream_ctx *st, int failed)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(st->req);
+
+  if (evcon)
+    httpd_connection_set_closecb(evcon, NULL, NULL);
+
+  if (!failed)
+    evhttp_send_reply_end(st->req);
+
+  evbuffer_free(st->evbuf);
+  event_free(st->ev);
+
+  if (st->xcode)
+    transcode_cleanup(&st->xcode);
+  else if (st->xc)
+    xcode_cache_release(st->xc);
+#ifndef HAVE_LIBEVENT2_OLD
+  else if (st->seg)
+    evbuffer_file_segment_free(st->seg); // Closes fd once queued data is sent
+#endif
+  else
+    {
+      free(st->buf);
+      close(st->fd);
+    }
+
+#ifdef HAVE_LIBEVENT2_OLD
+  if (g_st == st)
+    g_st = NULL;
+#endif
+
+  free(st);
+}
+
+static void
+stream_end_register(struct stream_ctx *st)
+{
+  if (!st->marked
+      && (st->stream_size > ((st->size * 50) / 100))
+      && (st->offset > ((st->size * 80) / 100)))
+    {
+      st->marked = 1;
+      worker_execute(playcount_inc_cb, &st->id, sizeof(int), 0);
+#ifdef LASTFM
+      worker_execute(scrobble_cb, &st->id, sizeof(int), 1);
+#endif
+    }
+}
+
+static void
+stream_chunk_resched_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct stream_ctx *st;
+  struct timeval tv;
+  int ret;
+
+  st = (struct stream_ctx *)arg;
+
+  evutil_timerclear(&tv);
+  ret = event_add(st->ev, &tv);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming\n");
+
+      stream_end(st, 0);
+    }
+}
+
+#ifdef HAVE_LIBEVENT2_OLD
 static void
 stream_chunk_resched_cb_wrapper(struct bufferevent *bufev, void *arg)
 {
@@ -678,6 +1290,80 @@ stream_chunk_xcode_cb(int fd, short event, void *arg)
     }
 }
 
+static void
+stream_chunk_xcode_cache_cb(int fd, short event, void *arg)
+{
+  struct stream_ctx *st;
+  struct xcode_cache_entry *xc;
+  struct timeval tv;
+  size_t chunk_size;
+  int ret;
+
+  st = (struct stream_ctx *)arg;
+  xc = st->xc;
+
+  if (st->end_offset && (st->offset > st->end_offset))
+    {
+      stream_end(st, 0);
+      return;
+    }
+
+  // Transcode until the cache has data at our offset, unless another request
+  // already got it there
+  if (st->offset >= xc->len)
+    {
+      ret = xcode_cache_fill(xc);
+      if (ret <= 0)
+	{
+	  if (ret == 0)
+	    DPRINTF(E_INFO, L_HTTPD, "Done streaming transcoded file id %d\n", st->id);
+	  else
+	    DPRINTF(E_LOG, L_HTTPD, "Transcoding error, file id %d\n", st->id);
+
+	  stream_end(st, 0);
+	  return;
+	}
+
+      if (st->offset >= xc->len)
+	goto consume;
+    }
+
+  chunk_size = MIN(xc->len - st->offset, STREAM_CHUNK_SIZE);
+  if (st->end_offset && ((st->offset + chunk_size) > (st->end_offset + 1)))
+    chunk_size = st->end_offset + 1 - st->offset;
+
+  evbuffer_add(st->evbuf, xc->data + st->offset, chunk_size);
+
+#ifdef HAVE_LIBEVENT2_OLD
+  evhttp_send_reply_chunk(st->req, st->evbuf);
+
+  struct evhttp_connection *evcon = evhttp_request_get_connection(st->req);
+  struct bufferevent *bufev = evhttp_connection_get_bufferevent(evcon);
+
+  g_st = st; // Can't pass st to callback so use global - limits libevent 2.0 to a single stream
+  bufev->writecb = stream_chunk_resched_cb_wrapper;
+#else
+  evhttp_send_reply_chunk_with_cb(st->req, st->evbuf, stream_chunk_resched_cb, st);
+#endif
+
+  st->offset += chunk_size;
+
+  stream_end_register(st);
+
+  return;
+
+ consume: /* reschedule immediately - transcode up to offset */
+  evutil_timerclear(&tv);
+  ret = event_add(st->ev, &tv);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Could not re-add one-shot event for streaming (cache)\n");
+
+      stream_end(st, 0);
+      return;
+    }
+}
+
 static void
 stream_chunk_raw_cb(int fd, short event, void *arg)
 {
@@ -698,7 +1384,23 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
   else
     chunk_size = STREAM_CHUNK_SIZE;  
 
+#ifdef HAVE_LIBEVENT2_OLD
   ret = read(st->fd, st->buf, chunk_size);
+  if (ret > 0)
+    evbuffer_add(st->evbuf, st->buf, ret);
+#else
+  // Adds a reference to the file instead of the data, so it goes from the
+  // page cache to the socket with sendfile() or mmap()
+  if (st->offset + chunk_size > st->size)
+    chunk_size = st->size - st->offset;
+
+  if (chunk_size == 0)
+    ret = 0;
+  else if (evbuffer_add_file_segment(st->evbuf, st->seg, st->offset, chunk_size) == 0)
+    ret = chunk_size;
+  else
+    ret = -1;
+#endif
   if (ret <= 0)
     {
       if (ret == 0)
@@ -712,8 +1414,6 @@ stream_chunk_raw_cb(int fd, short event, void *arg)
 
   DPRINTF(E_DBG, L_HTTPD, "Read %d bytes; streaming file id %d\n", ret, st->id);
 
-  evbuffer_add(st->evbuf, st->buf, ret);
-
 #ifdef HAVE_LIBEVENT2_OLD
   evhttp_send_reply_chunk(st->req, st->evbuf);
 
@@ -747,6 +1447,266 @@ stream_fail_cb(struct evhttp_connection *evcon, void *arg)
 }
 
 
+/* ------------------------------- STATISTICS ------------------------------- */
+
+/*
+ * Every connection is registered on its first request, so we can count
+ * connections and requests on reused connections, and so the requests in
+ * flight can be dropped when the connection goes away. libevent does not tell
+ * about requests that fail, so this is the only way to keep the in-flight
+ * gauge correct. Handlers that want to know about the connection closing must
+ * therefore use httpd_connection_set_closecb(). Only used by the httpd thread,
+ * except that httpd_stats is also read by httpd_stats_get().
+ */
+
+const char *httpd_route_class_names[HTTPD_ROUTE_MAX] =
+  {
+    "dacp",
+    "daap",
+    "jsonapi",
+    "artwork",
+    "streaming",
+    "oauth",
+    "rsp",
+    "files",
+  };
+
+const int httpd_stats_bucket_msec[HTTPD_STATS_BUCKETS - 1] = { 1, 5, 20, 100, 500, 2000, 10000 };
+
+static struct httpd_conn *
+conn_find(struct evhttp_connection *evcon)
+{
+  struct httpd_conn *conn;
+
+  for (conn = httpd_conns; conn; conn = conn->next)
+    {
+      if (conn->evcon == evcon)
+	return conn;
+    }
+
+  return NULL;
+}
+
+static void
+timing_finish(struct httpd_request_timing *timing, int code, bool aborted)
+{
+  struct httpd_request_timing *t;
+  struct httpd_route_stats *rs;
+  struct timespec now;
+  uint64_t msec;
+  int i;
+
+  if (timing == httpd_inflight)
+    httpd_inflight = timing->next;
+  else
+    {
+      for (t = httpd_inflight; t && t->next != timing; t = t->next)
+	;
+
+      if (t)
+	t->next = timing->next;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  msec = (now.tv_sec - timing->start.tv_sec) * 1000 + (now.tv_nsec - timing->start.tv_nsec) / 1000000;
+
+  for (i = 0; i < HTTPD_STATS_BUCKETS - 1 && msec >= httpd_stats_bucket_msec[i]; i++)
+    ; // Find bucket
+
+  rs = &httpd_stats.routes[timing->route];
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+  rs->in_flight--;
+  if (aborted)
+    rs->aborted++;
+  else
+    {
+      rs->latency[i]++;
+      rs->msec_total += msec;
+      if (code >= 400)
+	rs->errors++;
+    }
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+
+  free(timing);
+}
+
+#ifdef HAVE_EVHTTP_REQUEST_SET_ON_COMPLETE_CB
+static void
+timing_complete_cb(struct evhttp_request *req, void *arg)
+{
+  timing_finish(arg, evhttp_request_get_response_code(req), false);
+}
+#endif
+
+static void
+conn_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct httpd_conn *conn = arg;
+  struct httpd_conn *c;
+  struct httpd_request_timing *timing;
+  struct httpd_request_timing *next;
+
+  if (conn->closecb)
+    conn->closecb(evcon, conn->closecb_arg);
+
+  for (timing = httpd_inflight; timing; timing = next)
+    {
+      next = timing->next;
+      if (timing->conn == conn)
+	timing_finish(timing, 0, true);
+    }
+
+  if (conn == httpd_conns)
+    httpd_conns = conn->next;
+  else
+    {
+      for (c = httpd_conns; c && c->next != conn; c = c->next)
+	;
+
+      if (c)
+	c->next = conn->next;
+    }
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+  httpd_stats.connections_active--;
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+
+  free(conn);
+}
+
+// Returns NULL if the connection is new and we are at the connection limit
+static struct httpd_conn *
+conn_register(struct evhttp_connection *evcon)
+{
+  struct httpd_conn *conn;
+  bool reused;
+
+  conn = conn_find(evcon);
+  reused = (conn != NULL);
+
+  if (!conn && httpd_max_connections > 0 && httpd_stats.connections_active >= httpd_max_connections)
+    {
+      CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+      httpd_stats.connections_rejected++;
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+      return NULL;
+    }
+
+  if (!conn)
+    {
+      CHECK_NULL(L_HTTPD, conn = calloc(1, sizeof(struct httpd_conn)));
+      conn->evcon = evcon;
+      conn->next = httpd_conns;
+      httpd_conns = conn;
+
+      evhttp_connection_set_closecb(evcon, conn_close_cb, conn);
+    }
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+  if (reused)
+    httpd_stats.requests_reused++;
+  else
+    {
+      httpd_stats.connections++;
+      httpd_stats.connections_active++;
+    }
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+
+  return conn;
+}
+
+static void
+client_stats_add(const char *user_agent, enum httpd_route_class route)
+{
+  struct httpd_client_stats *cs;
+  int i;
+
+  if (!user_agent)
+    user_agent = "(none)";
+
+  for (i = 0; i < httpd_stats.nclients; i++)
+    {
+      cs = &httpd_stats.clients[i];
+      if (strncmp(cs->user_agent, user_agent, sizeof(cs->user_agent) - 1) == 0)
+	break;
+    }
+
+  // The last slot is shared by the clients that didn't get their own
+  if (i == HTTPD_STATS_CLIENTS_MAX)
+    cs = &httpd_stats.clients[HTTPD_STATS_CLIENTS_MAX - 1];
+  else if (i == httpd_stats.nclients)
+    {
+      if (i == HTTPD_STATS_CLIENTS_MAX - 1)
+	user_agent = "(other)";
+
+      cs = &httpd_stats.clients[i];
+      snprintf(cs->user_agent, sizeof(cs->user_agent), "%s", user_agent);
+      httpd_stats.nclients++;
+    }
+
+  cs->requests[route]++;
+}
+
+static struct httpd_request_timing *
+timing_start(struct evhttp_request *req, struct httpd_conn *conn, enum httpd_route_class route)
+{
+  struct httpd_request_timing *timing;
+  const char *user_agent;
+
+  CHECK_NULL(L_HTTPD, timing = calloc(1, sizeof(struct httpd_request_timing)));
+  timing->conn = conn;
+  timing->route = route;
+  clock_gettime(CLOCK_MONOTONIC, &timing->start);
+
+  timing->next = httpd_inflight;
+  httpd_inflight = timing;
+
+  user_agent = evhttp_find_header(evhttp_request_get_input_headers(req), "User-Agent");
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+  httpd_stats.routes[route].requests++;
+  httpd_stats.routes[route].in_flight++;
+  client_stats_add(user_agent, route);
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+
+#ifdef HAVE_EVHTTP_REQUEST_SET_ON_COMPLETE_CB
+  evhttp_request_set_on_complete_cb(req, timing_complete_cb, timing);
+#endif
+
+  return timing;
+}
+
+static void
+timing_handler_done(struct httpd_request_timing *timing, struct evhttp_request *req)
+{
+#ifndef HAVE_EVHTTP_REQUEST_SET_ON_COMPLETE_CB
+  // Without a completion callback from libevent we can only measure how long
+  // the handler took, which for async replies isn't the whole story
+  timing_finish(timing, evhttp_request_get_response_code(req), false);
+#endif
+}
+
+static void
+stats_conn_purge(void)
+{
+  struct httpd_conn *conn;
+  struct httpd_request_timing *timing;
+
+  for (timing = httpd_inflight; httpd_inflight; timing = httpd_inflight)
+    {
+      httpd_inflight = timing->next;
+      free(timing);
+    }
+
+  for (conn = httpd_conns; httpd_conns; conn = httpd_conns)
+    {
+      httpd_conns = conn->next;
+      free(conn);
+    }
+}
+
+
 /* ---------------------------- MAIN HTTPD THREAD --------------------------- */
 
 static void *
@@ -786,12 +1746,25 @@ httpd_gen_cb(struct evhttp_request *req, void *arg)
   struct evkeyvalq *input_headers;
   struct evkeyvalq *output_headers;
   struct httpd_uri_parsed *parsed;
+  struct httpd_request_timing *timing;
+  struct httpd_conn *conn;
+  enum httpd_route_class route;
   const char *uri;
 
   // Clear the proxy request flag set by evhttp if the request URI was absolute.
   // It has side-effects on Connection: keep-alive
   req->flags &= ~EVHTTP_PROXY_REQUEST;
 
+  conn = conn_register(evhttp_request_get_connection(req));
+  if (!conn)
+    {
+      DPRINTF(E_WARN, L_HTTPD, "Connection limit (%d) reached, rejecting request\n", httpd_max_connections);
+
+      // Also closes the connection
+      httpd_send_error(req, HTTP_SERVUNAVAIL, "Too Many Connections");
+      return;
+    }
+
   // Did we get a CORS preflight request?
   input_headers = evhttp_request_get_input_headers(req);
   if ( input_headers && allow_origin &&
@@ -826,55 +1799,574 @@ httpd_gen_cb(struct evhttp_request *req, void *arg)
     }
 
   if (strcmp(parsed->path, "/") == 0)
+    route = HTTPD_ROUTE_FILES;
+  else if (dacp_is_request(parsed->path))
+    route = HTTPD_ROUTE_DACP;
+  else if (daap_is_request(parsed->path))
+    route = HTTPD_ROUTE_DAAP;
+  else if (jsonapi_is_request(parsed->path))
+    route = HTTPD_ROUTE_JSONAPI;
+  else if (artworkapi_is_request(parsed->path))
+    route = HTTPD_ROUTE_ARTWORK;
+  else if (streaming_is_request(parsed->path))
+    route = HTTPD_ROUTE_STREAMING;
+  else if (oauth_is_request(parsed->path))
+    route = HTTPD_ROUTE_OAUTH;
+  else if (rsp_is_request(parsed->path))
+    route = HTTPD_ROUTE_RSP;
+  else
+    route = HTTPD_ROUTE_FILES;
+
+  timing = timing_start(req, conn, route);
+
+  /* Dispatch protocol-specific handlers */
+  switch (route)
+    {
+      case HTTPD_ROUTE_DACP:
+	dacp_request(req, parsed);
+	break;
+      case HTTPD_ROUTE_DAAP:
+	daap_request(req, parsed);
+	break;
+      case HTTPD_ROUTE_JSONAPI:
+	jsonapi_request(req, parsed);
+	break;
+      case HTTPD_ROUTE_ARTWORK:
+	artworkapi_request(req, parsed);
+	break;
+      case HTTPD_ROUTE_STREAMING:
+	streaming_request(req, parsed);
+	break;
+      case HTTPD_ROUTE_OAUTH:
+	oauth_request(req, parsed);
+	break;
+      case HTTPD_ROUTE_RSP:
+	rsp_request(req, parsed);
+	break;
+      default:
+	/* Serve web interface files */
+	DPRINTF(E_DBG, L_HTTPD, "HTTP request: '%s'\n", parsed->uri);
+	serve_file(req, parsed->path);
+    }
+
+  timing_handler_done(timing, req);
+
+ out:
+  httpd_uri_free(parsed);
+}
+
+
+/* ----------------------------- WORKER THREADS ----------------------------- */
+
+/*
+ * Called instead of evhttp_send_reply/httpd_send_error when a handler replies
+ * from a worker thread. Returns false if the reply should be sent directly,
+ * i.e. we are not in a worker or the reply is not for the job's request.
+ */
+static bool
+job_reply_capture(struct evhttp_request *req, bool is_error, int code, const char *reason, struct evbuffer *evbuf)
+{
+  struct httpd_job *job = httpd_job_current;
+
+  if (!job || job->req != req)
+    return false;
+
+  if (job->replied)
     {
-      goto serve_file;
+      DPRINTF(E_LOG, L_HTTPD, "Bug! Handler tried to reply twice to '%s'\n", job->uri_parsed->uri);
+      return true;
     }
 
-  /* Dispatch protocol-specific handlers */
-  if (dacp_is_request(parsed->path))
+  job->replied = true;
+  job->is_error = is_error;
+  job->code = code;
+  job->reason = safe_strdup(reason);
+
+  // Moves the data, so evbuf is drained like evhttp_send_reply() would do
+  if (evbuf)
+    evbuffer_add_buffer(job->reply, evbuf);
+
+  return true;
+}
+
+/* Thread: httpd */
+static enum command_state
+job_finish(void *arg, int *retval)
+{
+  struct httpd_job *job = arg;
+
+  if (!job->replied)
     {
-      dacp_request(req, parsed);
-      goto out;
+      DPRINTF(E_LOG, L_HTTPD, "Bug! No reply from handler of '%s'\n", job->uri_parsed->uri);
+      httpd_send_error(job->req, HTTP_INTERNAL, "Internal Server Error");
     }
-  else if (daap_is_request(parsed->path))
+  else if (job->is_error)
+    httpd_send_error(job->req, job->code, job->reason);
+  else
+    evhttp_send_reply(job->req, job->code, job->reason, job->reply);
+
+  // The struct itself is freed by commands
+  httpd_uri_free(job->uri_parsed);
+  free(job->peer_address);
+  free(job->reason);
+  evbuffer_free(job->reply);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+/* Thread: httpd worker */
+static enum command_state
+job_run(void *arg, int *retval)
+{
+  struct httpd_job *job = arg;
+
+  httpd_job_current = job;
+  job->cb(job->hreq);
+  httpd_job_current = NULL;
+
+  // Hand back to the httpd thread, which owns the connection
+  commands_exec_async(httpd_cmdbase, job_finish, job);
+
+  *retval = 0;
+  return COMMAND_PENDING; // Ask commands not to free the job, job_finish has it now
+}
+
+static void *
+httpd_worker(void *arg)
+{
+  struct httpd_worker *worker = arg;
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
     {
-      daap_request(req, parsed);
-      goto out;
+      DPRINTF(E_LOG, L_HTTPD, "Error: DB init failed (httpd worker)\n");
+
+      pthread_exit(NULL);
     }
-  else if (jsonapi_is_request(parsed->path))
+
+  event_base_dispatch(worker->evbase);
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+/* Thread: httpd */
+static enum command_state
+workers_stop(void *arg, int *retval)
+{
+  // From now on httpd_request_dispatch() runs handlers in the httpd thread
+  httpd_workers_stopped = true;
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+static int
+workers_init(void)
+{
+  struct httpd_worker *worker;
+  int num;
+  int i;
+  int ret;
+
+  num = cfg_getint(cfg_getsec(cfg, "general"), "httpd_workers");
+  if (num <= 0)
     {
-      jsonapi_request(req, parsed);
-      goto out;
+      DPRINTF(E_INFO, L_HTTPD, "No httpd worker threads, all requests will be handled by the httpd thread\n");
+      return 0;
     }
-  else if (artworkapi_is_request(parsed->path))
+
+  httpd_cmdbase = commands_base_new(evbase_httpd, NULL);
+  httpd_workers_stopped = false;
+
+  CHECK_NULL(L_HTTPD, httpd_workers = calloc(num, sizeof(struct httpd_worker)));
+
+  for (i = 0; i < num; i++)
     {
-      artworkapi_request(req, parsed);
-      goto out;
+      worker = &httpd_workers[i];
+
+      CHECK_NULL(L_HTTPD, worker->evbase = event_base_new());
+      worker->cmdbase = commands_base_new(worker->evbase, NULL);
+
+      ret = pthread_create(&worker->tid, NULL, httpd_worker, worker);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not spawn httpd worker thread: %s\n", strerror(ret));
+
+	  commands_base_free(worker->cmdbase);
+	  event_base_free(worker->evbase);
+	  break;
+	}
+
+      thread_setname(worker->tid, "httpd_worker");
+      httpd_workers_num++;
     }
-  else if (streaming_is_request(parsed->path))
+
+  DPRINTF(E_DBG, L_HTTPD, "Started %d httpd worker threads\n", httpd_workers_num);
+
+  return 0;
+}
+
+static void
+workers_deinit(void)
+{
+  struct httpd_worker *worker;
+  int i;
+
+  for (i = 0; i < httpd_workers_num; i++)
+    {
+      worker = &httpd_workers[i];
+
+      commands_base_destroy(worker->cmdbase);
+      pthread_join(worker->tid, NULL);
+      event_base_free(worker->evbase);
+    }
+
+  free(httpd_workers);
+  httpd_workers = NULL;
+  httpd_workers_num = 0;
+}
+
+
+/* --------------------------------- ROUTER --------------------------------- */
+
+/*
+ * The uri_map regexps are split into path segments and put in a trie, so a
+ * request is routed by walking its path parts instead of running regexec() for
+ * every entry. Regexps that can't be split this way, e.g. because they contain
+ * ".*", are still matched with regexec(), and so are requests with irregular
+ * paths like "/api//library/", so the result is always the same as matching
+ * the entries in order.
+ */
+
+enum route_seg_type {
+  ROUTE_SEG_LITERAL,
+  ROUTE_SEG_DIGITS,
+  ROUTE_SEG_ANY,
+  ROUTE_SEG_REGEX,
+};
+
+struct route_node {
+  enum route_seg_type type;
+  char *pattern;
+  regex_t preg;
+  // From a regexp without '$', so the literal only needs to be a prefix of
+  // the path part, and more parts may follow
+  bool prefix;
+
+  // Indices of the uri_map entries that end at this node
+  int *routes;
+  int nroutes;
+
+  struct route_node *children;
+  struct route_node *next;
+};
+
+struct route_info {
+  bool use_regexec;
+  int num_pos[HTTPD_PATH_NUM_MAX];
+  int num_count;
+};
+
+struct httpd_router {
+  struct httpd_uri_map *uri_map;
+  struct route_info *info;
+  int nroutes;
+  struct route_node root;
+};
+
+static void
+route_node_free(struct route_node *node)
+{
+  struct route_node *child;
+
+  while ((child = node->children))
+    {
+      node->children = child->next;
+      route_node_free(child);
+      free(child);
+    }
+
+  if (node->type == ROUTE_SEG_REGEX)
+    regfree(&node->preg);
+
+  free(node->pattern);
+  free(node->routes);
+}
+
+// Splits "^/foo/[[:digit:]]+$" into "foo" and "[[:digit:]]+". Returns the
+// number of segments, or -1 if the regexp can't be split.
+static int
+route_segments_split(char **segs, int max, bool *prefix, char *regexp)
+{
+  char *start;
+  char *ptr;
+  int depth;
+  int n;
+
+  if (strncmp(regexp, "^/", 2) != 0 || strstr(regexp, ".*"))
+    return -1;
+
+  *prefix = (regexp[strlen(regexp) - 1] != '$');
+  if (!*prefix)
+    regexp[strlen(regexp) - 1] = '\0';
+
+  n = 0;
+  depth = 0;
+  for (start = ptr = regexp + 2; ; ptr++)
+    {
+      if (*ptr == '[' || *ptr == '(')
+	depth++;
+      else if (*ptr == ']' || *ptr == ')')
+	depth--;
+      else if ((*ptr == '/' && depth == 0) || *ptr == '\0')
+	{
+	  if (ptr == start || n == max)
+	    return -1;
+
+	  segs[n++] = start;
+	  if (*ptr == '\0')
+	    break;
+
+	  *ptr = '\0';
+	  start = ptr + 1;
+	}
+    }
+
+  return n;
+}
+
+static struct route_node *
+route_node_add(struct route_node *parent, const char *seg, bool prefix)
+{
+  struct route_node *node;
+  enum route_seg_type type;
+  char *re;
+  int ret;
+
+  if (strcmp(seg, "[[:digit:]]+") == 0)
+    type = ROUTE_SEG_DIGITS;
+  else if (strcmp(seg, "[^/]+") == 0)
+    type = ROUTE_SEG_ANY;
+  else if (strpbrk(seg, ".[]()*+?|\\{}^$") == NULL)
+    type = ROUTE_SEG_LITERAL;
+  else
+    type = ROUTE_SEG_REGEX;
+
+  // Prefix matching is only done for literals
+  if (prefix && type != ROUTE_SEG_LITERAL)
+    return NULL;
+
+  for (node = parent->children; node; node = node->next)
+    {
+      if (node->type == type && node->prefix == prefix && strcmp(node->pattern, seg) == 0)
+	return node;
+    }
+
+  CHECK_NULL(L_HTTPD, node = calloc(1, sizeof(struct route_node)));
+  node->type = type;
+  node->pattern = strdup(seg);
+  node->prefix = prefix;
+
+  if (type == ROUTE_SEG_REGEX)
+    {
+      CHECK_NULL(L_HTTPD, re = safe_asprintf("^(%s)$", seg));
+      ret = regcomp(&node->preg, re, REG_EXTENDED | REG_NOSUB);
+      free(re);
+      if (ret != 0)
+	{
+	  free(node->pattern);
+	  free(node);
+	  return NULL;
+	}
+    }
+
+  node->next = parent->children;
+  parent->children = node;
+
+  return node;
+}
+
+static bool
+route_node_matches(struct route_node *node, const char *part)
+{
+  uint64_t num;
+
+  switch (node->type)
+    {
+      case ROUTE_SEG_LITERAL:
+	if (node->prefix)
+	  return (strncmp(part, node->pattern, strlen(node->pattern)) == 0);
+	return (strcmp(part, node->pattern) == 0);
+      case ROUTE_SEG_DIGITS:
+	return (part[strspn(part, "0123456789")] == '\0' && safe_atou64(part, &num) == 0);
+      case ROUTE_SEG_ANY:
+	return (strchr(part, '/') == NULL);
+      case ROUTE_SEG_REGEX:
+	return (strchr(part, '/') == NULL && regexec(&node->preg, part, 0, NULL, 0) == 0);
+    }
+
+  return false;
+}
+
+static bool
+route_method_matches(struct httpd_uri_map *map, int method)
+{
+  return !(map->method && method && !(method & map->method));
+}
+
+// Finds the lowest uri_map index that matches, since the entries are in
+// priority order
+static void
+route_match(int *best, struct httpd_router *router, struct route_node *node, char **parts, int method)
+{
+  struct route_node *child;
+  int i;
+
+  if (!parts[0] || node->prefix)
+    {
+      for (i = 0; i < node->nroutes; i++)
+	{
+	  if (node->routes[i] < *best && route_method_matches(&router->uri_map[node->routes[i]], method))
+	    *best = node->routes[i];
+	}
+    }
+
+  if (!parts[0])
+    return;
+
+  for (child = node->children; child; child = child->next)
     {
-      streaming_request(req, parsed);
-      goto out;
+      if (route_node_matches(child, parts[0]))
+	route_match(best, router, child, parts + 1, method);
     }
-  else if (oauth_is_request(parsed->path))
+}
+
+// The trie ignores empty path parts, so check the path is just the parts
+static bool
+route_path_is_regular(struct httpd_uri_parsed *uri_parsed)
+{
+  size_t len;
+  int i;
+
+  for (i = 0, len = 0; i < ARRAY_SIZE(uri_parsed->path_parts) && uri_parsed->path_parts[i]; i++)
+    len += 1 + strlen(uri_parsed->path_parts[i]);
+
+  return (i > 0 && len == strlen(uri_parsed->path));
+}
+
+static int
+router_find(struct httpd_router *router, struct httpd_uri_parsed *uri_parsed, int method)
+{
+  bool regular;
+  int best;
+  int i;
+
+  regular = route_path_is_regular(uri_parsed);
+
+  best = router->nroutes;
+  if (regular)
+    route_match(&best, router, &router->root, uri_parsed->path_parts, method);
+
+  // Entries not in the trie (or all of them if the path is irregular) that
+  // take priority over the trie's match
+  for (i = 0; i < best; i++)
     {
-      oauth_request(req, parsed);
-      goto out;
+      if (regular && !router->info[i].use_regexec)
+	continue;
+      if (!route_method_matches(&router->uri_map[i], method))
+	continue;
+      if (regexec(&router->uri_map[i].preg, uri_parsed->path, 0, NULL, 0) == 0)
+	return i;
     }
-  else if (rsp_is_request(parsed->path))
+
+  return (best < router->nroutes) ? best : -1;
+}
+
+struct httpd_router *
+httpd_router_new(struct httpd_uri_map *uri_map)
+{
+  struct httpd_router *router;
+  struct route_node *node;
+  struct route_info *info;
+  char *segs[ARRAY_SIZE(((struct httpd_uri_parsed *)0)->path_parts)];
+  char *regexp;
+  char buf[64];
+  bool prefix;
+  int nsegs;
+  int i;
+  int j;
+  int ret;
+
+  CHECK_NULL(L_HTTPD, router = calloc(1, sizeof(struct httpd_router)));
+  router->uri_map = uri_map;
+
+  for (i = 0; uri_map[i].handler; i++)
+    router->nroutes++;
+
+  CHECK_NULL(L_HTTPD, router->info = calloc(router->nroutes + 1, sizeof(struct route_info)));
+
+  for (i = 0; i < router->nroutes; i++)
     {
-      rsp_request(req, parsed);
-      goto out;
+      ret = regcomp(&uri_map[i].preg, uri_map[i].regexp, REG_EXTENDED | REG_NOSUB);
+      if (ret != 0)
+	{
+	  regerror(ret, &uri_map[i].preg, buf, sizeof(buf));
+	  DPRINTF(E_FATAL, L_HTTPD, "Could not compile route '%s': %s\n", uri_map[i].regexp, buf);
+
+	  router->nroutes = i;
+	  httpd_router_free(router);
+	  return NULL;
+	}
+
+      info = &router->info[i];
+
+      CHECK_NULL(L_HTTPD, regexp = strdup(uri_map[i].regexp));
+
+      nsegs = route_segments_split(segs, ARRAY_SIZE(segs), &prefix, regexp);
+
+      node = &router->root;
+      for (j = 0; node && j < nsegs; j++)
+	{
+	  node = route_node_add(node, segs[j], prefix && (j == nsegs - 1));
+	  if (node && node->type == ROUTE_SEG_DIGITS && info->num_count < HTTPD_PATH_NUM_MAX)
+	    info->num_pos[info->num_count++] = j;
+	}
+
+      free(regexp);
+
+      if (nsegs < 0 || !node)
+	{
+	  DPRINTF(E_DBG, L_HTTPD, "Route '%s' will be matched with regexec\n", uri_map[i].regexp);
+	  info->use_regexec = true;
+	  info->num_count = 0;
+	  continue;
+	}
+
+      CHECK_NULL(L_HTTPD, node->routes = realloc(node->routes, (node->nroutes + 1) * sizeof(int)));
+      node->routes[node->nroutes++] = i;
     }
 
-  DPRINTF(E_DBG, L_HTTPD, "HTTP request: '%s'\n", parsed->uri);
+  return router;
+}
 
-  /* Serve web interface files */
- serve_file:
-  serve_file(req, parsed->path);
+void
+httpd_router_free(struct httpd_router *router)
+{
+  int i;
 
- out:
-  httpd_uri_free(parsed);
+  if (!router)
+    return;
+
+  for (i = 0; i < router->nroutes; i++)
+    regfree(&router->uri_map[i].preg);
+
+  route_node_free(&router->root);
+  free(router->info);
+  free(router);
 }
 
 
@@ -982,14 +2474,14 @@ httpd_uri_parse(const char *uri)
 }
 
 struct httpd_request *
-httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed, const char *user_agent, struct httpd_uri_map *uri_map)
+httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed, const char *user_agent, struct httpd_router *router)
 {
   struct httpd_request *hreq;
   struct evhttp_connection *evcon;
   struct evkeyvalq *headers;
+  struct route_info *info;
   int req_method;
   int i;
-  int ret;
 
   CHECK_NULL(L_HTTPD, hreq = calloc(1, sizeof(struct httpd_request)));
 
@@ -1017,24 +2509,61 @@ httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_par
     hreq->user_agent = user_agent;
 
   // Find a handler for the path
-  for (i = 0; uri_map[i].handler; i++)
+  i = router_find(router, uri_parsed, req_method);
+  if (i < 0)
     {
-      // Check if handler supports the current http request method
-      if (uri_map[i].method && req_method && !(req_method & uri_map[i].method))
-	continue;
+      // Handler not found, that's an error
+      free(hreq);
+      return NULL;
+    }
 
-      ret = regexec(&uri_map[i].preg, uri_parsed->path, 0, NULL, 0);
-      if (ret == 0)
-        {
-          hreq->handler = uri_map[i].handler;
-          return hreq; // Success
-        }
+  hreq->handler = router->uri_map[i].handler;
+
+  info = &router->info[i];
+  for (hreq->path_num_count = 0; hreq->path_num_count < info->num_count; hreq->path_num_count++)
+    safe_atou64(uri_parsed->path_parts[info->num_pos[hreq->path_num_count]], &hreq->path_num[hreq->path_num_count]);
+
+  return hreq; // Success
+}
+
+/* Thread: httpd */
+void
+httpd_request_dispatch(struct httpd_request *hreq, void (*cb)(struct httpd_request *hreq))
+{
+  struct httpd_worker *worker;
+  struct httpd_job *job;
+
+  if (httpd_workers_num == 0 || httpd_workers_stopped)
+    {
+      cb(hreq);
+      return;
     }
 
-  // Handler not found, that's an error
-  free(hreq);
+  CHECK_NULL(L_HTTPD, job = calloc(1, sizeof(struct httpd_job)));
+  CHECK_NULL(L_HTTPD, job->reply = evbuffer_new());
 
-  return NULL;
+  job->uri_parsed = httpd_uri_parse(hreq->uri_parsed->uri);
+  if (!job->uri_parsed)
+    {
+      evbuffer_free(job->reply);
+      free(job);
+      cb(hreq);
+      return;
+    }
+
+  job->peer_address = safe_strdup(hreq->peer_address);
+  job->req = hreq->req;
+  job->hreq = hreq;
+  job->cb = cb;
+
+  hreq->uri_parsed = job->uri_parsed;
+  hreq->query = &(job->uri_parsed->ev_query);
+  hreq->peer_address = job->peer_address;
+
+  worker = &httpd_workers[httpd_workers_next];
+  httpd_workers_next = (httpd_workers_next + 1) % httpd_workers_num;
+
+  commands_exec_async(worker->cmdbase, job_run, job);
 }
 
 /* Thread: httpd */
@@ -1057,17 +2586,33 @@ httpd_stream_file(struct evhttp_request *req, int id)
   char buf[64];
   int64_t offset;
   int64_t end_offset;
+  int64_t suffix_len;
+#ifdef HAVE_LIBEVENT2_OLD
   off_t pos;
+#endif
   int transcode;
   int ret;
 
   offset = 0;
   end_offset = 0;
+  suffix_len = 0;
 
   input_headers = evhttp_request_get_input_headers(req);
 
   param = evhttp_find_header(input_headers, "Range");
-  if (param)
+  if (param && (strncmp(param, "bytes=-", strlen("bytes=-")) == 0))
+    {
+      DPRINTF(E_DBG, L_HTTPD, "Found Range header: %s\n", param);
+
+      /* Suffix length, i.e. the last n bytes, resolved when we know the size */
+      ret = safe_atoi64(param + strlen("bytes=-"), &suffix_len);
+      if ((ret < 0) || (suffix_len <= 0))
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Invalid suffix length, will stream whole file (%s)\n", param);
+	  suffix_len = 0;
+	}
+    }
+  else if (param)
     {
       DPRINTF(E_DBG, L_HTTPD, "Found Range header: %s\n", param);
 
@@ -1139,10 +2684,28 @@ httpd_stream_file(struct evhttp_request *req, int id)
     {
       DPRINTF(E_INFO, L_HTTPD, "Preparing to transcode %s\n", mfi->path);
 
-      stream_cb = stream_chunk_xcode_cb;
+      st->xc = xcode_cache_get(mfi, &quality);
+      if (st->xc)
+	{
+	  stream_cb = stream_chunk_xcode_cache_cb;
+
+	  // Once the whole file has been transcoded we know the exact size
+	  st->size = st->xc->complete ? st->xc->len : st->xc->est_size;
+	  if (end_offset >= st->size)
+	    end_offset = 0;
+
+	  // Data is kept by the cache, so we can start at the range offset
+	  st->offset = offset;
+	  st->end_offset = end_offset;
+	}
+      else
+	{
+	  stream_cb = stream_chunk_xcode_cb;
+
+	  st->xcode = transcode_setup(XCODE_PCM16_HEADER, &quality, mfi->data_kind, mfi->path, mfi->song_length, &st->size);
+	}
 
-      st->xcode = transcode_setup(XCODE_PCM16_HEADER, &quality, mfi->data_kind, mfi->path, mfi->song_length, &st->size);
-      if (!st->xcode)
+      if (!st->xcode && !st->xc)
 	{
 	  DPRINTF(E_WARN, L_HTTPD, "Transcoding setup failed, aborting streaming\n");
 
@@ -1159,6 +2722,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
       /* Stream the raw file */
       DPRINTF(E_INFO, L_HTTPD, "Preparing to stream %s\n", mfi->path);
 
+#ifdef HAVE_LIBEVENT2_OLD
       st->buf = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
       if (!st->buf)
 	{
@@ -1168,6 +2732,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
 	  goto out_free_st;
 	}
+#endif
 
       stream_cb = stream_chunk_raw_cb;
 
@@ -1192,6 +2757,25 @@ httpd_stream_file(struct evhttp_request *req, int id)
 	}
       st->size = sb.st_size;
 
+      if (suffix_len > 0)
+	offset = (suffix_len < st->size) ? st->size - suffix_len : 0;
+      if (end_offset >= st->size)
+	end_offset = 0;
+
+      if ((offset > 0) && (offset >= st->size))
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Range start %" PRIi64 " is beyond the end of %s\n", offset, mfi->path);
+
+	  ret = snprintf(buf, sizeof(buf), "bytes */%" PRIi64, (int64_t)st->size);
+	  if ((ret > 0) && (ret < sizeof(buf)))
+	    evhttp_add_header(output_headers, "Content-Range", buf);
+
+	  evhttp_send_error(req, 416, "Range Not Satisfiable");
+
+	  goto out_cleanup;
+	}
+
+#ifdef HAVE_LIBEVENT2_OLD
       pos = lseek(st->fd, offset, SEEK_SET);
       if (pos == (off_t) -1)
 	{
@@ -1201,6 +2785,19 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
 	  goto out_cleanup;
 	}
+#else
+      // The segment owns the fd from here, it is closed when the last chunk
+      // referencing it has been sent
+      st->seg = evbuffer_file_segment_new(st->fd, 0, st->size, EVBUF_FS_CLOSE_ON_FREE);
+      if (!st->seg)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not create file segment for %s\n", mfi->path);
+
+	  evhttp_send_error(req, HTTP_SERVUNAVAIL, "Internal Server Error");
+
+	  goto out_cleanup;
+	}
+#endif
       st->offset = offset;
       st->end_offset = end_offset;
 
@@ -1256,6 +2853,13 @@ httpd_stream_file(struct evhttp_request *req, int id)
       goto out_cleanup;
     }
 
+#ifndef HAVE_LIBEVENT2_OLD
+  // Without this libevent would mmap() the file segments instead of using
+  // sendfile() when the data is written to the socket
+  if (st->seg)
+    evbuffer_set_flags(st->evbuf, EVBUFFER_FLAG_DRAINS_TO_FD);
+#endif
+
   st->ev = event_new(evbase_httpd, -1, EV_TIMEOUT, stream_cb, st);
   evutil_timerclear(&tv);
   if (!st->ev || (event_add(st->ev, &tv) < 0))
@@ -1279,7 +2883,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
        * that if we are decoding because we can only guesstimate the
        * size in this case and the error margin is unknown and variable.
        */
-      if (!transcode)
+      if (!transcode || (st->xc && st->xc->complete))
 	{
 	  ret = snprintf(buf, sizeof(buf), "%" PRIi64, (int64_t)st->size);
 	  if ((ret < 0) || (ret >= sizeof(buf)))
@@ -1300,7 +2904,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
       DPRINTF(E_DBG, L_HTTPD, "Stream request with range %" PRIi64 "-%" PRIi64 "\n", offset, end_offset);
 
       ret = snprintf(buf, sizeof(buf), "bytes %" PRIi64 "-%" PRIi64 "/%" PRIi64,
-		     offset, (end_offset) ? end_offset : (int64_t)st->size, (int64_t)st->size);
+		     offset, (end_offset) ? end_offset : (int64_t)st->size - 1, (int64_t)st->size);
       if ((ret < 0) || (ret >= sizeof(buf)))
 	DPRINTF(E_LOG, L_HTTPD, "Content-Range too large for buffer, dropping\n");
       else
@@ -1328,7 +2932,7 @@ httpd_stream_file(struct evhttp_request *req, int id)
 
   evcon = evhttp_request_get_connection(req);
 
-  evhttp_connection_set_closecb(evcon, stream_fail_cb, st);
+  httpd_connection_set_closecb(evcon, stream_fail_cb, st);
 
   DPRINTF(E_INFO, L_HTTPD, "Kicking off streaming for %s\n", mfi->path);
 
@@ -1341,8 +2945,15 @@ httpd_stream_file(struct evhttp_request *req, int id)
     evbuffer_free(st->evbuf);
   if (st->xcode)
     transcode_cleanup(&st->xcode);
+  if (st->xc)
+    xcode_cache_release(st->xc);
   if (st->buf)
     free(st->buf);
+#ifndef HAVE_LIBEVENT2_OLD
+  if (st->seg)
+    evbuffer_file_segment_free(st->seg);
+  else
+#endif
   if (st->fd > 0)
     close(st->fd);
  out_free_st:
@@ -1351,92 +2962,220 @@ httpd_stream_file(struct evhttp_request *req, int id)
   free_mfi(mfi, 0);
 }
 
-struct evbuffer *
-httpd_gzip_deflate(struct evbuffer *in)
+static int
+gzip_init(z_stream *strm, int level)
 {
-  struct evbuffer *out;
-  struct evbuffer_iovec iovec[1];
-  z_stream strm;
   int ret;
 
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-
-  // Just to keep Coverity from complaining about uninitialized values
-  strm.total_in = 0;
-  strm.total_out = 0;
+  memset(strm, 0, sizeof(z_stream));
+  strm->zalloc = Z_NULL;
+  strm->zfree = Z_NULL;
+  strm->opaque = Z_NULL;
 
   // Set up a gzip stream (the "+ 16" in 15 + 16), instead of a zlib stream (default)
-  ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  ret = deflateInit2(strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
   if (ret != Z_OK)
     {
       DPRINTF(E_LOG, L_HTTPD, "zlib setup failed: %s\n", zError(ret));
-      return NULL;
+      return -1;
     }
 
-  strm.next_in = evbuffer_pullup(in, -1);
-  strm.avail_in = evbuffer_get_length(in);
+  return 0;
+}
+
+/*
+ * Compresses len bytes of data to out. The data is processed in pieces of
+ * GZIP_CHUNK_SIZE, so we never need a contiguous copy of the whole input or
+ * output. With Z_FINISH the gzip trailer is written too.
+ */
+static int
+gzip_write(z_stream *strm, struct evbuffer *out, const void *data, size_t len, int flush)
+{
+  struct evbuffer_iovec iovec[1];
+  int ret;
 
-  out = evbuffer_new();
-  if (!out)
+  strm->next_in = (Bytef *)data;
+  strm->avail_in = len;
+
+  do
     {
-      DPRINTF(E_LOG, L_HTTPD, "Could not allocate evbuffer for gzipped reply\n");
-      goto out_deflate_end;
+      ret = evbuffer_reserve_space(out, GZIP_CHUNK_SIZE, iovec, 1);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply\n");
+	  return -1;
+	}
+
+      strm->next_out = iovec[0].iov_base;
+      strm->avail_out = iovec[0].iov_len;
+
+      ret = deflate(strm, flush);
+      if (ret == Z_STREAM_ERROR)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "zlib deflate failed\n");
+	  return -1;
+	}
+
+      iovec[0].iov_len -= strm->avail_out;
+      evbuffer_commit_space(out, iovec, 1);
     }
+  while (strm->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+  return 0;
+}
+
+// Compresses all of in, which is left untouched
+static struct evbuffer *
+gzip_deflate(struct evbuffer *in, int level)
+{
+  struct evbuffer *out;
+  struct evbuffer_iovec *vec;
+  z_stream strm;
+  int nvec;
+  int i;
+  int ret;
 
-  // We use this to avoid a memcpy. The 512 is an arbitrary padding to make sure
-  // there is enough space, even if the compressed output should be slightly
-  // larger than input (could happen with small inputs).
-  ret = evbuffer_reserve_space(out, strm.avail_in + 512, iovec, 1);
+  ret = gzip_init(&strm, level);
   if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_HTTPD, "Could not reserve memory for gzipped reply\n");
-      goto out_evbuf_free;
-    }
+    return NULL;
+
+  CHECK_NULL(L_HTTPD, out = evbuffer_new());
 
-  strm.next_out = iovec[0].iov_base;
-  strm.avail_out = iovec[0].iov_len;
+  nvec = evbuffer_peek(in, -1, NULL, NULL, 0);
+  CHECK_NULL(L_HTTPD, vec = calloc(MAX(nvec, 1), sizeof(struct evbuffer_iovec)));
+  evbuffer_peek(in, -1, NULL, vec, nvec);
 
-  ret = deflate(&strm, Z_FINISH);
-  if (ret != Z_STREAM_END)
-    goto out_evbuf_free;
+  for (i = 0, ret = 0; i < nvec && ret == 0; i++)
+    ret = gzip_write(&strm, out, vec[i].iov_base, vec[i].iov_len, Z_NO_FLUSH);
 
-  iovec[0].iov_len -= strm.avail_out;
+  if (ret == 0)
+    ret = gzip_write(&strm, out, NULL, 0, Z_FINISH);
 
-  evbuffer_commit_space(out, iovec, 1);
+  free(vec);
   deflateEnd(&strm);
 
+  if (ret < 0)
+    {
+      evbuffer_free(out);
+      return NULL;
+    }
+
   return out;
+}
 
- out_evbuf_free:
-  evbuffer_free(out);
+struct evbuffer *
+httpd_gzip_deflate(struct evbuffer *in)
+{
+  return gzip_deflate(in, gzip_level);
+}
 
- out_deflate_end:
-  deflateEnd(&strm);
+struct httpd_reply_stream *
+httpd_send_reply_start(struct evhttp_request *req, int code, const char *reason, enum httpd_send_flags flags)
+{
+  struct httpd_reply_stream *stream;
+  struct evkeyvalq *output_headers;
 
-  return NULL;
+  CHECK_NULL(L_HTTPD, stream = calloc(1, sizeof(struct httpd_reply_stream)));
+  stream->req = req;
+
+  output_headers = evhttp_request_get_output_headers(req);
+
+  if (!(flags & HTTPD_SEND_NO_GZIP) && request_accepts_gzip(req) && gzip_init(&stream->strm, gzip_level) == 0)
+    {
+      CHECK_NULL(L_HTTPD, stream->gzbuf = evbuffer_new());
+      evhttp_add_header(output_headers, "Content-Encoding", "gzip");
+    }
+
+  if (allow_origin)
+    evhttp_add_header(output_headers, "Access-Control-Allow-Origin", allow_origin);
+
+  evhttp_send_reply_start(req, code, reason);
+
+  return stream;
+}
+
+void
+httpd_send_reply_chunk(struct httpd_reply_stream *stream, struct evbuffer *evbuf, void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+  struct evbuffer_iovec vec;
+  size_t len;
+  int flush;
+  int ret;
+
+  if (stream->gzbuf)
+    {
+      // If the caller waits for the chunk to be written, we must make sure
+      // there is something to write, so flush the compressor
+      flush = cb ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+      ret = 0;
+      while (ret == 0 && (len = evbuffer_get_contiguous_space(evbuf)) > 0)
+	{
+	  evbuffer_peek(evbuf, len, NULL, &vec, 1);
+	  ret = gzip_write(&stream->strm, stream->gzbuf, vec.iov_base, len, (len == evbuffer_get_length(evbuf)) ? flush : Z_NO_FLUSH);
+	  evbuffer_drain(evbuf, len);
+	}
+
+      // Drain in any case, as would be after evhttp_send_reply_chunk()
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+
+      evbuf = stream->gzbuf;
+    }
+
+#ifdef HAVE_LIBEVENT2_OLD
+  evhttp_send_reply_chunk(stream->req, evbuf);
+#else
+  if (cb)
+    evhttp_send_reply_chunk_with_cb(stream->req, evbuf, cb, arg);
+  else
+    evhttp_send_reply_chunk(stream->req, evbuf);
+#endif
+}
+
+void
+httpd_send_reply_end(struct httpd_reply_stream *stream)
+{
+  if (stream->gzbuf)
+    {
+      if (gzip_write(&stream->strm, stream->gzbuf, NULL, 0, Z_FINISH) == 0)
+	evhttp_send_reply_chunk(stream->req, stream->gzbuf);
+
+      deflateEnd(&stream->strm);
+      evbuffer_free(stream->gzbuf);
+    }
+
+  evhttp_send_reply_end(stream->req);
+
+  free(stream);
+}
+
+void
+httpd_send_reply_abort(struct httpd_reply_stream *stream)
+{
+  if (stream->gzbuf)
+    {
+      deflateEnd(&stream->strm);
+      evbuffer_free(stream->gzbuf);
+    }
+
+  free(stream);
 }
 
 void
 httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evbuf, enum httpd_send_flags flags)
 {
   struct evbuffer *gzbuf;
-  struct evkeyvalq *input_headers;
   struct evkeyvalq *output_headers;
-  const char *param;
   int do_gzip;
 
   if (!req)
     return;
 
-  input_headers = evhttp_request_get_input_headers(req);
   output_headers = evhttp_request_get_output_headers(req);
 
   do_gzip = ( (!(flags & HTTPD_SEND_NO_GZIP)) &&
               evbuf && (evbuffer_get_length(evbuf) > 512) &&
-              (param = evhttp_find_header(input_headers, "Accept-Encoding")) &&
-              (strstr(param, "gzip") || strstr(param, "*"))
+              request_accepts_gzip(req)
             );
 
   if (allow_origin)
@@ -1447,13 +3186,14 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
       DPRINTF(E_DBG, L_HTTPD, "Gzipping response\n");
 
       evhttp_add_header(output_headers, "Content-Encoding", "gzip");
-      evhttp_send_reply(req, code, reason, gzbuf);
+      if (!job_reply_capture(req, false, code, reason, gzbuf))
+	evhttp_send_reply(req, code, reason, gzbuf);
       evbuffer_free(gzbuf);
 
       // Drain original buffer, as would be after evhttp_send_reply()
       evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
     }
-  else
+  else if (!job_reply_capture(req, false, code, reason, evbuf))
     {
       evhttp_send_reply(req, code, reason, evbuf);
     }
@@ -1466,6 +3206,10 @@ httpd_send_error(struct evhttp_request* req, int error, const char* reason)
   struct evkeyvalq *output_headers;
   struct evbuffer *evbuf;
 
+  // Sent later by the httpd thread if we are in a worker
+  if (job_reply_capture(req, true, error, reason, NULL))
+    return;
+
   if (!allow_origin)
     {
       evhttp_send_error(req, error, reason);
@@ -1492,6 +3236,30 @@ httpd_send_error(struct evhttp_request* req, int error, const char* reason)
     evbuffer_free(evbuf);
 }
 
+void
+httpd_connection_set_closecb(struct evhttp_connection *evcon, void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+  struct httpd_conn *conn;
+
+  conn = conn_find(evcon);
+  if (!conn)
+    {
+      evhttp_connection_set_closecb(evcon, cb, arg);
+      return;
+    }
+
+  conn->closecb = cb;
+  conn->closecb_arg = arg;
+}
+
+void
+httpd_stats_get(struct httpd_stats *stats)
+{
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&httpd_stats_lck));
+  memcpy(stats, &httpd_stats, sizeof(struct httpd_stats));
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&httpd_stats_lck));
+}
+
 bool
 httpd_admin_check_auth(struct evhttp_request *req)
 {
@@ -1642,6 +3410,9 @@ int
 httpd_init(const char *webroot)
 {
   struct stat sb;
+  int timeout;
+  int max_size;
+  int cache_size;
   int ret;
 
   httpd_exit = 0;
@@ -1675,6 +3446,8 @@ httpd_init(const char *webroot)
       return -1;
     }
 
+  CHECK_NULL(L_HTTPD, xcode_cache_ev = evtimer_new(evbase_httpd, xcode_cache_idle_cb, NULL));
+
   ret = rsp_init();
   if (ret < 0)
     {
@@ -1788,6 +3561,18 @@ httpd_init(const char *webroot)
 
   httpd_port = cfg_getint(cfg_getsec(cfg, "library"), "port");
 
+  // A single stream may use up to 3/4 of the cache, so a few can share it
+  cache_size = cfg_getint(cfg_getsec(cfg, "library"), "transcode_cache_size");
+  xcode_cache_max = (cache_size > 0) ? cache_size : 0;
+  xcode_cache_entry_max = xcode_cache_max / 4 * 3;
+
+  gzip_level = cfg_getint(cfg_getsec(cfg, "general"), "gzip_level");
+  if (gzip_level < Z_DEFAULT_COMPRESSION || gzip_level > Z_BEST_COMPRESSION)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Invalid gzip_level %d, using default\n", gzip_level);
+      gzip_level = Z_DEFAULT_COMPRESSION;
+    }
+
   ret = net_evhttp_bind(evhttpd, httpd_port, "httpd");
   if (ret < 0)
     {
@@ -1797,6 +3582,22 @@ httpd_init(const char *webroot)
 
   evhttp_set_gencb(evhttpd, httpd_gen_cb, NULL);
 
+  httpd_max_connections = cfg_getint(cfg_getsec(cfg, "general"), "httpd_max_connections");
+
+  timeout = cfg_getint(cfg_getsec(cfg, "general"), "httpd_timeout");
+  if (timeout > 0)
+    evhttp_set_timeout(evhttpd, timeout);
+
+  max_size = cfg_getint(cfg_getsec(cfg, "general"), "httpd_max_headers_size");
+  if (max_size > 0)
+    evhttp_set_max_headers_size(evhttpd, max_size);
+
+  max_size = cfg_getint(cfg_getsec(cfg, "general"), "httpd_max_body_size");
+  if (max_size > 0)
+    evhttp_set_max_body_size(evhttpd, max_size);
+
+  workers_init();
+
   ret = pthread_create(&tid_httpd, NULL, httpd, NULL);
   if (ret != 0)
     {
@@ -1810,6 +3611,9 @@ httpd_init(const char *webroot)
   return 0;
 
  thread_fail:
+  workers_deinit();
+  if (httpd_cmdbase)
+    commands_base_free(httpd_cmdbase);
  bind_fail:
   evhttp_free(evhttpd);
  evhttpd_fail:
@@ -1839,6 +3643,7 @@ httpd_init(const char *webroot)
  daap_fail:
   rsp_deinit();
  rsp_fail:
+  event_free(xcode_cache_ev);
   event_base_free(evbase_httpd);
 
   return -1;
@@ -1850,6 +3655,17 @@ httpd_deinit(void)
 {
   int ret;
 
+  // Stop handing requests to the workers before they go away. The httpd thread
+  // keeps running until they are joined, so it still delivers the replies of
+  // the jobs they had queued. Commands run in order, so the second
+  // workers_stop() returns after the last of those replies has been handled.
+  if (httpd_workers_num > 0)
+    {
+      commands_exec_sync(httpd_cmdbase, workers_stop, NULL, NULL);
+      workers_deinit();
+      commands_exec_sync(httpd_cmdbase, workers_stop, NULL, NULL);
+    }
+
 #ifdef HAVE_EVENTFD
   ret = eventfd_write(exit_efd, 1);
   if (ret < 0)
@@ -1896,5 +3712,11 @@ httpd_deinit(void)
 #endif
   event_free(exitev);
   evhttp_free(evhttpd);
+  stats_conn_purge();
+  htdocs_cache_purge();
+  xcode_cache_purge();
+  event_free(xcode_cache_ev);
+  if (httpd_cmdbase)
+    commands_base_free(httpd_cmdbase);
   event_base_free(evbase_httpd);
 }
@@ -3,6 +3,7 @@
 #define __HTTPD_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <regex.h>
 #include <time.h>
 #include <event2/http.h>
@@ -14,6 +15,61 @@ enum httpd_send_flags
   HTTPD_SEND_NO_GZIP =   (1 << 0),
 };
 
+// Max number of numeric path segments captured for a request
+#define HTTPD_PATH_NUM_MAX 4
+
+// Request statistics are kept per route class
+enum httpd_route_class
+{
+  HTTPD_ROUTE_DACP,
+  HTTPD_ROUTE_DAAP,
+  HTTPD_ROUTE_JSONAPI,
+  HTTPD_ROUTE_ARTWORK,
+  HTTPD_ROUTE_STREAMING,
+  HTTPD_ROUTE_OAUTH,
+  HTTPD_ROUTE_RSP,
+  HTTPD_ROUTE_FILES,
+  HTTPD_ROUTE_MAX,
+};
+
+// Latency histogram buckets, see httpd_stats_bucket_msec
+#define HTTPD_STATS_BUCKETS 8
+// Number of user agents we count requests for
+#define HTTPD_STATS_CLIENTS_MAX 32
+
+struct httpd_route_stats {
+  uint64_t requests;
+  // Replies with status >= 400
+  uint64_t errors;
+  // Requests where the connection closed before the reply was sent
+  uint64_t aborted;
+  uint64_t msec_total;
+  uint64_t latency[HTTPD_STATS_BUCKETS];
+  int in_flight;
+};
+
+struct httpd_client_stats {
+  char user_agent[64];
+  uint64_t requests[HTTPD_ROUTE_MAX];
+};
+
+struct httpd_stats {
+  uint64_t connections;
+  int connections_active;
+  uint64_t connections_rejected;
+  // Requests that were not the first on their connection
+  uint64_t requests_reused;
+
+  struct httpd_route_stats routes[HTTPD_ROUTE_MAX];
+  struct httpd_client_stats clients[HTTPD_STATS_CLIENTS_MAX];
+  int nclients;
+};
+
+extern const char *httpd_route_class_names[HTTPD_ROUTE_MAX];
+
+// Upper bounds (exclusive) of the latency buckets, the last bucket has the rest
+extern const int httpd_stats_bucket_msec[HTTPD_STATS_BUCKETS - 1];
+
 /*
  * Contains a parsed version of the URI httpd got. The URI may have been
  * complete:
@@ -57,6 +113,11 @@ struct httpd_request {
   // A pointer to extra data that the module handling the request might need
   void *extra_data;
 
+  // The values of the path parts that matched [[:digit:]]+ in the handler's
+  // regexp, in order. Not set for regexps with ".*".
+  uint64_t path_num[HTTPD_PATH_NUM_MAX];
+  int path_num_count;
+
   // Reply evbuffer
   struct evbuffer *reply;
 
@@ -75,6 +136,31 @@ struct httpd_uri_map
   regex_t preg;
 };
 
+/*
+ * Routes request paths to the handlers of a uri_map, see httpd_router_new()
+ */
+struct httpd_router;
+
+/*
+ * A chunked reply in progress, see httpd_send_reply_start()
+ */
+struct httpd_reply_stream;
+
+/*
+ * Compiles the regexps of a uri_map into a router. Most regexps are turned
+ * into a trie of path segments, so routing doesn't need a regexec() for each
+ * entry. If more entries match a path, the first one wins, like before.
+ *
+ * @in  uri_map  Array terminated by an entry with a NULL handler. Must stay
+ *               valid until the router is freed.
+ * @return       The router, or NULL if a regexp is invalid
+ */
+struct httpd_router *
+httpd_router_new(struct httpd_uri_map *uri_map);
+
+void
+httpd_router_free(struct httpd_router *router);
+
 /*
  * Helper to free the parsed uri struct
  */
@@ -95,7 +181,22 @@ httpd_uri_parse(const char *uri);
  * request headers, except if provided as an argument to this function.
  */
 struct httpd_request *
-httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed, const char *user_agent, struct httpd_uri_map *uri_map);
+httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed, const char *user_agent, struct httpd_router *router);
+
+/*
+ * Runs cb(hreq) in one of the httpd worker threads, so that a slow handler
+ * does not hold up other requests. Takes ownership of hreq, which cb must
+ * free. The copies of the parsed uri and peer address that hreq points to are
+ * valid until cb returns. Replies made by cb with httpd_send_reply() or
+ * httpd_send_error() are sent by the httpd thread once cb has returned, so cb
+ * must reply exactly once and must not use any other evhttp send function. If
+ * there are no workers, cb is called directly.
+ *
+ * @in  hreq     Request parsed with httpd_request_parse()
+ * @in  cb       Function that handles the request and replies
+ */
+void
+httpd_request_dispatch(struct httpd_request *hreq, void (*cb)(struct httpd_request *hreq));
 
 void
 httpd_stream_file(struct evhttp_request *req, int id);
@@ -106,11 +207,15 @@ httpd_request_not_modified_since(struct evhttp_request *req, time_t mtime);
 bool
 httpd_request_etag_matches(struct evhttp_request *req, const char *etag);
 
+bool
+httpd_request_not_modified(struct evhttp_request *req, const char *etag, time_t mtime);
+
 void
 httpd_response_not_cachable(struct evhttp_request *req);
 
 /*
- * Gzips an evbuffer
+ * Gzips an evbuffer with the configured compression level. The input is
+ * compressed piece by piece, so it is not linearized, and it is not drained.
  *
  * @in  in       Data to be compressed
  * @return       Compressed data - must be freed by caller
@@ -148,6 +253,56 @@ httpd_send_reply(struct evhttp_request *req, int code, const char *reason, struc
 void
 httpd_send_error(struct evhttp_request *req, int error, const char *reason);
 
+/*
+ * For large replies that are produced in pieces. Sends the reply as chunks,
+ * gzipping them on the fly if the client accepts it, so neither the plain nor
+ * the compressed reply needs to be held in memory. Must be called from the
+ * httpd thread, i.e. not from a handler run with httpd_request_dispatch().
+ *
+ * @in  req      The evhttp request struct
+ * @in  code     HTTP code, e.g. 200
+ * @in  reason   See httpd_send_reply
+ * @in  flags    See flags above
+ * @return       Handle to pass to httpd_send_reply_chunk/_end
+ */
+struct httpd_reply_stream *
+httpd_send_reply_start(struct evhttp_request *req, int code, const char *reason, enum httpd_send_flags flags);
+
+/*
+ * Sends (and drains) evbuf as the next part of the reply. If cb is set it is
+ * called when the chunk has been written to the client, which a caller can
+ * use to produce the next chunk without buffering more than one at a time.
+ * The callback is not supported with libevent < 2.1.4.
+ */
+void
+httpd_send_reply_chunk(struct httpd_reply_stream *stream, struct evbuffer *evbuf, void (*cb)(struct evhttp_connection *, void *), void *arg);
+
+/*
+ * Completes the reply and frees the stream
+ */
+void
+httpd_send_reply_end(struct httpd_reply_stream *stream);
+
+/*
+ * Frees the stream without completing the reply, e.g. because the connection
+ * failed. Closing the connection, if required, is up to the caller.
+ */
+void
+httpd_send_reply_abort(struct httpd_reply_stream *stream);
+
+/*
+ * Must be used by handlers instead of evhttp_connection_set_closecb(), since
+ * httpd uses the close callback to keep track of connections
+ */
+void
+httpd_connection_set_closecb(struct evhttp_connection *evcon, void (*cb)(struct evhttp_connection *, void *), void *arg);
+
+/*
+ * Copies the current request statistics. Thread safe.
+ */
+void
+httpd_stats_get(struct httpd_stats *stats);
+
 /*
  * Redirects to the given path
  */
@@ -109,10 +109,11 @@ artworkapi_reply_item(struct httpd_request *hreq)
   if (ret != 0)
     return ret;
 
-  ret = safe_atou32(hreq->uri_parsed->path_parts[2], &id);
-  if (ret != 0)
+  if (hreq->path_num[0] > UINT32_MAX)
     return HTTP_BADREQUEST;
 
+  id = hreq->path_num[0];
+
   ret = artwork_get_item(hreq->reply, id, max_w, max_h, 0);
 
   return response_process(hreq, ret);
@@ -130,10 +131,11 @@ artworkapi_reply_group(struct httpd_request *hreq)
   if (ret != 0)
     return ret;
 
-  ret = safe_atou32(hreq->uri_parsed->path_parts[2], &id);
-  if (ret != 0)
+  if (hreq->path_num[0] > UINT32_MAX)
     return HTTP_BADREQUEST;
 
+  id = hreq->path_num[0];
+
   ret = artwork_get_group(hreq->reply, id, max_w, max_h, 0);
 
   return response_process(hreq, ret);
@@ -147,28 +149,18 @@ static struct httpd_uri_map artworkapi_handlers[] =
   { 0, NULL, NULL }
 };
 
+static struct httpd_router *artworkapi_router;
+
 
 /* ------------------------------- API --------------------------------- */
-void
-artworkapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
+
+/* Thread: httpd worker */
+static void
+artworkapi_request_handle(struct httpd_request *hreq)
 {
-  struct httpd_request *hreq;
+  struct evhttp_request *req = hreq->req;
   int status_code;
 
-  DPRINTF(E_DBG, L_WEB, "Artwork api request: '%s'\n", uri_parsed->uri);
-
-  if (!httpd_admin_check_auth(req))
-    return;
-
-  hreq = httpd_request_parse(req, uri_parsed, NULL, artworkapi_handlers);
-  if (!hreq)
-    {
-      DPRINTF(E_LOG, L_WEB, "Unrecognized path '%s' in artwork api request: '%s'\n", uri_parsed->path, uri_parsed->uri);
-
-      httpd_send_error(req, HTTP_BADREQUEST, "Bad Request");
-      return;
-    }
-
   CHECK_NULL(L_WEB, hreq->reply = evbuffer_new());
 
   status_code = hreq->handler(hreq);
@@ -199,6 +191,28 @@ artworkapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_pars
   free(hreq);
 }
 
+void
+artworkapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
+{
+  struct httpd_request *hreq;
+
+  DPRINTF(E_DBG, L_WEB, "Artwork api request: '%s'\n", uri_parsed->uri);
+
+  if (!httpd_admin_check_auth(req))
+    return;
+
+  hreq = httpd_request_parse(req, uri_parsed, NULL, artworkapi_router);
+  if (!hreq)
+    {
+      DPRINTF(E_LOG, L_WEB, "Unrecognized path '%s' in artwork api request: '%s'\n", uri_parsed->path, uri_parsed->uri);
+
+      httpd_send_error(req, HTTP_BADREQUEST, "Bad Request");
+      return;
+    }
+
+  httpd_request_dispatch(hreq, artworkapi_request_handle);
+}
+
 int
 artworkapi_is_request(const char *path)
 {
@@ -211,20 +225,11 @@ artworkapi_is_request(const char *path)
 int
 artworkapi_init(void)
 {
-  char buf[64];
-  int i;
-  int ret;
-
-  for (i = 0; artworkapi_handlers[i].handler; i++)
+  artworkapi_router = httpd_router_new(artworkapi_handlers);
+  if (!artworkapi_router)
     {
-      ret = regcomp(&artworkapi_handlers[i].preg, artworkapi_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
-      if (ret != 0)
-	{
-	  regerror(ret, &artworkapi_handlers[i].preg, buf, sizeof(buf));
-
-	  DPRINTF(E_FATAL, L_WEB, "artwork api init failed; regexp error: %s\n", buf);
-	  return -1;
-	}
+      DPRINTF(E_FATAL, L_WEB, "artwork api init failed; could not compile routes\n");
+      return -1;
     }
 
   return 0;
@@ -233,8 +238,5 @@ artworkapi_init(void)
 void
 artworkapi_deinit(void)
 {
-  int i;
-
-  for (i = 0; artworkapi_handlers[i].handler; i++)
-    regfree(&artworkapi_handlers[i].preg);
+  httpd_router_free(artworkapi_router);
 }
@@ -43,6 +43,7 @@
 
 #include <event2/event.h>
 #include <event2/bufferevent.h>
+#include <zlib.h>
 
 #include "httpd_daap.h"
 #include "logger.h"
@@ -75,9 +76,16 @@ extern struct event_base *evbase_httpd;
 /* Database number for the Radio item */
 #define DAAP_DB_RADIO 2
 
+/* Item and group lists that encode to more than this are not held in memory,
+ * but streamed to the client in chunks of DAAP_STREAM_CHUNK_SIZE
+ */
+#define DAAP_STREAM_THRESHOLD (4 * 1024 * 1024)
+#define DAAP_STREAM_CHUNK_SIZE (64 * 1024)
+
 /* Errors that the reply handlers may return */
 enum daap_reply_result
 {
+  DAAP_REPLY_OK_STREAMED     =  5,
   DAAP_REPLY_LOGOUT          =  4,
   DAAP_REPLY_NONE            =  3,
   DAAP_REPLY_NO_CONTENT      =  2,
@@ -115,6 +123,51 @@ struct sort_ctx {
   uint32_t misc_mshn;
 };
 
+/* A song or group list reply, which is produced from a query one item at a
+ * time by item_add, so that it can be encoded in two passes.
+ */
+struct daap_list {
+  const char *tag;
+  struct query_params qp;
+  const struct dmap_field **meta;
+  int nmeta;
+  int sort_headers;
+
+  // Sort headers are only built in the first pass, so this is NULL in the second
+  struct sort_ctx *sctx;
+
+  // Encodes the next item to evbuf, returns 1 when there are no more items
+  int (*item_add)(struct evbuffer *evbuf, struct daap_list *list);
+  // Only for group lists
+  struct evbuffer *item;
+  int nitems;
+
+  // Only for song lists
+  struct dmap_encode_plan *plan;
+  bool is_remote;
+  const char *user_agent;
+  const char *client_codecs;
+  char *last_codectype;
+  int transcode;
+};
+
+struct daap_list_stream {
+  struct evhttp_request *req;
+  struct httpd_reply_stream *reply;
+  struct event *ev;
+  struct daap_list *list;
+  struct evbuffer *evbuf;
+  // Sort headers, sent after the list
+  struct evbuffer *trailer;
+
+  // Length, checksum and number of items of the encoded list from the first pass
+  size_t len;
+  uint32_t crc;
+  size_t len_sent;
+  uint32_t crc_sent;
+  int nitems;
+};
+
 
 /* Default meta tags if not provided in the query */
 static char *default_meta_plsongs = "dmap.itemkind,dmap.itemid,dmap.itemname,dmap.containeritemid,dmap.parentcontainerid";
@@ -302,7 +355,7 @@ update_refresh_cb(int fd, short event, void *arg)
   dmap_add_int(reply, "musr", current_rev); /* 12 */
 
   evcon = evhttp_request_get_connection(ur->req);
-  evhttp_connection_set_closecb(evcon, NULL, NULL);
+  httpd_connection_set_closecb(evcon, NULL, NULL);
 
   httpd_send_reply(ur->req, HTTP_OK, "OK", reply, 0);
 
@@ -321,7 +374,7 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
 
   evc = evhttp_request_get_connection(ur->req);
   if (evc)
-    evhttp_connection_set_closecb(evc, NULL, NULL);
+    httpd_connection_set_closecb(evc, NULL, NULL);
 
   evhttp_request_free(ur->req);
   update_remove(ur);
@@ -698,6 +751,7 @@ daap_reply_send(struct httpd_request *hreq, enum daap_reply_result result)
 	break;
       case DAAP_REPLY_NO_CONNECTION:
       case DAAP_REPLY_NONE:
+      case DAAP_REPLY_OK_STREAMED:
 	// Send nothing
 	break;
     }
@@ -761,6 +815,476 @@ daap_request_authorize(struct httpd_request *hreq)
 }
 
 
+/* ------------------------------ LIST REPLIES ------------------------------ */
+
+/* Song and group lists can be very large, e.g. the full library for a client
+ * that syncs. The DMAP container lengths must precede the items, so the list
+ * is first encoded once to learn the lengths. If it turns out to be large,
+ * the encoded items are discarded as we go, and the query is run again
+ * while the reply is streamed, which means that only a chunk of the reply is
+ * held in memory at a time. The second pass is paced by the client, i.e. the
+ * next chunk is encoded when the previous one has been written. Both passes
+ * keep a CRC of the encoded items, so if the library changes in between, e.g.
+ * an item is retagged, the reply is aborted instead of completed with items
+ * that don't match the lengths or the sort headers from the first pass.
+ */
+
+// Continues crc with the contents of evbuf
+static uint32_t
+daap_list_crc(uint32_t crc, struct evbuffer *evbuf)
+{
+  size_t len;
+
+  len = evbuffer_get_length(evbuf);
+  if (len == 0)
+    return crc;
+
+  return crc32(crc, evbuffer_pullup(evbuf, -1), len);
+}
+
+static void
+daap_list_free(struct daap_list *list)
+{
+  if (!list)
+    return;
+
+  if (list->sctx)
+    daap_sort_context_free(list->sctx);
+  if (list->item)
+    evbuffer_free(list->item);
+
+  dmap_encode_plan_free(list->plan);
+
+  free(list->meta);
+  free(list->last_codectype);
+  free_query_params(&list->qp, 1);
+  free(list);
+}
+
+static int
+songlist_item_add(struct evbuffer *evbuf, struct daap_list *list)
+{
+  struct db_media_file_info dbmfi;
+  int ret;
+
+  ret = db_query_fetch_file(&dbmfi, &list->qp);
+  if (ret != 0)
+    return ret;
+
+  list->nitems++;
+
+  if (!dbmfi.codectype)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
+
+      list->transcode = 0;
+    }
+  else if (list->is_remote)
+    {
+      list->transcode = 1;
+    }
+  else if (!list->last_codectype || (strcmp(list->last_codectype, dbmfi.codectype) != 0))
+    {
+      list->transcode = transcode_needed(list->user_agent, list->client_codecs, dbmfi.codectype);
+
+      free(list->last_codectype);
+      list->last_codectype = strdup(dbmfi.codectype);
+    }
+
+  ret = dmap_encode_file_metadata(evbuf, list->plan, &dbmfi, list->transcode);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
+      return -100;
+    }
+
+  if (list->sctx)
+    {
+      ret = daap_sort_build(list->sctx, dbmfi.title_sort);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP song list reply\n");
+	  return -100;
+	}
+    }
+
+  DPRINTF(E_SPAM, L_DAAP, "Done with song\n");
+
+  return 0;
+}
+
+static int
+groups_item_add(struct evbuffer *evbuf, struct daap_list *list)
+{
+  struct db_group_info dbgri;
+  const struct dmap_field_map *dfm;
+  const struct dmap_field *df;
+  cfg_t *lib;
+  char **strval;
+  size_t len;
+  int32_t val;
+  int i;
+  int ret;
+
+  while ((ret = db_query_fetch_group(&dbgri, &list->qp)) == 0)
+    {
+      /* Don't add item if no name (eg blank album name) */
+      if (strlen(dbgri.itemname) == 0)
+	continue;
+
+      /* Don't add single item albums/artists if configured to hide */
+      lib = cfg_getsec(cfg, "library");
+      if (cfg_getbool(lib, "hide_singles") && (strcmp(dbgri.itemcount, "1") == 0))
+	continue;
+
+      break;
+    }
+
+  if (ret != 0)
+    return ret;
+
+  list->nitems++;
+
+  for (i = 0; i < list->nmeta; i++)
+    {
+      df = list->meta[i];
+      if (!df)
+	continue;
+
+      dfm = df->dfm;
+
+      /* dmap.itemcount - always added */
+      if (dfm == &dfm_dmap_mimc)
+	continue;
+
+      /* Not in struct group_info */
+      if (dfm->gri_offset < 0)
+	continue;
+
+      strval = (char **) ((char *)&dbgri + dfm->gri_offset);
+
+      if (!(*strval) || (**strval == '\0'))
+	continue;
+
+      dmap_add_field(list->item, df, *strval, 0);
+
+      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
+    }
+
+  if (list->sctx)
+    {
+      ret = daap_sort_build(list->sctx, dbgri.itemname_sort);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP groups reply\n");
+	  return -100;
+	}
+    }
+
+  /* Item count, always added (mimc) */
+  val = 0;
+  ret = safe_atoi32(dbgri.itemcount, &val);
+  if ((ret == 0) && (val > 0))
+    dmap_add_int(list->item, "mimc", val);
+
+  /* Song album artist (asaa), always added if group-type is albums  */
+  if (list->qp.type == Q_GROUP_ALBUMS)
+    dmap_add_string(list->item, "asaa", dbgri.songalbumartist);
+
+  /* Item id (miid) */
+  val = 0;
+  ret = safe_atoi32(dbgri.id, &val);
+  if ((ret == 0) && (val > 0))
+    dmap_add_int(list->item, "miid", val);
+
+  DPRINTF(E_SPAM, L_DAAP, "Done with group\n");
+
+  len = evbuffer_get_length(list->item);
+  dmap_add_container(evbuf, "mlit", len);
+  ret = evbuffer_add_buffer(evbuf, list->item);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not add group to group list for DAAP groups reply\n");
+      return -100;
+    }
+
+  return 0;
+}
+
+#ifndef HAVE_LIBEVENT2_OLD
+static void
+daap_list_stream_end(struct daap_list_stream *st, bool failed)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(st->req);
+  if (evcon)
+    httpd_connection_set_closecb(evcon, NULL, NULL);
+
+  if (failed)
+    httpd_send_reply_abort(st->reply);
+  else
+    httpd_send_reply_end(st->reply);
+
+  db_query_end(&st->list->qp);
+  daap_list_free(st->list);
+
+  if (st->trailer)
+    evbuffer_free(st->trailer);
+  evbuffer_free(st->evbuf);
+  event_free(st->ev);
+  free(st);
+}
+
+static void
+daap_list_stream_resched_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct daap_list_stream *st = arg;
+
+  event_active(st->ev, 0, 0);
+}
+
+static void
+daap_list_stream_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct daap_list_stream *st = arg;
+
+  DPRINTF(E_WARN, L_DAAP, "Connection failed; stopping streaming of DAAP list\n");
+
+  event_del(st->ev);
+
+  daap_list_stream_end(st, true);
+}
+
+static void
+daap_list_stream_cb(evutil_socket_t fd, short event, void *arg)
+{
+  struct daap_list_stream *st = arg;
+  struct daap_list *list = st->list;
+  struct evhttp_connection *evcon;
+  int ret;
+
+  ret = 0;
+  while (evbuffer_get_length(st->evbuf) < DAAP_STREAM_CHUNK_SIZE && (ret = list->item_add(st->evbuf, list)) == 0)
+    ; // Until chunk is full or there are no more items
+
+  st->len_sent += evbuffer_get_length(st->evbuf);
+  st->crc_sent = daap_list_crc(st->crc_sent, st->evbuf);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Error encoding DAAP list while streaming\n");
+      goto fail;
+    }
+
+  // The container lengths have been sent already, so we can't send anything
+  // else than what the first pass counted
+  if ((st->len_sent > st->len) || (ret == 1 && (st->len_sent != st->len || st->crc_sent != st->crc || list->nitems != st->nitems)))
+    {
+      DPRINTF(E_LOG, L_DAAP, "Library changed while streaming DAAP list, aborting reply\n");
+      goto fail;
+    }
+
+  if (ret == 1)
+    {
+      if (st->trailer)
+	evbuffer_add_buffer(st->evbuf, st->trailer);
+
+      httpd_send_reply_chunk(st->reply, st->evbuf, NULL, NULL);
+
+      DPRINTF(E_DBG, L_DAAP, "Done streaming DAAP list, %d items\n", list->nitems);
+
+      daap_list_stream_end(st, false);
+      return;
+    }
+
+  httpd_send_reply_chunk(st->reply, st->evbuf, daap_list_stream_resched_cb, st);
+  return;
+
+ fail:
+  evcon = evhttp_request_get_connection(st->req);
+
+  daap_list_stream_end(st, true);
+
+  // Close the connection so the client doesn't take the reply as complete
+  if (evcon)
+    evhttp_connection_free(evcon);
+}
+
+// Takes ownership of list and trailer
+static enum daap_reply_result
+daap_list_stream_start(struct httpd_request *hreq, struct daap_list *list, struct evbuffer *trailer, size_t len, uint32_t crc)
+{
+  struct daap_list_stream *st;
+  struct evhttp_connection *evcon;
+  int ret;
+
+  // Second pass, the sort headers are already done
+  list->nitems = 0;
+  free(list->last_codectype);
+  list->last_codectype = NULL;
+
+  ret = db_query_start(&list->qp);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not restart query for streaming\n");
+
+      evbuffer_drain(hreq->reply, evbuffer_get_length(hreq->reply));
+      dmap_error_make(hreq->reply, list->tag, "Could not start query");
+
+      if (trailer)
+	evbuffer_free(trailer);
+      daap_list_free(list);
+      return DAAP_REPLY_ERROR;
+    }
+
+  DPRINTF(E_DBG, L_DAAP, "Streaming DAAP list of %d items (%zu bytes)\n", list->qp.results, len);
+
+  CHECK_NULL(L_DAAP, st = calloc(1, sizeof(struct daap_list_stream)));
+  CHECK_NULL(L_DAAP, st->evbuf = evbuffer_new());
+  CHECK_NULL(L_DAAP, st->ev = event_new(evbase_httpd, -1, EV_TIMEOUT, daap_list_stream_cb, st));
+  CHECK_ERR(L_DAAP, evbuffer_expand(st->evbuf, DAAP_STREAM_CHUNK_SIZE));
+
+  st->req = hreq->req;
+  st->list = list;
+  st->trailer = trailer;
+  st->len = len;
+  st->crc = crc;
+  st->crc_sent = crc32(0, NULL, 0);
+  st->nitems = list->nitems;
+
+  // The list header from hreq->reply goes out as the first chunk
+  st->reply = httpd_send_reply_start(hreq->req, HTTP_OK, "OK", 0);
+  httpd_send_reply_chunk(st->reply, hreq->reply, NULL, NULL);
+
+  evcon = evhttp_request_get_connection(st->req);
+  httpd_connection_set_closecb(evcon, daap_list_stream_fail_cb, st);
+
+  event_active(st->ev, 0, 0);
+
+  return DAAP_REPLY_OK_STREAMED;
+}
+#endif
+
+// Takes ownership of list
+static enum daap_reply_result
+daap_reply_list(struct httpd_request *hreq, struct daap_list *list)
+{
+  struct evbuffer *items;
+  struct evbuffer *trailer;
+  size_t len;
+  size_t len_counted;
+  uint32_t crc;
+  bool streamable;
+  int ret;
+
+  CHECK_NULL(L_DAAP, items = evbuffer_new());
+  CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 61));
+  CHECK_ERR(L_DAAP, evbuffer_expand(items, 4096));
+
+  trailer = NULL;
+  if (list->sort_headers)
+    CHECK_NULL(L_DAAP, list->sctx = daap_sort_context_new());
+
+  ret = db_query_start(&list->qp);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
+
+      dmap_error_make(hreq->reply, list->tag, "Could not start query");
+      goto error;
+    }
+
+  // Only live requests are streamed, the cache wants the entire reply
+#ifdef HAVE_LIBEVENT2_OLD
+  streamable = false;
+#else
+  streamable = (hreq->req != NULL);
+#endif
+
+  len_counted = 0;
+  crc = crc32(0, NULL, 0);
+  while ((ret = list->item_add(items, list)) == 0)
+    {
+      len = evbuffer_get_length(items);
+      if (len_counted == 0 && (!streamable || len < DAAP_STREAM_THRESHOLD))
+	continue;
+
+      // Too large to keep, so from now on we only count the bytes
+      len_counted += len;
+      crc = daap_list_crc(crc, items);
+      evbuffer_drain(items, len);
+    }
+
+  DPRINTF(E_DBG, L_DAAP, "Done with %s list, %d items\n", list->tag, list->nitems);
+
+  db_query_end(&list->qp);
+
+  if (ret == -100)
+    {
+      dmap_error_make(hreq->reply, list->tag, "Out of memory");
+      goto error;
+    }
+  else if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_DAAP, "Error fetching results\n");
+      dmap_error_make(hreq->reply, list->tag, "Error fetching query results");
+      goto error;
+    }
+
+  if (list->sctx)
+    {
+      daap_sort_finalize(list->sctx);
+
+      CHECK_NULL(L_DAAP, trailer = evbuffer_new());
+      dmap_add_container(trailer, "mshl", evbuffer_get_length(list->sctx->headerlist)); /* 8 */
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(trailer, list->sctx->headerlist));
+
+      daap_sort_context_free(list->sctx);
+      list->sctx = NULL;
+    }
+
+  /* Add header to evbuf, add items and sort headers to evbuf */
+  len = len_counted + evbuffer_get_length(items);
+  if (trailer)
+    dmap_add_container(hreq->reply, list->tag, len + evbuffer_get_length(trailer) + 53);
+  else
+    dmap_add_container(hreq->reply, list->tag, len + 53);
+
+  dmap_add_int(hreq->reply, "mstt", 200);              /* 12 */
+  dmap_add_char(hreq->reply, "muty", 0);               /* 9 */
+  dmap_add_int(hreq->reply, "mtco", list->qp.results); /* 12 */
+  dmap_add_int(hreq->reply, "mrco", list->nitems);     /* 12 */
+  dmap_add_container(hreq->reply, "mlcl", len);        /* 8 */
+
+#ifndef HAVE_LIBEVENT2_OLD
+  if (len_counted > 0)
+    {
+      evbuffer_free(items);
+      return daap_list_stream_start(hreq, list, trailer, len, crc);
+    }
+#endif
+
+  CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, items));
+  if (trailer)
+    {
+      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, trailer));
+      evbuffer_free(trailer);
+    }
+
+  evbuffer_free(items);
+  daap_list_free(list);
+
+  return DAAP_REPLY_OK;
+
+ error:
+  evbuffer_free(items);
+  daap_list_free(list);
+
+  return DAAP_REPLY_ERROR;
+}
+
+
 /* --------------------------- REPLY HANDLERS ------------------------------- */
 /* Note that some handlers can be called without a connection (needed for     */
 /* cache regeneration), while others cannot. Those that cannot should check   */
@@ -1074,7 +1598,7 @@ daap_reply_update(struct httpd_request *hreq)
   evcon = evhttp_request_get_connection(hreq->req);
   if (evcon)
     {
-      evhttp_connection_set_closecb(evcon, update_fail_cb, ur);
+      httpd_connection_set_closecb(evcon, update_fail_cb, ur);
 
       // This is a workaround for some versions of libevent (2.0, but possibly
       // also 2.1) that don't detect if the client hangs up, and thus don't
@@ -1173,24 +1697,10 @@ daap_reply_dblist(struct httpd_request *hreq)
 static enum daap_reply_result
 daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 {
-  struct query_params qp;
-  struct db_media_file_info dbmfi;
-  struct evbuffer *song;
-  struct evbuffer *songlist;
+  struct daap_list *list;
   struct evkeyvalq *headers;
   struct daap_session *s;
-  const struct dmap_field **meta = NULL;
-  struct sort_ctx *sctx;
   const char *param;
-  const char *client_codecs;
-  const char *tag;
-  char *last_codectype;
-  size_t len;
-  int nmeta = 0;
-  int sort_headers;
-  int nsongs;
-  int transcode;
-  int ret;
 
   DPRINTF(E_DBG, L_DAAP, "Fetching song list for playlist %d\n", playlist);
 
@@ -1201,26 +1711,23 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
       return DAAP_REPLY_ERROR;
     }
 
+  CHECK_NULL(L_DAAP, list = calloc(1, sizeof(struct daap_list)));
+
   if (playlist != -1)
     {
       // Songs in playlist
-      tag = "apso";
-      query_params_set(&qp, &sort_headers, hreq, Q_PLITEMS);
-      qp.id = playlist;
+      list->tag = "apso";
+      query_params_set(&list->qp, &list->sort_headers, hreq, Q_PLITEMS);
+      list->qp.id = playlist;
     }
   else
     {
       // Songs in database
-      tag = "adbs";
-      query_params_set(&qp, &sort_headers, hreq, Q_ITEMS);
+      list->tag = "adbs";
+      query_params_set(&list->qp, &list->sort_headers, hreq, Q_ITEMS);
     }
 
-  CHECK_NULL(L_DAAP, songlist = evbuffer_new());
-  CHECK_NULL(L_DAAP, song = evbuffer_new());
-  CHECK_NULL(L_DAAP, sctx = daap_sort_context_new());
-  CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 61));
-  CHECK_ERR(L_DAAP, evbuffer_expand(songlist, 4096));
-  CHECK_ERR(L_DAAP, evbuffer_expand(song, 512));
+  list->item_add = songlist_item_add;
 
   param = evhttp_find_header(hreq->query, "meta");
   if (!param)
@@ -1233,135 +1740,28 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 
   if (param)
     {
-      nmeta = parse_meta(&meta, param);
-      if (nmeta < 0)
+      list->nmeta = parse_meta(&list->meta, param);
+      if (list->nmeta < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
 	  goto error;
 	}
     }
 
-  ret = db_query_start(&qp);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
+  list->plan = dmap_encode_plan_new(list->meta, list->nmeta, list->sort_headers);
 
-      dmap_error_make(hreq->reply, tag, "Could not start query");
-      goto error;
-    }
-
-  client_codecs = NULL;
+  list->is_remote = s->is_remote;
+  list->user_agent = hreq->user_agent;
   if (!s->is_remote && hreq->req)
     {
       headers = evhttp_request_get_input_headers(hreq->req);
-      client_codecs = evhttp_find_header(headers, "Accept-Codecs");
-    }
-
-  nsongs = 0;
-  last_codectype = NULL;
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
-    {
-      nsongs++;
-
-      if (!dbmfi.codectype)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
-
-	  transcode = 0;
-	}
-      else if (s->is_remote)
-	{
-	  transcode = 1;
-	}
-      else if (!last_codectype || (strcmp(last_codectype, dbmfi.codectype) != 0))
-	{
-	  transcode = transcode_needed(hreq->user_agent, client_codecs, dbmfi.codectype);
-
-	  free(last_codectype);
-	  last_codectype = strdup(dbmfi.codectype);
-	}
-
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers, transcode);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
-
-	  ret = -100;
-	  break;
-	}
-
-      if (sort_headers)
-	{
-	  ret = daap_sort_build(sctx, dbmfi.title_sort);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP song list reply\n");
-
-	      ret = -100;
-	      break;
-	    }
-   	}
-
-      DPRINTF(E_SPAM, L_DAAP, "Done with song\n");
-    }
-
-  DPRINTF(E_DBG, L_DAAP, "Done with song list, %d songs\n", nsongs);
-
-  free(last_codectype);
-  db_query_end(&qp);
-
-  if (ret == -100)
-    {
-      dmap_error_make(hreq->reply, tag, "Out of memory");
-      goto error;
-    }
-  else if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_DAAP, "Error fetching results\n");
-      dmap_error_make(hreq->reply, tag, "Error fetching query results");
-      goto error;
-    }
-
-  /* Add header to evbuf, add songlist to evbuf */
-  len = evbuffer_get_length(songlist);
-  if (sort_headers)
-    {
-      daap_sort_finalize(sctx);
-      dmap_add_container(hreq->reply, tag, len + evbuffer_get_length(sctx->headerlist) + 61);
-    }
-  else
-    dmap_add_container(hreq->reply, tag, len + 53);
-
-  dmap_add_int(hreq->reply, "mstt", 200);        /* 12 */
-  dmap_add_char(hreq->reply, "muty", 0);         /* 9 */
-  dmap_add_int(hreq->reply, "mtco", qp.results); /* 12 */
-  dmap_add_int(hreq->reply, "mrco", nsongs);     /* 12 */
-  dmap_add_container(hreq->reply, "mlcl", len); /* 8 */
-
-  CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, songlist));
-
-  if (sort_headers)
-    {
-      len = evbuffer_get_length(sctx->headerlist);
-      dmap_add_container(hreq->reply, "mshl", len); /* 8 */
-
-      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, sctx->headerlist));
+      list->client_codecs = evhttp_find_header(headers, "Accept-Codecs");
     }
 
-  free(meta);
-  daap_sort_context_free(sctx);
-  evbuffer_free(song);
-  evbuffer_free(songlist);
-  free_query_params(&qp, 1);
-
-  return DAAP_REPLY_OK;
+  return daap_reply_list(hreq, list);
 
  error:
-  free(meta);
-  daap_sort_context_free(sctx);
-  evbuffer_free(song);
-  evbuffer_free(songlist);
-  free_query_params(&qp, 1);
+  daap_list_free(list);
 
   return DAAP_REPLY_ERROR;
 }
@@ -1618,25 +2018,10 @@ daap_reply_playlists(struct httpd_request *hreq)
 static enum daap_reply_result
 daap_reply_groups(struct httpd_request *hreq)
 {
-  struct query_params qp;
-  struct db_group_info dbgri;
-  struct evbuffer *group;
-  struct evbuffer *grouplist;
-  const struct dmap_field_map *dfm;
-  const struct dmap_field *df;
-  const struct dmap_field **meta = NULL;
-  struct sort_ctx *sctx;
-  cfg_t *lib;
+  struct daap_list *list;
   const char *param;
-  char **strval;
-  char *tag;
-  size_t len;
-  int nmeta;
-  int sort_headers;
-  int ngrp;
-  int32_t val;
-  int i;
-  int ret;
+
+  CHECK_NULL(L_DAAP, list = calloc(1, sizeof(struct daap_list)));
 
   param = evhttp_find_header(hreq->query, "group-type");
   if (param && strcmp(param, "artists") == 0)
@@ -1644,27 +2029,24 @@ daap_reply_groups(struct httpd_request *hreq)
       // Request from Remote may have the form:
       //  groups?meta=dmap.xxx,dma...&type=music&group-type=artists&sort=album&include-sort-headers=1&query=('...')&session-id=...
       // Note: Since grouping by artist and sorting by album is crazy we override
-      tag = "agar";
-      query_params_set(&qp, &sort_headers, hreq, Q_GROUP_ARTISTS);
-      qp.sort = S_ARTIST;
+      list->tag = "agar";
+      query_params_set(&list->qp, &list->sort_headers, hreq, Q_GROUP_ARTISTS);
+      list->qp.sort = S_ARTIST;
     }
   else
     {
       // Request from Remote may have the form:
       //  groups?meta=dmap.xxx,dma...&type=music&group-type=albums&sort=artist&include-sort-headers=0&query=('...'))&session-id=...
       // Sort may also be 'album'
-      tag = "agal";
-      query_params_set(&qp, &sort_headers, hreq, Q_GROUP_ALBUMS);
-      if (qp.sort == S_NONE)
-	qp.sort = S_ALBUM;
+      list->tag = "agal";
+      query_params_set(&list->qp, &list->sort_headers, hreq, Q_GROUP_ALBUMS);
+      if (list->qp.sort == S_NONE)
+	list->qp.sort = S_ALBUM;
     }
 
-  CHECK_NULL(L_DAAP, grouplist = evbuffer_new());
-  CHECK_NULL(L_DAAP, group = evbuffer_new());
-  CHECK_NULL(L_DAAP, sctx = daap_sort_context_new());
-  CHECK_ERR(L_DAAP, evbuffer_expand(hreq->reply, 61));
-  CHECK_ERR(L_DAAP, evbuffer_expand(grouplist, 1024));
-  CHECK_ERR(L_DAAP, evbuffer_expand(group, 128));
+  list->item_add = groups_item_add;
+  CHECK_NULL(L_DAAP, list->item = evbuffer_new());
+  CHECK_ERR(L_DAAP, evbuffer_expand(list->item, 128));
 
   param = evhttp_find_header(hreq->query, "meta");
   if (!param)
@@ -1674,162 +2056,19 @@ daap_reply_groups(struct httpd_request *hreq)
       param = default_meta_group;
     }
 
-  nmeta = parse_meta(&meta, param);
-  if (nmeta < 0)
+  list->nmeta = parse_meta(&list->meta, param);
+  if (list->nmeta < 0)
     {
       DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
 
-      dmap_error_make(hreq->reply, tag, "Failed to parse query");
-      goto error;
-    }
-
-  ret = db_query_start(&qp);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_DAAP, "Could not start query\n");
-
-      dmap_error_make(hreq->reply, tag, "Could not start query");
+      dmap_error_make(hreq->reply, list->tag, "Failed to parse query");
       goto error;
     }
 
-  ngrp = 0;
-  while ((ret = db_query_fetch_group(&dbgri, &qp)) == 0)
-    {
-      /* Don't add item if no name (eg blank album name) */
-      if (strlen(dbgri.itemname) == 0)
-	continue;
-
-      /* Don't add single item albums/artists if configured to hide */
-      lib = cfg_getsec(cfg, "library");
-      if (cfg_getbool(lib, "hide_singles") && (strcmp(dbgri.itemcount, "1") == 0))
-	continue;
-
-      ngrp++;
-
-      for (i = 0; i < nmeta; i++)
-	{
-	  df = meta[i];
-	  if (!df)
-	    continue;
-
-	  dfm = df->dfm;
-
-	  /* dmap.itemcount - always added */
-	  if (dfm == &dfm_dmap_mimc)
-	    continue;
-
-	  /* Not in struct group_info */
-	  if (dfm->gri_offset < 0)
-	    continue;
-
-          strval = (char **) ((char *)&dbgri + dfm->gri_offset);
-
-          if (!(*strval) || (**strval == '\0'))
-            continue;
-
-	  dmap_add_field(group, df, *strval, 0);
-
-	  DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
-	}
-
-      if (sort_headers)
-	{
-	  ret = daap_sort_build(sctx, dbgri.itemname_sort);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP groups reply\n");
-
-	      ret = -100;
-	      break;
-	    }
-	}
-
-      /* Item count, always added (mimc) */
-      val = 0;
-      ret = safe_atoi32(dbgri.itemcount, &val);
-      if ((ret == 0) && (val > 0))
-	dmap_add_int(group, "mimc", val);
-
-      /* Song album artist (asaa), always added if group-type is albums  */
-      if (qp.type == Q_GROUP_ALBUMS)
-        dmap_add_string(group, "asaa", dbgri.songalbumartist);
-
-      /* Item id (miid) */
-      val = 0;
-      ret = safe_atoi32(dbgri.id, &val);
-      if ((ret == 0) && (val > 0))
-	dmap_add_int(group, "miid", val);
-
-      DPRINTF(E_SPAM, L_DAAP, "Done with group\n");
-
-      len = evbuffer_get_length(group);
-      dmap_add_container(grouplist, "mlit", len);
-      ret = evbuffer_add_buffer(grouplist, group);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DAAP, "Could not add group to group list for DAAP groups reply\n");
-
-	  ret = -100;
-	  break;
-	}
-    }
-
-  db_query_end(&qp);
-
-  DPRINTF(E_DBG, L_DAAP, "Done with group list, %d groups\n", ngrp);
-
-  if (ret == -100)
-    {
-      dmap_error_make(hreq->reply, tag, "Out of memory");
-      goto error;
-    }
-  else if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_DAAP, "Error fetching results\n");
-      dmap_error_make(hreq->reply, tag, "Error fetching query results");
-      goto error;
-    }
-
-  /* Add header to evbuf, add grouplist to evbuf */
-  len = evbuffer_get_length(grouplist);
-  if (sort_headers)
-    {
-      daap_sort_finalize(sctx);
-      dmap_add_container(hreq->reply, tag, len + evbuffer_get_length(sctx->headerlist) + 61);
-    }
-  else
-    dmap_add_container(hreq->reply, tag, len + 53);
-
-  dmap_add_int(hreq->reply, "mstt", 200);        /* 12 */
-  dmap_add_char(hreq->reply, "muty", 0);         /* 9 */
-  dmap_add_int(hreq->reply, "mtco", qp.results); /* 12 */
-  dmap_add_int(hreq->reply,"mrco", ngrp);        /* 12 */
-  dmap_add_container(hreq->reply, "mlcl", len);  /* 8 */
-
-  CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, grouplist));
-
-  if (sort_headers)
-    {
-      len = evbuffer_get_length(sctx->headerlist);
-      dmap_add_container(hreq->reply, "mshl", len); /* 8 */
-
-      CHECK_ERR(L_DAAP, evbuffer_add_buffer(hreq->reply, sctx->headerlist));
-    }
-
-  free(meta);
-  daap_sort_context_free(sctx);
-  evbuffer_free(group);
-  evbuffer_free(grouplist);
-  free_query_params(&qp, 1);
-
-  return DAAP_REPLY_OK;
+  return daap_reply_list(hreq, list);
 
  error:
-  free(meta);
-  daap_sort_context_free(sctx);
-  evbuffer_free(group);
-  evbuffer_free(grouplist);
-  free_query_params(&qp, 1);
+  daap_list_free(list);
 
   return DAAP_REPLY_ERROR;
 }
@@ -2229,6 +2468,8 @@ static struct httpd_uri_map daap_handlers[] =
     }
   };
 
+static struct httpd_router *daap_router;
+
 
 /* ------------------------------- DAAP API --------------------------------- */
 
@@ -2252,7 +2493,7 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   DPRINTF(E_DBG, L_DAAP, "DAAP request: '%s'\n", uri_parsed->uri);
 
-  hreq = httpd_request_parse(req, uri_parsed, NULL, daap_handlers);
+  hreq = httpd_request_parse(req, uri_parsed, NULL, daap_router);
   if (!hreq)
     {
       DPRINTF(E_LOG, L_DAAP, "Unrecognized path '%s' in DAAP request: '%s'\n", uri_parsed->path, uri_parsed->uri);
@@ -2324,7 +2565,7 @@ daap_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   DPRINTF(E_DBG, L_DAAP, "DAAP request handled in %d milliseconds\n", msec);
 
-  if (ret == DAAP_REPLY_OK && msec > cache_daap_threshold() && hreq->user_agent)
+  if ((ret == DAAP_REPLY_OK || ret == DAAP_REPLY_OK_STREAMED) && msec > cache_daap_threshold() && hreq->user_agent)
     cache_daap_add(uri_parsed->uri, hreq->user_agent, ((struct daap_session *)hreq->extra_data)->is_remote, msec);
 
   evbuffer_free(hreq->reply);
@@ -2390,7 +2631,7 @@ daap_reply_build(const char *uri, const char *user_agent, int is_remote)
   if (!uri_parsed)
     return NULL;
 
-  hreq = httpd_request_parse(NULL, uri_parsed, user_agent, daap_handlers);
+  hreq = httpd_request_parse(NULL, uri_parsed, user_agent, daap_router);
   if (!hreq)
     {
       DPRINTF(E_LOG, L_DAAP, "Cannot build reply, unrecognized path '%s' in request: '%s'\n", uri_parsed->path, uri_parsed->uri);
@@ -2424,24 +2665,15 @@ daap_reply_build(const char *uri, const char *user_agent, int is_remote)
 int
 daap_init(void)
 {
-  char buf[64];
-  int i;
-  int ret;
-
   srand((unsigned)time(NULL));
   current_rev = 2;
   update_requests = NULL;
 
-  for (i = 0; daap_handlers[i].handler; i++)
+  daap_router = httpd_router_new(daap_handlers);
+  if (!daap_router)
     {
-      ret = regcomp(&daap_handlers[i].preg, daap_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
-      if (ret != 0)
-        {
-          regerror(ret, &daap_handlers[i].preg, buf, sizeof(buf));
-
-          DPRINTF(E_FATAL, L_DAAP, "DAAP init failed; regexp error: %s\n", buf);
-	  return -1;
-        }
+      DPRINTF(E_FATAL, L_DAAP, "DAAP init failed; could not compile routes\n");
+      return -1;
     }
 
   return 0;
@@ -2453,10 +2685,8 @@ daap_deinit(void)
   struct daap_session *s;
   struct daap_update_request *ur;
   struct evhttp_connection *evcon;
-  int i;
 
-  for (i = 0; daap_handlers[i].handler; i++)
-    regfree(&daap_handlers[i].preg);
+  httpd_router_free(daap_router);
 
   for (s = daap_sessions; daap_sessions; s = daap_sessions)
     {
@@ -2471,7 +2701,7 @@ daap_deinit(void)
       evcon = evhttp_request_get_connection(ur->req);
       if (evcon)
 	{
-	  evhttp_connection_set_closecb(evcon, NULL, NULL);
+	  httpd_connection_set_closecb(evcon, NULL, NULL);
 	  evhttp_connection_free(evcon);
 	}
 
@@ -755,7 +755,7 @@ playstatusupdate_cb(int fd, short what, void *arg)
 
       evcon = evhttp_request_get_connection(ur->req);
       if (evcon)
-	evhttp_connection_set_closecb(evcon, NULL, NULL);
+	httpd_connection_set_closecb(evcon, NULL, NULL);
 
       // Only copy buffer if we actually need to reuse it
       if (ur->next)
@@ -811,7 +811,7 @@ update_fail_cb(struct evhttp_connection *evcon, void *arg)
 
   evc = evhttp_request_get_connection(ur->req);
   if (evc)
-    evhttp_connection_set_closecb(evc, NULL, NULL);
+    httpd_connection_set_closecb(evc, NULL, NULL);
 
   if (ur == update_requests)
     update_requests = ur->next;
@@ -2298,7 +2298,7 @@ dacp_reply_playstatusupdate(struct httpd_request *hreq)
   evcon = evhttp_request_get_connection(hreq->req);
   if (evcon)
     {
-      evhttp_connection_set_closecb(evcon, update_fail_cb, ur);
+      httpd_connection_set_closecb(evcon, update_fail_cb, ur);
 
       // This is a workaround for some versions of libevent (2.0, but possibly
       // also 2.1) that don't detect if the client hangs up, and thus don't
@@ -2848,6 +2848,8 @@ static struct httpd_uri_map dacp_handlers[] =
     }
   };
 
+static struct httpd_router *dacp_router;
+
 
 /* ------------------------------- DACP API --------------------------------- */
 
@@ -2859,7 +2861,7 @@ dacp_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   DPRINTF(E_DBG, L_DACP, "DACP request: '%s'\n", uri_parsed->uri);
 
-  hreq = httpd_request_parse(req, uri_parsed, NULL, dacp_handlers);
+  hreq = httpd_request_parse(req, uri_parsed, NULL, dacp_router);
   if (!hreq)
     {
       DPRINTF(E_LOG, L_DACP, "Unrecognized path '%s' in DACP request: '%s'\n", uri_parsed->path, uri_parsed->uri);
@@ -2895,8 +2897,6 @@ dacp_is_request(const char *path)
 int
 dacp_init(void)
 {
-  char buf[64];
-  int i;
   int ret;
 
   current_rev = 2;
@@ -2936,16 +2936,11 @@ dacp_init(void)
     }
 #endif /* HAVE_EVENTFD */
 
-  for (i = 0; dacp_handlers[i].handler; i++)
+  dacp_router = httpd_router_new(dacp_handlers);
+  if (!dacp_router)
     {
-      ret = regcomp(&dacp_handlers[i].preg, dacp_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
-      if (ret != 0)
-        {
-          regerror(ret, &dacp_handlers[i].preg, buf, sizeof(buf));
-
-          DPRINTF(E_FATAL, L_DACP, "DACP init failed; regexp error: %s\n", buf);
-	  goto regexp_fail;
-        }
+      DPRINTF(E_FATAL, L_DACP, "DACP init failed; could not compile routes\n");
+      goto regexp_fail;
     }
 
 #ifdef HAVE_EVENTFD
@@ -2988,14 +2983,12 @@ dacp_deinit(void)
 {
   struct dacp_update_request *ur;
   struct evhttp_connection *evcon;
-  int i;
 
   listener_remove(dacp_playstatus_update_handler);
 
   event_free(seek_timer);
 
-  for (i = 0; dacp_handlers[i].handler; i++)
-    regfree(&dacp_handlers[i].preg);
+  httpd_router_free(dacp_router);
 
   for (ur = update_requests; update_requests; ur = update_requests)
     {
@@ -3004,7 +2997,7 @@ dacp_deinit(void)
       evcon = evhttp_request_get_connection(ur->req);
       if (evcon)
 	{
-	  evhttp_connection_set_closecb(evcon, NULL, NULL);
+	  httpd_connection_set_closecb(evcon, NULL, NULL);
 	  evhttp_connection_free(evcon);
 	}
 
@@ -48,6 +48,7 @@
 # include "lastfm.h"
 #endif
 #include "library.h"
+#include "listener.h"
 #include "logger.h"
 #include "misc.h"
 #include "misc_json.h"
@@ -67,14 +68,23 @@ static char *default_playlist_directory;
 
 /* -------------------------------- HELPERS --------------------------------- */
 
+// The ETag is the timestamp plus the in-process write counter of the key, the
+// latter so that two library changes within a second don't give the same ETag
 static bool
 is_modified(struct evhttp_request *req, const char *key)
 {
-  int64_t db_update = 0;
+  int64_t db_update;
+  uint32_t serial;
+  char etag[64];
+  int ret;
+
+  ret = db_admin_getversion(&db_update, &serial, key);
+  if (ret < 0 || !db_update)
+    return true;
 
-  db_admin_getint64(&db_update, key);
+  snprintf(etag, sizeof(etag), "\"%" PRIi64 "-%" PRIu32 "\"", db_update, serial);
 
-  return (!db_update || !httpd_request_not_modified_since(req, (time_t)db_update));
+  return !httpd_request_not_modified(req, etag, (time_t)db_update);
 }
 
 static inline void
@@ -874,6 +884,90 @@ jsonapi_reply_config(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+static int
+jsonapi_reply_httpd_stats(struct httpd_request *hreq)
+{
+  struct httpd_stats *stats;
+  struct httpd_route_stats *rs;
+  json_object *jreply;
+  json_object *jconnections;
+  json_object *jroutes;
+  json_object *jroute;
+  json_object *jlatency;
+  json_object *jbucket;
+  json_object *jclients;
+  json_object *jclient;
+  json_object *jrequests;
+  int i;
+  int j;
+
+  CHECK_NULL(L_WEB, stats = malloc(sizeof(struct httpd_stats)));
+  httpd_stats_get(stats);
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+
+  jconnections = json_object_new_object();
+  json_object_object_add(jconnections, "total", json_object_new_int64(stats->connections));
+  json_object_object_add(jconnections, "active", json_object_new_int(stats->connections_active));
+  json_object_object_add(jconnections, "rejected", json_object_new_int64(stats->connections_rejected));
+  json_object_object_add(jconnections, "requests_reused", json_object_new_int64(stats->requests_reused));
+  json_object_object_add(jreply, "connections", jconnections);
+
+  jroutes = json_object_new_object();
+  for (i = 0; i < HTTPD_ROUTE_MAX; i++)
+    {
+      rs = &stats->routes[i];
+
+      jroute = json_object_new_object();
+      json_object_object_add(jroute, "requests", json_object_new_int64(rs->requests));
+      json_object_object_add(jroute, "errors", json_object_new_int64(rs->errors));
+      json_object_object_add(jroute, "aborted", json_object_new_int64(rs->aborted));
+      json_object_object_add(jroute, "in_flight", json_object_new_int(rs->in_flight));
+      json_object_object_add(jroute, "msec_total", json_object_new_int64(rs->msec_total));
+
+      // Each bucket counts the requests that took less than lt_ms, the last has the rest
+      jlatency = json_object_new_array();
+      for (j = 0; j < HTTPD_STATS_BUCKETS; j++)
+	{
+	  jbucket = json_object_new_object();
+	  if (j < HTTPD_STATS_BUCKETS - 1)
+	    json_object_object_add(jbucket, "lt_ms", json_object_new_int(httpd_stats_bucket_msec[j]));
+	  json_object_object_add(jbucket, "count", json_object_new_int64(rs->latency[j]));
+	  json_object_array_add(jlatency, jbucket);
+	}
+      json_object_object_add(jroute, "latency", jlatency);
+
+      json_object_object_add(jroutes, httpd_route_class_names[i], jroute);
+    }
+  json_object_object_add(jreply, "routes", jroutes);
+
+  jclients = json_object_new_array();
+  for (i = 0; i < stats->nclients; i++)
+    {
+      jclient = json_object_new_object();
+      json_object_object_add(jclient, "user_agent", json_object_new_string(stats->clients[i].user_agent));
+
+      jrequests = json_object_new_object();
+      for (j = 0; j < HTTPD_ROUTE_MAX; j++)
+	{
+	  if (stats->clients[i].requests[j] > 0)
+	    json_object_object_add(jrequests, httpd_route_class_names[j], json_object_new_int64(stats->clients[i].requests[j]));
+	}
+      json_object_object_add(jclient, "requests", jrequests);
+
+      json_object_array_add(jclients, jclient);
+    }
+  json_object_object_add(jreply, "clients", jclients);
+
+  free(stats);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
+
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
 static json_object *
 option_get_json(struct settings_option *option)
 {
@@ -1164,6 +1258,49 @@ jsonapi_reply_settings_option_delete(struct httpd_request *hreq)
   return HTTP_NOCONTENT;
 }
 
+static json_object *
+scan_stats_to_json(struct library_scan_stats *stats)
+{
+  json_object *jscan;
+  json_object *jstages;
+  char timestamp[32];
+  double files_per_sec;
+  int64_t eta;
+
+  jscan = json_object_new_object();
+
+  snprintf(timestamp, sizeof(timestamp), "%" PRIi64, (int64_t)stats->started_at);
+  safe_json_add_time_from_string(jscan, "started_at", timestamp);
+
+  files_per_sec = (stats->elapsed_ms > 0) ? (1000.0 * stats->files_scanned / stats->elapsed_ms) : 0;
+
+  // Estimate based on the number of files in the library before the scan
+  eta = -1;
+  if (stats->active && files_per_sec > 0 && stats->files_expected > stats->files_scanned)
+    eta = (stats->files_expected - stats->files_scanned) / files_per_sec;
+  else if (stats->active && files_per_sec > 0)
+    eta = 0;
+
+  json_object_object_add(jscan, "active", json_object_new_boolean(stats->active));
+  json_object_object_add(jscan, "elapsed_ms", json_object_new_int64(stats->elapsed_ms));
+  json_object_object_add(jscan, "files_scanned", json_object_new_int64(stats->files_scanned));
+  json_object_object_add(jscan, "files_expected", json_object_new_int64(stats->files_expected));
+  json_object_object_add(jscan, "files_per_sec", json_object_new_double(files_per_sec));
+  json_object_object_add(jscan, "bytes_read", json_object_new_int64(stats->bytes_read));
+  if (eta >= 0)
+    json_object_object_add(jscan, "eta", json_object_new_int64(eta));
+
+  jstages = json_object_new_object();
+  json_object_object_add(jstages, "readdir_ms", json_object_new_int64(stats->stage_usec[LIBRARY_SCAN_STAGE_READDIR] / 1000));
+  json_object_object_add(jstages, "stat_ms", json_object_new_int64(stats->stage_usec[LIBRARY_SCAN_STAGE_STAT] / 1000));
+  json_object_object_add(jstages, "probe_ms", json_object_new_int64(stats->stage_usec[LIBRARY_SCAN_STAGE_PROBE] / 1000));
+  json_object_object_add(jstages, "db_ms", json_object_new_int64(stats->stage_usec[LIBRARY_SCAN_STAGE_DB] / 1000));
+  json_object_object_add(jstages, "playlist_ms", json_object_new_int64(stats->stage_usec[LIBRARY_SCAN_STAGE_PLAYLIST] / 1000));
+  json_object_object_add(jscan, "stages", jstages);
+
+  return jscan;
+}
+
 /*
  * Endpoint to retrieve informations about the library
  *
@@ -1187,6 +1324,7 @@ jsonapi_reply_library(struct httpd_request *hreq)
   char *s;
   int i;
   struct library_source **sources;
+  struct library_scan_stats scan_stats;
   json_object *jscanners;
   json_object *jsource;
 
@@ -1225,6 +1363,10 @@ jsonapi_reply_library(struct httpd_request *hreq)
 
   json_object_object_add(jreply, "updating", json_object_new_boolean(library_is_scanning()));
 
+  library_scan_stats_get(&scan_stats);
+  if (scan_stats.started_at)
+    json_object_object_add(jreply, "scan", scan_stats_to_json(&scan_stats));
+
   jscanners = json_object_new_array();
   json_object_object_add(jreply, "scanners", jscanners);
   sources = library_sources();
@@ -1591,13 +1733,7 @@ jsonapi_reply_outputs_get_byid(struct httpd_request *hreq)
   json_object *jreply;
   int ret;
 
-  ret = safe_atou64(hreq->uri_parsed->path_parts[2], &output_id);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_WEB, "No valid output id given to outputs endpoint '%s'\n", hreq->uri_parsed->path);
-
-      return HTTP_BADREQUEST;
-    }
+  output_id = hreq->path_num[0];
 
   ret = player_speaker_get_byid(&speaker_info, output_id);
 
@@ -1630,13 +1766,7 @@ jsonapi_reply_outputs_put_byid(struct httpd_request *hreq)
   const char *pin;
   int ret;
 
-  ret = safe_atou64(hreq->uri_parsed->path_parts[2], &output_id);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_WEB, "No valid output id given to outputs endpoint '%s'\n", hreq->uri_parsed->path);
-
-      return HTTP_BADREQUEST;
-    }
+  output_id = hreq->path_num[0];
 
   in_evbuf = evhttp_request_get_input_buffer(hreq->req);
   request = jparse_obj_from_evbuffer(in_evbuf);
@@ -1689,13 +1819,7 @@ jsonapi_reply_outputs_toggle_byid(struct httpd_request *hreq)
   struct player_speaker_info spk;
   int ret;
 
-  ret = safe_atou64(hreq->uri_parsed->path_parts[2], &output_id);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_WEB, "No valid output id given to outputs endpoint '%s'\n", hreq->uri_parsed->path);
-
-      return HTTP_BADREQUEST;
-    }
+  output_id = hreq->path_num[0];
 
   ret = player_speaker_get_byid(&spk, output_id);
   if (ret < 0)
@@ -2073,8 +2197,8 @@ jsonapi_reply_player_seek(struct httpd_request *hreq)
   return HTTP_NOCONTENT;
 }
 
-static int
-jsonapi_reply_player(struct httpd_request *hreq)
+static json_object *
+player_to_json(void)
 {
   struct player_status status;
   struct db_queue_item *queue_item;
@@ -2144,6 +2268,16 @@ jsonapi_reply_player(struct httpd_request *hreq)
 	}
     }
 
+  return reply;
+}
+
+static int
+jsonapi_reply_player(struct httpd_request *hreq)
+{
+  json_object *reply;
+
+  reply = player_to_json();
+
   CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply)));
 
   jparse_free(reply);
@@ -2684,7 +2818,9 @@ jsonapi_reply_queue(struct httpd_request *hreq)
   uint32_t item_id;
   uint32_t count;
   int start_pos, end_pos;
-  int version = 0;
+  int64_t version64;
+  uint32_t serial;
+  int version;
   char etag[21];
   struct player_status status;
   struct db_queue_item queue_item;
@@ -2693,13 +2829,16 @@ jsonapi_reply_queue(struct httpd_request *hreq)
   json_object *item;
   int ret = 0;
 
-  db_admin_getint(&version, DB_ADMIN_QUEUE_VERSION);
-  db_queue_get_count(&count);
+  ret = db_admin_getversion(&version64, &serial, DB_ADMIN_QUEUE_VERSION);
+  version = (ret == 0) ? (int)version64 : 0;
+  ret = 0;
 
   snprintf(etag, sizeof(etag), "%d", version);
   if (httpd_request_etag_matches(hreq->req, etag))
     return HTTP_NOTMODIFIED;
 
+  db_queue_get_count(&count);
+
   memset(&query_params, 0, sizeof(struct query_params));
   reply = json_object_new_object();
 
@@ -4123,6 +4262,9 @@ jsonapi_reply_library_files(struct httpd_request *hreq)
   int total;
   int ret;
 
+  if (!is_modified(hreq->req, DB_ADMIN_DB_MODIFIED))
+    return HTTP_NOTMODIFIED;
+
   param = evhttp_find_header(hreq->query, "directory");
 
   directory_id = DIR_FILE;
@@ -4551,6 +4693,10 @@ jsonapi_reply_search(struct httpd_request *hreq)
       }
     }
 
+  // Expressions may contain relative dates, so only plain queries are cachable
+  if (!param_expression && !is_modified(hreq->req, DB_ADMIN_DB_MODIFIED))
+    return HTTP_NOTMODIFIED;
+
   memset(&smartpl_expression, 0, sizeof(struct smartpl));
 
   if (param_expression)
@@ -4636,6 +4782,7 @@ jsonapi_reply_library_backup(struct httpd_request *hreq)
 static struct httpd_uri_map adm_handlers[] =
   {
     { EVHTTP_REQ_GET,    "^/api/config$",                                jsonapi_reply_config },
+    { EVHTTP_REQ_GET,    "^/api/httpd/stats$",                           jsonapi_reply_httpd_stats },
     { EVHTTP_REQ_GET,    "^/api/settings$",                              jsonapi_reply_settings_get },
     { EVHTTP_REQ_GET,    "^/api/settings/[A-Za-z0-9_]+$",                jsonapi_reply_settings_category_get },
     { EVHTTP_REQ_GET,    "^/api/settings/[A-Za-z0-9_]+/[A-Za-z0-9_]+$",  jsonapi_reply_settings_option_get },
@@ -4713,36 +4860,25 @@ static struct httpd_uri_map adm_handlers[] =
     { 0, NULL, NULL }
   };
 
+static struct httpd_router *adm_router;
+
 
 /* ------------------------------- JSON API --------------------------------- */
 
-void
-jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
+/* Thread: httpd worker */
+static void
+jsonapi_request_handle(struct httpd_request *hreq)
 {
-  struct httpd_request *hreq;
+  struct evhttp_request *req = hreq->req;
   struct evkeyvalq *headers;
   int status_code;
 
-  DPRINTF(E_DBG, L_WEB, "JSON api request: '%s'\n", uri_parsed->uri);
-
-  if (!httpd_admin_check_auth(req))
-    return;
-
-  hreq = httpd_request_parse(req, uri_parsed, NULL, adm_handlers);
-  if (!hreq)
-    {
-      DPRINTF(E_LOG, L_WEB, "Unrecognized path '%s' in JSON api request: '%s'\n", uri_parsed->path, uri_parsed->uri);
-
-      httpd_send_error(req, HTTP_BADREQUEST, "Bad Request");
-      return;
-    }
-
   CHECK_NULL(L_WEB, hreq->reply = evbuffer_new());
 
   status_code = hreq->handler(hreq);
 
   if (status_code >= 400)
-    DPRINTF(E_LOG, L_WEB, "JSON api request failed with error code %d (%s)\n", status_code, uri_parsed->uri);
+    DPRINTF(E_LOG, L_WEB, "JSON api request failed with error code %d (%s)\n", status_code, hreq->uri_parsed->uri);
 
   switch (status_code)
     {
@@ -4780,6 +4916,29 @@ jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
   free(hreq);
 }
 
+void
+jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
+{
+  struct httpd_request *hreq;
+
+  DPRINTF(E_DBG, L_WEB, "JSON api request: '%s'\n", uri_parsed->uri);
+
+  if (!httpd_admin_check_auth(req))
+    return;
+
+  hreq = httpd_request_parse(req, uri_parsed, NULL, adm_router);
+  if (!hreq)
+    {
+      DPRINTF(E_LOG, L_WEB, "Unrecognized path '%s' in JSON api request: '%s'\n", uri_parsed->path, uri_parsed->uri);
+
+      httpd_send_error(req, HTTP_BADREQUEST, "Bad Request");
+      return;
+    }
+
+  // Library queries can take a while, so don't block the httpd thread
+  httpd_request_dispatch(hreq, jsonapi_request_handle);
+}
+
 int
 jsonapi_is_request(const char *path)
 {
@@ -4791,24 +4950,51 @@ jsonapi_is_request(const char *path)
   return 0;
 }
 
+json_object *
+jsonapi_state_get(short event)
+{
+  json_object *state;
+  json_object *outputs;
+  int64_t version;
+  uint32_t serial;
+  uint32_t count;
+  int ret;
+
+  switch (event)
+    {
+      case LISTENER_PLAYER:
+	return player_to_json();
+
+      case LISTENER_SPEAKER:
+	outputs = json_object_new_array();
+	player_speaker_enumerate(speaker_enum_cb, outputs);
+	return outputs;
+
+      case LISTENER_QUEUE:
+	ret = db_admin_getversion(&version, &serial, DB_ADMIN_QUEUE_VERSION);
+	if (ret < 0 || db_queue_get_count(&count) < 0)
+	  return NULL;
+
+	state = json_object_new_object();
+	json_object_object_add(state, "version", json_object_new_int((int)version));
+	json_object_object_add(state, "count", json_object_new_int((int)count));
+	return state;
+
+      default:
+	return NULL;
+    }
+}
+
 int
 jsonapi_init(void)
 {
-  char buf[64];
   char *temp_path;
-  int i;
-  int ret;
 
-  for (i = 0; adm_handlers[i].handler; i++)
+  adm_router = httpd_router_new(adm_handlers);
+  if (!adm_router)
     {
-      ret = regcomp(&adm_handlers[i].preg, adm_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
-      if (ret != 0)
-	{
-	  regerror(ret, &adm_handlers[i].preg, buf, sizeof(buf));
-
-	  DPRINTF(E_FATAL, L_WEB, "JSON api init failed; regexp error: %s\n", buf);
-	  return -1;
-	}
+      DPRINTF(E_FATAL, L_WEB, "JSON api init failed; could not compile routes\n");
+      return -1;
     }
 
   default_playlist_directory = NULL;
@@ -4840,10 +5026,7 @@ jsonapi_init(void)
 void
 jsonapi_deinit(void)
 {
-  int i;
-
-  for (i = 0; adm_handlers[i].handler; i++)
-    regfree(&adm_handlers[i].preg);
+  httpd_router_free(adm_router);
 
   free(default_playlist_directory);
 }
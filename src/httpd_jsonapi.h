@@ -2,6 +2,8 @@
 #ifndef __HTTPD_JSONAPI_H__
 #define __HTTPD_JSONAPI_H__
 
+#include <json.h>
+
 #include "httpd.h"
 
 int
@@ -16,4 +18,14 @@ jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 int
 jsonapi_is_request(const char *path);
 
+/*
+ * Returns the current state for a listener event, as pushed to websocket
+ * clients: the /api/player reply for LISTENER_PLAYER, the outputs array of
+ * /api/outputs for LISTENER_SPEAKER and the version and count of /api/queue for
+ * LISTENER_QUEUE. Returns NULL for other events or on error. Must not be called
+ * from the player thread, caller must free the result with jparse_free().
+ */
+json_object *
+jsonapi_state_get(short event);
+
 #endif /* !__HTTPD_JSONAPI_H__ */
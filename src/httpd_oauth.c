@@ -87,6 +87,8 @@ static struct httpd_uri_map oauth_handlers[] =
     }
   };
 
+static struct httpd_router *oauth_router;
+
 
 /* ------------------------------- OAUTH API -------------------------------- */
 
@@ -97,7 +99,7 @@ oauth_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   DPRINTF(E_LOG, L_WEB, "OAuth request: '%s'\n", uri_parsed->uri);
 
-  hreq = httpd_request_parse(req, uri_parsed, NULL, oauth_handlers);
+  hreq = httpd_request_parse(req, uri_parsed, NULL, oauth_router);
   if (!hreq)
     {
       DPRINTF(E_LOG, L_WEB, "Unrecognized path '%s' in OAuth request: '%s'\n", uri_parsed->path, uri_parsed->uri);
@@ -125,20 +127,11 @@ oauth_is_request(const char *path)
 int
 oauth_init(void)
 {
-  char buf[64];
-  int i;
-  int ret;
-
-  for (i = 0; oauth_handlers[i].handler; i++)
+  oauth_router = httpd_router_new(oauth_handlers);
+  if (!oauth_router)
     {
-      ret = regcomp(&oauth_handlers[i].preg, oauth_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
-      if (ret != 0)
-        {
-          regerror(ret, &oauth_handlers[i].preg, buf, sizeof(buf));
-
-          DPRINTF(E_FATAL, L_WEB, "OAuth init failed; regexp error: %s\n", buf);
-	  return -1;
-        }
+      DPRINTF(E_FATAL, L_WEB, "OAuth init failed; could not compile routes\n");
+      return -1;
     }
 
   return 0;
@@ -147,8 +140,5 @@ oauth_init(void)
 void
 oauth_deinit(void)
 {
-  int i;
-
-  for (i = 0; oauth_handlers[i].handler; i++)
-    regfree(&oauth_handlers[i].preg);
+  httpd_router_free(oauth_router);
 }
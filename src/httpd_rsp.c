@@ -860,9 +860,20 @@ static struct httpd_uri_map rsp_handlers[] =
     }
   };
 
+static struct httpd_router *rsp_router;
+
 
 /* -------------------------------- RSP API --------------------------------- */
 
+/* Thread: httpd worker */
+static void
+rsp_request_handle(struct httpd_request *hreq)
+{
+  hreq->handler(hreq);
+
+  free(hreq);
+}
+
 void
 rsp_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 {
@@ -871,7 +882,7 @@ rsp_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 
   DPRINTF(E_DBG, L_RSP, "RSP request: '%s'\n", uri_parsed->uri);
 
-  hreq = httpd_request_parse(req, uri_parsed, NULL, rsp_handlers);
+  hreq = httpd_request_parse(req, uri_parsed, NULL, rsp_router);
   if (!hreq)
     {
       DPRINTF(E_LOG, L_RSP, "Unrecognized path '%s' in RSP request: '%s'\n", uri_parsed->path, uri_parsed->uri);
@@ -888,9 +899,11 @@ rsp_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
       return;
     }
 
-  hreq->handler(hreq);
-
-  free(hreq);
+  // Streaming is driven by httpd's event loop, the rest can go to a worker
+  if (hreq->handler == rsp_stream)
+    rsp_request_handle(hreq);
+  else
+    httpd_request_dispatch(hreq, rsp_request_handle);
 }
 
 int
@@ -905,22 +918,13 @@ rsp_is_request(const char *path)
 int
 rsp_init(void)
 {
-  char buf[64];
-  int i;
-  int ret;
-
   snprintf(rsp_filter_files, sizeof(rsp_filter_files), "f.data_kind = %d", DATA_KIND_FILE);
 
-  for (i = 0; rsp_handlers[i].handler; i++)
+  rsp_router = httpd_router_new(rsp_handlers);
+  if (!rsp_router)
     {
-      ret = regcomp(&rsp_handlers[i].preg, rsp_handlers[i].regexp, REG_EXTENDED | REG_NOSUB);
-      if (ret != 0)
-        {
-          regerror(ret, &rsp_handlers[i].preg, buf, sizeof(buf));
-
-          DPRINTF(E_FATAL, L_RSP, "RSP init failed; regexp error: %s\n", buf);
-	  return -1;
-        }
+      DPRINTF(E_FATAL, L_RSP, "RSP init failed; could not compile routes\n");
+      return -1;
     }
 
   return 0;
@@ -929,8 +933,5 @@ rsp_init(void)
 void
 rsp_deinit(void)
 {
-  int i;
-
-  for (i = 0; rsp_handlers[i].handler; i++)
-    regfree(&rsp_handlers[i].preg);
+  httpd_router_free(rsp_router);
 }
@@ -177,7 +177,7 @@ streaming_end(void)
       evcon = evhttp_request_get_connection(session->req);
       if (evcon)
 	{
-	  evhttp_connection_set_closecb(evcon, NULL, NULL);
+	  httpd_connection_set_closecb(evcon, NULL, NULL);
 	  evhttp_connection_get_peer(evcon, &address, &port);
 	  DPRINTF(E_INFO, L_STREAMING, "Force close stream to %s:%d\n", address, (int)port);
 	}
@@ -599,7 +599,7 @@ streaming_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parse
 
   pthread_mutex_unlock(&streaming_sessions_lck);
 
-  evhttp_connection_set_closecb(evcon, streaming_close_cb, session);
+  httpd_connection_set_closecb(evcon, streaming_close_cb, session);
 
   return 0;
 }
@@ -37,6 +37,7 @@
 #include "logger.h"
 #include "conffile.h"
 #include "commands.h"
+#include "worker.h"
 #include "input.h"
 
 // Disallow further writes to the buffer when its size exceeds this threshold.
@@ -123,6 +124,43 @@ struct input_arg
   int seek_ms;
 };
 
+enum prebuffer_state
+{
+  PREBUFFER_NONE,
+  // The next item is being set up by a worker thread
+  PREBUFFER_OPENING,
+  // The next item is set up, and we are reading from it (or have read enough)
+  PREBUFFER_OPEN,
+  // The next item can't be prebuffered, start() will set it up as usual
+  PREBUFFER_SKIPPED,
+};
+
+struct input_prebuffer
+{
+  // Queue item id that the player says it will read next, 0 if unknown
+  uint32_t item_id;
+
+  enum prebuffer_state state;
+
+  // Incremented when the prebuffer is discarded, so that the result of a setup
+  // that was started before is ignored
+  unsigned int generation;
+
+  // The next item, set up ahead of time when the current source is close to
+  // its end, so that start() doesn't have to open it
+  struct input_source source;
+
+  // The first seconds of decoded data from the next item, plus the quality and
+  // flags it was written with. Handed over to the input buffer by start().
+  struct evbuffer *evbuf;
+  struct media_quality quality;
+  short flags;
+
+  // Set while the input thread is reading from the next item, so that
+  // input_write() knows where to put the data
+  bool active;
+};
+
 /* --- Globals --- */
 // Input thread
 static pthread_t tid_input;
@@ -139,6 +177,19 @@ static struct input_source input_now_reading;
 // Input buffer
 static struct input_buffer input_buffer;
 
+// Position of input_now_reading, so we know when it is close to the end
+static int now_reading_start_ms;
+static uint64_t now_reading_written;
+
+// Look-ahead of the next item, see prebuffer_check()
+static struct input_prebuffer input_prebuffer;
+static struct event *prebuffer_ev;
+static int prebuffer_secs;
+static int prebuffer_lead_ms;
+
+// Protects cmdbase from being used by a prebuffer worker after input_deinit()
+static pthread_mutex_t prebuffer_lck = PTHREAD_MUTEX_INITIALIZER;
+
 // Timeout waiting in playback loop
 static struct timespec input_loop_timeout = { 0, INPUT_LOOP_TIMEOUT_NSEC };
 
@@ -381,7 +432,30 @@ flush(short *flagptr)
 }
 
 static void
-stop(void)
+prebuffer_discard(void)
+{
+  int type;
+
+  event_del(prebuffer_ev);
+
+  type = input_prebuffer.source.type;
+
+  if (inputs[type]->stop && input_prebuffer.source.open)
+    inputs[type]->stop(&input_prebuffer.source);
+
+  clear(&input_prebuffer.source);
+
+  input_prebuffer.state = PREBUFFER_NONE;
+  input_prebuffer.generation++;
+
+  evbuffer_drain(input_prebuffer.evbuf, evbuffer_get_length(input_prebuffer.evbuf));
+  memset(&input_prebuffer.quality, 0, sizeof(struct media_quality));
+  input_prebuffer.flags = 0;
+}
+
+// Stops reading the current source, but keeps what we have prebuffered
+static void
+stop_now_reading(void)
 {
   int type;
 
@@ -398,6 +472,14 @@ stop(void)
   clear(&input_now_reading);
 }
 
+static void
+stop(void)
+{
+  stop_now_reading();
+
+  prebuffer_discard();
+}
+
 static int
 seek(struct input_source *source, int seek_ms)
 {
@@ -468,6 +550,220 @@ setup(struct input_source *source, struct db_queue_item *queue_item, int seek_ms
   return -1;
 }
 
+static int
+prebuffer_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
+{
+  if (flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR))
+    input_prebuffer.source.open = false;
+
+  // Quality is written along with the data by start(), so no need for a flag
+  input_prebuffer.flags |= (flags & ~INPUT_FLAG_QUALITY);
+
+  if (!evbuf)
+    return 0;
+
+  if (quality)
+    input_prebuffer.quality = *quality;
+
+  return evbuffer_add_buffer(input_prebuffer.evbuf, evbuf);
+}
+
+static void
+prebuffer_cb(evutil_socket_t fd, short what, void *arg)
+{
+  struct timeval tv = { 0, 0 };
+  struct media_quality *quality = &input_prebuffer.source.quality;
+  size_t wanted;
+  int ret;
+
+  input_prebuffer.active = true;
+  ret = inputs[input_prebuffer.source.type]->play(&input_prebuffer.source);
+  input_prebuffer.active = false;
+  if (ret < 0)
+    {
+      input_prebuffer.source.open = false;
+      return; // Error or EOF, start() will pass it on
+    }
+
+  wanted = prebuffer_secs * STOB(quality->sample_rate, quality->bits_per_sample, quality->channels);
+  if (evbuffer_get_length(input_prebuffer.evbuf) >= wanted)
+    {
+      DPRINTF(E_DBG, L_PLAYER, "Prebuffered %zu bytes of next item '%s'\n", evbuffer_get_length(input_prebuffer.evbuf), input_prebuffer.source.path);
+      return;
+    }
+
+  event_add(prebuffer_ev, &tv);
+}
+
+struct prebuffer_setup
+{
+  unsigned int generation;
+  uint32_t item_id;
+  struct input_source source;
+};
+
+// Takes the result of prebuffer_setup_cb() and starts reading from the source
+static enum command_state
+prebuffer_ready(void *arg, int *retval)
+{
+  struct prebuffer_setup *cmdarg = arg;
+  struct input_source *source = &cmdarg->source;
+
+  // Discarded while the worker was busy, e.g. the player moved on
+  if (cmdarg->generation != input_prebuffer.generation)
+    {
+      if (inputs[source->type]->stop && source->open)
+	inputs[source->type]->stop(source);
+
+      clear(source);
+      *retval = 0;
+      return COMMAND_END;
+    }
+
+  if (!source->open)
+    {
+      input_prebuffer.state = PREBUFFER_SKIPPED;
+      *retval = 0;
+      return COMMAND_END;
+    }
+
+  DPRINTF(E_DBG, L_PLAYER, "Prebuffering next item '%s' (item id %" PRIu32 ")\n", source->path, source->item_id);
+
+  input_prebuffer.source = *source;
+  input_prebuffer.state = PREBUFFER_OPEN;
+
+  event_active(prebuffer_ev, 0, 0);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+// Worker thread. Opening a file or a stream can take seconds (network shares,
+// slow http servers), which would hold up reading the current source if done
+// by the input thread. Only files and http are set up, since pipes and Spotify
+// can't be opened early without side effects.
+static void
+prebuffer_setup_cb(void *arg)
+{
+  struct prebuffer_setup *job = arg;
+  struct prebuffer_setup *cmdarg;
+  struct db_queue_item *queue_item;
+  int type;
+  int ret;
+
+  CHECK_NULL(L_PLAYER, cmdarg = calloc(1, sizeof(struct prebuffer_setup)));
+  cmdarg->generation = job->generation;
+  cmdarg->item_id = job->item_id;
+
+  // Held while we use the backends, so input_deinit() can't deinit them under us
+  pthread_mutex_lock(&prebuffer_lck);
+  if (!input_initialized)
+    {
+      pthread_mutex_unlock(&prebuffer_lck);
+      free(cmdarg);
+      return;
+    }
+
+  queue_item = db_queue_fetch_byitemid(job->item_id);
+  if (queue_item)
+    {
+      type = map_data_kind(queue_item->data_kind);
+      if (type == INPUT_TYPE_FILE || type == INPUT_TYPE_HTTP)
+	setup(&cmdarg->source, queue_item, 0);
+
+      free_queue_item(queue_item, 0);
+    }
+
+  // The source is not open if setup failed or wasn't attempted
+  ret = commands_exec_async(cmdbase, prebuffer_ready, cmdarg);
+  if (ret < 0)
+    {
+      if (inputs[cmdarg->source.type]->stop && cmdarg->source.open)
+	inputs[cmdarg->source.type]->stop(&cmdarg->source);
+
+      clear(&cmdarg->source);
+      free(cmdarg);
+    }
+  pthread_mutex_unlock(&prebuffer_lck);
+}
+
+// Starts the look-ahead of the next item when the current source is within
+// prebuffer_lead_ms of its end, or when it has been read to the end (e.g. if
+// the length is unknown). The lead gives the worker time to set up the next
+// item while the input thread keeps reading the current one, and then the
+// input thread decodes the first prebuffer_secs of the next item, so it is
+// ready when the player asks for it.
+static void
+prebuffer_check(bool read_end)
+{
+  struct media_quality *quality = &input_buffer.cur_write_quality;
+  struct prebuffer_setup job = { 0 };
+  uint64_t pos_ms;
+  size_t one_sec_size;
+
+  if (prebuffer_secs <= 0 || input_prebuffer.item_id == 0 || input_prebuffer.state != PREBUFFER_NONE)
+    return;
+
+  if (!read_end)
+    {
+      one_sec_size = STOB(quality->sample_rate, quality->bits_per_sample, quality->channels);
+      if (input_now_reading.len_ms == 0 || one_sec_size == 0)
+	return;
+
+      pos_ms = now_reading_start_ms + now_reading_written * 1000 / one_sec_size;
+      if (pos_ms + prebuffer_lead_ms < input_now_reading.len_ms)
+	return;
+    }
+
+  input_prebuffer.state = PREBUFFER_OPENING;
+
+  job.generation = input_prebuffer.generation;
+  job.item_id = input_prebuffer.item_id;
+
+  worker_execute(prebuffer_setup_cb, &job, sizeof(struct prebuffer_setup), 0);
+}
+
+// If the requested item is the one we have prebuffered then it becomes
+// input_now_reading and the prebuffered data is moved to the input buffer.
+// Returns 0 in that case, otherwise the prebuffer is discarded and returns -1.
+static int
+prebuffer_takeover(uint32_t item_id, int seek_ms)
+{
+  struct media_quality *quality;
+  int ret;
+
+  // If the setup is still running we don't wait for it, start() will just set
+  // up the item itself
+  if (input_prebuffer.state != PREBUFFER_OPEN || input_prebuffer.source.item_id != item_id || seek_ms > 0)
+    {
+      prebuffer_discard();
+      return -1;
+    }
+
+  event_del(prebuffer_ev);
+
+  clear(&input_now_reading);
+  input_now_reading = input_prebuffer.source;
+  memset(&input_prebuffer.source, 0, sizeof(struct input_source));
+  input_prebuffer.state = PREBUFFER_NONE;
+
+  DPRINTF(E_DBG, L_PLAYER, "Using %zu prebuffered bytes of item '%s' (item id %" PRIu32 ")\n",
+    evbuffer_get_length(input_prebuffer.evbuf), input_now_reading.path, input_now_reading.item_id);
+
+  // The player asks for the next item when there is INPUT_BUFFER_THRESHOLD or
+  // less left in the buffer, so the buffer will not be full here
+  quality = evbuffer_get_length(input_prebuffer.evbuf) > 0 ? &input_prebuffer.quality : NULL;
+  ret = input_write(input_prebuffer.evbuf, quality, input_prebuffer.flags);
+  if (ret != 0)
+    DPRINTF(E_WARN, L_PLAYER, "Could not move prebuffered data to the input buffer, dropping it\n");
+
+  evbuffer_drain(input_prebuffer.evbuf, evbuffer_get_length(input_prebuffer.evbuf));
+  memset(&input_prebuffer.quality, 0, sizeof(struct media_quality));
+  input_prebuffer.flags = 0;
+
+  return 0;
+}
+
 static enum command_state
 start(void *arg, int *retval)
 {
@@ -483,31 +779,47 @@ start(void *arg, int *retval)
       ret = seek(&input_now_reading, cmdarg->seek_ms);
       if (ret < 0)
 	DPRINTF(E_WARN, L_PLAYER, "Ignoring failed seek to %d ms in '%s'\n", cmdarg->seek_ms, input_now_reading.path);
+
+      now_reading_start_ms = (ret > 0) ? ret : 0;
+      now_reading_written = 0;
     }
   else
     {
+      // The prebuffer is kept, it may be the item we are asked to start
       if (input_now_reading.open)
-	stop();
+	stop_now_reading();
 
-      // Get the queue_item from the db
-      queue_item = db_queue_fetch_byitemid(cmdarg->item_id);
-      if (!queue_item)
-	{
-	  DPRINTF(E_LOG, L_PLAYER, "Input start was called with an item id that has disappeared (id=%d)\n", cmdarg->item_id);
-	  goto error;
-	}
+      now_reading_start_ms = 0;
+      now_reading_written = 0;
 
-      ret = setup(&input_now_reading, queue_item, cmdarg->seek_ms);
-      free_queue_item(queue_item, 0);
+      ret = prebuffer_takeover(cmdarg->item_id, cmdarg->seek_ms);
       if (ret < 0)
-	goto error;
+	{
+	  // Get the queue_item from the db
+	  queue_item = db_queue_fetch_byitemid(cmdarg->item_id);
+	  if (!queue_item)
+	    {
+	      DPRINTF(E_LOG, L_PLAYER, "Input start was called with an item id that has disappeared (id=%d)\n", cmdarg->item_id);
+	      goto error;
+	    }
+
+	  ret = setup(&input_now_reading, queue_item, cmdarg->seek_ms);
+	  free_queue_item(queue_item, 0);
+	  if (ret < 0)
+	    goto error;
+
+	  now_reading_start_ms = ret;
+	}
     }
 
   DPRINTF(E_DBG, L_PLAYER, "Starting input read loop for item '%s' (item id %" PRIu32 "), seek %d\n",
     input_now_reading.path, input_now_reading.item_id, cmdarg->seek_ms);
 
   event_add(input_open_timeout_ev, &input_open_timeout);
-  event_active(input_ev, 0, 0);
+
+  // A prebuffered item may have been read to the end already
+  if (input_now_reading.open)
+    event_active(input_ev, 0, 0);
 
   *retval = ret; // Return is the seek result
   return COMMAND_END;
@@ -550,6 +862,24 @@ stop_cmd(void *arg, int *retval)
   return COMMAND_END;
 }
 
+static enum command_state
+lookahead(void *arg, int *retval)
+{
+  struct input_arg *cmdarg = arg;
+
+  if (input_prebuffer.item_id != cmdarg->item_id)
+    prebuffer_discard();
+
+  input_prebuffer.item_id = cmdarg->item_id;
+
+  // The current source may already be close to the end, or past it
+  if (input_now_reading.item_id)
+    prebuffer_check(!input_now_reading.open);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
 static void
 timeout_cb(int fd, short what, void *arg)
 {
@@ -573,6 +903,10 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
   size_t len;
   int ret;
 
+  // Writes from the look-ahead of the next item (only done by the input thread)
+  if (pthread_equal(pthread_self(), tid_input) && input_prebuffer.active)
+    return prebuffer_write(evbuf, quality, flags);
+
   pthread_mutex_lock(&input_buffer.mutex);
 
   read_end = (flags & (INPUT_FLAG_EOF | INPUT_FLAG_ERROR));
@@ -617,6 +951,7 @@ input_write(struct evbuffer *evbuf, struct media_quality *quality, short flags)
 	}
 #endif
       input_buffer.bytes_written += len;
+      now_reading_written += len;
       ret = evbuffer_add_buffer(input_buffer.evbuf, evbuf);
       if (ret < 0)
 	{
@@ -732,9 +1067,12 @@ play(evutil_socket_t fd, short flags, void *arg)
   if (ret < 0)
     {
       input_now_reading.open = false;
+      prebuffer_check(true);
       return; // Error or EOF, so don't come back
     }
 
+  prebuffer_check(false);
+
   event_add(input_ev, &tv);
 }
 
@@ -863,6 +1201,19 @@ input_stop(void)
   commands_exec_async(cmdbase, stop_cmd, NULL);
 }
 
+void
+input_lookahead(uint32_t item_id)
+{
+  struct input_arg *cmdarg;
+
+  CHECK_NULL(L_PLAYER, cmdarg = malloc(sizeof(struct input_arg)));
+
+  cmdarg->item_id = item_id;
+  cmdarg->seek_ms = 0;
+
+  commands_exec_async(cmdbase, lookahead, cmdarg);
+}
+
 static void
 input_stop_sync(void)
 {
@@ -897,6 +1248,11 @@ input_init(void)
   CHECK_NULL(L_PLAYER, input_buffer.evbuf = evbuffer_new());
   CHECK_NULL(L_PLAYER, input_ev = event_new(evbase_input, -1, EV_PERSIST, play, NULL));
   CHECK_NULL(L_PLAYER, input_open_timeout_ev = evtimer_new(evbase_input, timeout_cb, NULL));
+  CHECK_NULL(L_PLAYER, input_prebuffer.evbuf = evbuffer_new());
+  CHECK_NULL(L_PLAYER, prebuffer_ev = evtimer_new(evbase_input, prebuffer_cb, NULL));
+
+  prebuffer_secs = cfg_getint(cfg_getsec(cfg, "library"), "prebuffer_next_seconds");
+  prebuffer_lead_ms = 1000 * cfg_getint(cfg_getsec(cfg, "library"), "prebuffer_lead_seconds");
 
   no_input = 1;
   for (i = 0; inputs[i]; i++)
@@ -939,6 +1295,8 @@ input_init(void)
  thread_fail:
   commands_base_free(cmdbase);
  input_fail:
+  event_free(prebuffer_ev);
+  evbuffer_free(input_prebuffer.evbuf);
   event_free(input_open_timeout_ev);
   event_free(input_ev);
   evbuffer_free(input_buffer.evbuf);
@@ -952,6 +1310,13 @@ input_deinit(void)
   int i;
   int ret;
 
+  // Waits for a prebuffer setup that is running in a worker, and makes sure no
+  // new ones start. input_stop_sync() then handles any setups already handed
+  // back to us, so no sources are left open when the backends go away.
+  pthread_mutex_lock(&prebuffer_lck);
+  input_initialized = false;
+  pthread_mutex_unlock(&prebuffer_lck);
+
   input_stop_sync();
 
   for (i = 0; inputs[i]; i++)
@@ -963,7 +1328,6 @@ input_deinit(void)
         inputs[i]->deinit();
     }
 
-  input_initialized = false;
   commands_base_destroy(cmdbase);
 
   ret = pthread_join(tid_input, NULL);
@@ -976,6 +1340,8 @@ input_deinit(void)
   pthread_cond_destroy(&input_buffer.cond);
   pthread_mutex_destroy(&input_buffer.mutex);
 
+  event_free(prebuffer_ev);
+  evbuffer_free(input_prebuffer.evbuf);
   event_free(input_open_timeout_ev);
   event_free(input_ev);
   evbuffer_free(input_buffer.evbuf);
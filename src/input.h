@@ -219,6 +219,16 @@ input_resume(uint32_t item_id, int seek_ms);
 void
 input_stop(void);
 
+/*
+ * Tells the input which item the player will ask for after the current one,
+ * so that it can be opened and prebuffered when the current one is close to
+ * its end. Non-blocking.
+ *
+ * @in  item_id  Queue item id of the next item, 0 if not known
+ */
+void
+input_lookahead(uint32_t item_id);
+
 /*
  * Flush input buffer. Output flags will be the same as input_read(). Call with
  * null pointer is valid.
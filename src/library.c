@@ -33,6 +33,7 @@
 #include <event2/event.h>
 
 #include "library.h"
+#include "artwork.h"
 #include "cache.h"
 #include "commands.h"
 #include "conffile.h"
@@ -113,6 +114,17 @@ static short deferred_update_events;
 // Stores callbacks that backends may have requested
 static struct library_callback_register library_cb_register[LIBRARY_MAX_CALLBACKS];
 
+// Progress and timing of the running (or last) scan. Only written from the
+// library thread, but read from other threads via library_scan_stats_get().
+static struct library_scan_stats scan_stats;
+static struct timespec scan_stats_start;
+static struct timespec scan_stats_notified;
+static pthread_mutex_t scan_stats_lck = PTHREAD_MUTEX_INITIALIZER;
+
+// While scanning, clients are notified with LISTENER_UPDATE at this interval
+// (in seconds), so they can show progress
+#define SCAN_STATS_NOTIFY_INTERVAL 5
+
 
 /* ------------------- CALLED BY LIBRARY SOURCE MODULES -------------------- */
 
@@ -284,6 +296,13 @@ handle_deferred_update_notifications(void)
       update_time = time(NULL);
       db_admin_setint64(DB_ADMIN_DB_UPDATE, (int64_t) update_time);
       db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) update_time);
+
+      // The callers only notify about the database, so we take care of the
+      // rest here, e.g. queue changes made by the scanner
+      if (deferred_update_events & ~LISTENER_DATABASE)
+	listener_notify(deferred_update_events & ~LISTENER_DATABASE);
+
+      deferred_update_events &= LISTENER_DATABASE;
     }
 
   return ret;
@@ -307,6 +326,62 @@ purge_cruft(time_t start, enum scan_kind scan_kind)
     }
 }
 
+static uint64_t
+scan_stats_usec_since(struct timespec *start, struct timespec *now)
+{
+  return (uint64_t)(now->tv_sec - start->tv_sec) * 1000000 + (now->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void
+scan_stats_begin(void)
+{
+  char filter[32];
+  uint32_t nitems;
+  int ret;
+
+  snprintf(filter, sizeof(filter), "f.data_kind = %d", DATA_KIND_FILE);
+  ret = db_files_get_count(&nitems, NULL, filter);
+  if (ret < 0)
+    nitems = 0;
+
+  pthread_mutex_lock(&scan_stats_lck);
+
+  memset(&scan_stats, 0, sizeof(struct library_scan_stats));
+  scan_stats.active = true;
+  scan_stats.started_at = time(NULL);
+  scan_stats.files_expected = nitems;
+
+  clock_gettime(CLOCK_MONOTONIC, &scan_stats_start);
+  scan_stats_notified = scan_stats_start;
+
+  pthread_mutex_unlock(&scan_stats_lck);
+}
+
+static void
+scan_stats_end(void)
+{
+  struct library_scan_stats stats;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&scan_stats_lck);
+
+  scan_stats.active = false;
+  scan_stats.elapsed_ms = scan_stats_usec_since(&scan_stats_start, &now) / 1000;
+  stats = scan_stats;
+
+  pthread_mutex_unlock(&scan_stats_lck);
+
+  DPRINTF(E_LOG, L_LIB, "Scanned %u files, read %.1f MB (readdir %.1f sec, stat %.1f sec, probe %.1f sec, db %.1f sec, playlists %.1f sec)\n",
+    stats.files_scanned, stats.bytes_read / 1048576.0,
+    stats.stage_usec[LIBRARY_SCAN_STAGE_READDIR] / 1000000.0,
+    stats.stage_usec[LIBRARY_SCAN_STAGE_STAT] / 1000000.0,
+    stats.stage_usec[LIBRARY_SCAN_STAGE_PROBE] / 1000000.0,
+    stats.stage_usec[LIBRARY_SCAN_STAGE_DB] / 1000000.0,
+    stats.stage_usec[LIBRARY_SCAN_STAGE_PLAYLIST] / 1000000.0);
+}
+
 static enum command_state
 rescan(void *arg, int *ret)
 {
@@ -318,6 +393,7 @@ rescan(void *arg, int *ret)
   DPRINTF(E_LOG, L_LIB, "Library rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  scan_stats_begin();
 
   scan_kind = arg;
 
@@ -348,6 +424,7 @@ rescan(void *arg, int *ret)
 
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
+  scan_stats_end();
   scanning = false;
 
   if (handle_deferred_update_notifications())
@@ -355,6 +432,8 @@ rescan(void *arg, int *ret)
   else
     listener_notify(LISTENER_UPDATE);
 
+  artwork_pyramid_schedule();
+
   *ret = 0;
   return COMMAND_END;
 }
@@ -370,6 +449,7 @@ metarescan(void *arg, int *ret)
   DPRINTF(E_LOG, L_LIB, "Library meta rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  scan_stats_begin();
 
   scan_kind = arg;
 
@@ -400,6 +480,7 @@ metarescan(void *arg, int *ret)
 
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library meta rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
+  scan_stats_end();
   scanning = false;
 
   if (handle_deferred_update_notifications())
@@ -407,6 +488,8 @@ metarescan(void *arg, int *ret)
   else
     listener_notify(LISTENER_UPDATE);
 
+  artwork_pyramid_schedule();
+
   *ret = 0;
   return COMMAND_END;
 }
@@ -422,6 +505,7 @@ fullrescan(void *arg, int *ret)
   DPRINTF(E_LOG, L_LIB, "Library full-rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  scan_stats_begin();
 
   player_playback_stop();
   db_queue_clear(0);
@@ -442,6 +526,7 @@ fullrescan(void *arg, int *ret)
 
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library full-rescan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
+  scan_stats_end();
   scanning = false;
 
   if (handle_deferred_update_notifications())
@@ -449,6 +534,8 @@ fullrescan(void *arg, int *ret)
   else
     listener_notify(LISTENER_UPDATE);
 
+  artwork_pyramid_schedule();
+
   *ret = 0;
   return COMMAND_END;
 }
@@ -625,7 +712,7 @@ item_add(void *arg, int *retval)
 static void
 update_trigger_cb(int fd, short what, void *arg)
 {
-  if (handle_deferred_update_notifications())
+  if (handle_deferred_update_notifications() && deferred_update_events)
     {
       listener_notify(deferred_update_events);
       deferred_update_events = 0;
@@ -712,6 +799,7 @@ initscan()
 
   scanning = true;
   starttime = time(NULL);
+  scan_stats_begin();
   listener_notify(LISTENER_UPDATE);
 
   // Only clear the queue if enabled (default) in config
@@ -746,12 +834,15 @@ initscan()
   endtime = time(NULL);
   DPRINTF(E_LOG, L_LIB, "Library init scan completed in %.f sec (%d changes)\n", difftime(endtime, starttime), deferred_update_notifications);
 
+  scan_stats_end();
   scanning = false;
 
   if (handle_deferred_update_notifications())
     listener_notify(LISTENER_UPDATE | LISTENER_DATABASE);
   else
     listener_notify(LISTENER_UPDATE);
+
+  artwork_pyramid_schedule();
 }
 
 bool
@@ -766,12 +857,77 @@ library_set_scanning(bool is_scanning)
   scanning = is_scanning;
 }
 
+void
+library_scan_stats_get(struct library_scan_stats *stats)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&scan_stats_lck);
+  *stats = scan_stats;
+  if (stats->active)
+    stats->elapsed_ms = scan_stats_usec_since(&scan_stats_start, &now) / 1000;
+  pthread_mutex_unlock(&scan_stats_lck);
+}
+
 bool
 library_is_exiting()
 {
   return scan_exit;
 }
 
+void
+library_scan_stats_stage(enum library_scan_stage stage, struct timespec *start)
+{
+  struct timespec now;
+
+  if (!scan_stats.active || stage >= LIBRARY_SCAN_STAGE_MAX)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&scan_stats_lck);
+  scan_stats.stage_usec[stage] += scan_stats_usec_since(start, &now);
+  pthread_mutex_unlock(&scan_stats_lck);
+}
+
+void
+library_scan_stats_file(void)
+{
+  struct timespec now;
+  bool notify = false;
+
+  if (!scan_stats.active)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&scan_stats_lck);
+  scan_stats.files_scanned++;
+  if (now.tv_sec - scan_stats_notified.tv_sec >= SCAN_STATS_NOTIFY_INTERVAL)
+    {
+      scan_stats_notified = now;
+      notify = true;
+    }
+  pthread_mutex_unlock(&scan_stats_lck);
+
+  // Lets clients (e.g. via websocket) know that there is new progress to show
+  if (notify)
+    listener_notify(LISTENER_UPDATE);
+}
+
+void
+library_scan_stats_bytes(uint64_t bytes_read)
+{
+  if (!scan_stats.active)
+    return;
+
+  pthread_mutex_lock(&scan_stats_lck);
+  scan_stats.bytes_read += bytes_read;
+  pthread_mutex_unlock(&scan_stats_lck);
+}
+
 void
 library_update_trigger(short update_events)
 {
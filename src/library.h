@@ -32,6 +32,39 @@
 
 typedef void (*library_cb)(void *arg);
 
+/*
+ * Stages of a library scan that are timed separately, so it is possible to
+ * tell if a scan is I/O-bound (readdir, stat, probe) or not (db, playlist)
+ */
+enum library_scan_stage
+{
+  LIBRARY_SCAN_STAGE_READDIR,
+  LIBRARY_SCAN_STAGE_STAT,
+  LIBRARY_SCAN_STAGE_PROBE,
+  LIBRARY_SCAN_STAGE_DB,
+  LIBRARY_SCAN_STAGE_PLAYLIST,
+  LIBRARY_SCAN_STAGE_MAX,
+};
+
+/*
+ * Progress and timing of the running (or last) library scan
+ */
+struct library_scan_stats
+{
+  bool active;
+  time_t started_at;
+  uint64_t elapsed_ms;
+
+  // Number of media files before the scan started, used for estimating time left
+  uint32_t files_expected;
+  // Number of media files processed so far
+  uint32_t files_scanned;
+  // Number of bytes read from media files (metadata probe and content hash)
+  uint64_t bytes_read;
+
+  uint64_t stage_usec[LIBRARY_SCAN_STAGE_MAX];
+};
+
 /*
  * Argument to library_callback_schedule()
  */
@@ -153,6 +186,27 @@ library_callback_schedule(library_cb cb, void *arg, struct timeval *wait, enum l
 bool
 library_is_exiting();
 
+/*
+ * Adds the time spent in a scan stage to the scan statistics
+ *
+ * @param stage Stage the time was spent in
+ * @param start Start of the stage, from clock_gettime(CLOCK_MONOTONIC)
+ */
+void
+library_scan_stats_stage(enum library_scan_stage stage, struct timespec *start);
+
+/*
+ * Counts a processed media file in the scan statistics
+ */
+void
+library_scan_stats_file(void);
+
+/*
+ * Adds to the number of bytes read in the scan statistics
+ */
+void
+library_scan_stats_bytes(uint64_t bytes_read);
+
 
 /* ------------------------ Library external interface --------------------- */
 
@@ -192,6 +246,14 @@ library_is_scanning();
 void
 library_set_scanning(bool is_scanning);
 
+/*
+ * Copies the statistics of the running (or last) scan, safe to call from any thread
+ *
+ * @param stats Struct to copy the statistics to
+ */
+void
+library_scan_stats_get(struct library_scan_stats *stats);
+
 /*
  * Trigger for sending the DATABASE event
  *
@@ -26,6 +26,7 @@
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
@@ -76,6 +77,10 @@
 #define F_SCAN_TYPE_AUDIOBOOK    (1 << 2)
 #define F_SCAN_TYPE_COMPILATION  (1 << 3)
 
+// Number of bytes read from the start and from the end of a file to compute
+// its content hash, which is used for detecting moved/renamed files
+#define CONTENT_HASH_BLOCK 65536
+
 
 enum file_type {
   FILE_UNKNOWN = 0,
@@ -535,19 +540,149 @@ static void
 process_deferred_playlists(void)
 {
   struct deferred_pl *pl;
+  struct timespec ts;
+
+  if (!playlists)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  scan_playlist_index_build();
+  library_scan_stats_stage(LIBRARY_SCAN_STAGE_PLAYLIST, &ts);
 
   while ((pl = playlists))
     {
       playlists = pl->next;
 
+      clock_gettime(CLOCK_MONOTONIC, &ts);
       process_playlist(pl->path, pl->mtime, pl->directory_id);
+      library_scan_stats_stage(LIBRARY_SCAN_STAGE_PLAYLIST, &ts);
 
       free(pl->path);
       free(pl);
 
       if (library_is_exiting())
-	return;
+	break;
     }
+
+  scan_playlist_index_free();
+}
+
+/* Computes a hash of the file size and the first and last CONTENT_HASH_BLOCK
+ * bytes of the file. Together with the file size this identifies a file even
+ * if it has been moved or renamed, but without having to read the whole file.
+ * Returns 0 on success, -1 if the file could not be read.
+ */
+static int
+file_content_hash(int64_t *hash, const char *path, struct stat *sb)
+{
+  uint8_t *buf;
+  ssize_t head;
+  ssize_t tail;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    {
+      DPRINTF(E_WARN, L_SCAN, "Could not open '%s' for content hashing: %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  CHECK_NULL(L_SCAN, buf = malloc(2 * CONTENT_HASH_BLOCK));
+
+  head = read(fd, buf, CONTENT_HASH_BLOCK);
+  tail = 0;
+  if (head == CONTENT_HASH_BLOCK && sb->st_size > CONTENT_HASH_BLOCK)
+    tail = pread(fd, buf + head, CONTENT_HASH_BLOCK, MAX(sb->st_size - CONTENT_HASH_BLOCK, CONTENT_HASH_BLOCK));
+
+  close(fd);
+
+  if (head < 0 || tail < 0)
+    {
+      DPRINTF(E_WARN, L_SCAN, "Could not read '%s' for content hashing: %s\n", path, strerror(errno));
+      free(buf);
+      return -1;
+    }
+
+  *hash = (int64_t)murmur_hash64(buf, head + tail, (uint32_t)sb->st_size);
+
+  library_scan_stats_bytes(head + tail);
+
+  // 0 is reserved for "no hash"
+  if (*hash == 0)
+    *hash = 1;
+
+  free(buf);
+  return 0;
+}
+
+/* Looks for a file in the library with the same size and content hash, but
+ * whose path no longer exists, i.e. which was probably moved to mfi->path
+ * while we weren't watching. If found, the library entry is moved to the new
+ * path, thus keeping its id, play count, rating and playlist memberships.
+ * Returns the id of the moved file and sets *mtime to the modified time
+ * recorded for it, or returns 0 if no candidate was found.
+ */
+static int
+file_moved_relocate(struct media_file_info *mfi, time_t *mtime)
+{
+  struct query_params qp;
+  struct db_media_file_info dbmfi;
+  char *oldpath = NULL;
+  uint32_t id = 0;
+  uint32_t time_modified = 0;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_ITEMS;
+  qp.idx_type = I_NONE;
+  qp.with_disabled = 1;
+  // Files with a pending inotify cookie are handled by db_file_enable_bycookie()
+  qp.filter = db_mprintf("f.file_size = %" PRIi64 " AND f.content_hash = %" PRIi64 " AND f.scan_kind = %d AND f.disabled IN (0, %" PRIi64 ")",
+                         (int64_t)mfi->file_size, mfi->content_hash, SCAN_KIND_FILES, INOTIFY_FAKE_COOKIE);
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    goto out;
+
+  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+    {
+      // If the original is still there then this is a copy, not a move
+      if (access(dbmfi.path, F_OK) == 0)
+	continue;
+
+      if (safe_atou32(dbmfi.id, &id) < 0 || safe_atou32(dbmfi.time_modified, &time_modified) < 0)
+	{
+	  id = 0;
+	  continue;
+	}
+
+      oldpath = strdup(dbmfi.path);
+      break;
+    }
+
+  db_query_end(&qp);
+
+  if (!oldpath)
+    goto out;
+
+  ret = db_file_path_update_byid(id, mfi->path, mfi->fname, mfi->virtual_path, mfi->directory_id);
+  if (ret <= 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Could not update moved file '%s' (id %" PRIu32 ") to new path '%s'\n", oldpath, id, mfi->path);
+      id = 0;
+      goto out;
+    }
+
+  DPRINTF(E_INFO, L_SCAN, "Detected that '%s' was moved to '%s'\n", oldpath, mfi->path);
+
+  cache_artwork_rename(oldpath, mfi->path);
+
+  *mtime = time_modified;
+
+ out:
+  free(oldpath);
+  free(qp.filter);
+  return id;
 }
 
 static void
@@ -556,13 +691,20 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
   bool is_bulkscan = (flags & F_SCAN_BULK);
   struct media_file_info mfi;
   char virtual_path[PATH_MAX];
+  struct timespec ts;
+  time_t moved_mtime;
+  int moved_id;
   int ret;
 
+  library_scan_stats_file();
+
   // Will return 0 if file is not in library or if file mtime is newer than library timestamp
   // - note if mtime is 0 then we always scan the file
   if (!(flags & F_SCAN_METARESCAN))
     {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
       ret = db_file_ping_bypath(file, sb->st_mtime);
+      library_scan_stats_stage(LIBRARY_SCAN_STAGE_DB, &ts);
       if ((sb->st_mtime != 0) && (ret != 0))
         return;
     }
@@ -609,7 +751,31 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 	  mfi.album_artist = safe_strdup(cfg_getstr(cfg_getsec(cfg, "library"), "compilation_artist"));
 	}
 
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ret = file_content_hash(&mfi.content_hash, file, sb);
+      library_scan_stats_stage(LIBRARY_SCAN_STAGE_PROBE, &ts);
+      if (ret == 0 && mfi.id == 0)
+	{
+	  clock_gettime(CLOCK_MONOTONIC, &ts);
+	  moved_id = file_moved_relocate(&mfi, &moved_mtime);
+	  library_scan_stats_stage(LIBRARY_SCAN_STAGE_DB, &ts);
+
+	  // If the new directory overrides kind or compilation flags we must do a
+	  // full save, since the relocated row still has the old values
+	  if (moved_id > 0 && moved_mtime == sb->st_mtime && !(type & (F_SCAN_TYPE_AUDIOBOOK | F_SCAN_TYPE_PODCAST | F_SCAN_TYPE_COMPILATION)))
+	    {
+	      // Unmodified, so the metadata we have is still good
+	      cache_artwork_ping(file, sb->st_mtime, !is_bulkscan);
+	      free_mfi(&mfi, 1);
+	      return;
+	    }
+	  else if (moved_id > 0)
+	    mfi.id = moved_id;
+	}
+
+      clock_gettime(CLOCK_MONOTONIC, &ts);
       ret = scan_metadata_ffmpeg(&mfi, file);
+      library_scan_stats_stage(LIBRARY_SCAN_STAGE_PROBE, &ts);
       if (ret < 0)
 	{
 	  free_mfi(&mfi, 1);
@@ -617,7 +783,9 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 	}
     }
 
+  clock_gettime(CLOCK_MONOTONIC, &ts);
   library_media_save(&mfi);
+  library_scan_stats_stage(LIBRARY_SCAN_STAGE_DB, &ts);
 
   cache_artwork_ping(file, sb->st_mtime, !is_bulkscan);
   // TODO [artworkcache] If entry in artwork cache exists for no artwork available, delete the entry if media file has embedded artwork
@@ -629,6 +797,8 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
 static void
 process_file(char *file, struct stat *sb, enum file_type file_type, int scan_type, int flags, int dir_id)
 {
+  struct timespec ts;
+
   switch (file_type)
     {
       case FILE_REGULAR:
@@ -640,8 +810,10 @@ process_file(char *file, struct stat *sb, enum file_type file_type, int scan_typ
 	if ((flags & F_SCAN_BULK) && (counter % 200 == 0))
 	  {
 	    DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
+	    clock_gettime(CLOCK_MONOTONIC, &ts);
 	    db_transaction_end();
 	    db_transaction_begin();
+	    library_scan_stats_stage(LIBRARY_SCAN_STAGE_DB, &ts);
 	  }
 	break;
 
@@ -650,7 +822,11 @@ process_file(char *file, struct stat *sb, enum file_type file_type, int scan_typ
 	if (flags & F_SCAN_BULK)
 	  defer_playlist(file, sb->st_mtime, dir_id);
 	else
-	  process_playlist(file, sb->st_mtime, dir_id);
+	  {
+	    clock_gettime(CLOCK_MONOTONIC, &ts);
+	    process_playlist(file, sb->st_mtime, dir_id);
+	    library_scan_stats_stage(LIBRARY_SCAN_STAGE_PLAYLIST, &ts);
+	  }
 	break;
 
       case FILE_SMARTPL:
@@ -799,6 +975,7 @@ process_directory(char *path, int parent_id, int flags)
   char entry[PATH_MAX];
   char resolved_path[PATH_MAX];
   struct stat sb;
+  struct timespec ts;
   int is_link;
   int follow_symlinks;
   struct watch_info wi;
@@ -848,8 +1025,10 @@ process_directory(char *path, int parent_id, int flags)
       if (library_is_exiting())
 	break;
 
+      clock_gettime(CLOCK_MONOTONIC, &ts);
       errno = 0;
       de = readdir(dirp);
+      library_scan_stats_stage(LIBRARY_SCAN_STAGE_READDIR, &ts);
       if (errno)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "readdir error in %s: %s\n", path, strerror(errno));
@@ -874,7 +1053,9 @@ process_directory(char *path, int parent_id, int flags)
       if (file_type == FILE_IGNORE)
 	continue;
 
+      clock_gettime(CLOCK_MONOTONIC, &ts);
       ret = read_attributes(resolved_path, entry, &sb, &is_link);
+      library_scan_stats_stage(LIBRARY_SCAN_STAGE_STAT, &ts);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "Skipping %s, read_attributes() failed\n", entry);
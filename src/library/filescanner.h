@@ -16,6 +16,16 @@ scan_metadata_stream(struct media_file_info *mfi, const char *path);
 void
 scan_playlist(const char *file, time_t mtime, int dir_id);
 
+/* Builds/frees an in-memory index of library paths, which scan_playlist() will
+ * use for matching playlist entries instead of querying the db per entry.
+ * Should be built after a bulk scan, when many playlists are to be processed.
+ */
+void
+scan_playlist_index_build(void);
+
+void
+scan_playlist_index_free(void);
+
 void
 scan_smartpl(const char *file, time_t mtime, int dir_id);
 
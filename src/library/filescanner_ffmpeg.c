@@ -35,6 +35,7 @@
 #include "logger.h"
 #include "misc.h"
 #include "http.h"
+#include "library.h"
 
 /* Mapping between the metadata name(s) and the offset
  * of the equivalent metadata field in struct media_file_info */
@@ -728,6 +729,9 @@ scan_metadata_ffmpeg(struct media_file_info *mfi, const char *file)
     }
 
  skip_extract:
+  if (mfi->data_kind == DATA_KIND_FILE && ctx->pb)
+    library_scan_stats_bytes(ctx->pb->bytes_read);
+
   avformat_close_input(&ctx);
 
   if (mdcount == 0)
@@ -31,15 +31,14 @@
 #include <errno.h>
 #include <limits.h>
 
-#include <sys/mman.h>
-
 #include <stdint.h>
 #include <inttypes.h>
-
-#include <plist/plist.h>
+#include <time.h>
 
 #include <event2/http.h>
 
+#include "mxml-compat.h"
+
 #include "logger.h"
 #include "db.h"
 #include "library.h"
@@ -58,11 +57,91 @@ struct itml_to_db_map {
   struct itml_to_db_map *next;
 };
 
+/* The XML is parsed with mxml's SAX interface, so that we never hold more than
+ * the key/value pairs of the current track or playlist in memory. These are the
+ * value types we care about (anything else is stored as ITML_OTHER, so that we
+ * can still check for the presence of the key).
+ */
+enum itml_type {
+  ITML_OTHER,
+  ITML_STRING,
+  ITML_INTEGER,
+  ITML_DATE,
+  ITML_BOOLEAN,
+};
+
+/* Max number of keys we will store for a single dict, a track dict usually
+ * has around 30-40, the rest will be ignored
+ */
+#define ITML_DICT_MAX_KEYS 64
+
+struct itml_keyval {
+  char *key;
+  enum itml_type type;
+  char *value;
+};
+
+struct itml_dict {
+  struct itml_keyval kv[ITML_DICT_MAX_KEYS];
+  int nkv;
+};
+
+/* Roles of the dicts and arrays we are tracking while parsing */
+enum itml_role {
+  ITML_ROLE_IGNORE,
+  ITML_ROLE_ROOT,
+  ITML_ROLE_TRACKS,
+  ITML_ROLE_TRACK,
+  ITML_ROLE_PLAYLISTS,
+  ITML_ROLE_PLAYLIST,
+  ITML_ROLE_PLITEMS,
+  ITML_ROLE_PLITEM,
+};
+
+/* Max nesting of dicts/arrays, regular iTunes XML only goes 5 deep */
+#define ITML_STACK_SIZE 16
+
+struct itml_container {
+  enum itml_role role;
+  char *key; // Last <key> seen in this container
+};
+
+struct itml_parser {
+  const char *path;
+  bool failed;
+
+  struct itml_container stack[ITML_STACK_SIZE];
+  int depth;
+  int ignore_depth; // Containers nested deeper than ITML_STACK_SIZE
+
+  // Text content of the current leaf element
+  char *text;
+  size_t text_len;
+  size_t text_size;
+
+  struct itml_dict root;
+  struct itml_dict dict; // Current track, playlist item or playlist
+
+  struct itml_to_db_map **id_map;
+  int ntracks;
+  int nloaded;
+  bool in_tracks;
+  bool have_tracks;
+  bool have_playlists;
+
+  // Current playlist, pl_id is 0 if we are not adding items to it
+  struct itml_dict pl;
+  char *pl_name;
+  int pl_id;
+  int pl_nitems;
+  bool pl_has_items;
+};
+
 /* Mapping between iTunes library metadata keys and the offset
  * of the equivalent metadata field in struct media_file_info */
 struct metadata_map {
   char *key;
-  plist_type type;
+  enum itml_type type;
   size_t offset;
 };
 
@@ -107,30 +186,30 @@ struct metadata_map {
  */
 static struct metadata_map md_map[] =
   {
-    { "Name",         PLIST_STRING,  mfi_offsetof(title) },
-    { "Artist",       PLIST_STRING,  mfi_offsetof(artist) },
-    { "Album Artist", PLIST_STRING,  mfi_offsetof(album_artist) },
-    { "Composer",     PLIST_STRING,  mfi_offsetof(composer) },
-    { "Album",        PLIST_STRING,  mfi_offsetof(album) },
-    { "Genre",        PLIST_STRING,  mfi_offsetof(genre) },
-    { "Comments",     PLIST_STRING,  mfi_offsetof(comment) },
-    { "Track Count",  PLIST_UINT,    mfi_offsetof(total_tracks) },
-    { "Track Number", PLIST_UINT,    mfi_offsetof(track) },
-    { "Disc Count",   PLIST_UINT,    mfi_offsetof(total_discs) },
-    { "Disc Number",  PLIST_UINT,    mfi_offsetof(disc) },
-    { "Year",         PLIST_UINT,    mfi_offsetof(year) },
-    { "Total Time",   PLIST_UINT,    mfi_offsetof(song_length) },
-    { "Bit Rate",     PLIST_UINT,    mfi_offsetof(bitrate) },
-    { "Sample Rate",  PLIST_UINT,    mfi_offsetof(samplerate) },
-    { "BPM",          PLIST_UINT,    mfi_offsetof(bpm) },
-    { "Rating",       PLIST_UINT,    mfi_offsetof(rating) },
-    { "Compilation",  PLIST_BOOLEAN, mfi_offsetof(compilation) },
-    { "Date Added",   PLIST_DATE,    mfi_offsetof(time_added) },
-    { "Play Date UTC",PLIST_DATE,    mfi_offsetof(time_played) },
-    { "Play Count",   PLIST_UINT,    mfi_offsetof(play_count) },
-    { "Skip Count",   PLIST_UINT,    mfi_offsetof(skip_count) },
-    { "Skip Date",    PLIST_DATE,    mfi_offsetof(time_skipped) },
-    { NULL,           0, 0 }
+    { "Name",         ITML_STRING,  mfi_offsetof(title) },
+    { "Artist",       ITML_STRING,  mfi_offsetof(artist) },
+    { "Album Artist", ITML_STRING,  mfi_offsetof(album_artist) },
+    { "Composer",     ITML_STRING,  mfi_offsetof(composer) },
+    { "Album",        ITML_STRING,  mfi_offsetof(album) },
+    { "Genre",        ITML_STRING,  mfi_offsetof(genre) },
+    { "Comments",     ITML_STRING,  mfi_offsetof(comment) },
+    { "Track Count",  ITML_INTEGER, mfi_offsetof(total_tracks) },
+    { "Track Number", ITML_INTEGER, mfi_offsetof(track) },
+    { "Disc Count",   ITML_INTEGER, mfi_offsetof(total_discs) },
+    { "Disc Number",  ITML_INTEGER, mfi_offsetof(disc) },
+    { "Year",         ITML_INTEGER, mfi_offsetof(year) },
+    { "Total Time",   ITML_INTEGER, mfi_offsetof(song_length) },
+    { "Bit Rate",     ITML_INTEGER, mfi_offsetof(bitrate) },
+    { "Sample Rate",  ITML_INTEGER, mfi_offsetof(samplerate) },
+    { "BPM",          ITML_INTEGER, mfi_offsetof(bpm) },
+    { "Rating",       ITML_INTEGER, mfi_offsetof(rating) },
+    { "Compilation",  ITML_BOOLEAN, mfi_offsetof(compilation) },
+    { "Date Added",   ITML_DATE,    mfi_offsetof(time_added) },
+    { "Play Date UTC",ITML_DATE,    mfi_offsetof(time_played) },
+    { "Play Count",   ITML_INTEGER, mfi_offsetof(play_count) },
+    { "Skip Count",   ITML_INTEGER, mfi_offsetof(skip_count) },
+    { "Skip Date",    ITML_DATE,    mfi_offsetof(time_skipped) },
+    { NULL,           0,            0 }
   };
 
 static void
@@ -196,122 +275,145 @@ id_map_get(struct itml_to_db_map **id_map, uint64_t itml_id)
   return 0;
 }
 
-/* plist helpers */
-static int
-get_dictval_int_from_key(plist_t dict, const char *key, uint64_t *val)
+/* Dict helpers */
+static void
+dict_clear(struct itml_dict *dict)
 {
-  plist_t node;
-
-  node = plist_dict_get_item(dict, key);
-
-  if (!node)
-    return -1;
-
-  if (plist_get_node_type(node) != PLIST_UINT)
-    return -1;
+  int i;
 
-  plist_get_uint_val(node, val);
+  for (i = 0; i < dict->nkv; i++)
+    {
+      free(dict->kv[i].key);
+      free(dict->kv[i].value);
+    }
 
-  return 0;
+  dict->nkv = 0;
 }
 
-static int
-get_dictval_date_from_key(plist_t dict, const char *key, uint32_t *val)
+static void
+dict_add(struct itml_dict *dict, const char *key, enum itml_type type, const char *value)
 {
-  plist_t node;
-  int32_t secs;
-  int32_t dummy;
+  struct itml_keyval *kv;
 
-  node = plist_dict_get_item(dict, key);
+  if (dict->nkv == ITML_DICT_MAX_KEYS)
+    {
+      DPRINTF(E_SPAM, L_SCAN, "Too many keys in iTunes XML dict, ignoring '%s'\n", key);
+      return;
+    }
 
-  if (!node)
-    return -1;
+  kv = &dict->kv[dict->nkv];
 
-  if (plist_get_node_type(node) != PLIST_DATE)
-    return -1;
+  kv->key = strdup(key);
+  kv->type = type;
+  kv->value = safe_strdup(value);
+
+  dict->nkv++;
+}
 
-  // secs will be number of seconds since 01/01/2001
-  plist_get_date_val(node, &secs, &dummy);
+static struct itml_keyval *
+dict_get(struct itml_dict *dict, const char *key)
+{
+  int i;
 
-  // make it a Unix Timestamp by adding seconds from 1/1/1970 to 1/1/2001
-  *val = (uint32_t) (secs + 978307200);
+  for (i = 0; i < dict->nkv; i++)
+    {
+      if (strcmp(dict->kv[i].key, key) == 0)
+	return &dict->kv[i];
+    }
 
-  return 0;
+  return NULL;
 }
 
 static int
-get_dictval_bool_from_key(plist_t dict, const char *key, uint8_t *val)
+get_dictval_int_from_key(struct itml_dict *dict, const char *key, uint64_t *val)
 {
-  plist_t node;
+  struct itml_keyval *kv;
+  int64_t integer;
+  int ret;
 
-  node = plist_dict_get_item(dict, key);
+  kv = dict_get(dict, key);
 
-  /* Not present means false */
-  if (!node)
-    {
-      *val = 0;
+  if (!kv || !kv->value)
+    return -1;
 
-      return 0;
-    }
+  if (kv->type != ITML_INTEGER)
+    return -1;
 
-  if (plist_get_node_type(node) != PLIST_BOOLEAN)
+  ret = safe_atoi64(kv->value, &integer);
+  if (ret < 0)
     return -1;
 
-  plist_get_bool_val(node, val);
+  *val = (uint64_t)integer;
 
   return 0;
 }
 
 static int
-get_dictval_string_from_key(plist_t dict, const char *key, char **val)
+get_dictval_date_from_key(struct itml_dict *dict, const char *key, uint32_t *val)
 {
-  plist_t node;
+  struct itml_keyval *kv;
+  struct tm tm;
+  time_t t;
 
-  node = plist_dict_get_item(dict, key);
+  kv = dict_get(dict, key);
 
-  if (!node)
+  if (!kv || !kv->value)
     return -1;
 
-  if (plist_get_node_type(node) != PLIST_STRING)
+  if (kv->type != ITML_DATE)
     return -1;
 
-  plist_get_string_val(node, val);
+  // Dates are ISO 8601 in UTC, e.g. 2016-08-09T15:07:35Z
+  memset(&tm, 0, sizeof(struct tm));
+  if (!strptime(kv->value, "%Y-%m-%dT%H:%M:%SZ", &tm))
+    return -1;
+
+  t = timegm(&tm);
+  if (t < 0)
+    return -1;
+
+  *val = (uint32_t)t;
 
   return 0;
 }
 
 static int
-get_dictval_dict_from_key(plist_t dict, const char *key, plist_t *val)
+get_dictval_bool_from_key(struct itml_dict *dict, const char *key, uint8_t *val)
 {
-  plist_t node;
+  struct itml_keyval *kv;
 
-  node = plist_dict_get_item(dict, key);
+  kv = dict_get(dict, key);
 
-  if (!node)
-    return -1;
+  /* Not present means false */
+  if (!kv)
+    {
+      *val = 0;
 
-  if (plist_get_node_type(node) != PLIST_DICT)
+      return 0;
+    }
+
+  if (kv->type != ITML_BOOLEAN || !kv->value)
     return -1;
 
-  *val = node;
+  *val = (strcmp(kv->value, "true") == 0);
 
   return 0;
 }
 
 static int
-get_dictval_array_from_key(plist_t dict, const char *key, plist_t *val)
+get_dictval_string_from_key(struct itml_dict *dict, const char *key, char **val)
 {
-  plist_t node;
+  struct itml_keyval *kv;
 
-  node = plist_dict_get_item(dict, key);
+  kv = dict_get(dict, key);
 
-  if (!node)
+  if (!kv)
     return -1;
 
-  if (plist_get_node_type(node) != PLIST_ARRAY)
+  if (kv->type != ITML_STRING)
     return -1;
 
-  *val = node;
+  *val = strdup(kv->value ? kv->value : "");
 
   return 0;
 }
@@ -319,7 +421,7 @@ get_dictval_array_from_key(plist_t dict, const char *key, plist_t *val)
 
 /* We don't actually check anything (yet) despite the name */
 static int
-check_meta(plist_t dict)
+check_meta(struct itml_dict *dict)
 {
   char *appver;
   char *folder;
@@ -434,7 +536,7 @@ mfi_id_find(const char *path)
 }
 
 static int
-process_track_file(plist_t trk)
+process_track_file(struct itml_dict *trk)
 {
   struct media_file_info *mfi;
   char *location;
@@ -491,7 +593,7 @@ process_track_file(plist_t trk)
     {
       switch (md_map[i].type)
 	{
-	  case PLIST_UINT:
+	  case ITML_INTEGER:
 	    ret = get_dictval_int_from_key(trk, md_map[i].key, &integer);
 	    if (ret < 0)
 	      break;
@@ -501,7 +603,7 @@ process_track_file(plist_t trk)
 	    *intval = (uint32_t)integer;
 	    break;
 
-	  case PLIST_STRING:
+	  case ITML_STRING:
 	    ret = get_dictval_string_from_key(trk, md_map[i].key, &string);
 	    if (ret < 0)
 	      break;
@@ -514,7 +616,7 @@ process_track_file(plist_t trk)
 	    *strval = string;
 	    break;
 
-	  case PLIST_BOOLEAN:
+	  case ITML_BOOLEAN:
 	    ret = get_dictval_bool_from_key(trk, md_map[i].key, &boolean);
 	    if (ret < 0)
 	      break;
@@ -524,7 +626,7 @@ process_track_file(plist_t trk)
 	    *chrval = boolean;
 	    break;
 
-	  case PLIST_DATE:
+	  case ITML_DATE:
 	    intval = (uint32_t *) ((char *) mfi + md_map[i].offset);
 
 	    get_dictval_date_from_key(trk, md_map[i].key, intval);
@@ -560,7 +662,7 @@ process_track_file(plist_t trk)
 }
 
 static int
-process_track_stream(plist_t trk)
+process_track_stream(struct itml_dict *trk)
 {
   char *url;
   int ret;
@@ -580,177 +682,153 @@ process_track_stream(plist_t trk)
   return ret;
 }
 
-static int
-process_tracks(struct itml_to_db_map **id_map, plist_t tracks)
+static void
+process_track(struct itml_parser *parser, struct itml_dict *trk)
 {
-  plist_t trk;
-  plist_dict_iter iter;
   char *str;
   uint64_t trk_id;
   uint8_t disabled;
-  int ntracks;
-  int nloaded;
   int mfi_id;
   int ret;
 
-  if (plist_dict_get_size(tracks) == 0)
+  ret = get_dictval_int_from_key(trk, "Track ID", &trk_id);
+  if (ret < 0)
     {
-      DPRINTF(E_WARN, L_SCAN, "No tracks in iTunes library\n");
-      return 0;
+      DPRINTF(E_WARN, L_SCAN, "Track ID not found!\n");
+      return;
     }
 
-  db_transaction_begin();
-
-  ntracks = 0;
-  nloaded = 0;
-
-  iter = NULL;
-  plist_dict_new_iter(tracks, &iter);
+  ret = get_dictval_bool_from_key(trk, "Disabled", &disabled);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_SCAN, "Malformed track record (id %" PRIu64 ")\n", trk_id);
+      return;
+    }
 
-  plist_dict_next_item(tracks, iter, NULL, &trk);
-  while (trk)
+  if (disabled)
     {
-      if (plist_get_node_type(trk) != PLIST_DICT)
-	{
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+      DPRINTF(E_INFO, L_SCAN, "Track %" PRIu64 " disabled; skipping\n", trk_id);
+      return;
+    }
 
-      ret = get_dictval_int_from_key(trk, "Track ID", &trk_id);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Track ID not found!\n");
+  ret = get_dictval_string_from_key(trk, "Track Type", &str);
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_SCAN, "Track %" PRIu64 " has no track type\n", trk_id);
+      return;
+    }
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  if (strcmp(str, "URL") == 0)
+    mfi_id = process_track_stream(trk);
+  else if (strcmp(str, "File") == 0)
+    mfi_id = process_track_file(trk);
+  else
+    {
+      DPRINTF(E_LOG, L_SCAN, "Unknown track type: '%s'\n", str);
 
-      ret = get_dictval_bool_from_key(trk, "Disabled", &disabled);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Malformed track record (id %" PRIu64 ")\n", trk_id);
+      free(str);
+      return;
+    }
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  free(str);
 
-      if (disabled)
-	{
-	  DPRINTF(E_INFO, L_SCAN, "Track %" PRIu64 " disabled; skipping\n", trk_id);
+  parser->ntracks++;
+  if (parser->ntracks % 200 == 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Processed %d tracks...\n", parser->ntracks);
+      db_transaction_end();
+      db_transaction_begin();
+    }
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  if (mfi_id <= 0)
+    return;
 
-      ret = get_dictval_string_from_key(trk, "Track Type", &str);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "Track %" PRIu64 " has no track type\n", trk_id);
+  ret = id_map_add(parser->id_map, trk_id, mfi_id);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_SCAN, "Out of memory for itml -> db mapping\n");
 
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  parser->nloaded++;
+}
 
-      if (strcmp(str, "URL") == 0)
-	mfi_id = process_track_stream(trk);
-      else if (strcmp(str, "File") == 0)
-	mfi_id = process_track_file(trk);
-      else
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Unknown track type: '%s'\n", str);
+static int
+tracks_begin(struct itml_parser *parser)
+{
+  int ret;
 
-	  free(str);
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  /* Meta data, the keys of the root dict that precede the Tracks dict */
+  ret = check_meta(&parser->root);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Missing meta elements in iTunes XML playlist '%s'\n", parser->path);
+      return -1;
+    }
 
-      free(str);
+  parser->have_tracks = true;
+  parser->in_tracks = true;
 
-      ntracks++;
-      if (ntracks % 200 == 0)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Processed %d tracks...\n", ntracks);
-	  db_transaction_end();
-	  db_transaction_begin();
-	}
+  db_transaction_begin();
 
-      if (mfi_id <= 0)
-	{
-	  plist_dict_next_item(tracks, iter, NULL, &trk);
-	  continue;
-	}
+  return 0;
+}
 
-      ret = id_map_add(id_map, trk_id, mfi_id);
-      if (ret < 0)
-	DPRINTF(E_LOG, L_SCAN, "Out of memory for itml -> db mapping\n");
+static int
+tracks_end(struct itml_parser *parser)
+{
+  parser->in_tracks = false;
 
-      nloaded++;
+  db_transaction_end();
 
-      plist_dict_next_item(tracks, iter, NULL, &trk);
+  if (parser->nloaded <= 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "No tracks loaded from iTunes XML '%s'\n", parser->path);
+      return -1;
     }
 
-  free(iter);
+  DPRINTF(E_LOG, L_SCAN, "Loaded %d tracks from iTunes XML '%s'\n", parser->nloaded, parser->path);
 
-  db_transaction_end();
-
-  return nloaded;
+  return 0;
 }
 
 static void
-process_pl_items(plist_t items, int pl_id, const char *name, struct itml_to_db_map **id_map)
+process_pl_item(struct itml_parser *parser, struct itml_dict *trk)
 {
-  plist_t trk;
   uint64_t itml_id;
   uint32_t db_id;
-  uint32_t alen;
-  uint32_t i;
-  int ntracks;
   int ret;
 
-  db_transaction_begin();
-
-  ntracks = 0;
+  // Playlist was ignored or could not be saved
+  if (parser->pl_id <= 0)
+    return;
 
-  alen = plist_array_get_size(items);
-  for (i = 0; i < alen; i++)
+  ret = get_dictval_int_from_key(trk, "Track ID", &itml_id);
+  if (ret < 0)
     {
-      trk = plist_array_get_item(items, i);
-
-      if (plist_get_node_type(trk) != PLIST_DICT)
-	continue;
-
-      ret = get_dictval_int_from_key(trk, "Track ID", &itml_id);
-      if (ret < 0)
-	{
-	  DPRINTF(E_WARN, L_SCAN, "No Track ID found for playlist item %u in '%s'\n", i, name);
-	  continue;
-	}
+      DPRINTF(E_WARN, L_SCAN, "No Track ID found for playlist item %d in '%s'\n", parser->pl_nitems, parser->pl_name);
+      return;
+    }
 
-      db_id = id_map_get(id_map, itml_id);
-      if (!db_id)
-	{
-	  DPRINTF(E_INFO, L_SCAN, "Did not find a match for track ID %" PRIu64 " in '%s'\n", itml_id, name);
-	  continue;
-	}
+  db_id = id_map_get(parser->id_map, itml_id);
+  if (!db_id)
+    {
+      DPRINTF(E_INFO, L_SCAN, "Did not find a match for track ID %" PRIu64 " in '%s'\n", itml_id, parser->pl_name);
+      return;
+    }
 
-      ret = db_pl_add_item_byid(pl_id, db_id);
-      if (ret < 0)
-	DPRINTF(E_WARN, L_SCAN, "Could not add ID %d to playlist '%s'\n", db_id, name);
+  ret = db_pl_add_item_byid(parser->pl_id, db_id);
+  if (ret < 0)
+    DPRINTF(E_WARN, L_SCAN, "Could not add ID %d to playlist '%s'\n", db_id, parser->pl_name);
 
-      ntracks++;
-      if (ntracks % 200 == 0)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Processed %d tracks from playlist '%s'...\n", ntracks, name);
-	  db_transaction_end();
-	  db_transaction_begin();
-	}
+  parser->pl_nitems++;
+  if (parser->pl_nitems % 200 == 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Processed %d tracks from playlist '%s'...\n", parser->pl_nitems, parser->pl_name);
+      db_transaction_end();
+      db_transaction_begin();
     }
-
-  db_transaction_end();
 }
 
 static bool
-ignore_pl(plist_t pl, const char *name)
+ignore_pl(struct itml_dict *pl, const char *name)
 {
   uint64_t kind;
   uint8_t master;
@@ -776,7 +854,7 @@ ignore_pl(plist_t pl, const char *name)
 
   /* Import smart playlists (optional) */
   if (!cfg_getbool(cfg_getsec(cfg, "library"), "itunes_smartpl")
-      && (plist_dict_get_item(pl, "Smart Info") || plist_dict_get_item(pl, "Smart Criteria")))
+      && (dict_get(pl, "Smart Info") || dict_get(pl, "Smart Criteria")))
     {
       DPRINTF(E_INFO, L_SCAN, "Ignoring iTunes smart playlist as set in config '%s'\n", name);
       return true;
@@ -785,79 +863,419 @@ ignore_pl(plist_t pl, const char *name)
   return false;
 }
 
+/* Called when we reach the "Playlist Items" array of a playlist. iTunes puts
+ * it last in the playlist dict, so at this point we have all the keys we need
+ * to decide if the playlist should be imported.
+ */
 static void
-process_pls(plist_t playlists, const char *file, struct itml_to_db_map **id_map)
+playlist_begin(struct itml_parser *parser)
 {
-  plist_t pl;
-  plist_t items;
   struct playlist_info pli;
   char *name;
   uint64_t id;
-  uint32_t alen;
-  uint32_t i;
   int ret;
 
-  alen = plist_array_get_size(playlists);
-  for (i = 0; i < alen; i++)
+  parser->pl_has_items = true;
+
+  ret = get_dictval_int_from_key(&parser->pl, "Playlist ID", &id);
+  if (ret < 0)
     {
-      pl = plist_array_get_item(playlists, i);
+      DPRINTF(E_DBG, L_SCAN, "Playlist ID not found!\n");
+      return;
+    }
 
-      if (plist_get_node_type(pl) != PLIST_DICT)
-	continue;
+  ret = get_dictval_string_from_key(&parser->pl, "Name", &name);
+  if (ret < 0)
+    {
+      DPRINTF(E_DBG, L_SCAN, "Name not found!\n");
+      return;
+    }
 
-      ret = get_dictval_int_from_key(pl, "Playlist ID", &id);
-      if (ret < 0)
-	{
-	  DPRINTF(E_DBG, L_SCAN, "Playlist ID not found!\n");
-	  continue;
-	}
+  if (ignore_pl(&parser->pl, name))
+    {
+      free(name);
+      return;
+    }
 
-      ret = get_dictval_string_from_key(pl, "Name", &name);
-      if (ret < 0)
-	{
-	  DPRINTF(E_DBG, L_SCAN, "Name not found!\n");
-	  continue;
-	}
+  playlist_fill(&pli, parser->path);
 
-      if (ignore_pl(pl, name))
-	{
-	  free(name);
-	  continue;
-	}
+  free(pli.title);
+  pli.title = strdup(name);
+  free(pli.virtual_path);
+  pli.virtual_path = safe_asprintf("/file:%s/%s", parser->path, name);
 
-      ret = get_dictval_array_from_key(pl, "Playlist Items", &items);
-      if (ret < 0)
-	{
-	  DPRINTF(E_INFO, L_SCAN, "Playlist '%s' has no items\n", name);
+  ret = library_playlist_save(&pli);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_SCAN, "Error adding iTunes playlist '%s' (%s)\n", name, parser->path);
 
-	  free(name);
-	  continue;
-	}
+      free_pli(&pli, 1);
+      free(name);
+      return;
+    }
 
-      playlist_fill(&pli, file);
+  DPRINTF(E_INFO, L_SCAN, "Added playlist as id %d\n", ret);
 
-      free(pli.title);
-      pli.title = strdup(name);
-      free(pli.virtual_path);
-      pli.virtual_path = safe_asprintf("/file:%s/%s", file, name);
+  free_pli(&pli, 1);
 
-      ret = library_playlist_save(&pli);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_SCAN, "Error adding iTunes playlist '%s' (%s)\n", name, file);
+  parser->pl_id = ret;
+  parser->pl_name = name;
+  parser->pl_nitems = 0;
 
-	  free_pli(&pli, 1);
-	  free(name);
-	  continue;
-	}
+  db_transaction_begin();
+}
 
-      DPRINTF(E_INFO, L_SCAN, "Added playlist as id %d\n", ret);
+static void
+playlist_end(struct itml_parser *parser)
+{
+  if (parser->pl_id <= 0)
+    return;
 
-      process_pl_items(items, ret, name, id_map);
+  db_transaction_end();
 
-      free_pli(&pli, 1);
+  free(parser->pl_name);
+  parser->pl_name = NULL;
+  parser->pl_id = 0;
+}
+
+static void
+playlist_close(struct itml_parser *parser)
+{
+  char *name;
+
+  if (!parser->pl_has_items && get_dictval_string_from_key(&parser->pl, "Name", &name) == 0)
+    {
+      DPRINTF(E_INFO, L_SCAN, "Playlist '%s' has no items\n", name);
       free(name);
     }
+
+  dict_clear(&parser->pl);
+  parser->pl_has_items = false;
+}
+
+
+/* SAX parser */
+static void
+text_reset(struct itml_parser *parser)
+{
+  parser->text_len = 0;
+  if (parser->text)
+    parser->text[0] = '\0';
+}
+
+static void
+text_append(struct itml_parser *parser, const char *data)
+{
+  size_t len;
+
+  if (!data)
+    return;
+
+  len = strlen(data);
+  if (parser->text_len + len + 1 > parser->text_size)
+    {
+      parser->text_size = parser->text_len + len + 1 + 256;
+      CHECK_NULL(L_SCAN, parser->text = realloc(parser->text, parser->text_size));
+    }
+
+  memcpy(parser->text + parser->text_len, data, len + 1);
+  parser->text_len += len;
+}
+
+static bool
+is_container(const char *name)
+{
+  return (strcmp(name, "dict") == 0 || strcmp(name, "array") == 0);
+}
+
+static enum itml_role
+container_role(struct itml_container *parent, const char *name)
+{
+  bool is_dict = (strcmp(name, "dict") == 0);
+  const char *key;
+
+  if (!parent)
+    return is_dict ? ITML_ROLE_ROOT : ITML_ROLE_IGNORE;
+
+  key = parent->key ? parent->key : "";
+
+  switch (parent->role)
+    {
+      case ITML_ROLE_ROOT:
+	if (is_dict && strcmp(key, "Tracks") == 0)
+	  return ITML_ROLE_TRACKS;
+	if (!is_dict && strcmp(key, "Playlists") == 0)
+	  return ITML_ROLE_PLAYLISTS;
+	break;
+
+      case ITML_ROLE_TRACKS:
+	if (is_dict)
+	  return ITML_ROLE_TRACK;
+	break;
+
+      case ITML_ROLE_PLAYLISTS:
+	if (is_dict)
+	  return ITML_ROLE_PLAYLIST;
+	break;
+
+      case ITML_ROLE_PLAYLIST:
+	if (!is_dict && strcmp(key, "Playlist Items") == 0)
+	  return ITML_ROLE_PLITEMS;
+	break;
+
+      case ITML_ROLE_PLITEMS:
+	if (is_dict)
+	  return ITML_ROLE_PLITEM;
+	break;
+
+      default:
+	break;
+    }
+
+  return ITML_ROLE_IGNORE;
+}
+
+static struct itml_dict *
+container_dict(struct itml_parser *parser, struct itml_container *container)
+{
+  switch (container->role)
+    {
+      case ITML_ROLE_ROOT:
+	return &parser->root;
+      case ITML_ROLE_TRACK:
+      case ITML_ROLE_PLITEM:
+	return &parser->dict;
+      case ITML_ROLE_PLAYLIST:
+	return &parser->pl;
+      default:
+	return NULL;
+    }
+}
+
+static void
+container_open(struct itml_parser *parser, const char *name)
+{
+  struct itml_container *parent;
+  struct itml_container *container;
+  enum itml_role role;
+  int ret = 0;
+
+  if (parser->ignore_depth > 0 || parser->depth == ITML_STACK_SIZE)
+    {
+      parser->ignore_depth++;
+      return;
+    }
+
+  parent = (parser->depth > 0) ? &parser->stack[parser->depth - 1] : NULL;
+
+  role = container_role(parent, name);
+
+  // The key has been consumed by this container
+  if (parent)
+    {
+      free(parent->key);
+      parent->key = NULL;
+    }
+
+  container = &parser->stack[parser->depth];
+  container->role = role;
+  container->key = NULL;
+  parser->depth++;
+
+  switch (role)
+    {
+      case ITML_ROLE_TRACKS:
+	ret = tracks_begin(parser);
+	break;
+
+      case ITML_ROLE_PLAYLISTS:
+	parser->have_playlists = true;
+	break;
+
+      case ITML_ROLE_PLAYLIST:
+	dict_clear(&parser->pl);
+	parser->pl_has_items = false;
+	break;
+
+      case ITML_ROLE_PLITEMS:
+	playlist_begin(parser);
+	break;
+
+      case ITML_ROLE_TRACK:
+      case ITML_ROLE_PLITEM:
+	dict_clear(&parser->dict);
+	break;
+
+      default:
+	break;
+    }
+
+  if (ret < 0)
+    parser->failed = true;
+}
+
+static void
+container_close(struct itml_parser *parser)
+{
+  struct itml_container *container;
+  int ret = 0;
+
+  if (parser->ignore_depth > 0)
+    {
+      parser->ignore_depth--;
+      return;
+    }
+
+  if (parser->depth == 0)
+    return;
+
+  parser->depth--;
+  container = &parser->stack[parser->depth];
+
+  switch (container->role)
+    {
+      case ITML_ROLE_TRACK:
+	process_track(parser, &parser->dict);
+	dict_clear(&parser->dict);
+	break;
+
+      case ITML_ROLE_TRACKS:
+	ret = tracks_end(parser);
+	break;
+
+      case ITML_ROLE_PLITEM:
+	process_pl_item(parser, &parser->dict);
+	dict_clear(&parser->dict);
+	break;
+
+      case ITML_ROLE_PLITEMS:
+	playlist_end(parser);
+	break;
+
+      case ITML_ROLE_PLAYLIST:
+	playlist_close(parser);
+	break;
+
+      default:
+	break;
+    }
+
+  free(container->key);
+  container->key = NULL;
+
+  if (ret < 0)
+    parser->failed = true;
+}
+
+static void
+value_close(struct itml_parser *parser, const char *name)
+{
+  struct itml_container *container;
+  struct itml_dict *dict;
+  enum itml_type type;
+  const char *value;
+
+  if (parser->ignore_depth > 0 || parser->depth == 0)
+    return;
+
+  container = &parser->stack[parser->depth - 1];
+
+  if (strcmp(name, "key") == 0)
+    {
+      free(container->key);
+      container->key = strdup(parser->text ? parser->text : "");
+      return;
+    }
+
+  dict = container_dict(parser, container);
+  if (!dict || !container->key)
+    return;
+
+  value = parser->text;
+  if (strcmp(name, "string") == 0)
+    type = ITML_STRING;
+  else if (strcmp(name, "integer") == 0)
+    type = ITML_INTEGER;
+  else if (strcmp(name, "date") == 0)
+    type = ITML_DATE;
+  else if (strcmp(name, "true") == 0 || strcmp(name, "false") == 0)
+    {
+      type = ITML_BOOLEAN;
+      value = name;
+    }
+  else
+    {
+      type = ITML_OTHER;
+      value = NULL; // Don't keep e.g. the base64 of <data>
+    }
+
+  dict_add(dict, container->key, type, value);
+
+  free(container->key);
+  container->key = NULL;
+}
+
+static void
+itml_sax_cb(mxml_node_t *node, mxml_sax_event_t event, void *data)
+{
+  struct itml_parser *parser = data;
+  const char *name;
+
+  if (parser->failed)
+    return;
+
+  switch (event)
+    {
+      case MXML_SAX_ELEMENT_OPEN:
+	name = mxmlGetElement(node);
+	if (!name)
+	  break;
+
+	if (is_container(name))
+	  container_open(parser, name);
+	else
+	  text_reset(parser);
+	break;
+
+      case MXML_SAX_ELEMENT_CLOSE:
+	name = mxmlGetElement(node);
+	if (!name)
+	  break;
+
+	if (is_container(name))
+	  container_close(parser);
+	else
+	  value_close(parser, name);
+	break;
+
+      case MXML_SAX_DATA:
+	text_append(parser, mxmlGetOpaque(node));
+	break;
+
+      default:
+	break;
+    }
+}
+
+static void
+parser_deinit(struct itml_parser *parser)
+{
+  int i;
+
+  // Parsing was aborted with an open transaction, so close it
+  if (parser->in_tracks)
+    db_transaction_end();
+  if (parser->pl_id > 0)
+    playlist_end(parser);
+
+  for (i = 0; i < parser->depth; i++)
+    free(parser->stack[i].key);
+
+  dict_clear(&parser->root);
+  dict_clear(&parser->dict);
+  dict_clear(&parser->pl);
+
+  free(parser->text);
 }
 
 static bool
@@ -917,16 +1335,16 @@ itml_is_modified(const char *path, time_t mtime)
   return true;
 }
 
+/* The library is parsed as a stream, processing each track and playlist as
+ * soon as its closing tag is read, so memory use does not depend on the size
+ * of the XML (except for the small itml -> db id map).
+ */
 void
 scan_itunes_itml(const char *path, time_t mtime, int dir_id)
 {
-  struct stat sb;
-  struct itml_to_db_map **id_map = NULL;
-  char *itml_xml;
-  plist_t itml = NULL;
-  plist_t node;
+  struct itml_parser *parser = NULL;
+  mxml_node_t *top;
   int fd = -1;
-  int ret;
 
   if (!itml_is_modified(path, mtime))
     {
@@ -940,95 +1358,60 @@ scan_itunes_itml(const char *path, time_t mtime, int dir_id)
       goto error;
     }
 
-  ret = fstat(fd, &sb);
-  if (ret < 0)
-    {
-      DPRINTF(E_LOG, L_SCAN, "Could not stat iTunes library '%s': %s\n", path, strerror(errno));
-      goto error;
-    }
+  CHECK_NULL(L_SCAN, parser = calloc(1, sizeof(struct itml_parser)));
+
+  parser->path = path;
 
-  itml_xml = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (itml_xml == MAP_FAILED)
+  parser->id_map = calloc(ID_MAP_SIZE, sizeof(struct itml_to_db_map *));
+  if (!parser->id_map)
     {
-      DPRINTF(E_LOG, L_SCAN, "Could not map iTunes library '%s': %s\n", path, strerror(errno));
+      DPRINTF(E_LOG, L_SCAN, "iTunes library parser could not allocate ID map\n");
       goto error;
     }
 
-  plist_from_xml(itml_xml, sb.st_size, &itml);
-
-  ret = munmap(itml_xml, sb.st_size);
-  if (ret < 0)
-    DPRINTF(E_LOG, L_SCAN, "Could not unmap iTunes library '%s': %s\n", path, strerror(errno));
+  top = mxmlSAXLoadFd(NULL, fd, MXML_OPAQUE_CALLBACK, itml_sax_cb, parser);
+  if (top)
+    mxmlDelete(top);
 
   close(fd);
   fd = -1;
 
-  if (!itml)
-    {
-      DPRINTF(E_LOG, L_SCAN, "iTunes XML playlist '%s' failed to parse\n", path);
-      goto error;
-    }
-
-  if (plist_get_node_type(itml) != PLIST_DICT)
-    {
-      DPRINTF(E_LOG, L_SCAN, "Malformed iTunes XML playlist '%s'\n", path);
-      goto error;
-    }
+  if (parser->failed)
+    goto error;
 
-  /* Meta data */
-  ret = check_meta(itml);
-  if (ret < 0)
+  if (parser->depth != 0)
     {
-      DPRINTF(E_LOG, L_SCAN, "Missing meta elements in iTunes XML playlist '%s'\n", path);
+      DPRINTF(E_LOG, L_SCAN, "iTunes XML playlist '%s' failed to parse\n", path);
       goto error;
     }
 
-  /* Tracks */
-  ret = get_dictval_dict_from_key(itml, "Tracks", &node);
-  if (ret < 0)
+  if (!parser->have_tracks)
     {
       DPRINTF(E_LOG, L_SCAN, "Could not find Tracks dict in '%s'\n", path);
       goto error;
     }
 
-  id_map = calloc(ID_MAP_SIZE, sizeof(struct itml_to_db_map *));
-  if (!id_map)
-    {
-      DPRINTF(E_LOG, L_SCAN, "iTunes library parser could not allocate ID map\n");
-      goto error;
-    }
-
-  ret = process_tracks(id_map, node);
-  if (ret <= 0)
-    {
-      DPRINTF(E_LOG, L_SCAN, "No tracks loaded from iTunes XML '%s'\n", path);
-      goto error;
-    }
-
-  DPRINTF(E_LOG, L_SCAN, "Loaded %d tracks from iTunes XML '%s'\n", ret, path);
-
-  /* Playlists */
-  ret = get_dictval_array_from_key(itml, "Playlists", &node);
-  if (ret < 0)
+  if (!parser->have_playlists)
     {
       DPRINTF(E_LOG, L_SCAN, "Could not find Playlists dict in '%s'\n", path);
       goto error;
     }
 
-  process_pls(node, path, id_map);
-
-  id_map_free(id_map);
-  plist_free(itml);
+  id_map_free(parser->id_map);
+  parser_deinit(parser);
+  free(parser);
 
   return;
 
  error:
   if (fd >= 0)
     close(fd);
-  if (itml)
-    plist_free(itml);
-
-  id_map_free(id_map);
+  if (parser)
+    {
+      id_map_free(parser->id_map);
+      parser_deinit(parser);
+      free(parser);
+    }
 
   // We failed this time, but if another request for a scan is made we want to
   // try again - even if the mtime is the same. So here we delete the special
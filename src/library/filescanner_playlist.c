@@ -39,6 +39,9 @@
 #include "misc.h"
 #include "library.h"
 
+// Number of playlist items that are collected before inserting them in the db
+#define PL_ITEMS_BATCH 200
+
 enum playlist_type
 {
   PLAYLIST_UNKNOWN = 0,
@@ -47,6 +50,25 @@ enum playlist_type
   PLAYLIST_SMART,
 };
 
+struct pl_index_entry
+{
+  char *path;
+  uint64_t hash; // Hash of the case-folded filename
+  struct pl_index_entry *next;
+};
+
+// In-memory index of library paths by filename, so that entries in playlists
+// can be matched without a db query per entry
+struct pl_index
+{
+  struct pl_index_entry **buckets;
+  uint32_t mask;
+  int nentries;
+};
+
+// Only set while a bulk scan processes its deferred playlists
+static struct pl_index *pl_index;
+
 static enum playlist_type
 playlist_type(const char *path)
 {
@@ -277,8 +299,192 @@ process_url(int pl_id, const char *path, struct media_file_info *mfi)
   return db_pl_add_item_bypath(pl_id, path);
 }
 
+/* ----------------------- Index of library filenames ---------------------- */
+
+// Same case folding as sqlite's NOCASE collation, i.e. only ASCII
+static uint64_t
+fname_hash(const char *fname)
+{
+  char buf[PATH_MAX];
+  size_t len;
+  size_t i;
+
+  for (i = 0, len = 0; fname[i] && len < sizeof(buf); i++, len++)
+    buf[len] = (fname[i] >= 'A' && fname[i] <= 'Z') ? fname[i] + ('a' - 'A') : fname[i];
+
+  return murmur_hash64(buf, len, 0);
+}
+
+// Counts the '/' separators in the common tail of a and b (ignoring case),
+// e.g. 1 for '/a/b/file.mp3' and '/c/file.mp3', 2 for '/a/b/file.mp3' and
+// '/x/b/file.mp3'. A relative path without a leading '/' is not counted for
+// its first component, so '/a/b/file.mp3' and 'b/file.mp3' also gives 1.
 static int
-process_regular_file(int pl_id, char *path)
+path_match_score(const char *a, const char *b)
+{
+  const char *pa = a + strlen(a);
+  const char *pb = b + strlen(b);
+  int score = 0;
+
+  while (pa > a && pb > b)
+    {
+      pa--;
+      pb--;
+
+      if (tolower((unsigned char)*pa) != tolower((unsigned char)*pb))
+	break;
+      if (*pa == '/')
+	score++;
+    }
+
+  return score;
+}
+
+void
+scan_playlist_index_build(void)
+{
+  struct query_params qp;
+  struct pl_index_entry *entry;
+  char *dbpath;
+  uint32_t nbuckets;
+  int ret;
+
+  scan_playlist_index_free();
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_BROWSE_PATH;
+  qp.sort = S_NONE;
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      db_query_end(&qp);
+      return;
+    }
+
+  for (nbuckets = 1024; nbuckets < qp.results; nbuckets <<= 1)
+    ; // Size so the average chain length is at most 1
+
+  CHECK_NULL(L_SCAN, pl_index = calloc(1, sizeof(struct pl_index)));
+  CHECK_NULL(L_SCAN, pl_index->buckets = calloc(nbuckets, sizeof(struct pl_index_entry *)));
+  pl_index->mask = nbuckets - 1;
+
+  while ((db_query_fetch_string(&dbpath, &qp) == 0) && dbpath)
+    {
+      CHECK_NULL(L_SCAN, entry = malloc(sizeof(struct pl_index_entry)));
+      CHECK_NULL(L_SCAN, entry->path = strdup(dbpath));
+      entry->hash = fname_hash(filename_from_path(dbpath));
+      entry->next = pl_index->buckets[entry->hash & pl_index->mask];
+      pl_index->buckets[entry->hash & pl_index->mask] = entry;
+      pl_index->nentries++;
+    }
+
+  db_query_end(&qp);
+
+  DPRINTF(E_DBG, L_SCAN, "Built playlist index with %d paths\n", pl_index->nentries);
+}
+
+void
+scan_playlist_index_free(void)
+{
+  struct pl_index_entry *entry;
+  uint32_t i;
+
+  if (!pl_index)
+    return;
+
+  for (i = 0; i <= pl_index->mask; i++)
+    {
+      while ((entry = pl_index->buckets[i]))
+	{
+	  pl_index->buckets[i] = entry->next;
+	  free(entry->path);
+	  free(entry);
+	}
+    }
+
+  free(pl_index->buckets);
+  free(pl_index);
+  pl_index = NULL;
+}
+
+// Same matching as the db query in process_regular_file(), but using the index
+static char *
+pl_index_match(const char *path)
+{
+  struct pl_index_entry *entry;
+  const char *fname;
+  const char *winner;
+  uint64_t hash;
+  int ncandidates;
+  int score;
+  int i;
+
+  fname = filename_from_path(path);
+  hash = fname_hash(fname);
+
+  ncandidates = 0;
+  for (entry = pl_index->buckets[hash & pl_index->mask]; entry; entry = entry->next)
+    {
+      if (entry->hash == hash && strcasecmp(filename_from_path(entry->path), fname) == 0)
+	ncandidates++;
+    }
+
+  winner = NULL;
+  score = 0;
+  for (entry = pl_index->buckets[hash & pl_index->mask]; entry; entry = entry->next)
+    {
+      if (entry->hash != hash || strcasecmp(filename_from_path(entry->path), fname) != 0)
+	continue;
+
+      if (ncandidates == 1)
+	{
+	  winner = entry->path;
+	  break;
+	}
+
+      i = path_match_score(path, entry->path);
+
+      DPRINTF(E_SPAM, L_SCAN, "Comparison of '%s' and '%s' gave score %d\n", entry->path, path, i);
+
+      if (i > score)
+	{
+	  winner = entry->path;
+	  score = i;
+	}
+      else if (i == score)
+	winner = NULL;
+    }
+
+  return winner ? strdup(winner) : NULL;
+}
+
+
+/* ----------------------------- Playlist items ---------------------------- */
+
+static int
+pl_items_flush(int pl_id, char **items, int *nitems)
+{
+  int ret;
+  int i;
+
+  if (*nitems == 0)
+    return 0;
+
+  ret = db_pl_add_items_bypath(pl_id, (const char **)items, *nitems);
+
+  for (i = 0; i < *nitems; i++)
+    free(items[i]);
+
+  *nitems = 0;
+
+  return ret;
+}
+
+// Finds the library file that best matches the playlist entry in path. The
+// result must be freed by the caller.
+static int
+process_regular_file(char **winner_path, int pl_id, char *path)
 {
   struct query_params qp;
   char filter[PATH_MAX];
@@ -297,6 +503,19 @@ process_regular_file(int pl_id, char *path)
 	path[i] = '/';
     }
 
+  if (pl_index)
+    {
+      *winner_path = pl_index_match(path);
+      if (!*winner_path)
+	{
+	  DPRINTF(E_LOG, L_SCAN, "No file in the library matches playlist entry '%s'\n", path);
+	  return -1;
+	}
+
+      DPRINTF(E_DBG, L_SCAN, "Adding '%s' to playlist %d\n", *winner_path, pl_id);
+      return 0;
+    }
+
   ret = db_snprintf(filter, sizeof(filter), "f.fname = '%q' COLLATE NOCASE", filename_from_path(path));
   if (ret < 0)
     {
@@ -356,8 +575,7 @@ process_regular_file(int pl_id, char *path)
 
   DPRINTF(E_DBG, L_SCAN, "Adding '%s' to playlist %d (results %d)\n", winner, pl_id, qp.results);
 
-  db_pl_add_item_bypath(pl_id, winner);
-  free(winner);
+  *winner_path = winner;
 
   return 0;
 }
@@ -417,8 +635,11 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
   FILE *fp;
   struct media_file_info mfi;
   char buf[PATH_MAX];
+  char *items[PL_ITEMS_BATCH];
   char *path;
+  char *winner;
   size_t len;
+  int nitems;
   int pl_id;
   int pl_format;
   int ntracks;
@@ -446,6 +667,7 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
   memset(&mfi, 0, sizeof(struct media_file_info));
   ntracks = 0;
   nadded = 0;
+  nitems = 0;
 
   while (fgets(buf, sizeof(buf), fp) != NULL)
     {
@@ -478,18 +700,28 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
       if ((!isalnum(path[0])) && (path[0] != '/') && (path[0] != '.'))
 	continue;
 
-      // URLs and playlists will be added to library, tracks should already be there
+      // URLs and playlists will be added to library, tracks should already be
+      // there. Tracks are collected and added in batches, but the batch must
+      // be flushed before adding a URL, so that the order is kept.
       if (net_is_http_or_https(path))
-	ret = process_url(pl_id, path, &mfi);
+	{
+	  pl_items_flush(pl_id, items, &nitems);
+	  ret = process_url(pl_id, path, &mfi);
+	}
       else if (playlist_type(path) != PLAYLIST_UNKNOWN)
 	ret = process_nested_playlist(pl_id, path);
       else
-	ret = process_regular_file(pl_id, path);
+	{
+	  ret = process_regular_file(&winner, pl_id, path);
+	  if (ret == 0)
+	    items[nitems++] = winner;
+	}
 
       ntracks++;
-      if (ntracks % 200 == 0)
+      if (ntracks % PL_ITEMS_BATCH == 0)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "Processed %d items...\n", ntracks);
+	  pl_items_flush(pl_id, items, &nitems);
 	  db_transaction_end();
 	  db_transaction_begin();
 	}
@@ -501,6 +733,8 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
       free_mfi(&mfi, 1);
     }
 
+  pl_items_flush(pl_id, items, &nitems);
+
   db_transaction_end();
 
   // In case we had some m3u ext metadata that we never got to use, free it now
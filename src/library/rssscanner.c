@@ -50,11 +50,22 @@
 #include "misc_json.h"
 #include "library.h"
 #include "library/filescanner.h"
+#include "rng.h"
 
 #define APPLE_PODCASTS_SERVER "https://podcasts.apple.com/"
 #define APPLE_ITUNES_SERVER "https://itunes.apple.com/"
 #define RSS_LIMIT_DEFAULT 10
 
+// Max number of feeds fetched at the same time during refresh
+#define RSS_FETCH_PARALLEL 8
+
+// Max number of feeds fetched before they are processed
+#define RSS_FETCH_BATCH 32
+
+// The refresh interval is randomized by up to this many seconds, so that feeds
+// are not requested at the same time every hour
+#define RSS_REFRESH_JITTER 300
+
 enum rss_scan_type {
   RSS_SCAN_RESCAN,
   RSS_SCAN_META,
@@ -68,8 +79,30 @@ struct rss_item_info {
   const char *type;
 };
 
+// Validators from the last response from each feed, so that refreshes can use
+// conditional requests. Only accessed from the library thread.
+struct rss_feed {
+  char *path;
+  char *feedurl; // Differs from path for Apple podcast urls
+  char *etag;
+  char *last_modified;
+
+  struct rss_feed *next;
+};
+
+struct rss_fetch {
+  struct rss_feed *feed;
+  struct http_client_ctx ctx;
+  struct keyval output_headers;
+  struct keyval input_headers;
+};
+
 static struct timeval rss_refresh_interval = { 3600, 0 };
 
+static struct rss_feed *rss_feeds;
+
+static struct rng_ctx rss_rng;
+
 // Forward
 static void
 rss_refresh(void *arg);
@@ -233,50 +266,170 @@ playlist_fetch(bool *is_new, const char *path)
   return NULL;
 }
 
-static mxml_node_t *
-rss_xml_get(const char *url)
+static struct rss_feed *
+rss_feed_get(const char *path)
 {
-  struct http_client_ctx ctx = { 0 };
-  const char *raw = NULL;
-  mxml_node_t *xml = NULL;
-  char *feedurl;
-  int ret;
+  struct rss_feed *feed;
+
+  for (feed = rss_feeds; feed; feed = feed->next)
+    {
+      if (strcmp(feed->path, path) == 0)
+	return feed;
+    }
+
+  CHECK_NULL(L_LIB, feed = calloc(1, sizeof(struct rss_feed)));
+  feed->path = strdup(path);
+
+  feed->next = rss_feeds;
+  rss_feeds = feed;
+
+  return feed;
+}
+
+static void
+rss_feed_validators_set(struct rss_feed *feed, struct keyval *headers)
+{
+  free(feed->etag);
+  feed->etag = safe_strdup(keyval_get(headers, "ETag"));
+  free(feed->last_modified);
+  feed->last_modified = safe_strdup(keyval_get(headers, "Last-Modified"));
+}
+
+static void
+rss_feed_free(struct rss_feed *feed)
+{
+  free(feed->path);
+  free(feed->feedurl);
+  free(feed->etag);
+  free(feed->last_modified);
+  free(feed);
+}
+
+static void
+rss_feeds_free(void)
+{
+  struct rss_feed *feed;
+
+  while ((feed = rss_feeds))
+    {
+      rss_feeds = feed->next;
+      rss_feed_free(feed);
+    }
+}
+
+// Removes the validators of feeds that are no longer in the library, i.e. that
+// have been deleted or unsubscribed since the last scan
+static void
+rss_feeds_prune(char **paths, int npaths)
+{
+  struct rss_feed **prev;
+  struct rss_feed *feed;
+  int i;
+
+  prev = &rss_feeds;
+  while ((feed = *prev))
+    {
+      for (i = 0; i < npaths; i++)
+	{
+	  if (strcmp(feed->path, paths[i]) == 0)
+	    break;
+	}
+
+      if (i < npaths)
+	{
+	  prev = &feed->next;
+	  continue;
+	}
+
+      DPRINTF(E_DBG, L_LIB, "Forgetting RSS feed '%s', no longer in library\n", feed->path);
+
+      *prev = feed->next;
+      rss_feed_free(feed);
+    }
+}
+
+// Prepares the request for a feed. If conditional is true and we have
+// validators from a previous response, the server can reply 304 Not Modified.
+static int
+rss_fetch_prepare(struct rss_fetch *fetch, const char *path, bool conditional)
+{
+  struct rss_feed *feed;
+
+  memset(fetch, 0, sizeof(struct rss_fetch));
+
+  feed = rss_feed_get(path);
 
   // Is it an apple podcast stream?
   // ie https://podcasts.apple.com/is/podcast/cgp-grey/id974722423
-  if (strncmp(url, APPLE_PODCASTS_SERVER, strlen(APPLE_PODCASTS_SERVER)) == 0)
+  if (!feed->feedurl && strncmp(path, APPLE_PODCASTS_SERVER, strlen(APPLE_PODCASTS_SERVER)) == 0)
     {
-      feedurl = apple_rss_feedurl_get(url);
-      if (!feedurl)
-	return NULL;
+      feed->feedurl = apple_rss_feedurl_get(path);
+      if (!feed->feedurl)
+	return -1;
     }
-  else
-    feedurl = strdup(url);
+  else if (!feed->feedurl)
+    feed->feedurl = strdup(path);
 
-  CHECK_NULL(L_LIB, ctx.input_body = evbuffer_new());
-  ctx.url = feedurl;
+  if (conditional && feed->etag)
+    keyval_add(&fetch->output_headers, "If-None-Match", feed->etag);
+  if (conditional && feed->last_modified)
+    keyval_add(&fetch->output_headers, "If-Modified-Since", feed->last_modified);
 
-  ret = http_client_request(&ctx, NULL);
-  if (ret < 0 || ctx.response_code != HTTP_OK)
+  CHECK_NULL(L_LIB, fetch->ctx.input_body = evbuffer_new());
+  fetch->ctx.url = feed->feedurl;
+  fetch->ctx.output_headers = &fetch->output_headers;
+  fetch->ctx.input_headers = &fetch->input_headers;
+  fetch->ctx.ret = -1;
+
+  fetch->feed = feed;
+
+  return 0;
+}
+
+static void
+rss_fetch_clear(struct rss_fetch *fetch)
+{
+  if (fetch->ctx.input_body)
+    evbuffer_free(fetch->ctx.input_body);
+
+  keyval_clear(&fetch->output_headers);
+  keyval_clear(&fetch->input_headers);
+
+  memset(fetch, 0, sizeof(struct rss_fetch));
+}
+
+static bool
+rss_fetch_is_unmodified(struct rss_fetch *fetch)
+{
+  return (fetch->ctx.ret == 0 && fetch->ctx.response_code == HTTP_NOTMODIFIED);
+}
+
+static mxml_node_t *
+rss_xml_get(struct rss_fetch *fetch)
+{
+  struct http_client_ctx *ctx = &fetch->ctx;
+  const char *raw = NULL;
+  mxml_node_t *xml = NULL;
+
+  if (ctx->ret < 0 || ctx->response_code != HTTP_OK)
     {
-      DPRINTF(E_LOG, L_LIB, "Failed to fetch RSS from '%s' (return %d, error code %d)\n", ctx.url, ret, ctx.response_code);
-      goto cleanup;
+      DPRINTF(E_LOG, L_LIB, "Failed to fetch RSS from '%s' (return %d, error code %d)\n", ctx->url, ctx->ret, ctx->response_code);
+      return NULL;
     }
 
-  evbuffer_add(ctx.input_body, "", 1);
+  evbuffer_add(ctx->input_body, "", 1);
 
-  raw = (const char*)evbuffer_pullup(ctx.input_body, -1);
+  raw = (const char*)evbuffer_pullup(ctx->input_body, -1);
 
   xml = mxmlLoadString(NULL, raw, MXML_OPAQUE_CALLBACK);
   if (!xml)
     {
-      DPRINTF(E_LOG, L_LIB, "Failed to parse RSS XML from '%s'\n", ctx.url);
-      goto cleanup;
+      DPRINTF(E_LOG, L_LIB, "Failed to parse RSS XML from '%s'\n", ctx->url);
+      return NULL;
     }
 
- cleanup:
-  evbuffer_free(ctx.input_body);
-  free(feedurl);
+  rss_feed_validators_set(fetch->feed, ctx->input_headers);
+
   return xml;
 }
 
@@ -408,7 +561,7 @@ mfi_metadata_fixup(struct media_file_info *mfi, struct rss_item_info *ri, const
 }
 
 static int
-rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
+rss_save(struct playlist_info *pli, int *count, struct rss_fetch *fetch, enum rss_scan_type scan_type)
 {
   mxml_node_t *xml;
   const char *feed_title;
@@ -420,7 +573,7 @@ rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
   void *ptr = NULL;
   int ret;
 
-  xml = rss_xml_get(pli->path);
+  xml = rss_xml_get(fetch);
   if (!xml)
     {
       DPRINTF(E_LOG, L_LIB, "Could not get RSS/xml from '%s' (id %d)\n", pli->path, pli->id);
@@ -503,14 +656,38 @@ rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
   return 0;
 }
 
+// If the feed hasn't changed since last refresh we just protect the playlist
+// and its items from being purged
 static int
-rss_scan(const char *path, enum rss_scan_type scan_type)
+rss_unmodified(const char *path)
+{
+  struct playlist_info *pli;
+
+  pli = db_pl_fetch_bypath(path);
+  if (!pli)
+    return -1;
+
+  db_pl_ping(pli->id);
+  db_pl_ping_items_bymatch("", pli->id);
+
+  DPRINTF(E_DBG, L_SCAN, "RSS feed '%s' (id %d) not modified\n", path, pli->id);
+
+  free_pli(pli, 0);
+  return 0;
+}
+
+// Takes a fetch which has been made, see rss_fetch_prepare()
+static int
+rss_scan(const char *path, struct rss_fetch *fetch, enum rss_scan_type scan_type)
 {
   struct playlist_info *pli;
   bool pl_is_new;
   int count;
   int ret;
 
+  if (rss_fetch_is_unmodified(fetch))
+    return rss_unmodified(path);
+
   // Fetches or creates playlist
   pli = playlist_fetch(&pl_is_new, path);
   if (!pli)
@@ -521,7 +698,7 @@ rss_scan(const char *path, enum rss_scan_type scan_type)
   // metadata from the RSS.
   //
   // playlistitems are only cleared if we are ready to add entries
-  ret = rss_save(pli, &count, scan_type);
+  ret = rss_save(pli, &count, fetch, scan_type);
   if (ret < 0)
     goto error;
 
@@ -543,14 +720,32 @@ rss_scan(const char *path, enum rss_scan_type scan_type)
   return -1;
 }
 
+static void
+rss_refresh_schedule(void)
+{
+  struct timeval wait = rss_refresh_interval;
+
+  wait.tv_sec += rng_rand_range(&rss_rng, 0, RSS_REFRESH_JITTER);
+
+  library_callback_schedule(rss_refresh, NULL, &wait, LIBRARY_CB_ADD_OR_REPLACE);
+}
+
 static void
 rss_scan_all(enum rss_scan_type scan_type)
 {
   struct query_params qp = { 0 };
   struct db_playlist_info dbpli;
+  struct rss_fetch *fetches = NULL;
+  struct http_client_ctx **ctxs = NULL;
+  char **paths = NULL;
   time_t start;
   time_t end;
+  int npaths;
+  int batch;
+  int nbatch;
+  int nctxs;
   int count;
+  int i;
   int ret;
 
   DPRINTF(E_DBG, L_LIB, "Refreshing RSS feeds\n");
@@ -569,23 +764,74 @@ rss_scan_all(enum rss_scan_type scan_type)
       return;
     }
 
-  count = 0;
+  npaths = 0;
   while (((ret = db_query_fetch_pl(&dbpli, &qp)) == 0) && (dbpli.path))
     {
-      ret = rss_scan(dbpli.path, scan_type);
-      if (ret == 0)
-	count++;
+      CHECK_NULL(L_LIB, paths = realloc(paths, (npaths + 1) * sizeof(char *)));
+      paths[npaths] = strdup(dbpli.path);
+      npaths++;
     }
 
   db_query_end(&qp);
   free(qp.filter);
 
+  // Only prune if we got the full list
+  if (ret == 0)
+    rss_feeds_prune(paths, npaths);
+
+  if (npaths == 0)
+    return;
+
+  // The feeds are fetched in batches, with a number of requests in parallel,
+  // and then processed and saved one feed at a time. The batching limits how
+  // many feed bodies we hold in memory. A metadata rescan must get the full
+  // feeds, so no conditional requests in that case.
+  CHECK_NULL(L_LIB, fetches = calloc(RSS_FETCH_BATCH, sizeof(struct rss_fetch)));
+  CHECK_NULL(L_LIB, ctxs = calloc(RSS_FETCH_BATCH, sizeof(struct http_client_ctx *)));
+
+  count = 0;
+  for (batch = 0; batch < npaths; batch += RSS_FETCH_BATCH)
+    {
+      nbatch = MIN(npaths - batch, RSS_FETCH_BATCH);
+
+      for (i = 0, nctxs = 0; i < nbatch && !library_is_exiting(); i++)
+	{
+	  ret = rss_fetch_prepare(&fetches[i], paths[batch + i], (scan_type == RSS_SCAN_RESCAN));
+	  if (ret < 0)
+	    continue;
+
+	  ctxs[nctxs] = &fetches[i].ctx;
+	  nctxs++;
+	}
+
+      http_client_request_multi(ctxs, nctxs, RSS_FETCH_PARALLEL);
+
+      for (i = 0; i < nbatch; i++)
+	{
+	  if (fetches[i].feed && !library_is_exiting())
+	    {
+	      ret = rss_scan(paths[batch + i], &fetches[i], scan_type);
+	      if (ret == 0)
+		count++;
+	    }
+
+	  rss_fetch_clear(&fetches[i]);
+	}
+    }
+
+  for (i = 0; i < npaths; i++)
+    free(paths[i]);
+
+  free(ctxs);
+  free(fetches);
+  free(paths);
+
   end = time(NULL);
 
   if (count == 0)
     return;
 
-  library_callback_schedule(rss_refresh, NULL, &rss_refresh_interval, LIBRARY_CB_ADD_OR_REPLACE);
+  rss_refresh_schedule();
 
   DPRINTF(E_INFO, L_LIB, "Refreshed %d RSS feeds in %.f sec (scan type %d)\n", count, difftime(end, start), scan_type);
 }
@@ -616,12 +862,14 @@ static int
 rss_fullscan(void)
 {
   DPRINTF(E_LOG, L_LIB, "RSS feeds removed during full-rescan\n");
+  rss_feeds_free();
   return LIBRARY_OK;
 }
 
 static int
 rss_add(const char *path)
 {
+  struct rss_fetch fetch;
   int ret;
 
   if (!net_is_http_or_https(path))
@@ -632,19 +880,42 @@ rss_add(const char *path)
 
   DPRINTF(E_DBG, L_LIB, "Adding RSS '%s'\n", path);
 
-  ret = rss_scan(path, RSS_SCAN_RESCAN);
+  ret = rss_fetch_prepare(&fetch, path, false);
   if (ret < 0)
     return LIBRARY_PATH_INVALID;
 
-  library_callback_schedule(rss_refresh, NULL, &rss_refresh_interval, LIBRARY_CB_ADD_OR_REPLACE);
+  fetch.ctx.ret = http_client_request(&fetch.ctx, NULL);
+
+  ret = rss_scan(path, &fetch, RSS_SCAN_RESCAN);
+  rss_fetch_clear(&fetch);
+  if (ret < 0)
+    return LIBRARY_PATH_INVALID;
+
+  rss_refresh_schedule();
 
   return LIBRARY_OK;
 }
 
+static int
+rss_init(void)
+{
+  rng_init(&rss_rng);
+
+  return 0;
+}
+
+static void
+rss_deinit(void)
+{
+  rss_feeds_free();
+}
+
 struct library_source rssscanner =
 {
   .scan_kind = SCAN_KIND_RSS,
   .disabled = 0,
+  .init = rss_init,
+  .deinit = rss_deinit,
   .initscan = rss_rescan,
   .rescan = rss_rescan,
   .metarescan = rss_metascan,
@@ -35,6 +35,10 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <time.h>
+#ifdef HAVE_EVENTFD
+# include <sys/eventfd.h>
+#endif
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -65,6 +69,8 @@ enum mpd_type {
 
 #define MPD_ALL_IDLE_LISTENER_EVENTS (LISTENER_PLAYER | LISTENER_QUEUE | LISTENER_VOLUME | LISTENER_SPEAKER | LISTENER_OPTIONS | LISTENER_DATABASE | LISTENER_UPDATE | LISTENER_STORED_PLAYLIST | LISTENER_RATING)
 #define MPD_RATING_FACTOR 10.0
+#define MPD_BINARY_LIMIT_DEFAULT 8192
+#define MPD_BINARY_LIMIT_MIN 64
 
 static pthread_t tid_mpd;
 
@@ -77,6 +83,20 @@ static struct evhttp *evhttpd;
 static struct evconnlistener *mpd_listener;
 static int mpd_sockfd;
 
+// Listener events not yet handled by the mpd thread. mpd_listener_cb() adds to
+// the mask and only signals the fd if the mask was empty, so a burst of events
+// results in one wakeup of the mpd thread.
+static short mpd_pending_events;
+#ifdef HAVE_EVENTFD
+static int mpd_notify_efd;
+#else
+static int mpd_notify_pipe[2];
+#endif
+static struct event *mpd_notify_ev;
+
+// Minimum time in ms between two idle notifications to the same client
+static int mpd_idle_min_interval;
+
 
 // Virtual path to the default playlist directory
 static char *default_pl_dir;
@@ -211,6 +231,99 @@ find_tagtype(const char *tag)
   return NULL;
 }
 
+/*
+ * Directory listings (lsinfo, listall, listallinfo) can be very large, so they
+ * are produced step by step from a cursor over the directory tree, and only as
+ * fast as the client reads them (see mpd_write_cb).
+ */
+#define MPD_DIR_FILES_PAGE 1000
+
+// Output is added to a listing until this much is waiting to be sent
+#define MPD_DIR_OUTPUT_LIMIT 65536
+
+// Write watermarks of the client socket: data is held back in the client's
+// output evbuffer above the high mark, and the listing continues once the
+// socket has drained to the low mark
+#define MPD_WRITE_LOWAT 65536
+#define MPD_WRITE_HIWAT 262144
+
+enum mpd_dir_stage
+{
+  MPD_DIR_ENTER,
+  MPD_DIR_SUBDIRS,
+  MPD_DIR_FILES,
+};
+
+struct mpd_dir_frame
+{
+  int dir_id;
+  enum mpd_dir_stage stage;
+
+  // Sub directories, loaded when the frame is entered
+  int *subdir_ids;
+  char **subdir_paths;
+  int nsubdirs;
+  int subdir_next;
+
+  // Id of the last file listed, the next page starts after it
+  uint32_t file_last_id;
+
+  struct mpd_dir_frame *parent;
+};
+
+struct mpd_dir_cursor
+{
+  // Directory currently being listed, NULL when the listing is complete
+  struct mpd_dir_frame *frame;
+
+  int listall;
+  int listinfo;
+
+  // Add the stored playlists after the listing (lsinfo of the root directory)
+  bool with_playlists;
+
+  // Command name for the ACK if the listing fails after it was started
+  char *command;
+
+  // Set while adding to the output, so mpd_write_cb does not reenter
+  bool busy;
+};
+
+static void
+mpd_dir_frame_free(struct mpd_dir_frame *frame)
+{
+  int i;
+
+  for (i = 0; i < frame->nsubdirs; i++)
+    free(frame->subdir_paths[i]);
+
+  free(frame->subdir_paths);
+  free(frame->subdir_ids);
+  free(frame);
+}
+
+static void
+mpd_dir_frame_pop(struct mpd_dir_cursor *cursor)
+{
+  struct mpd_dir_frame *frame = cursor->frame;
+
+  cursor->frame = frame->parent;
+  mpd_dir_frame_free(frame);
+}
+
+static void
+mpd_dir_cursor_free(struct mpd_dir_cursor *cursor)
+{
+  if (!cursor)
+    return;
+
+  while (cursor->frame)
+    mpd_dir_frame_pop(cursor);
+
+  free(cursor->command);
+  free(cursor);
+}
+
 /*
  * MPD client connection data
  */
@@ -228,6 +341,28 @@ struct mpd_client_ctx
   // The events the client is waiting for (set by the idle command)
   short idle_events;
 
+  // Time (monotonic, in ms) of the last idle notification
+  uint64_t idle_last_ms;
+
+  // Timer for sending a notification that was held back by the minimum interval
+  struct event *idle_timer;
+
+  // Number of idle notifications sent, and events merged into a later one
+  unsigned int idle_sent;
+  unsigned int idle_suppressed;
+
+  // Directory listing that is being sent to the client
+  struct mpd_dir_cursor *dir_cursor;
+
+  // Max size of the binary data in a response (set by the binarylimit command)
+  size_t binarylimit;
+
+  // Artwork of the last albumart/readpicture request. Clients get the image in
+  // chunks, so the requests for the following chunks are served from here.
+  char *artwork_uri;
+  struct evbuffer *artwork;
+  int artwork_format;
+
   // The output buffer for the client (used to send data to the client)
   struct evbuffer *evbuffer;
 
@@ -254,7 +389,8 @@ free_mpd_client_ctx(void *ctx)
     {
       if (client == client_ctx)
 	{
-	  DPRINTF(E_DBG, L_MPD, "Removing mpd client\n");
+	  DPRINTF(E_DBG, L_MPD, "Removing mpd client (idle notifications sent: %u, suppressed: %u)\n",
+	    client_ctx->idle_sent, client_ctx->idle_suppressed);
 
 	  if (prev)
 	    prev->next = client->next;
@@ -268,6 +404,15 @@ free_mpd_client_ctx(void *ctx)
       client = client->next;
     }
 
+  if (client_ctx->idle_timer)
+    event_free(client_ctx->idle_timer);
+
+  if (client_ctx->artwork)
+    evbuffer_free(client_ctx->artwork);
+  free(client_ctx->artwork_uri);
+
+  mpd_dir_cursor_free(client_ctx->dir_cursor);
+
   free(client_ctx);
 }
 
@@ -873,6 +1018,9 @@ mpd_command_currentsong(struct evbuffer *evbuf, int argc, char **argv, char **er
 static int
 mpd_notify_idle_client(struct mpd_client_ctx *client_ctx, short events);
 
+static void
+mpd_idle_reply(struct mpd_client_ctx *client_ctx, short events);
+
 /*
  * Example input:
  * idle "database" "mixer" "options" "output" "player" "playlist" "sticker" "update"
@@ -932,7 +1080,7 @@ mpd_command_noidle(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
    * empty at this time."
    */
   if (ctx->events)
-    mpd_notify_idle_client(ctx, ctx->events);
+    mpd_idle_reply(ctx, ctx->events);
   else
     evbuffer_add(ctx->evbuffer, "OK\n", 3);
 
@@ -1718,6 +1866,9 @@ mpd_command_add(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, st
     {
       player_get_status(&status);
 
+      // The library thread adds the item, so it must not be blocked by our batch
+      db_queue_batch_end();
+
       // Given path is not in the library, check if it is possible to add as a non-library queue item
       ret = library_queue_item_add(argv[1], -1, status.shuffle, status.item_id, NULL, NULL);
       if (ret != LIBRARY_OK)
@@ -1759,6 +1910,9 @@ mpd_command_addid(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
     {
       player_get_status(&status);
 
+      // The library thread adds the item, so it must not be blocked by our batch
+      db_queue_batch_end();
+
       // Given path is not in the library, directly add it as a new queue item
       ret = library_queue_item_add(argv[1], to_pos, status.shuffle, status.item_id, NULL, NULL);
       if (ret != LIBRARY_OK)
@@ -2818,19 +2972,47 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
   return 0;
 }
 
+static void
+mpd_dir_frame_push(struct mpd_dir_cursor *cursor, int dir_id)
+{
+  struct mpd_dir_frame *frame;
+
+  CHECK_NULL(L_MPD, frame = calloc(1, sizeof(struct mpd_dir_frame)));
+
+  frame->dir_id = dir_id;
+  frame->stage = MPD_DIR_ENTER;
+  frame->parent = cursor->frame;
+
+  cursor->frame = frame;
+}
+
+static void
+mpd_dir_cursor_start(struct mpd_client_ctx *ctx, int dir_id, int listall, int listinfo, bool with_playlists, const char *command)
+{
+  struct mpd_dir_cursor *cursor;
+
+  CHECK_NULL(L_MPD, cursor = calloc(1, sizeof(struct mpd_dir_cursor)));
+
+  cursor->listall = listall;
+  cursor->listinfo = listinfo;
+  cursor->with_playlists = with_playlists;
+  cursor->command = safe_strdup(command);
+
+  mpd_dir_frame_push(cursor, dir_id);
+
+  mpd_dir_cursor_free(ctx->dir_cursor);
+  ctx->dir_cursor = cursor;
+}
+
 static int
-mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int listinfo, char **errmsg)
+mpd_dir_playlists_add(struct evbuffer *evbuf, int directory_id, int listinfo, char **errmsg)
 {
-  struct directory_info subdir;
   struct query_params qp;
-  struct directory_enum dir_enum;
   struct db_playlist_info dbpli;
   char modified[32];
   uint32_t time_modified;
-  struct db_media_file_info dbmfi;
   int ret;
 
-  // Load playlists for dir-id
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_PL;
   qp.sort = S_PLAYLIST;
@@ -2870,56 +3052,78 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
   db_query_end(&qp);
   free(qp.filter);
 
-  // Load sub directories for dir-id
+  return 0;
+}
+
+static int
+mpd_dir_subdirs_load(struct mpd_dir_frame *frame, char **errmsg)
+{
+  struct directory_enum dir_enum;
+  struct directory_info subdir;
+  int size;
+  int ret;
+
   memset(&dir_enum, 0, sizeof(struct directory_enum));
-  dir_enum.parent_id = directory_id;
+  dir_enum.parent_id = frame->dir_id;
   ret = db_directory_enum_start(&dir_enum);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_MPD, "Failed to start directory enum for parent_id %d\n", directory_id);
+      DPRINTF(E_LOG, L_MPD, "Failed to start directory enum for parent_id %d\n", frame->dir_id);
       db_directory_enum_end(&dir_enum);
-      return -1;
+      *errmsg = safe_asprintf("Could not start directory enum");
+      return ACK_ERROR_UNKNOWN;
     }
+
+  size = 0;
   while ((ret = db_directory_enum_fetch(&dir_enum, &subdir)) == 0 && subdir.id > 0)
     {
-      if (listinfo)
-	{
-	  evbuffer_add_printf(evbuf,
-	    "directory: %s\n"
-	    "Last-Modified: %s\n",
-	    (subdir.virtual_path + 1),
-	    "2015-12-01 00:00");
-	}
-      else
+      if (frame->nsubdirs == size)
 	{
-	  evbuffer_add_printf(evbuf,
-	    "directory: %s\n",
-	    (subdir.virtual_path + 1));
+	  size = size ? 2 * size : 16;
+	  CHECK_NULL(L_MPD, frame->subdir_ids = realloc(frame->subdir_ids, size * sizeof(int)));
+	  CHECK_NULL(L_MPD, frame->subdir_paths = realloc(frame->subdir_paths, size * sizeof(char *)));
 	}
 
-      if (listall)
-	{
-	  mpd_add_directory(evbuf, subdir.id, listall, listinfo, errmsg);
-	}
+      frame->subdir_ids[frame->nsubdirs] = subdir.id;
+      frame->subdir_paths[frame->nsubdirs] = safe_strdup(subdir.virtual_path);
+      frame->nsubdirs++;
     }
   db_directory_enum_end(&dir_enum);
 
-  // Load files for dir-id
+  return 0;
+}
+
+// Adds the next page of files in the directory, sets *nfiles to the number added
+static int
+mpd_dir_files_add(struct evbuffer *evbuf, struct mpd_dir_frame *frame, int listinfo, int *nfiles, char **errmsg)
+{
+  struct query_params qp;
+  struct db_media_file_info dbmfi;
+  int ret;
+
+  *nfiles = 0;
+
+  // Paged by id, which unlike the other sort keys is unique, so a page starts
+  // exactly where the previous one ended without the db skipping rows
   memset(&qp, 0, sizeof(struct query_params));
   qp.type = Q_ITEMS;
-  qp.sort = S_ARTIST;
-  qp.idx_type = I_NONE;
-  qp.filter = db_mprintf("(f.directory_id = %d)", directory_id);
+  qp.order = strdup("f.id");
+  qp.idx_type = I_SUB;
+  qp.limit = MPD_DIR_FILES_PAGE;
+  qp.filter = db_mprintf("(f.directory_id = %d AND f.id > %" PRIu32 ")", frame->dir_id, frame->file_last_id);
   ret = db_query_start(&qp);
   if (ret < 0)
     {
       db_query_end(&qp);
       free(qp.filter);
+      free(qp.order);
       *errmsg = safe_asprintf("Could not start query");
       return ACK_ERROR_UNKNOWN;
     }
   while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
     {
+      safe_atou32(dbmfi.id, &frame->file_last_id);
+
       if (listinfo)
 	{
 	  ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
@@ -2934,13 +3138,118 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
 	    "file: %s\n",
 	    (dbmfi.virtual_path + 1));
 	}
+
+      (*nfiles)++;
     }
   db_query_end(&qp);
   free(qp.filter);
+  free(qp.order);
 
   return 0;
 }
 
+/*
+ * Adds the next part of the listing to evbuf: the playlists of a directory, a
+ * sub directory or a page of files. The order is the same as a depth first
+ * traversal: playlists, then each sub directory (followed by its contents if
+ * listall is set), then the files.
+ */
+static int
+mpd_dir_cursor_step(struct evbuffer *evbuf, struct mpd_dir_cursor *cursor, char **errmsg)
+{
+  struct mpd_dir_frame *frame = cursor->frame;
+  char *path;
+  int nfiles;
+  int ret;
+
+  switch (frame->stage)
+    {
+      case MPD_DIR_ENTER:
+	ret = mpd_dir_playlists_add(evbuf, frame->dir_id, cursor->listinfo, errmsg);
+	if (ret == 0)
+	  ret = mpd_dir_subdirs_load(frame, errmsg);
+
+	frame->stage = MPD_DIR_SUBDIRS;
+	return ret;
+
+      case MPD_DIR_SUBDIRS:
+	if (frame->subdir_next >= frame->nsubdirs)
+	  {
+	    frame->stage = MPD_DIR_FILES;
+	    return 0;
+	  }
+
+	path = frame->subdir_paths[frame->subdir_next];
+	if (cursor->listinfo)
+	  {
+	    evbuffer_add_printf(evbuf,
+	      "directory: %s\n"
+	      "Last-Modified: %s\n",
+	      (path + 1),
+	      "2015-12-01 00:00");
+	  }
+	else
+	  {
+	    evbuffer_add_printf(evbuf,
+	      "directory: %s\n",
+	      (path + 1));
+	  }
+
+	if (cursor->listall)
+	  mpd_dir_frame_push(cursor, frame->subdir_ids[frame->subdir_next]);
+
+	frame->subdir_next++;
+	return 0;
+
+      case MPD_DIR_FILES:
+	ret = mpd_dir_files_add(evbuf, frame, cursor->listinfo, &nfiles, errmsg);
+	if (ret != 0 || nfiles < MPD_DIR_FILES_PAGE)
+	  mpd_dir_frame_pop(cursor);
+
+	return ret;
+    }
+
+  return 0;
+}
+
+/*
+ * Continues the client's directory listing until evbuf holds at least limit
+ * bytes (no limit if 0). When the listing is complete or has failed, the
+ * cursor is freed and ctx->dir_cursor is reset.
+ *
+ * @return 0 on success, ACK error code on failure
+ */
+static int
+mpd_dir_cursor_run(struct evbuffer *evbuf, struct mpd_client_ctx *ctx, size_t limit, char **errmsg)
+{
+  struct mpd_dir_cursor *cursor = ctx->dir_cursor;
+  int ret;
+
+  ret = 0;
+  cursor->busy = true;
+
+  while (cursor->frame && (limit == 0 || evbuffer_get_length(evbuf) < limit))
+    {
+      ret = mpd_dir_cursor_step(evbuf, cursor, errmsg);
+      if (ret != 0)
+	break;
+    }
+
+  cursor->busy = false;
+
+  if (ret == 0 && cursor->frame)
+    return 0;
+
+  // If the root directory was listed add the stored playlists to the response
+  if (ret == 0 && cursor->with_playlists)
+    ret = mpd_command_listplaylists(evbuf, 0, NULL, errmsg, ctx);
+
+  mpd_dir_cursor_free(cursor);
+  ctx->dir_cursor = NULL;
+
+  return ret;
+}
+
 static int
 mpd_command_listall(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
@@ -2976,9 +3285,9 @@ mpd_command_listall(struct evbuffer *evbuf, int argc, char **argv, char **errmsg
       return ACK_ERROR_NO_EXIST;
     }
 
-  ret = mpd_add_directory(evbuf, dir_id, 1, 0, errmsg);
+  mpd_dir_cursor_start(ctx, dir_id, 1, 0, false, argv[0]);
 
-  return ret;
+  return 0;
 }
 
 static int
@@ -3016,9 +3325,9 @@ mpd_command_listallinfo(struct evbuffer *evbuf, int argc, char **argv, char **er
       return ACK_ERROR_NO_EXIST;
     }
 
-  ret = mpd_add_directory(evbuf, dir_id, 1, 1, errmsg);
+  mpd_dir_cursor_start(ctx, dir_id, 1, 1, false, argv[0]);
 
-  return ret;
+  return 0;
 }
 
 /*
@@ -3030,7 +3339,7 @@ mpd_command_lsinfo(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
 {
   int dir_id;
   char parent[PATH_MAX];
-  int print_playlists;
+  bool print_playlists;
   int ret;
 
   if (argc < 2 || strlen(argv[1]) == 0
@@ -3053,7 +3362,7 @@ mpd_command_lsinfo(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
       return ACK_ERROR_UNKNOWN;
     }
 
-  print_playlists = 0;
+  print_playlists = false;
   if ((strncmp(parent, "/", 1) == 0 && strlen(parent) == 1))
     {
       /*
@@ -3061,7 +3370,7 @@ mpd_command_lsinfo(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
        * In this case additional to the directory contents the stored playlists will be returned.
        * This behavior is deprecated in the mpd protocol but clients like ncmpccp or ympd uses it.
        */
-      print_playlists = 1;
+      print_playlists = true;
     }
 
 
@@ -3073,15 +3382,10 @@ mpd_command_lsinfo(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
       return ACK_ERROR_NO_EXIST;
     }
 
-  ret = mpd_add_directory(evbuf, dir_id, 0, 1, errmsg);
-
-  // If the root directory was passed as argument add the stored playlists to the response
-  if (ret == 0 && print_playlists)
-    {
-      return mpd_command_listplaylists(evbuf, argc, argv, errmsg, ctx);
-    }
+  // If the root directory was passed as argument the stored playlists are added after the listing
+  mpd_dir_cursor_start(ctx, dir_id, 0, 1, print_playlists, argv[0]);
 
-  return ret;
+  return 0;
 }
 
 /*
@@ -3210,6 +3514,165 @@ mpd_command_update(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
   return 0;
 }
 
+/*
+ * Loads the artwork for the given uri into the client's artwork buffer, unless
+ * it is already there. The first chunk (offset 0) always reloads, so a client
+ * gets new artwork when it requests the image again. artwork_get_item() uses
+ * the artwork cache, so that is usually also cheap.
+ *
+ * @return 0 if the client has artwork for the uri, -1 if there is no artwork
+ */
+static int
+mpd_artwork_load(struct mpd_client_ctx *ctx, const char *uri, size_t offset)
+{
+  struct media_file_info *mfi;
+  char *virtual_path;
+  int id;
+
+  if (offset > 0 && ctx->artwork_uri && strcmp(ctx->artwork_uri, uri) == 0)
+    return ctx->artwork ? 0 : -1;
+
+  free(ctx->artwork_uri);
+  ctx->artwork_uri = strdup(uri);
+  if (ctx->artwork)
+    evbuffer_drain(ctx->artwork, evbuffer_get_length(ctx->artwork));
+  else
+    CHECK_NULL(L_MPD, ctx->artwork = evbuffer_new());
+
+  // The uri is either a song or a directory
+  virtual_path = prepend_slash(uri);
+  mfi = db_file_fetch_byvirtualpath(virtual_path);
+  if (mfi)
+    id = mfi->id;
+  else
+    id = db_file_id_by_virtualpath_match(virtual_path);
+  free_mfi(mfi, 0);
+  free(virtual_path);
+
+  if (id > 0)
+    ctx->artwork_format = artwork_get_item(ctx->artwork, id, ART_DEFAULT_WIDTH, ART_DEFAULT_HEIGHT, 0);
+  else
+    ctx->artwork_format = -1;
+
+  if (ctx->artwork_format < 0)
+    {
+      DPRINTF(E_DBG, L_MPD, "No artwork found for uri '%s'\n", uri);
+      evbuffer_free(ctx->artwork);
+      ctx->artwork = NULL;
+      return -1;
+    }
+
+  return 0;
+}
+
+/*
+ * Adds a chunk of the client's artwork buffer to the response:
+ *
+ * size: 41232
+ * type: image/jpeg  (if with_type is set)
+ * binary: 8192
+ * <8192 bytes>
+ */
+static int
+mpd_artwork_chunk_add(struct evbuffer *evbuf, struct mpd_client_ctx *ctx, size_t offset, bool with_type, char **errmsg)
+{
+  struct evbuffer_ptr ptr;
+  struct evbuffer_iovec iov[8];
+  size_t size;
+  size_t len;
+  size_t n;
+  int nvec;
+  int i;
+
+  size = evbuffer_get_length(ctx->artwork);
+  if (offset > size)
+    {
+      *errmsg = safe_asprintf("Offset too large");
+      return ACK_ERROR_ARG;
+    }
+
+  len = MIN(size - offset, ctx->binarylimit);
+
+  evbuffer_add_printf(evbuf, "size: %zu\n", size);
+  if (with_type)
+    evbuffer_add_printf(evbuf, "type: %s\n", (ctx->artwork_format == ART_FMT_PNG) ? "image/png" : "image/jpeg");
+  evbuffer_add_printf(evbuf, "binary: %zu\n", len);
+
+  // Copy the chunk without linearizing the image buffer
+  evbuffer_ptr_set(ctx->artwork, &ptr, offset, EVBUFFER_PTR_SET);
+  while (len > 0)
+    {
+      nvec = evbuffer_peek(ctx->artwork, len, &ptr, iov, ARRAY_SIZE(iov));
+      if (nvec <= 0)
+	break;
+
+      for (i = 0; i < nvec && i < ARRAY_SIZE(iov) && len > 0; i++)
+	{
+	  n = MIN(iov[i].iov_len, len);
+	  evbuffer_add(evbuf, iov[i].iov_base, n);
+	  evbuffer_ptr_set(ctx->artwork, &ptr, n, EVBUFFER_PTR_ADD);
+	  len -= n;
+	}
+    }
+
+  evbuffer_add(evbuf, "\n", 1);
+
+  return 0;
+}
+
+/*
+ * Command handler function for 'albumart'
+ * Returns a chunk of the artwork for the song or directory in argv[1], starting
+ * at the offset in argv[2]. The client requests the chunks one after another.
+ */
+static int
+mpd_command_albumart(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  uint32_t offset;
+  int ret;
+
+  ret = safe_atou32(argv[2], &offset);
+  if (ret < 0)
+    {
+      *errmsg = safe_asprintf("Argument doesn't convert to integer: '%s'", argv[2]);
+      return ACK_ERROR_ARG;
+    }
+
+  ret = mpd_artwork_load(ctx, argv[1], offset);
+  if (ret < 0)
+    {
+      *errmsg = safe_asprintf("No file exists");
+      return ACK_ERROR_NO_EXIST;
+    }
+
+  return mpd_artwork_chunk_add(evbuf, ctx, offset, false, errmsg);
+}
+
+/*
+ * Command handler function for 'readpicture'
+ * Like albumart, but also returns the image type. If there is no artwork the
+ * response is empty instead of an error.
+ */
+static int
+mpd_command_readpicture(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  uint32_t offset;
+  int ret;
+
+  ret = safe_atou32(argv[2], &offset);
+  if (ret < 0)
+    {
+      *errmsg = safe_asprintf("Argument doesn't convert to integer: '%s'", argv[2]);
+      return ACK_ERROR_ARG;
+    }
+
+  ret = mpd_artwork_load(ctx, argv[1], offset);
+  if (ret < 0)
+    return 0;
+
+  return mpd_artwork_chunk_add(evbuf, ctx, offset, true, errmsg);
+}
+
 static int
 mpd_sticker_get(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, const char *virtual_path)
 {
@@ -3545,6 +4008,30 @@ mpd_command_password(struct evbuffer *evbuf, int argc, char **argv, char **errms
   return ACK_ERROR_PASSWORD;
 }
 
+static int
+mpd_command_binarylimit(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
+{
+  uint32_t size;
+  int ret;
+
+  ret = safe_atou32(argv[1], &size);
+  if (ret < 0)
+    {
+      *errmsg = safe_asprintf("Argument doesn't convert to integer: '%s'", argv[1]);
+      return ACK_ERROR_ARG;
+    }
+
+  if (size < MPD_BINARY_LIMIT_MIN)
+    {
+      *errmsg = safe_asprintf("Value too small");
+      return ACK_ERROR_ARG;
+    }
+
+  ctx->binarylimit = size;
+
+  return 0;
+}
+
 /*
  * Callback function for the 'player_speaker_enumerate' function.
  * Expect a struct output_get_param as argument and allocates a struct output if
@@ -4036,11 +4523,17 @@ struct mpd_command
    */
   int (*handler)(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx);
   int min_argc;
+
+  /*
+   * True if the command only adds to the queue through the db, so that within a
+   * command list it can be part of one queue batch (see db_queue_batch_begin)
+   */
+  bool queue_batch;
 };
 
 static struct mpd_command mpd_handlers[] =
   {
-    /* commandname                | handler function                      | minimum argument count*/
+    /* commandname                | handler function                      | minimum argument count | queue batch */
 
     // Commands for querying status
     { "clearerror",                 mpd_command_ignore,                     -1 },
@@ -4075,8 +4568,8 @@ static struct mpd_command mpd_handlers[] =
     { "stop",                       mpd_command_stop,                       -1 },
 
     // The current playlist
-    { "add",                        mpd_command_add,                         2 },
-    { "addid",                      mpd_command_addid,                       2 },
+    { "add",                        mpd_command_add,                         2, true },
+    { "addid",                      mpd_command_addid,                       2, true },
     { "clear",                      mpd_command_clear,                      -1 },
     { "delete",                     mpd_command_delete,                     -1 },
     { "deleteid",                   mpd_command_deleteid,                    2 },
@@ -4112,17 +4605,19 @@ static struct mpd_command mpd_handlers[] =
     { "save",                       mpd_command_save,                        2 },
 
     // The music database
+    { "albumart",                   mpd_command_albumart,                    3 },
     { "count",                      mpd_command_count,                      -1 },
     { "find",                       mpd_command_find,                       -1 },
-    { "findadd",                    mpd_command_findadd,                    -1 },
+    { "findadd",                    mpd_command_findadd,                    -1, true },
     { "list",                       mpd_command_list,                       -1 },
     { "listall",                    mpd_command_listall,                    -1 },
     { "listallinfo",                mpd_command_listallinfo,                -1 },
     { "listfiles",                  mpd_command_listfiles,                  -1 },
     { "lsinfo",                     mpd_command_lsinfo,                     -1 },
 //    { "readcomments",               mpd_command_readcomments,               -1 },
+    { "readpicture",                mpd_command_readpicture,                 3 },
     { "search",                     mpd_command_search,                     -1 },
-    { "searchadd",                  mpd_command_searchadd,                  -1 },
+    { "searchadd",                  mpd_command_searchadd,                  -1, true },
 //    { "searchaddpl",                mpd_command_searchaddpl,                -1 },
     { "update",                     mpd_command_update,                     -1 },
 //    { "rescan",                     mpd_command_rescan,                     -1 },
@@ -4137,6 +4632,7 @@ static struct mpd_command mpd_handlers[] =
     { "sticker",                    mpd_command_sticker,                     4 },
 
     // Connection settings
+    { "binarylimit",                mpd_command_binarylimit,                 2 },
     { "close",                      mpd_command_ignore,                     -1 },
 //    { "kill",                       mpd_command_kill,                       -1 },
     { "password",                   mpd_command_password,                   -1 },
@@ -4208,6 +4704,52 @@ mpd_command_commands(struct evbuffer *evbuf, int argc, char **argv, char **errms
 }
 
 
+/*
+ * Adds the next part of the client's directory listing to the output, and the
+ * final OK (or ACK) when the listing is complete. Reading commands from the
+ * client is suspended while the listing is pending.
+ *
+ * @return true if the listing was completed by this call
+ */
+static bool
+mpd_dir_listing_continue(struct bufferevent *bev, struct mpd_client_ctx *client_ctx)
+{
+  struct evbuffer *output;
+  char *command;
+  char *errmsg;
+  int ret;
+
+  // Adding output can invoke the write callback from within mpd_dir_cursor_run
+  if (!client_ctx->dir_cursor || client_ctx->dir_cursor->busy)
+    return false;
+
+  output = bufferevent_get_output(bev);
+  command = safe_strdup(client_ctx->dir_cursor->command);
+
+  ret = mpd_dir_cursor_run(output, client_ctx, MPD_DIR_OUTPUT_LIMIT, &errmsg);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_MPD, "Error executing command '%s': %s\n", command, errmsg);
+      evbuffer_add_printf(output, "ACK [%d@%d] {%s} %s\n", ret, 0, command, errmsg);
+      free(errmsg);
+    }
+  else if (!client_ctx->dir_cursor)
+    {
+      evbuffer_add(output, "OK\n", 3);
+    }
+
+  free(command);
+
+  if (client_ctx->dir_cursor)
+    {
+      bufferevent_disable(bev, EV_READ);
+      return false;
+    }
+
+  bufferevent_enable(bev, EV_READ);
+  return true;
+}
+
 /*
  * The read callback function is invoked if a complete command sequence was received from the client
  * (see mpd_input_filter function).
@@ -4228,6 +4770,7 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
   enum command_list_type listtype;
   int idle_cmd;
   int close_cmd;
+  int dir_cmd;
   char *argv[COMMAND_ARGV_MAX];
   int argc;
   struct mpd_client_ctx *client_ctx = (struct mpd_client_ctx *)ctx;
@@ -4241,6 +4784,7 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
 
   idle_cmd = 0;
   close_cmd = 0;
+  dir_cmd = 0;
 
   listtype = COMMAND_LIST_NONE;
   ncmd = 0;
@@ -4297,6 +4841,17 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
        */
       command = mpd_find_command(argv[0]);
 
+      /*
+       * Consecutive queue additions in a command list are run as one batch (one
+       * transaction, one queue version change and one idle event). The batch
+       * must end before any other command, since that might depend on the
+       * changes being visible to other threads, e.g. "play".
+       */
+      if (command && command->queue_batch && listtype != COMMAND_LIST_NONE && client_ctx->authenticated)
+	db_queue_batch_begin();
+      else
+	db_queue_batch_end();
+
       if (command == NULL)
 	{
 	  errmsg = safe_asprintf("Unsupported command '%s'", argv[0]);
@@ -4320,6 +4875,23 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
       else
 	ret = command->handler(output, argc, argv, &errmsg, client_ctx);
 
+      /*
+       * A directory listing is sent as the client reads it (see mpd_write_cb),
+       * the remaining input is processed when the listing is complete. In a
+       * command list the listing is added right away.
+       */
+      if (ret == 0 && client_ctx->dir_cursor)
+	{
+	  if (listtype == COMMAND_LIST_NONE)
+	    {
+	      dir_cmd = 1;
+	      free(line);
+	      break;
+	    }
+
+	  ret = mpd_dir_cursor_run(output, client_ctx, 0, &errmsg);
+	}
+
       /*
        * If an error occurred, add the ACK line to the response buffer and exit the loop
        */
@@ -4351,6 +4923,8 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
       ncmd++;
     }
 
+  db_queue_batch_end();
+
   DPRINTF(E_SPAM, L_MPD, "Finished MPD command sequence: %d\n", ret);
 
   /*
@@ -4363,6 +4937,14 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
       evbuffer_add(output, "OK\n", 3);
     }
 
+  if (dir_cmd)
+    {
+      // Remaining commands are processed when the listing is complete
+      if (mpd_dir_listing_continue(bev, client_ctx) && evbuffer_get_length(input) > 0)
+	mpd_read_cb(bev, ctx);
+      return;
+    }
+
   if (close_cmd)
     {
       /*
@@ -4375,6 +4957,21 @@ mpd_read_cb(struct bufferevent *bev, void *ctx)
     }
 }
 
+/*
+ * The write callback function is invoked when the client has read the output.
+ * If a directory listing is pending, the next part is added, and when it is
+ * complete any commands the client sent in the meantime are processed.
+ *
+ * @param bev the buffer event
+ * @param ctx the client context
+ */
+static void
+mpd_write_cb(struct bufferevent *bev, void *ctx)
+{
+  if (mpd_dir_listing_continue(bev, ctx) && evbuffer_get_length(bufferevent_get_input(bev)) > 0)
+    mpd_read_cb(bev, ctx);
+}
+
 /*
  * Callback when an event occurs on the bufferevent
  */
@@ -4505,6 +5102,8 @@ mpd_accept_conn_cb(struct evconnlistener *listener,
       return;
     }
 
+  client_ctx->binarylimit = MPD_BINARY_LIMIT_DEFAULT;
+
   client_ctx->authenticated = !cfg_getstr(cfg_getsec(cfg, "library"), "password");
   if (!client_ctx->authenticated)
     {
@@ -4515,8 +5114,12 @@ mpd_accept_conn_cb(struct evconnlistener *listener,
   client_ctx->next = mpd_clients;
   mpd_clients = client_ctx;
 
+  // The filter event only passes output to the socket up to the high watermark,
+  // which is what lets large directory listings wait for the client
+  bufferevent_setwatermark(bev, EV_WRITE, MPD_WRITE_LOWAT, MPD_WRITE_HIWAT);
+
   bev = bufferevent_filter_new(bev, mpd_input_filter, NULL, BEV_OPT_CLOSE_ON_FREE, free_mpd_client_ctx, client_ctx);
-  bufferevent_setcb(bev, mpd_read_cb, NULL, mpd_event_cb, client_ctx);
+  bufferevent_setcb(bev, mpd_read_cb, mpd_write_cb, mpd_event_cb, client_ctx);
   bufferevent_enable(bev, EV_READ | EV_WRITE);
 
   /*
@@ -4543,21 +5146,19 @@ mpd_accept_error_cb(struct evconnlistener *listener, void *ctx)
   DPRINTF(E_LOG, L_MPD, "Error occured %d (%s) on the listener.\n", err, evutil_socket_error_to_string(err));
 }
 
-static int
-mpd_notify_idle_client(struct mpd_client_ctx *client_ctx, short events)
+static uint64_t
+mpd_now_ms(void)
 {
-  if (!client_ctx->is_idle)
-    {
-      client_ctx->events |= events;
-      return 1;
-    }
+  struct timespec ts;
 
-  if (!(client_ctx->idle_events & events))
-    {
-      DPRINTF(E_DBG, L_MPD, "Client not listening for events: %d\n", events);
-      return 1;
-    }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
+static void
+mpd_idle_reply(struct mpd_client_ctx *client_ctx, short events)
+{
   if (events & LISTENER_DATABASE)
     evbuffer_add(client_ctx->evbuffer, "changed: database\n", 18);
   if (events & LISTENER_UPDATE)
@@ -4582,44 +5183,124 @@ mpd_notify_idle_client(struct mpd_client_ctx *client_ctx, short events)
   client_ctx->is_idle = false;
   client_ctx->idle_events = 0;
   client_ctx->events = 0;
+  client_ctx->idle_last_ms = mpd_now_ms();
+  client_ctx->idle_sent++;
+}
 
-  return 0;
+static void
+mpd_idle_timer_cb(int fd, short what, void *arg)
+{
+  struct mpd_client_ctx *client_ctx = arg;
+
+  if (client_ctx->events)
+    mpd_notify_idle_client(client_ctx, client_ctx->events);
 }
 
-static enum command_state
-mpd_notify_idle(void *arg, int *retval)
+/*
+ * Sends the idle reply if the client is waiting for one of the events. If the
+ * last notification was less than mpd_idle_min_interval ago, the events are
+ * kept and sent together with any following events when the interval is over.
+ */
+static int
+mpd_notify_idle_client(struct mpd_client_ctx *client_ctx, short events)
 {
-  short event_mask;
-  struct mpd_client_ctx *client;
-  int i;
+  struct timeval tv;
+  uint64_t elapsed_ms;
 
-  event_mask = *(short *)arg;
-  DPRINTF(E_DBG, L_MPD, "Notify clients waiting for idle results: %d\n", event_mask);
+  if (!client_ctx->is_idle)
+    {
+      client_ctx->events |= events;
+      return 1;
+    }
 
-  i = 0;
-  client = mpd_clients;
-  while (client)
+  if (!(client_ctx->idle_events & events))
+    {
+      DPRINTF(E_DBG, L_MPD, "Client not listening for events: %d\n", events);
+      return 1;
+    }
+
+  if (mpd_idle_min_interval > 0 && client_ctx->idle_sent > 0)
     {
-      DPRINTF(E_DBG, L_MPD, "Notify client #%d\n", i);
+      elapsed_ms = mpd_now_ms() - client_ctx->idle_last_ms;
+      if (elapsed_ms < mpd_idle_min_interval)
+	{
+	  client_ctx->events |= events;
+	  client_ctx->idle_suppressed++;
 
-      mpd_notify_idle_client(client, event_mask);
-      client = client->next;
-      i++;
+	  if (!client_ctx->idle_timer)
+	    CHECK_NULL(L_MPD, client_ctx->idle_timer = evtimer_new(evbase_mpd, mpd_idle_timer_cb, client_ctx));
+
+	  if (!evtimer_pending(client_ctx->idle_timer, NULL))
+	    {
+	      tv.tv_sec = (mpd_idle_min_interval - elapsed_ms) / 1000;
+	      tv.tv_usec = ((mpd_idle_min_interval - elapsed_ms) % 1000) * 1000;
+	      evtimer_add(client_ctx->idle_timer, &tv);
+	    }
+
+	  return 1;
+	}
     }
 
-  *retval = 0;
-  return COMMAND_END;
+  mpd_idle_reply(client_ctx, client_ctx->events | events);
+
+  return 0;
+}
+
+/* Thread: mpd */
+static void
+mpd_notify_cb(int fd, short what, void *arg)
+{
+  struct mpd_client_ctx *client;
+  short event_mask;
+  int ret;
+
+#ifdef HAVE_EVENTFD
+  eventfd_t count;
+
+  ret = eventfd_read(mpd_notify_efd, &count);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_MPD, "Could not read notify event counter: %s\n", strerror(errno));
+#else
+  char dummy[32];
+
+  // Drain, there may be more than one write
+  ret = read(mpd_notify_pipe[0], dummy, sizeof(dummy));
+  if (ret < 0)
+    DPRINTF(E_LOG, L_MPD, "Could not read from notify pipe: %s\n", strerror(errno));
+#endif
+
+  event_mask = __atomic_exchange_n(&mpd_pending_events, 0, __ATOMIC_ACQ_REL);
+  if (!event_mask)
+    return;
+
+  DPRINTF(E_DBG, L_MPD, "Notify clients waiting for idle results: %d\n", event_mask);
+
+  for (client = mpd_clients; client; client = client->next)
+    mpd_notify_idle_client(client, event_mask);
 }
 
+/* Thread: the thread the event occurred */
 static void
 mpd_listener_cb(short event_mask)
 {
-  short *ptr;
+  short old_mask;
+  int ret;
 
-  ptr = (short *)malloc(sizeof(short));
-  *ptr = event_mask;
-  DPRINTF(E_DBG, L_MPD, "Asynchronous listener callback called with event type %d.\n", event_mask);
-  commands_exec_async(cmdbase, mpd_notify_idle, ptr);
+  old_mask = __atomic_fetch_or(&mpd_pending_events, event_mask, __ATOMIC_ACQ_REL);
+  if (old_mask)
+    return; // mpd thread has already been signaled and will pick up our events too
+
+#ifdef HAVE_EVENTFD
+  ret = eventfd_write(mpd_notify_efd, 1);
+  if (ret < 0)
+    DPRINTF(E_LOG, L_MPD, "Could not send notify event: %s\n", strerror(errno));
+#else
+  char dummy = 42;
+
+  ret = write(mpd_notify_pipe[1], &dummy, sizeof(dummy));
+  if (ret != sizeof(dummy))
+    DPRINTF(E_LOG, L_MPD, "Could not write to notify pipe: %s\n", strerror(errno));
+#endif
 }
 
 /*
@@ -4792,6 +5473,35 @@ mpd_init(void)
   CHECK_NULL(L_MPD, evbase_mpd = event_base_new());
   CHECK_NULL(L_MPD, cmdbase = commands_base_new(evbase_mpd, NULL));
 
+  mpd_idle_min_interval = cfg_getint(cfg_getsec(cfg, "mpd"), "idle_min_interval");
+
+#ifdef HAVE_EVENTFD
+  mpd_notify_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (mpd_notify_efd < 0)
+    {
+      DPRINTF(E_LOG, L_MPD, "Could not create notify eventfd: %s\n", strerror(errno));
+      goto notify_fail;
+    }
+
+  CHECK_NULL(L_MPD, mpd_notify_ev = event_new(evbase_mpd, mpd_notify_efd, EV_READ | EV_PERSIST, mpd_notify_cb, NULL));
+#else
+# ifdef HAVE_PIPE2
+  ret = pipe2(mpd_notify_pipe, O_CLOEXEC | O_NONBLOCK);
+# else
+  ret = pipe(mpd_notify_pipe);
+  if (ret == 0)
+    ret = fcntl(mpd_notify_pipe[0], F_SETFL, O_NONBLOCK);
+# endif
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_MPD, "Could not create notify pipe: %s\n", strerror(errno));
+      goto notify_fail;
+    }
+
+  CHECK_NULL(L_MPD, mpd_notify_ev = event_new(evbase_mpd, mpd_notify_pipe[0], EV_READ | EV_PERSIST, mpd_notify_cb, NULL));
+#endif
+  event_add(mpd_notify_ev, NULL);
+
   mpd_sockfd = net_bind(&port, SOCK_STREAM | SOCK_NONBLOCK, "mpd");
   if (mpd_sockfd < 0)
     {
@@ -4858,6 +5568,14 @@ mpd_init(void)
  connew_fail:
   close(mpd_sockfd);
  bind_fail:
+  event_free(mpd_notify_ev);
+#ifdef HAVE_EVENTFD
+  close(mpd_notify_efd);
+#else
+  close(mpd_notify_pipe[0]);
+  close(mpd_notify_pipe[1]);
+#endif
+ notify_fail:
   commands_base_free(cmdbase);
   event_base_free(evbase_mpd);
   evbase_mpd = NULL;
@@ -4890,6 +5608,14 @@ mpd_deinit(void)
 
   listener_remove(mpd_listener_cb);
 
+  event_free(mpd_notify_ev);
+#ifdef HAVE_EVENTFD
+  close(mpd_notify_efd);
+#else
+  close(mpd_notify_pipe[0]);
+  close(mpd_notify_pipe[1]);
+#endif
+
   while (mpd_clients)
     {
       free_mpd_client_ctx(mpd_clients);
@@ -167,6 +167,17 @@ mxmlGetFirstChild(mxml_node_t *node)	/* I - Node to get */
 }
 #endif
 
+#ifndef HAVE_MXMLGETELEMENT
+__attribute__((unused)) static const char *			/* O - Element name or NULL */
+mxmlGetElement(mxml_node_t *node)	/* I - Node to get */
+{
+  if (!node || node->type != MXML_ELEMENT)
+    return (NULL);
+
+  return (node->value.element.name);
+}
+#endif
+
 #ifndef HAVE_MXMLGETTYPE
 __attribute__((unused)) static mxml_type_t			/* O - Type of node */
 mxmlGetType(mxml_node_t *node)		/* I - Node to get */
@@ -308,6 +308,12 @@ static enum repeat_mode repeat;
 static char shuffle;
 static char consume;
 
+// Copy of the status that is published by the player thread with
+// status_publish() and read by player_get_status() from any thread, using
+// status_snapshot_seq as a seqlock (odd while being written)
+static struct player_status status_snapshot;
+static unsigned int status_snapshot_seq;
+
 // Playback timer
 #ifdef HAVE_TIMERFD
 static int pb_timer_fd;
@@ -382,6 +388,87 @@ scrobble_cb(void *arg)
 }
 #endif
 
+static void
+status_fill(struct player_status *status)
+{
+  memset(status, 0, sizeof(struct player_status));
+
+  status->shuffle = shuffle;
+  status->consume = consume;
+  status->repeat = repeat;
+
+  status->volume = outputs_volume_get();
+
+  status->plid = cur_plid;
+
+  // Can be called in the middle of a session change, e.g. from playback_cb()
+  if (!pb_session.playing_now)
+    {
+      status->status = PLAY_STOPPED;
+      return;
+    }
+
+  switch (player_state)
+    {
+      case PLAY_STOPPED:
+	status->status  = PLAY_STOPPED;
+	break;
+
+      case PLAY_PAUSED:
+	status->status  = PLAY_PAUSED;
+	status->id      = pb_session.playing_now->id;
+	status->item_id = pb_session.playing_now->item_id;
+
+	status->pos_ms  = pb_session.playing_now->pos_ms;
+	status->len_ms  = pb_session.playing_now->len_ms;
+
+	break;
+
+      case PLAY_PLAYING:
+	// Still buffering is reported as paused
+	if (pb_session.playing_now->play_start == 0 || pb_session.pos < pb_session.playing_now->play_start)
+	  status->status = PLAY_PAUSED;
+	else
+	  status->status = PLAY_PLAYING;
+
+	status->id      = pb_session.playing_now->id;
+	status->item_id = pb_session.playing_now->item_id;
+
+	status->pos_ms  = pb_session.playing_now->pos_ms;
+	status->len_ms  = pb_session.playing_now->len_ms;
+
+	break;
+    }
+}
+
+/*
+ * Publishes the current status for player_get_status(). Must be called by the
+ * player thread (or before it is started) after anything in the status has
+ * changed. It is called by status_update() and by playback_cb() for position
+ * updates, so most callers don't have to do it explicitly.
+ */
+static void
+status_publish(void)
+{
+  struct player_status status;
+  unsigned int seq;
+
+  status_fill(&status);
+
+  if (memcmp(&status, &status_snapshot, sizeof(struct player_status)) == 0)
+    return;
+
+  // Only the player thread writes, so it can read seq without synchronization
+  seq = status_snapshot_seq;
+
+  __atomic_store_n(&status_snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(&status_snapshot, &status, sizeof(struct player_status));
+
+  __atomic_store_n(&status_snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
 // This is just to be able to log the caller in a simple way
 #define status_update(x, y) status_update_impl((x), (y), __func__)
 static void
@@ -391,6 +478,9 @@ status_update_impl(enum play_status status, short listener_events, const char *c
 
   player_state = status;
 
+  // Must come before the notification, since listeners will usually read it
+  status_publish();
+
   listener_notify(listener_events);
 }
 
@@ -477,6 +567,32 @@ queue_item_next(uint32_t item_id)
   return NULL;
 }
 
+/*
+ * Returns the id of the item that queue_item_next() will most likely return
+ * when the given item ends, or 0 if unknown. Unlike queue_item_next() it will
+ * not reshuffle the queue, so in that case it is unknown.
+ */
+static uint32_t
+queue_item_next_id(uint32_t item_id)
+{
+  struct db_queue_item *queue_item;
+  uint32_t next_id;
+
+  if (repeat == REPEAT_SONG)
+    return item_id;
+
+  queue_item = db_queue_fetch_next(item_id, shuffle);
+  if (!queue_item && repeat == REPEAT_ALL && !shuffle)
+    queue_item = db_queue_fetch_bypos(0, shuffle);
+  if (!queue_item)
+    return 0;
+
+  next_id = queue_item->id;
+  free_queue_item(queue_item, 0);
+
+  return next_id;
+}
+
 static struct db_queue_item *
 queue_item_prev(uint32_t item_id)
 {
@@ -670,6 +786,13 @@ source_next_create(struct player_source *current)
   return ps;
 }
 
+// Lets the input prepare the item after ps, see input_lookahead()
+static void
+source_lookahead(struct player_source *ps)
+{
+  input_lookahead(queue_item_next_id(ps->item_id));
+}
+
 static void
 source_stop(void)
 {
@@ -679,6 +802,8 @@ source_stop(void)
 static int
 source_start(struct player_source *ps)
 {
+  int ret;
+
   if (!ps)
     return 0;
 
@@ -686,7 +811,11 @@ source_start(struct player_source *ps)
 
   input_flush(NULL);
 
-  return input_seek(ps->item_id, (int)ps->seek_ms);
+  ret = input_seek(ps->item_id, (int)ps->seek_ms);
+  if (ret >= 0)
+    source_lookahead(ps);
+
+  return ret;
 }
 
 static void
@@ -698,6 +827,7 @@ source_next(struct player_source *ps)
   DPRINTF(E_DBG, L_PLAYER, "Opening next track: '%s' (id=%d)\n", ps->path, ps->item_id);
 
   input_start(ps->item_id);
+  source_lookahead(ps);
 }
 
 static int
@@ -709,6 +839,7 @@ source_restart(struct player_source *ps)
   // thread making a sync call to player_playback_start() -> pb_resume() ->
   // source_restart() -> input_resume()
   input_resume(ps->item_id, ps->pos_ms);
+  source_lookahead(ps);
 
   return 0;
 }
@@ -1354,6 +1485,9 @@ playback_cb(int fd, short what, void *arg)
       if (player_flush_pending == 0)
 	input_buffer_full_cb(player_playback_start);
     }
+
+  // Position has moved (and maybe buffering has finished)
+  status_publish();
 }
 
 
@@ -1873,85 +2007,6 @@ pb_suspend(void)
 
 /* --------------- Actual commands, executed in the player thread ----------- */
 
-static enum command_state
-get_status(void *arg, int *retval)
-{
-  struct player_status *status = arg;
-
-  memset(status, 0, sizeof(struct player_status));
-
-  status->shuffle = shuffle;
-  status->consume = consume;
-  status->repeat = repeat;
-
-  status->volume = outputs_volume_get();
-
-  status->plid = cur_plid;
-
-  switch (player_state)
-    {
-      case PLAY_STOPPED:
-	DPRINTF(E_DBG, L_PLAYER, "Player status: stopped\n");
-
-	status->status  = PLAY_STOPPED;
-	break;
-
-      case PLAY_PAUSED:
-	DPRINTF(E_DBG, L_PLAYER, "Player status: paused\n");
-
-	status->status  = PLAY_PAUSED;
-	status->id      = pb_session.playing_now->id;
-	status->item_id = pb_session.playing_now->item_id;
-
-	status->pos_ms  = pb_session.playing_now->pos_ms;
-	status->len_ms  = pb_session.playing_now->len_ms;
-
-	break;
-
-      case PLAY_PLAYING:
-	if (pb_session.playing_now->play_start == 0 || pb_session.pos < pb_session.playing_now->play_start)
-	  {
-	    DPRINTF(E_DBG, L_PLAYER, "Player status: playing (buffering)\n");
-
-	    status->status = PLAY_PAUSED;
-	  }
-	else
-	  {
-	    DPRINTF(E_DBG, L_PLAYER, "Player status: playing\n");
-
-	    status->status = PLAY_PLAYING;
-	  }
-
-	status->id      = pb_session.playing_now->id;
-	status->item_id = pb_session.playing_now->item_id;
-
-	status->pos_ms  = pb_session.playing_now->pos_ms;
-	status->len_ms  = pb_session.playing_now->len_ms;
-
-	break;
-    }
-
-  *retval = 0;
-  return COMMAND_END;
-}
-
-static enum command_state
-playing_now(void *arg, int *retval)
-{
-  uint32_t *id = arg;
-
-  if (player_state == PLAY_STOPPED)
-    {
-      *retval = -1;
-      return COMMAND_END;
-    }
-
-  *id = pb_session.playing_now->id;
-
-  *retval = 0;
-  return COMMAND_END;
-}
-
 static enum command_state
 playback_stop(void *arg, int *retval)
 {
@@ -3115,6 +3170,8 @@ playerqueue_plid(void *arg, int *retval)
   union player_arg *cmdarg = arg;
   cur_plid = cmdarg->id;
 
+  status_publish();
+
   *retval = 0;
   return COMMAND_END;
 }
@@ -3126,15 +3183,45 @@ playerqueue_generic_bh(void *arg, int *retval)
   return COMMAND_END;
 }
 
+// The item after the one being read may have changed, e.g. because the user
+// added an item with "play next", so the input should prepare that instead
+static enum command_state
+playerqueue_lookahead(void *arg, int *retval)
+{
+  if (pb_session.source_list)
+    source_lookahead(pb_session.source_list);
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+/* Thread: any */
+static void
+player_listener_cb(short event_mask)
+{
+  commands_exec_async(cmdbase, playerqueue_lookahead, NULL);
+}
+
 /* ------------------------------- Player API ------------------------------- */
 
 int
 player_get_status(struct player_status *status)
 {
-  int ret;
+  unsigned int seq1;
+  unsigned int seq2;
 
-  ret = commands_exec_sync(cmdbase, get_status, NULL, status);
-  return ret;
+  // Read the snapshot published by the player thread, retry if it was written
+  // to while copying
+  do
+    {
+      seq1 = __atomic_load_n(&status_snapshot_seq, __ATOMIC_ACQUIRE);
+      memcpy(status, &status_snapshot, sizeof(struct player_status));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      seq2 = __atomic_load_n(&status_snapshot_seq, __ATOMIC_RELAXED);
+    }
+  while ((seq1 & 1) || seq1 != seq2);
+
+  return 0;
 }
 
 
@@ -3149,10 +3236,14 @@ player_get_status(struct player_status *status)
 int
 player_playing_now(uint32_t *id)
 {
-  int ret;
+  struct player_status status;
 
-  ret = commands_exec_sync(cmdbase, playing_now, NULL, id);
-  return ret;
+  player_get_status(&status);
+  if (status.status == PLAY_STOPPED)
+    return -1;
+
+  *id = status.id;
+  return 0;
 }
 
 /*
@@ -3736,6 +3827,8 @@ player_init(void)
       goto error_outputs_deinit;
     }
 
+  status_publish();
+
   ret = pthread_create(&tid_player, NULL, player, NULL);
   if (ret < 0)
     {
@@ -3745,6 +3838,8 @@ player_init(void)
 
   thread_setname(tid_player, "player");
 
+  listener_add(player_listener_cb, LISTENER_QUEUE);
+
   return 0;
 
  error_input_deinit:
@@ -3771,6 +3866,8 @@ player_deinit(void)
 {
   int ret;
 
+  listener_remove(player_listener_cb);
+
   player_playback_abort();
 
 #ifdef HAVE_TIMERFD
@@ -21,9 +21,13 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -57,8 +61,12 @@
 #define MAX_BAD_PACKETS 5
 // How long to wait (in microsec) before interrupting av_read_frame
 #define READ_TIMEOUT 30000000
-// Buffer size for reading/writing input and output evbuffers
+// Default buffer size for reading/writing input and output evbuffers, the
+// input size can be changed with library.decode_buffer_size_spotify
 #define AVIO_BUFFER_SIZE 4096
+// Buffer size for reading files with avio_file_open() if only read-ahead is
+// configured (same as ffmpeg's default)
+#define AVIO_FILE_BUFFER_SIZE 32768
 // Size of the wav header that iTunes needs
 #define WAV_HEADER_LEN 44
 
@@ -131,6 +139,9 @@ struct decode_ctx
   // IO Context for non-file input
   AVIOContext *avio;
 
+  // IO Context for file input, if not left to ffmpeg (see avio_file_open)
+  AVIOContext *avio_file;
+
   // Stream and decoder data
   struct stream_ctx audio_stream;
   struct stream_ctx video_stream;
@@ -205,6 +216,16 @@ struct avio_evbuffer {
   void *seekfn_arg;
 };
 
+struct avio_file {
+  int fd;
+  // Current read position in the file
+  int64_t pos;
+  // Size of the read-ahead window, 0 if disabled
+  int64_t readahead;
+  // Read-ahead has been requested up to this offset
+  int64_t readahead_end;
+};
+
 
 /* -------------------------- PROFILE CONFIGURATION ------------------------ */
 
@@ -855,7 +876,7 @@ avio_evbuffer_seek(void *opaque, int64_t offset, int whence)
 }
 
 static AVIOContext *
-avio_evbuffer_open(struct transcode_evbuf_io *evbuf_io, int is_output)
+avio_evbuffer_open(struct transcode_evbuf_io *evbuf_io, int is_output, int buffer_size)
 {
   struct avio_evbuffer *ae;
   AVIOContext *s;
@@ -868,7 +889,7 @@ avio_evbuffer_open(struct transcode_evbuf_io *evbuf_io, int is_output)
       return NULL;
     }
 
-  ae->buffer = av_mallocz(AVIO_BUFFER_SIZE);
+  ae->buffer = av_mallocz(buffer_size);
   if (!ae->buffer)
     {
       DPRINTF(E_LOG, L_FFMPEG, "Out of memory for avio buffer\n");
@@ -882,9 +903,9 @@ avio_evbuffer_open(struct transcode_evbuf_io *evbuf_io, int is_output)
   ae->seekfn_arg = evbuf_io->seekfn_arg;
 
   if (is_output)
-    s = avio_alloc_context(ae->buffer, AVIO_BUFFER_SIZE, 1, ae, NULL, avio_evbuffer_write, NULL);
+    s = avio_alloc_context(ae->buffer, buffer_size, 1, ae, NULL, avio_evbuffer_write, NULL);
   else
-    s = avio_alloc_context(ae->buffer, AVIO_BUFFER_SIZE, 0, ae, avio_evbuffer_read, NULL, (evbuf_io->seekfn ? avio_evbuffer_seek : NULL));
+    s = avio_alloc_context(ae->buffer, buffer_size, 0, ae, avio_evbuffer_read, NULL, (evbuf_io->seekfn ? avio_evbuffer_seek : NULL));
 
   if (!s)
     {
@@ -901,9 +922,18 @@ avio_evbuffer_open(struct transcode_evbuf_io *evbuf_io, int is_output)
 }
 
 static AVIOContext *
-avio_input_evbuffer_open(struct transcode_evbuf_io *evbuf_io)
+avio_input_evbuffer_open(struct transcode_evbuf_io *evbuf_io, enum data_kind data_kind)
 {
-  return avio_evbuffer_open(evbuf_io, 0);
+  int buffer_size;
+
+  buffer_size = AVIO_BUFFER_SIZE;
+  if (data_kind == DATA_KIND_SPOTIFY)
+    buffer_size = cfg_getint(cfg_getsec(cfg, "library"), "decode_buffer_size_spotify");
+
+  if (buffer_size <= 0)
+    buffer_size = AVIO_BUFFER_SIZE;
+
+  return avio_evbuffer_open(evbuf_io, 0, buffer_size);
 }
 
 static AVIOContext *
@@ -913,7 +943,7 @@ avio_output_evbuffer_open(struct evbuffer *evbuf)
 
   evbuf_io.evbuf = evbuf;
 
-  return avio_evbuffer_open(&evbuf_io, 1);
+  return avio_evbuffer_open(&evbuf_io, 1, AVIO_BUFFER_SIZE);
 }
 
 static void
@@ -934,6 +964,122 @@ avio_evbuffer_close(AVIOContext *s)
   av_free(s);
 }
 
+/* Reading local files ourselves instead of through ffmpeg's file protocol lets
+ * us choose the read size, and ask the kernel to read ahead of the decoder.
+ * With files on a network share this replaces a stream of small synchronous
+ * reads with larger reads that are already underway when the decoder needs
+ * the data.
+ */
+static int
+avio_file_read(void *opaque, uint8_t *buf, int size)
+{
+  struct avio_file *af = (struct avio_file *)opaque;
+  ssize_t ret;
+
+  ret = read(af->fd, buf, size);
+  if (ret < 0)
+    return AVERROR(errno);
+  else if (ret == 0)
+    return AVERROR_EOF;
+
+  af->pos += ret;
+
+#ifdef HAVE_POSIX_FADVISE
+  // Request the next window when half of the current one has been read, the
+  // kernel then reads it in the background
+  if (af->readahead > 0 && af->pos + af->readahead / 2 >= af->readahead_end)
+    {
+      if (af->readahead_end < af->pos)
+	af->readahead_end = af->pos;
+
+      posix_fadvise(af->fd, af->readahead_end, af->readahead, POSIX_FADV_WILLNEED);
+      af->readahead_end += af->readahead;
+    }
+#endif
+
+  return ret;
+}
+
+static int64_t
+avio_file_seek(void *opaque, int64_t offset, int whence)
+{
+  struct avio_file *af = (struct avio_file *)opaque;
+  struct stat sb;
+  off_t pos;
+
+  if (whence & AVSEEK_SIZE)
+    return (fstat(af->fd, &sb) == 0) ? sb.st_size : AVERROR(errno);
+
+  pos = lseek(af->fd, offset, whence & ~AVSEEK_FORCE);
+  if (pos < 0)
+    return AVERROR(errno);
+
+  // Read-ahead starts over from the new position
+  af->pos = pos;
+  af->readahead_end = pos;
+
+  return pos;
+}
+
+static AVIOContext *
+avio_file_open(const char *path, int buffer_size, int readahead)
+{
+  struct avio_file *af;
+  uint8_t *buffer;
+  AVIOContext *s;
+
+  CHECK_NULL(L_XCODE, af = calloc(1, sizeof(struct avio_file)));
+
+  af->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (af->fd < 0)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not open '%s': %s\n", path, strerror(errno));
+      free(af);
+      return NULL;
+    }
+
+  af->readahead = readahead;
+
+#ifdef HAVE_POSIX_FADVISE
+  if (readahead > 0)
+    posix_fadvise(af->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  CHECK_NULL(L_XCODE, buffer = av_mallocz(buffer_size));
+
+  s = avio_alloc_context(buffer, buffer_size, 0, af, avio_file_read, NULL, avio_file_seek);
+  if (!s)
+    {
+      DPRINTF(E_LOG, L_XCODE, "Could not allocate AVIOContext\n");
+
+      av_free(buffer);
+      close(af->fd);
+      free(af);
+      return NULL;
+    }
+
+  s->seekable = AVIO_SEEKABLE_NORMAL;
+
+  return s;
+}
+
+static void
+avio_file_close(AVIOContext *s)
+{
+  struct avio_file *af;
+
+  if (!s)
+    return;
+
+  af = (struct avio_file *)s->opaque;
+
+  close(af->fd);
+  free(af);
+
+  av_free(s->buffer);
+  av_free(s);
+}
+
 
 /* --------------------------- INPUT/OUTPUT INIT --------------------------- */
 
@@ -995,6 +1141,9 @@ open_input(struct decode_ctx *ctx, const char *path, struct transcode_evbuf_io *
 #endif
   unsigned int stream_index;
   const char *user_agent;
+  cfg_t *lib;
+  int buffer_size;
+  int readahead;
   int ret = 0;
 
   CHECK_NULL(L_XCODE, ctx->ifmt_ctx = avformat_alloc_context());
@@ -1037,13 +1186,27 @@ open_input(struct decode_ctx *ctx, const char *path, struct transcode_evbuf_io *
 	  goto out_fail;
 	}
 
-      CHECK_NULL(L_XCODE, ctx->avio = avio_input_evbuffer_open(evbuf_io));
+      CHECK_NULL(L_XCODE, ctx->avio = avio_input_evbuffer_open(evbuf_io, ctx->data_kind));
 
       ctx->ifmt_ctx->pb = ctx->avio;
       ret = avformat_open_input(&ctx->ifmt_ctx, NULL, ifmt, &options);
     }
   else
     {
+      // Local files are left to ffmpeg unless a buffer size or read-ahead is
+      // configured
+      lib = cfg_getsec(cfg, "library");
+      buffer_size = cfg_getint(lib, "decode_buffer_size_file");
+      readahead = cfg_getint(lib, "decode_readahead_file");
+      if (ctx->data_kind == DATA_KIND_FILE && path && path[0] == '/' && (buffer_size > 0 || readahead > 0))
+	{
+	  ctx->avio_file = avio_file_open(path, (buffer_size > 0) ? buffer_size : AVIO_FILE_BUFFER_SIZE, readahead);
+	  if (!ctx->avio_file)
+	    goto out_fail;
+
+	  ctx->ifmt_ctx->pb = ctx->avio_file;
+	}
+
       ret = avformat_open_input(&ctx->ifmt_ctx, path, NULL, &options);
     }
 
@@ -1093,6 +1256,7 @@ open_input(struct decode_ctx *ctx, const char *path, struct transcode_evbuf_io *
 
  out_fail:
   avio_evbuffer_close(ctx->avio);
+  avio_file_close(ctx->avio_file);
   avcodec_free_context(&ctx->audio_stream.codec);
   avcodec_free_context(&ctx->video_stream.codec);
   avformat_close_input(&ctx->ifmt_ctx);
@@ -1104,6 +1268,7 @@ static void
 close_input(struct decode_ctx *ctx)
 {
   avio_evbuffer_close(ctx->avio);
+  avio_file_close(ctx->avio_file);
   avcodec_free_context(&ctx->audio_stream.codec);
   avcodec_free_context(&ctx->video_stream.codec);
   avformat_close_input(&ctx->ifmt_ctx);
@@ -25,13 +25,17 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
 #include "conffile.h"
+#include "db.h"
+#include "httpd_jsonapi.h"
 #include "listener.h"
 #include "logger.h"
 #include "misc.h"
+#include "misc_json.h"
 
 
 static struct lws_context *context;
@@ -46,6 +50,29 @@ static pthread_mutex_t websocket_write_event_lock;
 // Event mask of events processed by the writeable callback
 static short websocket_write_events;
 
+/*
+ * State that is pushed together with the notify message to clients that asked
+ * for it, so they don't all have to fetch it from the JSON API after an event.
+ * The state is serialized once per batch of events and the same string is then
+ * sent to every client. Only accessed by the websocket thread.
+ */
+struct ws_state
+{
+  const char *name;
+  // Events that change this state
+  short events;
+  // Event to pass to jsonapi_state_get()
+  short get_event;
+  char *json;
+};
+
+static struct ws_state ws_states[] =
+  {
+    { "player", LISTENER_PLAYER | LISTENER_OPTIONS | LISTENER_VOLUME, LISTENER_PLAYER },
+    { "outputs", LISTENER_SPEAKER | LISTENER_VOLUME, LISTENER_SPEAKER },
+    { "queue", LISTENER_QUEUE, LISTENER_QUEUE },
+  };
+
 
 /* Thread: library (the thread the event occurred) */
 static void
@@ -80,6 +107,7 @@ struct per_session_data {
   struct lws *wsi;
   short requested_events;
   short write_events;
+  bool with_state;
 };
 
 /* one of these is created for each vhost our protocol is used with */
@@ -93,12 +121,17 @@ struct per_vhost_data {
  * Expects the message in "in" to be a JSON string of the form:
  *
  * {
- *   "notify": [ "update" ]
+ *   "notify": [ "update" ],
+ *   "state": true
  * }
+ *
+ * "state" is optional, if true the notify messages include the new state (see
+ * send_notify_reply).
  */
 static int
-process_notify_request(short *requested_events, void *in, size_t len)
+process_notify_request(struct per_session_data *pss, void *in, size_t len)
 {
+  short *requested_events = &pss->requested_events;
   json_tokener *tokener;
   json_object *request;
   json_object *item;
@@ -122,6 +155,8 @@ process_notify_request(short *requested_events, void *in, size_t len)
 
   DPRINTF(E_DBG, L_WEB, "notify callback request: %s\n", json_object_to_json_string(request));
 
+  pss->with_state = (json_object_object_get_ex(request, "state", &needle) && json_object_get_boolean(needle));
+
   if (json_object_object_get_ex(request, "notify", &needle) && json_object_get_type(needle) == json_type_array)
     {
       count = json_object_array_length(needle);
@@ -184,6 +219,58 @@ process_notify_request(short *requested_events, void *in, size_t len)
   return 0;
 }
 
+/*
+ * Serializes the state affected by the given events, if any client with
+ * state push enabled is interested in it
+ */
+static void
+state_refresh(struct per_session_data *pss_list, short events)
+{
+  struct per_session_data *pss;
+  json_object *state;
+  short wanted;
+  int i;
+
+  wanted = 0;
+  for (pss = pss_list; pss; pss = pss->pss_list)
+    {
+      if (pss->with_state)
+	wanted |= pss->requested_events;
+    }
+
+  wanted &= events;
+  if (!wanted)
+    return;
+
+  for (i = 0; i < ARRAY_SIZE(ws_states); i++)
+    {
+      if (!(wanted & ws_states[i].events))
+	continue;
+
+      free(ws_states[i].json);
+      ws_states[i].json = NULL;
+
+      state = jsonapi_state_get(ws_states[i].get_event);
+      if (!state)
+	continue;
+
+      ws_states[i].json = strdup(json_object_to_json_string(state));
+      jparse_free(state);
+    }
+}
+
+static void
+state_free(void)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(ws_states); i++)
+    {
+      free(ws_states[i].json);
+      ws_states[i].json = NULL;
+    }
+}
+
 /*
  * Notify clients of the notify-protocol about occurred events
  *
@@ -192,14 +279,20 @@ process_notify_request(short *requested_events, void *in, size_t len)
  * {
  *   "notify": [ "update" ]
  * }
+ *
+ * If the client enabled state push, the current state for the events is added,
+ * as "player" (same as GET /api/player), "outputs" (the outputs array of
+ * GET /api/outputs) and "queue" (version and count of GET /api/queue).
  */
 static void
-send_notify_reply(short events, struct lws* wsi)
+send_notify_reply(short events, struct lws* wsi, bool with_state)
 {
   unsigned char* buf;
-  const char* json_response;
-  json_object* reply;
+  const char* notify_json;
   json_object* notify;
+  size_t len;
+  int n;
+  int i;
 
   DPRINTF(E_DBG, L_WEB, "notify callback reply: %d\n", events);
 
@@ -245,17 +338,31 @@ send_notify_reply(short events, struct lws* wsi)
       json_object_array_add(notify, json_object_new_string("queue"));
     }
 
-  reply = json_object_new_object();
-  json_object_object_add(reply, "notify", notify);
+  notify_json = json_object_to_json_string(notify);
+
+  // The state strings are already serialized, so the message is put together
+  // here instead of adding them to a json object
+  len = strlen("{\"notify\":}") + strlen(notify_json);
+  for (i = 0; with_state && i < ARRAY_SIZE(ws_states); i++)
+    {
+      if ((events & ws_states[i].events) && ws_states[i].json)
+	len += strlen(",\"\":") + strlen(ws_states[i].name) + strlen(ws_states[i].json);
+    }
+
+  CHECK_NULL(L_WEB, buf = malloc(LWS_PRE + len + 1));
 
-  json_response = json_object_to_json_string(reply);
+  n = sprintf((char *)&buf[LWS_PRE], "{\"notify\":%s", notify_json);
+  for (i = 0; with_state && i < ARRAY_SIZE(ws_states); i++)
+    {
+      if ((events & ws_states[i].events) && ws_states[i].json)
+	n += sprintf((char *)&buf[LWS_PRE + n], ",\"%s\":%s", ws_states[i].name, ws_states[i].json);
+    }
+  n += sprintf((char *)&buf[LWS_PRE + n], "}");
 
-  buf = malloc(LWS_PRE + strlen(json_response));
-  memcpy(&buf[LWS_PRE], json_response, strlen(json_response));
-  lws_write(wsi, &buf[LWS_PRE], strlen(json_response), LWS_WRITE_TEXT);
+  lws_write(wsi, &buf[LWS_PRE], n, LWS_WRITE_TEXT);
 
   free(buf);
-  json_object_put(reply);
+  json_object_put(notify);
 }
 
 /*
@@ -339,6 +446,7 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
       pthread_mutex_unlock(&websocket_write_event_lock);
       if (vhd && events)
       {
+        state_refresh(vhd->pss_list, events);
         ppss = &(vhd->pss_list);
         while (*ppss) {
           (*ppss)->write_events |= events;
@@ -349,13 +457,13 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
       if (pss->requested_events & pss->write_events)
       {
         events = pss->requested_events & pss->write_events;
-        send_notify_reply(events, wsi);
+        send_notify_reply(events, wsi, pss->with_state);
         pss->write_events = 0;
       }
       break;
 
     case LWS_CALLBACK_RECEIVE:
-      ret = process_notify_request(&pss->requested_events, in, len);
+      ret = process_notify_request(pss, in, len);
       break;
 
 #if LWS_LIBRARY_VERSION_MAJOR >= 3
@@ -366,6 +474,8 @@ callback_notify(struct lws *wsi, enum lws_callback_reasons reason, void *user, v
         events = websocket_write_events;
         websocket_write_events = 0;
         pthread_mutex_unlock(&websocket_write_event_lock);
+        if (events)
+          state_refresh(vhd->pss_list, events);
         lws_start_foreach_llp(struct per_session_data **, ppss, vhd->pss_list)
         {
           (*ppss)->write_events |= events;
@@ -414,6 +524,16 @@ static struct lws_protocols protocols[] =
 static void *
 websocket(void *arg)
 {
+  int ret;
+
+  // For the state that is pushed to clients
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Error: DB init failed\n");
+      pthread_exit(NULL);
+    }
+
   listener_add(listener_cb, LISTENER_UPDATE | LISTENER_DATABASE | LISTENER_PAIRING | LISTENER_SPOTIFY | LISTENER_LASTFM | LISTENER_SPEAKER
                | LISTENER_PLAYER | LISTENER_OPTIONS | LISTENER_VOLUME | LISTENER_QUEUE);
 
@@ -429,6 +549,9 @@ websocket(void *arg)
 #endif
   }
 
+  state_free();
+  db_perthread_deinit();
+
   pthread_exit(NULL);
 }
 